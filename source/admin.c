@@ -346,6 +346,29 @@ static int check_system_resources(int report) {
     return AM_SUCCESS;
 }
 
+/*
+ * argv[2] = OPTIONAL agent id (as in AmAgentId directive), default is 0
+ */
+static void show_metrics(int argc, char **argv) {
+    char *text;
+    int id = argc > 2 ? (int) strtol(argv[2], NULL, 10) : AM_DEFAULT_AGENT_ID;
+    int rv = am_metrics_open(id);
+    if (rv == AM_ENOTSTARTED) {
+        fprintf(stderr, "\nAgent metrics are not available (agent not running).\n\n");
+        exit_status = EXIT_FAILURE;
+        return;
+    }
+    if (rv != AM_SUCCESS) {
+        fprintf(stderr, "\nUnable to access agent metrics (%s).\n\n", am_strerror(rv));
+        exit_status = EXIT_FAILURE;
+        return;
+    }
+    text = am_metrics_text(0);
+    fprintf(stdout, "%s", NOTNULL(text));
+    am_free(text);
+    am_metrics_shutdown();
+}
+
 static void show_version(int argc, char **argv) {
     static const char *server_version =
 #ifdef SERVER_VERSION
@@ -2494,6 +2517,7 @@ int main(int argc, char **argv) {
         { "--o", modify_ownership },
 #endif
         { "--v", show_version },
+        { "--m", show_metrics },
         { "--k", generate_key },
         { "--p", password_encrypt },
         { "--d", password_decrypt },
@@ -2681,7 +2705,9 @@ int main(int argc, char **argv) {
             "Encrypt password:\n"
             " agentadmin --p \"key\" \"password\"\n\n"
             "Build and version information:\n"
-            " agentadmin --v\n\n", DESCRIPTION);
+            " agentadmin --v\n\n"
+            "Agent metrics (Prometheus text format):\n"
+            " agentadmin --m [agent id]\n\n", DESCRIPTION);
 
     am_net_options_delete(&net_options);
     return EXIT_SUCCESS;
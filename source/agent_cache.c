@@ -40,6 +40,7 @@
 
 #include "agent_cache.h"
 #include "rwlock.h"
+#include "thread.h"
 
 #define STATFILE                            "stats"
 #define LOCKFILE                            "lockfile"
@@ -53,6 +54,8 @@
 
 #define GC_MARKER                           0xa4420810u
 
+#define POLICY_EPOCH_LOAD_RETRY             256                                   /* attempts to read a consistent copy */
+
 #if defined _WIN32
 
 #define incr(p)                             InterlockedIncrement(p)
@@ -62,6 +65,9 @@
 #define cas(p, old, new)                    (casv(p, old, new) == (old))
 #define yield()                             SwitchToThread()
 
+#define load_acquire(p)                     InterlockedCompareExchange64((volatile LONG64 *) (p), 0, 0)
+#define store_release(p, v)                 InterlockedExchange64((volatile LONG64 *) (p), (LONG64) (v))
+
 #elif defined(__sun)
 
 #include <sys/atomic.h>
@@ -72,6 +78,9 @@
 #define cas(p, old, new)                    (atomic_cas_32(p, old, new) == (old))
 #define yield()                             sched_yield()
 
+#define load_acquire(p)                     atomic_cas_64(p, 0, 0)
+#define store_release(p, v)                 atomic_swap_64(p, v)
+
 #else
 
 #define incr(p)                             __sync_fetch_and_add(p, 1)
@@ -81,6 +90,9 @@
 #define cas(p, old, new)                    __sync_bool_compare_and_swap(p, old, new)
 #define yield()                             sched_yield()
 
+#define load_acquire(p)                     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)                 __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
 #endif
 
 #ifdef GC_STATS
@@ -131,18 +143,33 @@ struct cache_gc_stat {
 
 };
 
+union cache_policy_epoch {
+
+    struct {
+        volatile uint64_t                   generation;                               /* odd while an update is in progress */
+        volatile uint64_t                   epoch, changed;
+    } v;
+
+    uint8_t                                 padding[64];
+
+};
+
 struct stats {
 
     int64_t                                 basetime;
 
     union cache_stat                        reads, updates, writes, failures, deletes, expires, lru;
 
+    union cache_policy_epoch                policy;                                   /* AM_POLICY_CHANGE_KEY header copy */
+
     struct cache_gc_stat                    cache, data;
 
 };
 
 static const size_t                         user_hdr_sz = offsetof(struct user_entry, data);
 
+static AM_THREAD_LOCAL int                  writer_locked = 0;                        /* this thread holds the writer lock */
+
 static struct stats                        *stats = 0;
 
 static struct readlock                     *locks = 0;
@@ -710,6 +737,91 @@ incr(&stats->deletes.v);
 
 }
 
+struct delete_ref {
+
+    uint32_t                                hash;
+    int                                     index;
+
+};
+
+static int compare_delete_refs(const void *a, const void *b) {
+
+    const struct delete_ref                *x = a, *y = b;
+
+    uint32_t                                lx = x->hash & (N_LOCKS - 1), ly = y->hash & (N_LOCKS - 1);
+
+    if (lx != ly) {
+        return lx < ly ? -1 : 1;
+    }
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->index - y->index;
+
+}
+
+/*
+ * remove anything that matches from the collision lists, for a batch of keys: deletions are grouped by hash lock
+ * so that each lock is taken only once per batch
+ *
+ * returns the number of hash locks taken
+ *
+ */
+int cache_delete_batch(uint32_t *h, void **data, int count, int (*identity)(void *, void *)) {
+
+    pid_t                                   pid = getpid();
+
+    struct delete_ref                      *refs;
+
+    int                                     i, j, k, n_locks = 0;
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    if (( refs = malloc(sizeof(struct delete_ref) * count) ) == NULL) {
+        for (i = 0; i < count; i++) {                                                  /* one lock per key then */
+            cache_delete(h[i], data[i], identity);
+        }
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        refs[i].hash = h[i] % HASH_SZ;
+        refs[i].index = i;
+    }
+    qsort(refs, count, sizeof(struct delete_ref), compare_delete_refs);
+
+    agent_memory_validate(pid);
+
+    for (i = 0; i < count; i = j) {
+        uint32_t                            lock = refs[i].hash & (N_LOCKS - 1);
+
+        for (j = i + 1; j < count && (refs[j].hash & (N_LOCKS - 1)) == lock; j++)
+            ;
+
+        if (cache_readlock_p(refs[i].hash, pid) == 0) {
+            continue;
+        }
+        n_locks++;
+
+        for (k = i; k < j; k++) {
+            offset                          ofs = hashtable[refs[k].hash];
+
+            if (~ ofs) {
+                purge_identical_entries(pid, refs[k].hash, agent_memory_ptr(ofs), 0, data[refs[k].index], identity);
+            }
+incr(&stats->deletes.v);
+        }
+        cache_readlock_release_p(refs[i].hash, pid);
+    }
+
+    free(refs);
+
+    return n_locks;
+
+}
+
 /*
  * note: this might be silly because read locks should be very short-lived, but the caller should
  * release this read lock.
@@ -728,6 +840,7 @@ int cache_get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data,
     agent_memory_validate(pid);
 
     if (cache_readlock_p(hash, pid) == 0) {
+am_metrics_incr(AM_METRIC_CACHE_MISS);
         return 1;
     }
 
@@ -759,6 +872,7 @@ int cache_get_readlocked_ptr(uint32_t h, void **addr, uint32_t *ln, void *data,
                     *addr = p->data;
                     *ln = p->ln;
 incr(&stats->reads.v);
+am_metrics_incr(AM_METRIC_CACHE_HIT);
                     return 0;
                 }
             }
@@ -766,11 +880,94 @@ incr(&stats->reads.v);
     }
 
     cache_readlock_release_p(hash, pid);
+am_metrics_incr(AM_METRIC_CACHE_MISS);
 
     return 1;
 
 }
 
+/*
+ * publish policy change times for all processes (single writer: the writer lock is taken
+ * here unless this thread holds it already)
+ */
+void cache_policy_epoch_publish(uint64_t epoch, uint64_t changed) {
+
+    uint64_t                                generation;
+    int                                     locked = 0;
+
+    if (stats == NULL) {
+        return;
+    }
+    if (!writer_locked) {
+        if (cache_writer_lock() != AM_SUCCESS) {
+            return;
+        }
+        locked = 1;
+    }
+
+    /* odd generation left behind by a writer that died while publishing is closed here */
+    generation = stats->policy.v.generation | 1;
+    store_release(&stats->policy.v.generation, generation);
+    store_release(&stats->policy.v.epoch, epoch);
+    store_release(&stats->policy.v.changed, changed);
+    store_release(&stats->policy.v.generation, generation + 1);
+
+    if (locked) {
+        cache_writer_unlock();
+    }
+
+}
+
+/*
+ * consistent snapshot of the published policy change times, without taking any lock;
+ * AM_EAGAIN when an update does not complete within POLICY_EPOCH_LOAD_RETRY attempts
+ */
+int cache_policy_epoch_load(uint64_t *generation, uint64_t *epoch, uint64_t *changed) {
+
+    uint64_t                                check;
+    int                                     i;
+
+    if (stats == NULL) {
+        return AM_ERROR;
+    }
+
+    for (i = 0; i < POLICY_EPOCH_LOAD_RETRY; i++) {
+        *generation = load_acquire(&stats->policy.v.generation);
+        if ((*generation & 1) == 0) {
+            *epoch = load_acquire(&stats->policy.v.epoch);
+            *changed = load_acquire(&stats->policy.v.changed);
+            check = load_acquire(&stats->policy.v.generation);
+            if (check == *generation) {
+                return AM_SUCCESS;
+            }
+        }
+        yield();
+    }
+    return AM_EAGAIN;
+
+}
+
+/*
+ * serialise read-modify-write updates of a cache entry between processes
+ */
+int cache_writer_lock() {
+
+    int                                     status = am_shm_lock(stats_pool);
+
+    if (status == AM_SUCCESS) {
+        writer_locked = 1;
+    }
+    return status;
+
+}
+
+void cache_writer_unlock() {
+
+    writer_locked = 0;
+    am_shm_unlock(stats_pool);
+
+}
+
 void cache_release_readlocked_ptr(uint32_t h) {
 
     pid_t                                   pid = getpid();
@@ -837,6 +1034,7 @@ static int cache_garbage_checker(void *cbdata, pid_t pid, int32_t type, void *p)
                     if (cache_readlock_try_unique(hash)) {
                         cache_readlock_release_all_p(hash, pid);
 incr_gc_stat(&stats->data.collected.v);
+am_metrics_incr(AM_METRIC_GC_COLLECTED);
                         
                         return 1;                                             /* no new threads can reach this block, and it isn't being read */
                     }
@@ -860,6 +1058,7 @@ incr_gc_stat(&stats->data.collected.v);
                     if (cache_readlock_try_unique(hash)) {
                         cache_readlock_release_all_p(hash, pid);
 incr_gc_stat(&stats->cache.collected.v);
+am_metrics_incr(AM_METRIC_GC_COLLECTED);
 
                         return 1;                                             /* no new threads can reach this block, and it isn't being read */
                     }
@@ -876,6 +1075,7 @@ incr_gc_stat(&stats->cache.collected.v);
 void cache_garbage_collect() {
 
     agent_memory_scan(getpid(), cache_garbage_checker, 0);
+    am_metrics_incr(AM_METRIC_GC_RUN);
 
 }
 
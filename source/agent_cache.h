@@ -28,9 +28,17 @@ int cache_add(uint32_t hash, void *data, size_t ln, int64_t expires, int (*ident
 
 void cache_delete(uint32_t hash, void *data, int (*identity)(void *, void *));
 
+int cache_delete_batch(uint32_t *hash, void **data, int count, int (*identity)(void *, void *));
+
 int cache_get_readlocked_ptr(uint32_t hash, void **addr, uint32_t *ln, void *data, int64_t now, int (*identity)(void *, void *));
 void cache_release_readlocked_ptr(uint32_t hash);
 
+int cache_writer_lock();
+void cache_writer_unlock();
+
+void cache_policy_epoch_publish(uint64_t epoch, uint64_t changed);
+int cache_policy_epoch_load(uint64_t *generation, uint64_t *epoch, uint64_t *changed);
+
 void cache_purge_expired_entries(pid_t pid);
 
 void cache_garbage_collect();
@@ -672,7 +672,10 @@ void *agent_memory_alloc(pid_t pid, uint32_t cluster, int32_t type, uint32_t siz
 
     p = alloc_with_compact(cluster_free_lists(cluster), seq, type, required);
     spinlock_unlock(&cluster_lock(cluster));
-    
+
+    if (p == 0) {
+        am_metrics_incr(AM_METRIC_ALLOC_FAILURE);
+    }
     return p;
 
 }
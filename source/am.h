@@ -84,8 +84,16 @@ typedef enum {
 #define AM_MAX_THREADS_POOL         AM_MAX_INSTANCES
 #endif
 
-#ifndef AM_LOG_QUEUE_SIZE
-#define AM_LOG_QUEUE_SIZE           16384 /* must be a power of two */
+#ifndef AM_LOG_BUFFER_SIZE
+#define AM_LOG_BUFFER_SIZE          (16 * 1024 * 1024) /* log ring size, bytes (rounded up to a power of two) */
+#endif
+
+#ifndef AM_AUDIT_BUFFER_SIZE
+#define AM_AUDIT_BUFFER_SIZE        (512 * 1024) /* remote audit ring size (per instance), bytes */
+#endif
+
+#ifndef AM_AUDIT_BUFFER_COUNT
+#define AM_AUDIT_BUFFER_COUNT       4 /* number of remote audit rings (instances with remote audit logging) */
 #endif
 
 #ifndef AM_LOG_MESSAGE_SIZE
@@ -156,6 +164,7 @@ typedef enum {
 #define AM_CACHE_SHM_NAME       "am_shared_cache"
 #define AM_CONFIG_SHM_NAME      "am_shared_conf"
 #define AM_LOG_SHM_NAME         "am_shared_log"
+#define AM_METRICS_SHM_NAME     "am_shared_metrics"
 
 typedef enum {
     AM_OK = 0, AM_FAIL, AM_RETRY, AM_QUIT
@@ -233,6 +242,25 @@ struct url {
     char query[AM_URI_SIZE + 1];
 };
 
+#define AM_ARENA_BLOCK_SIZE     4096
+
+/* request scoped bump allocator; everything allocated from it is released at once
+ * with am_arena_release (or by the container, when alloc_f is set) */
+typedef struct {
+    char *ptr; /* next free byte in the current block */
+    size_t avail; /* bytes left in the current block */
+    void *blocks; /* heap blocks owned by the arena */
+    void *(*alloc_f)(void *, size_t); /* container allocator (apr pool, varnish workspace), NULL - heap only */
+    void *alloc_ctx;
+} am_arena_t;
+
+void am_arena_init(am_arena_t *a, void *(*alloc_f)(void *, size_t), void *alloc_ctx);
+void *am_arena_alloc(am_arena_t *a, size_t size);
+char *am_arena_strdup(am_arena_t *a, const char *s);
+char *am_arena_strndup(am_arena_t *a, const char *s, size_t size);
+char *am_arena_asprintf(am_arena_t *a, const char *fmt, ...);
+void am_arena_release(am_arena_t *a);
+
 typedef struct am_request {
     am_status_t status;
     unsigned int retry;
@@ -246,10 +274,10 @@ typedef struct am_request {
     const char *orig_url;
     const char *path_info;
     struct url url; /* parsed/normalized request url (split in values) */
-    char *normalized_url; /* normalized request url */
-    char *overridden_url; /* normalized/overridden request url */
-    char *normalized_url_pathinfo;
-    char *overridden_url_pathinfo;
+    char *normalized_url; /* normalized request url (arena) */
+    char *overridden_url; /* normalized/overridden request url (arena) */
+    char *normalized_url_pathinfo; /* arena */
+    char *overridden_url_pathinfo; /* arena */
     const char *cookies;
     const char *content_type;
     int method;
@@ -257,8 +285,8 @@ typedef struct am_request {
     char *token;
     struct am_session_info session_info;
 
-    char *client_ip;
-    char *client_host;
+    char *client_ip; /* arena */
+    char *client_host; /* arena */
 
     const char *user;
     const char *user_temp;
@@ -275,12 +303,15 @@ typedef struct am_request {
     char *post_data; /* in memory */
     char *post_data_fn; /* in file (file name) */
     size_t post_data_sz;
+    am_bool_t post_data_in_memory; /* read POST body into memory, do not store it in a file */
+    am_bool_t pdp_in_memory; /* container can replay preserved POST body from memory (post_data) */
     const char *post_data_url;
 
     unsigned long instance_id;
     am_config_t *conf; /*agent configuration*/
 
     void *ctx; /*web container/request context*/
+    am_arena_t arena; /*request scoped allocations, released with am_request_free*/
 #ifdef _WIN32
     void *ctx_class;
 #endif
@@ -334,11 +365,27 @@ void am_log_shutdown(int id);
 int am_log_cleanup(int id);
 void am_log_register_instance(unsigned long instance_id, const char *debug_log, int log_level, int log_size,
         const char *audit_log, int audit_level, int audit_size, const char *config_file);
+void am_log_set_options(unsigned long instance_id, int sync, int deferred,
+        int rotate_compress, int rotate_keep, int rotate_age);
+void am_log_get_stats(unsigned long instance_id, unsigned int *writes, unsigned int *syncs);
 
 void am_config_free(am_config_t **c);
 am_config_t *am_get_config_file(unsigned long instance_id, const char *filename);
 int am_get_agent_config(unsigned long instance_id, const char *config_file, am_config_t **cnf);
 
+#define AM_POST_BUFFER_MIN      4096
+#define AM_POST_LARES_MAX       (4 * 1024 * 1024) /* hard limit for LARES/SAML posts, always read into memory */
+#define AM_POST_MEMORY_MAX      (1024 * 1024) /* larger in-memory POST bodies spill into a file */
+
+typedef struct {
+    char *data; /* NUL terminated */
+    size_t size;
+    size_t capacity;
+} am_post_buffer_t;
+
+int am_post_buffer_append(am_post_buffer_t *b, const void *data, size_t data_sz, size_t limit);
+void am_post_buffer_free(am_post_buffer_t *b);
+
 void uuid(char *buf, size_t buflen);
 char *base64_decode(const char *in, size_t *length);
 char *base64_encode(const void *in, size_t *length);
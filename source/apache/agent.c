@@ -54,8 +54,14 @@ typedef struct {
     int size;
     apr_file_t *tmp_file;
     char *output_ptr;
+    const char *data; /* preserved post data in memory (no tmp_file) */
 } amagent_filter_ctx;
 
+typedef struct {
+    const char *data;
+    apr_size_t size;
+} amagent_post_data;
+
 typedef struct {
     char enabled;
     char *config;
@@ -479,36 +485,41 @@ static am_status_t set_custom_response(am_request_t *rq, const char *text, const
                         }
                         apr_file_close(pdp_file);
                         apr_file_remove(rq->post_data_fn, r->pool);
-
-                        /* recreate x-www-form-urlencoded HTML Form data */
-
-                        for (pair = apr_strtok(a, "&", &last); pair;
-                                pair = apr_strtok(NULL, "&", &last)) {
-                            for (eq = pair; *eq; ++eq) {
-                                if (*eq == '+') *eq = ' ';
-                            }
-                            ap_unescape_url(pair);
-                            eq = strchr(pair, '=');
-                            if (eq) {
-                                *eq++ = 0;
-                                inputs = apr_pstrcat(r->pool, inputs,
-                                        "<input type=\"hidden\" name=\"", pair, "\" value=\"", eq, "\"/>", NULL);
-                            } else {
-                                inputs = apr_pstrcat(r->pool, inputs,
-                                        "<input type=\"hidden\" name=\"", pair, "\" value=\"\"/>", NULL);
-                            }
-                        }
                     } else {
                         apr_strerror(rv, buf, AP_IOBUFSIZE);
                         AM_LOG_ERROR(rq->instance_id, "%s unable to open post preservation file: %s, %s",
                                 thisfunc, rq->post_data_fn, buf);
                         apr_file_remove(rq->post_data_fn, r->pool);
                     }
+                } else if (rq->post_data != NULL && rq->post_data_sz > 0) {
+                    a = apr_pstrmemdup(r->pool, rq->post_data, rq->post_data_sz);
+                }
+
+                if (a != NULL) {
+                    /* recreate x-www-form-urlencoded HTML Form data */
+
+                    for (pair = apr_strtok(a, "&", &last); pair;
+                            pair = apr_strtok(NULL, "&", &last)) {
+                        for (eq = pair; *eq; ++eq) {
+                            if (*eq == '+') *eq = ' ';
+                        }
+                        ap_unescape_url(pair);
+                        eq = strchr(pair, '=');
+                        if (eq) {
+                            *eq++ = 0;
+                            inputs = apr_pstrcat(r->pool, inputs,
+                                    "<input type=\"hidden\" name=\"", pair, "\" value=\"", eq, "\"/>", NULL);
+                        } else {
+                            inputs = apr_pstrcat(r->pool, inputs,
+                                    "<input type=\"hidden\" name=\"", pair, "\" value=\"\"/>", NULL);
+                        }
+                    }
                 }
 
                 r->clength = 0;
                 apr_table_unset(r->headers_in, "Content-Length");
                 apr_table_unset(r->notes, amagent_post_filter_name);
+                apr_pool_userdata_setn(NULL, amagent_post_filter_name, NULL, r->pool);
                 ap_set_content_type(r, "text/html");
                 ap_rprintf(r, "<html><head></head><body onload=\"document.postform.submit()\">"
                         "<form name=\"postform\" method=\"%s\" action=\"%s\">"
@@ -632,6 +643,7 @@ static am_status_t set_request_body(am_request_t *rq) {
     }
 
     apr_table_unset(r->notes, amagent_post_filter_name);
+    apr_pool_userdata_setn(NULL, amagent_post_filter_name, NULL, r->pool);
 
     if (ISVALID(rq->post_data_fn) && rq->post_data_sz > 0) {
         apr_table_set(r->notes, amagent_post_filter_name,
@@ -639,20 +651,78 @@ static am_status_t set_request_body(am_request_t *rq) {
         r->clength = rq->post_data_sz;
         apr_table_set(r->headers_in, "Content-Length",
                 apr_psprintf(r->pool, "%ld", rq->post_data_sz));
+    } else if (rq->post_data != NULL && rq->post_data_sz > 0) {
+        /* replay post data from memory (see amagent_post_filter) */
+        amagent_post_data *post = apr_palloc(r->pool, sizeof (amagent_post_data));
+        if (post == NULL) {
+            return AM_ENOMEM;
+        }
+        post->data = apr_pmemdup(r->pool, rq->post_data, rq->post_data_sz);
+        post->size = rq->post_data_sz;
+        apr_pool_userdata_setn(post, amagent_post_filter_name, NULL, r->pool);
+        r->clength = rq->post_data_sz;
+        apr_table_set(r->headers_in, "Content-Length",
+                apr_psprintf(r->pool, "%ld", rq->post_data_sz));
     }
     return AM_SUCCESS;
 }
 
+/* create a new POST preservation file and move the (screened) body buffer into it */
+static am_status_t post_body_to_file(am_request_t *rq, request_rec *r, am_post_buffer_t *body,
+        apr_file_t **fd, char **file_name) {
+    static const char *thisfunc = "get_request_body():";
+    apr_status_t ret;
+    apr_size_t nbytes_written;
+    char buferr[50];
+    char key[37];
+
+    if (ISINVALID(rq->conf->pdp_dir)) {
+        AM_LOG_ERROR(rq->instance_id, "%s invalid POST preservation configuration", thisfunc);
+        return AM_EINVAL;
+    }
+
+    uuid(key, sizeof (key));
+    *file_name = apr_psprintf(r->pool, "%s/%s", rq->conf->pdp_dir, key);
+    ret = apr_file_open(fd, *file_name,
+            APR_FOPEN_CREATE | APR_FOPEN_APPEND | APR_FOPEN_WRITE | APR_FOPEN_BINARY,
+            APR_OS_DEFAULT, r->pool);
+    if (ret != APR_SUCCESS) {
+        apr_strerror(ret, buferr, sizeof (buferr));
+        AM_LOG_ERROR(rq->instance_id, "%s unable to open POST preservation file %s for write, %s",
+                thisfunc, *file_name, buferr);
+        *fd = NULL;
+        return AM_FILE_ERROR;
+    }
+
+    if (body->size > 0) {
+        ret = apr_file_write_full(*fd, body->data, body->size, &nbytes_written);
+        if (ret != APR_SUCCESS) {
+            apr_strerror(ret, buferr, sizeof (buferr));
+            AM_LOG_ERROR(rq->instance_id, "%s unable to write to POST preservation file: %s, %s",
+                    thisfunc, *file_name, buferr);
+            return AM_FILE_ERROR;
+        }
+    }
+    am_post_buffer_free(body);
+    return AM_SUCCESS;
+}
+
+/*
+ * read request body; LARES/SAML posts (and others when rq->post_data_in_memory is set) are
+ * read into a geometrically growing memory buffer with a hard size limit, all other post data
+ * is streamed into a file. In-memory post data over AM_POST_MEMORY_MAX spills into a file.
+ */
 static am_status_t get_request_body(am_request_t *rq) {
     static const char *thisfunc = "get_request_body():";
     request_rec *r;
     apr_bucket_brigade *bb;
     int eos_found = 0;
-    size_t read_bytes = 0, tmp_sz = 0;
-    am_bool_t to_file = AM_FALSE;
-    apr_status_t read_status = 0, ret, tmp_writes = APR_SUCCESS;
-    am_status_t status = AM_ERROR;
-    char *out = NULL, *out_tmp, *file_name = NULL, *tmp;
+    size_t read_bytes = 0;
+    am_bool_t screened = AM_FALSE, lares = AM_FALSE;
+    apr_status_t read_status = 0, ret;
+    am_status_t status = AM_SUCCESS;
+    am_post_buffer_t body = {NULL, 0, 0};
+    char *file_name = NULL;
     apr_file_t *fd = NULL;
     char buferr[50];
 
@@ -662,12 +732,6 @@ static am_status_t get_request_body(am_request_t *rq) {
 
     r = (request_rec *) rq->ctx;
 
-    /* reserve twice the size of the bytes read from input filter/brigade in one go */
-#define TEMP_BUFFER_SZ  (HUGE_STRING_LEN * 2) 
-    tmp = apr_palloc(r->pool, TEMP_BUFFER_SZ);
-    if (tmp == NULL)
-        return AM_ENOMEM;
-
     bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
 
     do {
@@ -675,18 +739,16 @@ static am_status_t get_request_body(am_request_t *rq) {
         read_status = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES,
                 APR_BLOCK_READ, HUGE_STRING_LEN);
         if (read_status != APR_SUCCESS) {
-            am_free(out);
-            return AM_ERROR;
+            status = AM_ERROR;
+            break;
         }
 
-        ob = APR_BRIGADE_FIRST(bb);
-        while (ob != APR_BRIGADE_SENTINEL(bb)) {
+        for (ob = APR_BRIGADE_FIRST(bb); ob != APR_BRIGADE_SENTINEL(bb); ob = APR_BUCKET_NEXT(ob)) {
             const char *data = NULL;
             apr_size_t data_size = 0;
 
             if (APR_BUCKET_IS_EOS(ob)) {
                 eos_found = 1;
-                status = AM_SUCCESS;
                 break;
             }
 
@@ -696,146 +758,114 @@ static am_status_t get_request_body(am_request_t *rq) {
 
             /* read data */
             apr_bucket_read(ob, &data, &data_size, APR_BLOCK_READ);
+            if (data == NULL || data_size == 0) {
+                continue;
+            }
 
-            if (data != NULL && data_size > 0) {
-
-                if (tmp_writes != APR_EOF && (tmp_sz + data_size) <= TEMP_BUFFER_SZ) {
-                    /* stream initial data into the temp buffer */
-                    memcpy(tmp + tmp_sz, data, data_size);
-                    tmp_sz += data_size;
-                }
-
-                AM_LOG_DEBUG(rq->instance_id, "%s read: %ld, temp: %ld bytes",
-                        thisfunc, data_size, tmp_sz);
-
-                if (tmp_writes != APR_EOF) {
-                    /* try to analyze temp buffer data - see if we can spot our key */
-                    if (tmp_sz > 5) {
-                        /* we've got enough data - check if that's 
-                         * LARES POST or should it be stored into a file */
-                        tmp_writes = APR_EOF;
-                        to_file = memcmp(tmp, "LARES=", 6) != 0;
-                    } else {
-                        /* too little was read in */
-                        ob = APR_BUCKET_NEXT(ob);
-                        continue;
-                    }
+            AM_LOG_DEBUG(rq->instance_id, "%s read: %ld, total: %ld bytes",
+                    thisfunc, data_size, read_bytes + body.size + data_size);
+
+            if (fd != NULL) {
+                /* stream directly into a file */
+                apr_size_t nbytes_written;
+                ret = apr_file_write_full(fd, data, data_size, &nbytes_written);
+                if (ret != APR_SUCCESS) {
+                    apr_strerror(ret, buferr, sizeof (buferr));
+                    AM_LOG_ERROR(rq->instance_id, "%s unable to write to POST preservation file: %s, %s",
+                            thisfunc, file_name, buferr);
+                    status = AM_FILE_ERROR;
+                    break;
                 }
+                read_bytes += data_size;
+                continue;
+            }
 
-                AM_LOG_DEBUG(rq->instance_id, "%s storing into: %s, temp writes: %s",
-                        thisfunc, to_file ? "file" : "memory", tmp_writes == APR_EOF ? "done" : "working");
-
-                if (tmp_writes == APR_EOF) {
-                    /* no more temp buffer screening - write data directly into a file (heap buffer) */
-
-                    if (to_file) {
-                        apr_size_t nbytes_written;
-
-                        if (fd == NULL) {
-                            char key[37];
-
-                            if (ISINVALID(rq->conf->pdp_dir)) {
-                                AM_LOG_ERROR(rq->instance_id, "%s invalid POST preservation configuration",
-                                        thisfunc);
-                                status = AM_EINVAL;
-                                eos_found = 1;
-                                break;
-                            }
-
-                            uuid(key, sizeof (key));
-                            file_name = apr_psprintf(r->pool, "%s/%s", rq->conf->pdp_dir, key);
-                            ret = apr_file_open(&fd, file_name,
-                                    APR_FOPEN_CREATE | APR_FOPEN_APPEND | APR_FOPEN_WRITE | APR_FOPEN_BINARY,
-                                    APR_OS_DEFAULT, r->pool);
-                            if (ret != APR_SUCCESS) {
-                                apr_strerror(ret, buferr, sizeof (buferr));
-                                AM_LOG_ERROR(rq->instance_id, "%s unable to open POST preservation file %s for write, %s",
-                                        thisfunc, file_name, buferr);
-                                status = AM_FILE_ERROR;
-                                eos_found = 1;
-                                break;
-                            }
-                        }
+            status = am_post_buffer_append(&body, data, data_size,
+                    !screened || lares ? AM_POST_LARES_MAX : AM_POST_MEMORY_MAX);
 
-                        if (tmp_sz > 0) {
-                            /* write down whatever we have stored in the temp buffer */
-                            ret = apr_file_write_full(fd, tmp, tmp_sz, &nbytes_written);
-                            if (ret != APR_SUCCESS) {
-                                apr_strerror(ret, buferr, sizeof (buferr));
-                                AM_LOG_ERROR(rq->instance_id, "%s unable to write to POST preservation file: %s, %s",
-                                        thisfunc, file_name, buferr);
-                                status = AM_FILE_ERROR;
-                                eos_found = 1;
-                                break;
-                            }
-                            read_bytes += tmp_sz;
-                            tmp_sz = 0;
-                        } else {
-                            ret = apr_file_write_full(fd, data, data_size, &nbytes_written);
-                            if (ret != APR_SUCCESS) {
-                                apr_strerror(ret, buferr, sizeof (buferr));
-                                AM_LOG_ERROR(rq->instance_id, "%s unable to write to POST preservation file: %s, %s",
-                                        thisfunc, file_name, buferr);
-                                status = AM_FILE_ERROR;
-                                eos_found = 1;
-                                break;
-                            }
-                            read_bytes += data_size;
-                        }
+            if (status == AM_ENOSPC && lares) {
+                AM_LOG_ERROR(rq->instance_id, "%s LARES post data is over %d bytes",
+                        thisfunc, AM_POST_LARES_MAX);
+                break;
+            }
 
-                    } else {
+            if (status == AM_ENOSPC) {
+                /* too large to keep in memory - continue in a file */
+                AM_LOG_DEBUG(rq->instance_id, "%s post data is over %d bytes, storing into a file",
+                        thisfunc, AM_POST_MEMORY_MAX);
+                read_bytes = body.size;
+                status = post_body_to_file(rq, r, &body, &fd, &file_name);
+                if (status == AM_SUCCESS) {
+                    apr_size_t nbytes_written;
+                    ret = apr_file_write_full(fd, data, data_size, &nbytes_written);
+                    status = ret == APR_SUCCESS ? AM_SUCCESS : AM_FILE_ERROR;
+                    read_bytes += data_size;
+                }
+                if (status != AM_SUCCESS) {
+                    break;
+                }
+                continue;
+            }
 
-                        /* process in-memory data */
-                        out_tmp = realloc(out, read_bytes + (tmp_sz > 0 ? tmp_sz : data_size) + 1);
-                        if (out_tmp == NULL) {
-                            am_free(out);
-                            status = AM_ENOMEM;
-                            eos_found = 1;
-                            break;
-                        }
-                        out = out_tmp;
+            if (status != AM_SUCCESS) {
+                break;
+            }
 
-                        if (tmp_sz > 0) {
-                            /* write down whatever we have stored in the temp buffer */
-                            memcpy(out + read_bytes, tmp, tmp_sz);
-                            read_bytes += tmp_sz;
-                            tmp_sz = 0;
-                        } else {
-                            memcpy(out + read_bytes, data, data_size);
-                            read_bytes += data_size;
-                        }
-                        out[read_bytes] = 0;
+            if (!screened && body.size > 5) {
+                /* we've got enough data - check if that's LARES POST or should it be
+                 * stored into a file (unless the caller asked for memory) */
+                screened = AM_TRUE;
+                lares = memcmp(body.data, "LARES=", 6) == 0;
+                if (!lares && !rq->post_data_in_memory) {
+                    read_bytes = body.size;
+                    status = post_body_to_file(rq, r, &body, &fd, &file_name);
+                    if (status != AM_SUCCESS) {
+                        break;
                     }
                 }
+                AM_LOG_DEBUG(rq->instance_id, "%s storing into: %s", thisfunc, fd != NULL ? "file" : "memory");
             }
-
-            ob = APR_BUCKET_NEXT(ob);
-            status = AM_SUCCESS;
         }
-        apr_brigade_destroy(bb);
+        apr_brigade_cleanup(bb);
 
-    } while (eos_found == 0);
+    } while (eos_found == 0 && status == AM_SUCCESS);
 
     apr_brigade_destroy(bb);
 
-    rq->post_data = out;
-    rq->post_data_fn = ISVALID(file_name) ? strdup(file_name) : NULL;
-    rq->post_data_sz = read_bytes;
-
     if (fd != NULL) {
         apr_file_close(fd);
     }
 
-    if (status == AM_SUCCESS) {
-        AM_LOG_DEBUG(rq->instance_id, "%s processed %ld bytes\n%s", thisfunc,
-                read_bytes, ISVALID(out) ? out : LOGEMPTY(file_name));
-        /* remove Content-Length since the body has been read */
-        r->clength = 0;
-        apr_table_unset(r->headers_in, "Content-Length");
+    if (status != AM_SUCCESS) {
+        am_post_buffer_free(&body);
+        if (ISVALID(file_name)) {
+            apr_file_remove(file_name, r->pool);
+        }
+        return status;
     }
+
+    if (fd != NULL) {
+        rq->post_data = NULL;
+        rq->post_data_fn = strdup(file_name);
+        rq->post_data_sz = read_bytes;
+    } else {
+        rq->post_data = body.data;
+        rq->post_data_fn = NULL;
+        rq->post_data_sz = body.size;
+    }
+
+    AM_LOG_DEBUG(rq->instance_id, "%s processed %ld bytes\n%s", thisfunc,
+            rq->post_data_sz, ISVALID(rq->post_data) ? rq->post_data : LOGEMPTY(file_name));
+    /* remove Content-Length since the body has been read */
+    r->clength = 0;
+    apr_table_unset(r->headers_in, "Content-Length");
     return status;
 }
 
+static void *request_arena_alloc(void *pool, size_t size) {
+    return apr_palloc((apr_pool_t *) pool, size);
+}
+
 /**
  * The incoming request_req is changed into an am_request_t on which ALL of our remaining processing is then done.
  */
@@ -889,6 +919,8 @@ static int amagent_auth_handler(request_rec *req) {
     am_request.status = AM_ERROR;
     am_request.instance_id = config->config_id;
     am_request.ctx = req;
+    /* request scoped allocations live in the request pool, released by httpd */
+    am_arena_init(&am_request.arena, request_arena_alloc, req->pool);
     am_request.method = get_method_num(req, config->config_id);
     am_request.content_type = apr_table_get(req->headers_in, "Content-Type");
     am_request.cookies = apr_table_get(req->headers_in, "Cookie");
@@ -912,6 +944,7 @@ static int amagent_auth_handler(request_rec *req) {
     am_request.am_get_request_url_f = get_request_url;
     am_request.am_get_post_data_f = get_request_body;
     am_request.am_set_post_data_f = set_request_body;
+    am_request.pdp_in_memory = AM_TRUE;
     am_request.am_set_user_f = set_user;
     am_request.am_set_header_in_request_f = set_header_in_request;
     am_request.am_add_header_in_response_f = add_header_in_response;
@@ -946,6 +979,15 @@ static void amagent_auth_post_insert_filter(request_rec *req) {
     ap_add_input_filter(amagent_post_filter_name, NULL, req, req->connection);
 }
 
+/* preserved post data has been replayed (or failed to) - release it */
+static void amagent_post_filter_done(request_rec *r, const char *file_name) {
+    if (ISVALID(file_name)) {
+        apr_file_remove(file_name, r->pool);
+    }
+    apr_table_unset(r->notes, amagent_post_filter_name);
+    apr_pool_userdata_setn(NULL, amagent_post_filter_name, NULL, r->pool);
+}
+
 static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *bucket_out,
         ap_input_mode_t emode, apr_read_type_e eblock, apr_off_t nbytes) {
     static const char *thisfunc = "amagent_post_filter():";
@@ -954,11 +996,16 @@ static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *buck
     apr_status_t ret;
     char buferr[50];
     const char *file_name = apr_table_get(r->notes, amagent_post_filter_name);
+    amagent_post_data *post = NULL;
 
     amagent_filter_ctx *state = f->ctx;
 
     if (ISINVALID(file_name)) {
-        return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
+        /* post data might be preserved in memory */
+        apr_pool_userdata_get((void **) &post, amagent_post_filter_name, r->pool);
+        if (post == NULL || post->size == 0) {
+            return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
+        }
     }
 
     if (state == NULL) {
@@ -968,8 +1015,7 @@ static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *buck
         if (state == NULL) {
             ap_log_rerror(APLOG_MARK, APLOG_ERR | APLOG_NOERRNO, 0, r, "%s memory allocation error",
                     thisfunc);
-            apr_file_remove(file_name, r->pool);
-            apr_table_unset(r->notes, amagent_post_filter_name);
+            amagent_post_filter_done(r, file_name);
             return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
         }
 
@@ -977,31 +1023,33 @@ static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *buck
         if (state->output_ptr == NULL) {
             ap_log_rerror(APLOG_MARK, APLOG_ERR | APLOG_NOERRNO, 0, r, "%s memory allocation error",
                     thisfunc);
-            apr_file_remove(file_name, r->pool);
-            apr_table_unset(r->notes, amagent_post_filter_name);
+            amagent_post_filter_done(r, file_name);
             return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
         }
 
-        ret = apr_file_open(&state->tmp_file, file_name, APR_FOPEN_READ | APR_FOPEN_BINARY,
-                APR_OS_DEFAULT, r->pool);
-        if (ret != APR_SUCCESS) {
-            apr_strerror(ret, buferr, sizeof (buferr));
-            ap_log_rerror(APLOG_MARK, APLOG_ERR | APLOG_NOERRNO, 0, r, "%s unable to open POST preservation file: %s, %s",
-                    thisfunc, file_name, buferr);
-            apr_file_remove(file_name, r->pool);
-            apr_table_unset(r->notes, amagent_post_filter_name);
-            return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
-        }
+        if (post != NULL) {
+            state->data = post->data;
+            state->size = (int) post->size;
+        } else {
+            ret = apr_file_open(&state->tmp_file, file_name, APR_FOPEN_READ | APR_FOPEN_BINARY,
+                    APR_OS_DEFAULT, r->pool);
+            if (ret != APR_SUCCESS) {
+                apr_strerror(ret, buferr, sizeof (buferr));
+                ap_log_rerror(APLOG_MARK, APLOG_ERR | APLOG_NOERRNO, 0, r, "%s unable to open POST preservation file: %s, %s",
+                        thisfunc, file_name, buferr);
+                amagent_post_filter_done(r, file_name);
+                return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
+            }
 
-        ret = apr_file_info_get(&finfo, APR_FINFO_SIZE, state->tmp_file);
-        state->size = finfo.size;
+            ret = apr_file_info_get(&finfo, APR_FINFO_SIZE, state->tmp_file);
+            state->size = finfo.size;
+        }
         state->output_sent = 0;
         state->done_writing = 0;
     }
 
     if (state->done_writing == 1) {
-        apr_file_remove(file_name, r->pool);
-        apr_table_unset(r->notes, amagent_post_filter_name);
+        amagent_post_filter_done(r, file_name);
         return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
     }
 
@@ -1013,15 +1061,18 @@ static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *buck
 
         if (state->size - state->output_sent < len) len = state->size - state->output_sent;
 
-        ret = apr_file_read(state->tmp_file, state->output_ptr, &len);
-        if (ret != APR_SUCCESS) {
-            apr_strerror(ret, buferr, sizeof (buferr));
-            ap_log_rerror(APLOG_MARK, APLOG_ERR | APLOG_NOERRNO, 0, r, "%s unable to read POST preservation file: %s, %s",
-                    thisfunc, file_name, buferr);
-            apr_file_close(state->tmp_file);
-            apr_file_remove(file_name, r->pool);
-            apr_table_unset(r->notes, amagent_post_filter_name);
-            return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
+        if (state->data != NULL) {
+            memcpy(state->output_ptr, state->data + state->output_sent, len);
+        } else {
+            ret = apr_file_read(state->tmp_file, state->output_ptr, &len);
+            if (ret != APR_SUCCESS) {
+                apr_strerror(ret, buferr, sizeof (buferr));
+                ap_log_rerror(APLOG_MARK, APLOG_ERR | APLOG_NOERRNO, 0, r, "%s unable to read POST preservation file: %s, %s",
+                        thisfunc, file_name, buferr);
+                apr_file_close(state->tmp_file);
+                amagent_post_filter_done(r, file_name);
+                return ap_get_brigade(f->next, bucket_out, emode, eblock, nbytes);
+            }
         }
 
         pbktOut = apr_bucket_heap_create(state->output_ptr, len, NULL, c->bucket_alloc);
@@ -1044,9 +1095,10 @@ static apr_status_t amagent_post_filter(ap_filter_t *f, apr_bucket_brigade *buck
         /* nothing left for us to do in this request */
         ap_remove_input_filter(f);
 
-        apr_file_close(state->tmp_file);
-        apr_file_remove(file_name, r->pool);
-        apr_table_unset(r->notes, amagent_post_filter_name);
+        if (state->tmp_file != NULL) {
+            apr_file_close(state->tmp_file);
+        }
+        amagent_post_filter_done(r, file_name);
     }
 
     return APR_SUCCESS;
@@ -21,61 +21,113 @@
 #include "thread.h"
 #include "net_client.h"
 
-#define AUDIT_SHM_LOCK_TIMEOUT 500 /* msec */
 #define THROTTLE_CNTRL 50 /* default max number of batch messages per second */
-#define BATCH_SIZE 20
+#define BATCH_SIZE 20 /* default max number of messages in one request */
+#define BATCH_SIZE_MAX 1000
+#define BATCH_BYTES 0x4000 /* default max request payload size */
+#define REQID_SIZE 12
 #define DEFAULT_RUN_INTERVAL 5 /* minutes */
+#define NET_CONFIG_REFRESH 60 /* sec, how long a cached agent configuration is used for remote audit requests */
+
+#define AUDIT_RING_MIN_SIZE (64 * 1024)
+#define AUDIT_RING_MAX_SIZE (64 * 1024 * 1024)
+#define AUDIT_RING_RETRY_LIMIT 1000
+#define AUDIT_RECORD_ALIGN(s) \
+    (((s) + sizeof (struct audit_record) - 1) & ~((uint32_t) sizeof (struct audit_record) - 1))
+#define AUDIT_RING_OFFSET \
+    ((sizeof (struct am_audit) + 63) & ~((size_t) 63))
+
+#define AUDIT_SPOOL_MAGIC 0x414d5350 /* AMSP */
+#define AUDIT_SPOOL_VERSION 2
+#define AUDIT_SPOOL_RECORD_DONE 0x444f4e45 /* record is complete */
+#define AUDIT_SPOOL_RECORD_VOID 0x564f4944 /* record space is reserved, but the record could not be written */
+#define AUDIT_SPOOL_STALL_TIMEOUT 60 /* sec, incomplete record (writer crashed) is skipped after */
+#define AUDIT_SPOOL_HEADER_SIZE 4096
+#define AUDIT_LATENCY_LOW 0.5 /* sec, request time to grow the batch size */
+#define AUDIT_LATENCY_HIGH 2.0 /* sec, request time to shrink the batch size */
+
+#if defined(_WIN32)
+#define AM_ATOMIC_ADD_32        InterlockedExchangeAdd
+#define AM_ATOMIC_CAS_32        InterlockedCompareExchange
+#define AM_ATOMIC_SWAP_32       InterlockedExchange
+#elif defined(__sun)
+#include <sys/atomic.h>
+#define AM_ATOMIC_ADD_32(t,v)   (atomic_add_32_nv(t,v) - (v))
+#define AM_ATOMIC_CAS_32(t,o,n) atomic_cas_32(t,n,o)
+#define AM_ATOMIC_SWAP_32       atomic_swap_32
+#else
+#define AM_ATOMIC_ADD_32        __sync_fetch_and_add
+#define AM_ATOMIC_CAS_32(t,o,n) __sync_val_compare_and_swap(t,n,o)
+
+static inline uint32_t AM_ATOMIC_SWAP_32(volatile uint32_t *target, uint32_t value) {
+    __sync_synchronize();
+    return __sync_lock_test_and_set(target, value);
+}
+#endif
 
-#define AUDIT_ENTRY_LINKS(offset) (&((struct am_audit_entry *) AM_GET_POINTER(audit_shm->pool, (offset)))->lh)
-
-#define OFFSET_LIST_APPEND(hdr, links, offset) do {\
-    if ((hdr)->last) {\
-        links((hdr)->last)->next = offset;\
-        links(offset)->prev = (hdr)->last;\
-    } else {\
-        (hdr)->first = offset;\
-    }\
-    (hdr)->last = offset;\
-} while (0)
-
-#define OFFSET_LIST_UNLINK(hdr, links, offset) do {\
-    if (links(offset)->next) {\
-        links(links(offset)->next)->prev = links(offset)->prev;\
-    } else {\
-        (hdr)->last = links(offset)->prev;\
-    }\
-    if (links(offset)->prev) {\
-        links(links(offset)->prev)->next = links(offset)->next;\
-    } else {\
-        (hdr)->first = links(offset)->next;\
-    }\
-} while (0)
-
-#define AM_OFFSET_LIST_FOR_EACH_OFFSET(base, header, e, offset) \
-    for (offset = (header)->first; (e = AM_GET_POINTER((base), offset), offset); \
-        offset = e->lh.next)
-
-struct offset_list_hdr {
-    unsigned int first, last;
-};
+#if defined(_WIN32)
+#define AUDIT_CAS_64(p, o, n)    (InterlockedCompareExchange64((volatile LONG64 *) (p), n, o) == (LONG64) (o))
+#define AUDIT_YIELD()            SwitchToThread()
+#elif defined(__sun)
+#define AUDIT_CAS_64(p, o, n)    (atomic_cas_64(p, o, n) == (o))
+#define AUDIT_YIELD()            sched_yield()
+#else
+#define AUDIT_CAS_64(p, o, n)    __sync_bool_compare_and_swap(p, o, n)
+#define AUDIT_YIELD()            sched_yield()
+#endif
+
+/*
+ * Remote audit entries are queued in a per-instance ring in the audit shared memory segment.
+ * Request threads (any process) reserve ring space with an atomic cursor update and never
+ * take the shared memory mutex; the audit timer drains the ring (single consumer per instance).
+ * The segment is sized for a fixed number of rings (AM_AUDIT_BUFFER_COUNT) when it is created and
+ * it is never resized - ring memory is accessed without the lock, so it must not be re-mapped.
+ * Rings are assigned to instances when they register; an instance registered after all the rings
+ * are taken has no ring.
+ *
+ * When an instance has a spool file (next to its audit log file), the timer moves ring entries
+ * to the spool file first, then sends spooled entries and checkpoints the spool read offset after
+ * each batch accepted by the server. Unsent entries survive process and host restarts and are sent
+ * when the agent starts again.
+ *
+ * Spool file space is reserved with an atomic update of the append cursor in the memory-mapped
+ * spool file header, so that request threads can write an entry which does not fit in the ring
+ * straight to the spool file, without the shared memory mutex and without fsync. Complete records
+ * (up to the first one still being written) are committed - fsync'ed and made visible to the sender -
+ * by the timer. When the ring is full, a low priority worker job is also scheduled to spool the ring
+ * ahead of the next timer run. With no spool file, entries which do not fit in the ring are dropped.
+ */
 
 struct am_audit {
+    uint32_t ring_size; /* per-instance ring size, power of two */
+    uint32_t ring_count;
     struct am_audit_config {
         unsigned long instance_id;
+        uint32_t ring; /* ring index + 1, 0 - no ring assigned */
         int interval;
         int last;
-        struct offset_list_hdr list_hdr;
+        int batch_size;
+        int batch_bytes;
+        volatile uint32_t write_start; /* ring cursors */
+        volatile uint32_t write_end;
+        volatile uint32_t read;
+        volatile uint32_t draining; /* set while the ring is drained (ring consumer) */
+        volatile uint32_t sending; /* set while spooled entries are sent */
+        volatile uint32_t dropped; /* number of entries dropped (ring full) */
+        volatile uint32_t spilling; /* ring spool job is scheduled (ring full) */
+        volatile uint32_t spool_ready; /* spool file state is recovered (by the first process opening it) */
         char config_file[AM_PATH_SIZE];
         char openam[AM_URI_SIZE];
+        char spool[AM_PATH_SIZE]; /* spool file name, empty - no spool file */
     } config[AM_MAX_INSTANCES];
 };
 
-struct am_audit_entry {
-    uint64_t size;
-    unsigned long instance_id;
-    struct offset_list lh;
-    char server_id[12];
-    char value[1];
+struct audit_record {
+    volatile uint32_t size; /* record size, aligned */
+    volatile uint32_t done_write;
+    uint32_t data_size; /* message size, 0 for padding records */
+    uint32_t reserved;
+    char server_id[16];
 };
 
 struct am_audit_transfer {
@@ -85,9 +137,64 @@ struct am_audit_transfer {
     char *config_file;
 };
 
+struct audit_spool_header {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint64_t read; /* checkpoint: offset of the first record not yet sent */
+    volatile uint64_t write; /* offset past the last committed record */
+    volatile uint64_t end; /* append reservation cursor, 0 - spool file is being reset */
+    uint64_t stall; /* offset of an incomplete record the commit is waiting for */
+    uint64_t stall_time;
+};
+
+struct audit_spool_record {
+    uint32_t size; /* message size */
+    volatile uint32_t state; /* AUDIT_SPOOL_RECORD_DONE/VOID, written last */
+    char server_id[16];
+};
+
 static am_timer_event_t *audit_timer = NULL;
 static am_shm_t *audit_shm = NULL;
 
+#ifdef _WIN32
+static INIT_ONCE audit_net_config_initialized = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION audit_net_config_mutex;
+
+static BOOL CALLBACK audit_net_config_mutex_init(PINIT_ONCE io, PVOID p, PVOID *c) {
+    InitializeCriticalSection(&audit_net_config_mutex);
+    return TRUE;
+}
+
+#define AUDIT_NET_CONFIG_LOCK() \
+    do { \
+        InitOnceExecuteOnce(&audit_net_config_initialized, audit_net_config_mutex_init, NULL, NULL); \
+        EnterCriticalSection(&audit_net_config_mutex); \
+    } while (0)
+#define AUDIT_NET_CONFIG_UNLOCK() LeaveCriticalSection(&audit_net_config_mutex)
+#else
+static pthread_mutex_t audit_net_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define AUDIT_NET_CONFIG_LOCK() pthread_mutex_lock(&audit_net_config_mutex)
+#define AUDIT_NET_CONFIG_UNLOCK() pthread_mutex_unlock(&audit_net_config_mutex)
+#endif
+
+/* per-process agent configuration cache for remote audit requests (audit worker jobs, AUDIT_NET_CONFIG_LOCK held) */
+static struct audit_net_config {
+    unsigned long instance_id;
+    time_t loaded;
+    am_config_t *conf;
+} audit_net_config[AM_MAX_INSTANCES];
+
+/* per-process instance spool files (opened with audit_shm lock held, looked up by request threads without it) */
+static struct audit_spool {
+    unsigned long instance_id;
+    int fd;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+    struct audit_spool_header *header;
+    int batch_size; /* current (adaptive) batch size */
+} audit_spools[AM_MAX_INSTANCES];
+
 static const char *AUDIT_REQ_MSG = "<Request><![CDATA[<logRecWrite reqid=\"%%d\"><log logName=\"%s\" sid=\"%s\">"
         "</log><logRecord><level>800</level><recMsg>%s</recMsg><logInfoMap><logInfo><infoKey>LoginIDSid</infoKey>"
         "<infoValue>%s</infoValue></logInfo></logInfoMap></logRecord></logRecWrite>]]></Request>%%s";
@@ -105,13 +212,53 @@ static int throttle_ratio() {
     return THROTTLE_CNTRL;
 }
 
+static uint32_t get_audit_ring_size() {
+    uint64_t size = AM_AUDIT_BUFFER_SIZE;
+    uint32_t ring_size = AUDIT_RING_MIN_SIZE;
+    char *env = getenv("AM_AUDIT_BUFFER_SIZE");
+    if (ISVALID(env)) {
+        char *end = NULL;
+        uint64_t value = strtoull(env, &end, 10);
+        if (end != NULL && (*end == 'k' || *end == 'K')) {
+            value *= 1024;
+        } else if (end != NULL && (*end == 'm' || *end == 'M')) {
+            value *= 1024 * 1024;
+        }
+        if (value > 0) {
+            size = value;
+        }
+    }
+    while (ring_size < size && ring_size < AUDIT_RING_MAX_SIZE) {
+        ring_size <<= 1;
+    }
+    return ring_size;
+}
+
+static uint32_t get_audit_ring_count() {
+    uint32_t count = AM_AUDIT_BUFFER_COUNT;
+    char *env = getenv("AM_AUDIT_BUFFER_COUNT");
+    if (ISVALID(env)) {
+        char *end = NULL;
+        unsigned long value = strtoul(env, &end, 10);
+        if (end != NULL && *end == '\0' && value > 0) {
+            count = (uint32_t) value;
+        }
+    }
+    return count > AM_MAX_INSTANCES ? AM_MAX_INSTANCES : count;
+}
+
 int am_audit_init(int id) {
     int shm_status = AM_ERROR;
+    uint32_t ring_size, ring_count;
+    uint64_t size;
     if (audit_shm != NULL) return AM_SUCCESS;
 
-    /* allocate memory: average audit entry size * 2048 */
+    /* the segment holds configuration table and the rings (plus allocator overhead) */
+    ring_size = get_audit_ring_size();
+    ring_count = get_audit_ring_count();
+    size = AUDIT_RING_OFFSET + (uint64_t) ring_size * ring_count;
     audit_shm = am_shm_create(get_global_name(AM_AUDIT_SHM_NAME, id),
-            sizeof (struct am_audit) + ((sizeof (struct am_audit_entry) + 800) * 2048), AM_FALSE, NULL, &shm_status);
+            page_size(size + 0x10000), AM_FALSE, NULL, &shm_status);
     if (audit_shm == NULL) {
         return shm_status;
     }
@@ -120,12 +267,14 @@ int am_audit_init(int id) {
     }
 
     if (audit_shm->init) {
-        struct am_audit *audit_data = (struct am_audit *) am_shm_alloc(audit_shm, sizeof (struct am_audit));
+        struct am_audit *audit_data = (struct am_audit *) am_shm_alloc(audit_shm, size);
         if (audit_data == NULL) {
             return AM_ENOMEM;
         }
         am_shm_lock(audit_shm);
-        memset(audit_data->config, 0, sizeof (audit_data->config));
+        memset(audit_data, 0, size);
+        audit_data->ring_size = ring_size;
+        audit_data->ring_count = ring_count;
         /* store table offset (for other processes) */
         am_shm_set_user_offset(audit_shm, AM_GET_OFFSET(audit_shm->pool, audit_data));
         am_shm_unlock(audit_shm);
@@ -134,7 +283,10 @@ int am_audit_init(int id) {
     return AM_SUCCESS;
 }
 
+static void close_audit_spools();
+
 int am_audit_shutdown() {
+    close_audit_spools();
     am_shm_shutdown(audit_shm);
     audit_shm = NULL;
     return AM_SUCCESS;
@@ -156,37 +308,498 @@ static struct am_audit_config *get_audit_config(unsigned long instance_id) {
     return NULL;
 }
 
-static am_status_t add_audit_entry(unsigned long instance_id,
-        const char *server_id, const char *message, size_t size) {
-    int offset;
-    struct am_audit_entry *audit_entry;
-    struct am_audit_config *config;
+static struct audit_record *get_audit_record(struct am_audit *audit, struct am_audit_config *config, uint32_t cursor) {
+    return (struct audit_record *) ((char *) audit + AUDIT_RING_OFFSET +
+            (size_t) (config->ring - 1) * audit->ring_size + (cursor & (audit->ring_size - 1)));
+}
 
-    audit_entry = am_shm_alloc(audit_shm, sizeof (struct am_audit_entry) +size + 1);
-    if (audit_entry == NULL) {
-        return AM_ENOMEM;
+/**
+ * Mark record as written and move write_end cursor over all the records which are complete.
+ */
+static void audit_record_write_done(struct am_audit *audit, struct am_audit_config *config,
+        struct audit_record *record) {
+    AM_ATOMIC_SWAP_32(&record->done_write, 1);
+    for (;;) {
+        /* try and get the right to move the cursor */
+        uint32_t cursor = config->write_end;
+        record = get_audit_record(audit, config, cursor);
+        if (AM_ATOMIC_CAS_32(&record->done_write, 0, 1) != 1) {
+            /* some other thread has already moved cursor for us or we have
+             * reached as far as it possible for us to move the cursor
+             */
+            break;
+        }
+        AM_ATOMIC_CAS_32(&config->write_end, cursor + record->size, cursor);
     }
+}
 
+/**
+ * Reserve a ring record of 'size' bytes (aligned). Does not wait for ring space.
+ */
+static struct audit_record *get_audit_write_block(struct am_audit *audit, struct am_audit_config *config,
+        uint32_t size) {
+    int i;
+    uint32_t ring_size = audit->ring_size;
+    if (config->ring == 0) {
+        return NULL;
+    }
+    for (i = 0; i < AUDIT_RING_RETRY_LIMIT; i++) {
+        uint32_t cursor = config->write_start;
+        uint32_t contiguous = ring_size - (cursor & (ring_size - 1));
+        /* a record which does not fit before the end of the ring is preceded by a padding record */
+        uint32_t reserve = size <= contiguous ? size : contiguous;
+        if (cursor - config->read + reserve > ring_size) {
+            return NULL;
+        }
+        if (AM_ATOMIC_CAS_32(&config->write_start, cursor + reserve, cursor) == cursor) {
+            struct audit_record *record = get_audit_record(audit, config, cursor);
+            record->size = reserve;
+            if (reserve == size) {
+                return record;
+            }
+            record->data_size = 0;
+            audit_record_write_done(audit, config, record);
+            i--;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Spool file helpers. Spool file is appended (and read) at explicit offsets; the header page
+ * is memory-mapped and holds the checkpointed read offset and the end of the last complete record.
+ */
+#ifdef _WIN32
+
+static int spool_pwrite(int fd, const void *buf, uint32_t size, uint64_t offset) {
+    DWORD written = 0;
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof (OVERLAPPED));
+    ov.Offset = (DWORD) (offset & 0xFFFFFFFFul);
+    ov.OffsetHigh = (DWORD) ((offset >> 32) & 0xFFFFFFFFul);
+    if (!WriteFile((HANDLE) _get_osfhandle(fd), buf, size, &written, &ov)) {
+        return -1;
+    }
+    return (int) written;
+}
+
+static int spool_pread(int fd, void *buf, uint32_t size, uint64_t offset) {
+    DWORD read = 0;
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof (OVERLAPPED));
+    ov.Offset = (DWORD) (offset & 0xFFFFFFFFul);
+    ov.OffsetHigh = (DWORD) ((offset >> 32) & 0xFFFFFFFFul);
+    if (!ReadFile((HANDLE) _get_osfhandle(fd), buf, size, &read, &ov)) {
+        return -1;
+    }
+    return (int) read;
+}
+
+#define spool_open(name) _open(name, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE)
+#define spool_close _close
+#define spool_sync _commit
+#define spool_truncate(fd, size) _chsize_s(fd, size)
+#define spool_size(fd) _filelengthi64(fd)
+#define spool_header_sync(s) FlushViewOfFile((s)->header, AUDIT_SPOOL_HEADER_SIZE)
+
+#else
+
+#define spool_pwrite(fd, buf, size, offset) pwrite(fd, buf, size, (off_t) (offset))
+#define spool_pread(fd, buf, size, offset) pread(fd, buf, size, (off_t) (offset))
+#define spool_open(name) open(name, O_CREAT | O_RDWR, S_IWUSR | S_IRUSR | S_IRGRP)
+#define spool_close close
+#define spool_sync fsync
+#define spool_truncate(fd, size) ftruncate(fd, (off_t) (size))
+#define spool_header_sync(s) msync((s)->header, AUDIT_SPOOL_HEADER_SIZE, MS_SYNC)
+
+static int64_t spool_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    return (int64_t) st.st_size;
+}
+
+#endif
+
+static void close_audit_spool(struct audit_spool *s) {
+    if (s->header != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(s->header);
+        CloseHandle(s->mapping);
+        s->mapping = NULL;
+#else
+        munmap(s->header, AUDIT_SPOOL_HEADER_SIZE);
+#endif
+        s->header = NULL;
+    }
+    if (s->fd != -1) {
+        spool_close(s->fd);
+    }
+    s->fd = -1;
+    s->instance_id = 0;
+}
+
+static void close_audit_spools() {
+    int i;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (audit_spools[i].instance_id != 0) {
+            close_audit_spool(&audit_spools[i]);
+        }
+    }
+}
+
+/**
+ * Look up an instance spool file opened by this process.
+ */
+static struct audit_spool *find_audit_spool(unsigned long instance_id) {
+    int i;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct audit_spool *s = &audit_spools[i];
+        if (s->instance_id == instance_id && s->header != NULL && s->fd != -1) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Open (or create) instance spool file. The first process to open it (since the audit shared
+ * memory segment was created) recovers its state: records past the last committed one (appends
+ * interrupted by a crash) are discarded. Must be called with audit_shm lock held.
+ */
+static struct audit_spool *get_audit_spool(struct am_audit_config *config) {
+    static const char *thisfunc = "get_audit_spool():";
+    int i, empty = -1;
+    int64_t size;
+    struct audit_spool *s;
+    struct audit_spool_header *h;
+    unsigned long instance_id = config->instance_id;
+    const char *path = config->spool;
+
+    if (ISINVALID(path)) {
+        return NULL;
+    }
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (audit_spools[i].instance_id == instance_id) {
+            return &audit_spools[i];
+        }
+        if (audit_spools[i].instance_id == 0 && empty == -1) {
+            empty = i;
+        }
+    }
+    if (empty == -1) {
+        return NULL;
+    }
+
+    s = &audit_spools[empty];
+    s->fd = spool_open(path);
+    if (s->fd == -1) {
+        AM_LOG_WARNING(instance_id, "%s failed to open audit spool file %s (error: %d)", thisfunc, path, errno);
+        return NULL;
+    }
+    size = spool_size(s->fd);
+    if (size < AUDIT_SPOOL_HEADER_SIZE && spool_truncate(s->fd, AUDIT_SPOOL_HEADER_SIZE) != 0) {
+        AM_LOG_WARNING(instance_id, "%s failed to initialize audit spool file %s (error: %d)", thisfunc, path, errno);
+        close_audit_spool(s);
+        return NULL;
+    }
+#ifdef _WIN32
+    s->mapping = CreateFileMappingA((HANDLE) _get_osfhandle(s->fd), NULL, PAGE_READWRITE, 0,
+            AUDIT_SPOOL_HEADER_SIZE, NULL);
+    s->header = s->mapping == NULL ? NULL :
+            (struct audit_spool_header *) MapViewOfFile(s->mapping, FILE_MAP_ALL_ACCESS, 0, 0, AUDIT_SPOOL_HEADER_SIZE);
+#else
+    s->header = (struct audit_spool_header *) mmap(NULL, AUDIT_SPOOL_HEADER_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, s->fd, 0);
+    if (s->header == MAP_FAILED) {
+        s->header = NULL;
+    }
+#endif
+    if (s->header == NULL) {
+        AM_LOG_WARNING(instance_id, "%s failed to map audit spool file %s", thisfunc, path);
+        close_audit_spool(s);
+        return NULL;
+    }
+    s->batch_size = 0;
+
+    h = s->header;
+    if (config->spool_ready) {
+        /* other processes may be appending to the spool file already */
+        s->instance_id = instance_id;
+        return s;
+    }
+    if (h->magic != AUDIT_SPOOL_MAGIC || h->version != AUDIT_SPOOL_VERSION ||
+            h->write < AUDIT_SPOOL_HEADER_SIZE || h->read < AUDIT_SPOOL_HEADER_SIZE) {
+        h->magic = AUDIT_SPOOL_MAGIC;
+        h->version = AUDIT_SPOOL_VERSION;
+        h->read = h->write = AUDIT_SPOOL_HEADER_SIZE;
+    }
+    size = spool_size(s->fd);
+    if (size < 0 || (uint64_t) size < h->write) {
+        /* spool file was truncated */
+        h->write = size < AUDIT_SPOOL_HEADER_SIZE ? AUDIT_SPOOL_HEADER_SIZE : (uint64_t) size;
+    }
+    if (h->read > h->write) {
+        h->read = h->write;
+    }
+    if ((uint64_t) size > h->write && spool_truncate(s->fd, h->write) != 0) {
+        AM_LOG_WARNING(instance_id, "%s failed to truncate audit spool file %s (error: %d)", thisfunc, path, errno);
+    }
+    h->end = h->write;
+    h->stall = h->stall_time = 0;
+    spool_header_sync(s);
+    config->spool_ready = 1;
+    s->instance_id = instance_id;
+
+    if (h->read < h->write) {
+        AM_LOG_INFO(instance_id, "%s audit spool file %s has %"PR_L64" bytes of unsent audit log messages",
+                thisfunc, path, (int64_t) (h->write - h->read));
+    }
+    return s;
+}
+
+/**
+ * Reserve spool file space for a record with 'size' bytes of message (atomic, no lock).
+ */
+static int spool_reserve(struct audit_spool *s, uint32_t size, uint64_t *offset) {
+    int i;
+    uint64_t need = sizeof (struct audit_spool_record) + size;
+    for (i = 0; i < AUDIT_RING_RETRY_LIMIT; i++) {
+        uint64_t end = s->header->end;
+        if (end < AUDIT_SPOOL_HEADER_SIZE) {
+            /* wait for the reset to complete */
+            AUDIT_YIELD();
+            continue;
+        }
+        if (AUDIT_CAS_64(&s->header->end, end, end + need)) {
+            *offset = end;
+            return AM_SUCCESS;
+        }
+    }
+    return AM_EAGAIN;
+}
+
+/**
+ * Write a record into reserved spool file space: message, record header and then the record state,
+ * which tells the commit that the record is complete. When the record can not be written, its space
+ * is marked void (skipped by the commit and the sender).
+ */
+static int spool_append(struct audit_spool *s, uint64_t offset, const char *server_id,
+        const char *message, uint32_t size) {
+    struct audit_spool_record r;
+    uint32_t state = AUDIT_SPOOL_RECORD_DONE;
+    int status = AM_SUCCESS;
+    memset(&r, 0, sizeof (struct audit_spool_record));
+    r.size = size;
     if (ISVALID(server_id)) {
-        strncpy(audit_entry->server_id, server_id, sizeof (audit_entry->server_id) - 1);
-    } else {
-        memset(audit_entry->server_id, 0, sizeof (audit_entry->server_id));
+        strncpy(r.server_id, server_id, sizeof (r.server_id) - 1);
+    }
+    if (spool_pwrite(s->fd, message, size, offset + sizeof (struct audit_spool_record)) != (int) size ||
+            spool_pwrite(s->fd, &r, sizeof (struct audit_spool_record), offset) != sizeof (struct audit_spool_record)) {
+        status = AM_FILE_ERROR;
+        state = AUDIT_SPOOL_RECORD_VOID;
+        if (spool_pwrite(s->fd, &r, sizeof (struct audit_spool_record), offset) != sizeof (struct audit_spool_record)) {
+            /* left for the commit to skip once it times out */
+            return status;
+        }
+    }
+    if (spool_pwrite(s->fd, &state, sizeof (state),
+            offset + offsetof(struct audit_spool_record, state)) != sizeof (state)) {
+        return AM_FILE_ERROR;
+    }
+    return status;
+}
+
+/**
+ * Write an audit entry to the spool file (request threads, no lock).
+ */
+static int spool_write_entry(struct audit_spool *s, const char *server_id, const char *message, uint32_t size) {
+    uint64_t offset;
+    int status = spool_reserve(s, size, &offset);
+    if (status == AM_SUCCESS) {
+        status = spool_append(s, offset, server_id, message, size);
+    }
+    return status;
+}
+
+/**
+ * Commit complete spool records: fsync the spool file and move the committed end over them,
+ * up to the first record which is still being written. A record which stays incomplete for
+ * AUDIT_SPOOL_STALL_TIMEOUT seconds (its writer has crashed) is skipped, or if even its size is
+ * not known, all the space reserved after it is discarded. Must be called with audit_shm lock held.
+ */
+static void spool_commit(struct audit_spool *s, unsigned long instance_id) {
+    static const char *thisfunc = "spool_commit():";
+    struct audit_spool_header *h = s->header;
+    uint64_t offset = h->write, end = h->end;
+    struct audit_spool_record r;
+
+    while (offset < end) {
+        if (spool_pread(s->fd, &r, sizeof (struct audit_spool_record), offset) != sizeof (struct audit_spool_record)) {
+            break;
+        }
+        if (r.state != AUDIT_SPOOL_RECORD_DONE && r.state != AUDIT_SPOOL_RECORD_VOID) {
+            uint64_t now = (uint64_t) time(NULL);
+            if (h->stall != offset) {
+                h->stall = offset;
+                h->stall_time = now;
+                break;
+            }
+            if (now - h->stall_time < AUDIT_SPOOL_STALL_TIMEOUT) {
+                break;
+            }
+            if (r.size == 0 || offset + sizeof (struct audit_spool_record) + r.size > end) {
+                AM_LOG_ERROR(instance_id, "%s incomplete audit spool record at offset %"PR_L64", discarding %"PR_L64" bytes",
+                        thisfunc, (int64_t) offset, (int64_t) (end - offset));
+                offset = end;
+                break;
+            }
+            r.state = AUDIT_SPOOL_RECORD_VOID;
+            if (spool_pwrite(s->fd, &r, sizeof (struct audit_spool_record), offset) != sizeof (struct audit_spool_record)) {
+                break;
+            }
+            AM_LOG_ERROR(instance_id, "%s incomplete audit spool record at offset %"PR_L64", skipping it",
+                    thisfunc, (int64_t) offset);
+        }
+        offset += sizeof (struct audit_spool_record) + r.size;
+    }
+    if (offset == h->write) {
+        return;
+    }
+    spool_sync(s->fd);
+    h->write = offset;
+    spool_header_sync(s);
+}
+
+/**
+ * Move complete ring records to the spool file. Must be called with audit_shm lock held.
+ * Ring has a single consumer: nothing is done while the ring is drained elsewhere (a process
+ * with no access to the spool file sending ring entries directly).
+ */
+static am_status_t spool_audit_records(struct am_audit *audit, struct am_audit_config *config,
+        struct audit_spool *s) {
+    static const char *thisfunc = "spool_audit_records():";
+    am_status_t status = AM_SUCCESS;
+
+    if (AM_ATOMIC_CAS_32(&config->draining, 1, 0) != 0) {
+        /* entries written to the spool file directly are committed anyway */
+        spool_commit(s, config->instance_id);
+        return AM_EAGAIN;
+    }
+
+    while (config->read != config->write_end) {
+        uint32_t cursor = config->read, record_size;
+        struct audit_record *record = get_audit_record(audit, config, cursor);
+        record_size = record->size;
+        if (record->data_size > 0) {
+            status = spool_write_entry(s, record->server_id, (char *) (record + 1), record->data_size);
+            if (status != AM_SUCCESS) {
+                break;
+            }
+        }
+        /* release record space */
+        memset(record, 0, record_size);
+        AM_ATOMIC_SWAP_32(&config->read, cursor + record_size);
+    }
+    spool_commit(s, config->instance_id);
+    AM_ATOMIC_SWAP_32(&config->draining, 0);
+    if (status != AM_SUCCESS) {
+        AM_LOG_ERROR(config->instance_id, "%s failed to write audit spool file (error: %d)", thisfunc, errno);
     }
-    memcpy(audit_entry->value, message, size);
-    audit_entry->value[size] = '\0';
-    audit_entry->size = size;
-    audit_entry->instance_id = instance_id;
+    return status;
+}
+
+/**
+ * Spool the audit ring of an instance (if it has a spool file).
+ */
+static void spool_audit_entries(unsigned long instance_id) {
+    struct am_audit *audit;
+    struct am_audit_config *config;
+    struct audit_spool *s;
+
+    if (audit_shm == NULL || am_shm_lock(audit_shm) != AM_SUCCESS) {
+        return;
+    }
+    audit = get_audit_data();
+    config = get_audit_config(instance_id);
+    if (audit != NULL && config != NULL) {
+        if ((s = get_audit_spool(config)) != NULL) {
+            spool_audit_records(audit, config, s);
+        }
+        AM_ATOMIC_SWAP_32(&config->spilling, 0);
+    }
+    am_shm_unlock(audit_shm);
+}
 
-    audit_entry->lh.next = audit_entry->lh.prev = 0;
+static void audit_spill_worker(void *arg) {
+    unsigned long *instance_id = (unsigned long *) arg;
+    if (instance_id == NULL) return;
+    spool_audit_entries(*instance_id);
+    free(instance_id);
+}
+
+/**
+ * Schedule a ring spool job for an instance with a full ring. Does not wait: the job is
+ * best-effort, the audit timer spools the ring anyway.
+ */
+static void schedule_audit_spill(struct am_audit_config *config) {
+    unsigned long *instance_id;
+    if (config->spool[0] == '\0' || AM_ATOMIC_CAS_32(&config->spilling, 1, 0) != 0) {
+        return;
+    }
+    instance_id = malloc(sizeof (unsigned long));
+    if (instance_id != NULL) {
+        *instance_id = config->instance_id;
+        if (am_worker_dispatch_lane(AM_WORKER_LANE_LOW, config->instance_id,
+                audit_spill_worker, instance_id) == AM_SUCCESS) {
+            return;
+        }
+        free(instance_id);
+    }
+    AM_ATOMIC_SWAP_32(&config->spilling, 0);
+}
+
+static am_status_t add_audit_entry(unsigned long instance_id,
+        const char *server_id, const char *message, size_t size) {
+    struct am_audit *audit;
+    struct am_audit_config *config;
+    struct audit_record *record;
 
+    audit = get_audit_data();
     config = get_audit_config(instance_id);
-    if (config == NULL) {
-        am_shm_free(audit_shm, audit_entry);
+    if (audit == NULL || config == NULL) {
         return AM_EINVAL;
     }
+    if (size > audit->ring_size / 4) {
+        return AM_E2BIG;
+    }
+
+    record = get_audit_write_block(audit, config, AUDIT_RECORD_ALIGN(sizeof (struct audit_record) + size + 1));
+    if (record == NULL) {
+        struct audit_spool *s;
+        /* ring is full (or there is no ring for this instance) - write this entry to the spool file and
+         * have the ring moved to the spool file; with no spool file the entry is dropped */
+        if (config->spool[0] != '\0' && (s = find_audit_spool(instance_id)) != NULL &&
+                spool_write_entry(s, server_id, message, (uint32_t) size) == AM_SUCCESS) {
+            schedule_audit_spill(config);
+            return AM_SUCCESS;
+        }
+        AM_ATOMIC_ADD_32(&config->dropped, 1);
+        am_metrics_incr(AM_METRIC_AUDIT_DROPPED);
+        schedule_audit_spill(config);
+        return AM_ENOSPC;
+    }
+
+    memset(record->server_id, 0, sizeof (record->server_id));
+    if (ISVALID(server_id)) {
+        strncpy(record->server_id, server_id, sizeof (record->server_id) - 1);
+    }
+    memcpy(record + 1, message, size);
+    ((char *) (record + 1))[size] = '\0';
+    record->data_size = (uint32_t) size;
 
-    offset = AM_GET_OFFSET(audit_shm->pool, audit_entry);
-    OFFSET_LIST_APPEND(&config->list_hdr, AUDIT_ENTRY_LINKS, offset);
+    audit_record_write_done(audit, config, record);
     return AM_SUCCESS;
 }
 
@@ -227,107 +840,309 @@ int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token
     }
     size = msg_size;
 
-    status = am_shm_lock_timeout(audit_shm, AUDIT_SHM_LOCK_TIMEOUT);
-    if (status != AM_SUCCESS) {
-        AM_FREE(tmp, message, message_b64);
-        return status;
-    }
-
     status = add_audit_entry(instance_id, agent_token_server_id, message, size);
 
-    am_shm_unlock(audit_shm);
     AM_FREE(tmp, message, message_b64);
     return status;
 }
 
-#ifndef UNIT_TEST
-static
-#endif
-am_status_t extract_audit_entries(unsigned long instance_id,
+static void free_audit_batch(int count, struct am_audit_transfer *batch) {
+    int i;
+    for (i = 0; i < count; i++) {
+        AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
+        batch[i].message = batch[i].server_id = batch[i].config_file = NULL;
+    }
+}
+
+/**
+ * Release ring records from the read cursor up to 'end' (records of a sent batch).
+ */
+static void release_ring_entries(struct am_audit *audit, struct am_audit_config *config, uint32_t end) {
+    while (config->read != end) {
+        uint32_t cursor = config->read, size;
+        struct audit_record *record = get_audit_record(audit, config, cursor);
+        size = record->size;
+        memset(record, 0, size);
+        AM_ATOMIC_SWAP_32(&config->read, cursor + size);
+    }
+}
+
+/**
+ * Send audit ring entries directly (instance has no spool file). Ring records are released only
+ * after their batch was accepted by the server; the rest is kept for the next run.
+ */
+static int send_ring_entries(struct am_audit *audit, struct am_audit_config *config,
+        const char *openam, const char *config_file, int max_count, int max_bytes, struct am_audit_transfer *batch,
         am_status_t(*callback)(const char *openam, int count, struct am_audit_transfer *batch)) {
-    static const char *thisfunc = "extract_audit_entries():";
-    am_status_t status;
-    struct am_audit_entry *e;
-    unsigned int offset = 0;
-    struct am_audit_config *config;
-    int i, c = 0, total = 0, ratio;
-    struct am_audit_transfer *batch;
+    static const char *thisfunc = "send_ring_entries():";
+    int c = 0, total = 0, ratio = throttle_ratio();
     uint64_t batch_size = 0;
+    uint32_t cursor = config->read;
     am_timer_t tm;
     double elapsed;
+    am_status_t status = AM_SUCCESS;
 
-    batch = malloc(BATCH_SIZE * sizeof (struct am_audit_transfer));
-    if (batch == NULL) {
-        return AM_ENOMEM;
-    }
-
-    status = am_shm_lock(audit_shm);
-    if (status != AM_SUCCESS) {
-        AM_FREE(batch);
-        return status;
-    }
+    am_timer_start(&tm);
 
-    config = get_audit_config(instance_id);
-    if (config == NULL) {
-        AM_FREE(batch);
-        am_shm_unlock(audit_shm);
-        return AM_EINVAL;
-    }
+    while (cursor != config->write_end) {
+        struct audit_record *record;
 
-    ratio = throttle_ratio();
-    am_timer_start(&tm);
+        elapsed = am_timer_elapsed(&tm);
+        if (elapsed > 1 && (total / elapsed) > ratio) {
+            /* leave the rest for the next run */
+#ifdef UNIT_TEST
+            printf("total: %d, elapsed: %f\n", total, elapsed);
+#endif
+            break;
+        }
 
-    AM_OFFSET_LIST_FOR_EACH_OFFSET(audit_shm->pool, &config->list_hdr, e, offset) {
-        batch[c].message = strdup(e->value);
-        batch[c].instance_id = e->instance_id;
-        batch[c].server_id = strdup(e->server_id);
-        batch[c].config_file = strdup(config->config_file);
+        record = get_audit_record(audit, config, cursor);
+        if (record->data_size > 0) {
+            batch[c].message = strndup((char *) (record + 1), record->data_size);
+            batch[c].instance_id = config->instance_id;
+            batch[c].server_id = strdup(record->server_id);
+            batch[c].config_file = strdup(config_file);
 
-        c++;
-        total++;
-        batch_size += e->size;
+            c++;
+            batch_size += record->data_size;
+        }
+        cursor += record->size;
 
         /* estimate the size of the next message (and overall batch_size) */
-        if ((batch_size + (e->size * 2)) >= 0x4000 || c == BATCH_SIZE) {
+        if (c > 0 && ((batch_size + (batch_size / c) * 2) >= (uint64_t) max_bytes || c == max_count)) {
 #ifdef UNIT_TEST
             printf("sending batch size: %lld bytes, count: %d\n", batch_size, c);
 #endif
-            AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, config->openam);
-            callback(config->openam, c, batch);
-            for (i = 0; i < c; i++) {
-                AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
-                batch[i].message = batch[i].server_id = batch[i].config_file = NULL;
+            AM_LOG_DEBUG(config->instance_id, "%s sending %d audit log messages to %s", thisfunc, c, openam);
+            status = callback(openam, c, batch);
+            free_audit_batch(c, batch);
+            if (status != AM_SUCCESS) {
+                c = 0;
+                break;
             }
+            release_ring_entries(audit, config, cursor);
+            total += c;
             c = 0;
             batch_size = 0;
         }
+    }
+
+    if (c) {
+        AM_LOG_DEBUG(config->instance_id, "%s sending %d audit log messages to %s", thisfunc, c, openam);
+        status = callback(openam, c, batch);
+        free_audit_batch(c, batch);
+        if (status == AM_SUCCESS) {
+            release_ring_entries(audit, config, cursor);
+            total += c;
+        }
+    } else if (status == AM_SUCCESS) {
+        /* trailing padding records */
+        release_ring_entries(audit, config, cursor);
+    }
 
-        OFFSET_LIST_UNLINK(&config->list_hdr, AUDIT_ENTRY_LINKS, offset);
-        am_shm_free(audit_shm, e);
+    if (status != AM_SUCCESS) {
+        AM_LOG_WARNING(config->instance_id, "%s failed to send audit log messages to %s (%s), will retry later",
+                thisfunc, openam, am_strerror(status));
+    }
 
+    am_timer_stop(&tm);
+    return total;
+}
+
+/**
+ * Send spooled audit entries, advancing the spool read checkpoint after each batch which was
+ * accepted by the server. Batch size adapts to the server response time: it shrinks
+ * when requests are slow or fail (the rest is kept for the next run) and grows back
+ * (up to the configured limit) when they are fast.
+ */
+static int send_spool_entries(struct audit_spool *s, unsigned long instance_id,
+        const char *openam, const char *config_file, int max_count, int max_bytes, struct am_audit_transfer *batch,
+        am_status_t(*callback)(const char *openam, int count, struct am_audit_transfer *batch)) {
+    static const char *thisfunc = "send_spool_entries():";
+    int c, total = 0, ratio = throttle_ratio();
+    uint64_t offset, next, end, batch_size;
+    am_timer_t tm, rt;
+    double elapsed;
+    am_status_t status;
+
+    if (s->batch_size <= 0 || s->batch_size > max_count) {
+        s->batch_size = max_count;
+    }
+
+    am_timer_start(&tm);
+
+    offset = s->header->read;
+    end = s->header->write;
+    while (offset < end) {
         elapsed = am_timer_elapsed(&tm);
         if (elapsed > 1 && (total / elapsed) > ratio) {
+            break;
+        }
+
+        c = 0;
+        batch_size = 0;
+        next = offset;
+        while (next < end && c < s->batch_size) {
+            struct audit_spool_record r;
+            if (spool_pread(s->fd, &r, sizeof (struct audit_spool_record), next) != sizeof (struct audit_spool_record) ||
+                    r.size == 0 || next + sizeof (struct audit_spool_record) + r.size > end) {
+                AM_LOG_ERROR(instance_id, "%s invalid audit spool record at offset %"PR_L64", discarding %"PR_L64" bytes",
+                        thisfunc, (int64_t) next, (int64_t) (end - next));
+                next = end;
+                break;
+            }
+            if (r.state == AUDIT_SPOOL_RECORD_VOID) {
+                next += sizeof (struct audit_spool_record) + r.size;
+                continue;
+            }
+            if (c > 0 && batch_size + r.size > (uint64_t) max_bytes) {
+                break;
+            }
+            r.server_id[sizeof (r.server_id) - 1] = '\0';
+            batch[c].message = malloc(r.size + 1);
+            if (batch[c].message == NULL ||
+                    spool_pread(s->fd, batch[c].message, r.size, next + sizeof (struct audit_spool_record)) != (int) r.size) {
+                am_free(batch[c].message);
+                batch[c].message = NULL;
+                break;
+            }
+            batch[c].message[r.size] = '\0';
+            batch[c].instance_id = instance_id;
+            batch[c].server_id = strdup(r.server_id);
+            batch[c].config_file = strdup(config_file);
+            c++;
+            batch_size += r.size;
+            next += sizeof (struct audit_spool_record) + r.size;
+        }
+
+        if (c == 0) {
+            if (next != offset) {
+                /* skip over invalid data */
+                offset = s->header->read = next;
+                spool_header_sync(s);
+                continue;
+            }
+            break;
+        }
+
 #ifdef UNIT_TEST
-            printf("total: %d, elapsed: %f\n", total, elapsed);
+        printf("sending batch size: %lld bytes, count: %d\n", batch_size, c);
 #endif
-            for (i = 0; i < c; i++) {
-                AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
-                batch[i].message = batch[i].server_id = batch[i].config_file = NULL;
-            }
-            c = 0;
+        AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, openam);
+        am_timer_start(&rt);
+        status = callback(openam, c, batch);
+        am_timer_stop(&rt);
+        free_audit_batch(c, batch);
+
+        if (status != AM_SUCCESS) {
+            s->batch_size = s->batch_size > 1 ? s->batch_size / 2 : 1;
+            AM_LOG_WARNING(instance_id, "%s failed to send audit log messages to %s (%s), will retry later",
+                    thisfunc, openam, am_strerror(status));
             break;
         }
-    }
 
-    if (c) {
+        /* checkpoint */
+        offset = s->header->read = next;
+        spool_header_sync(s);
         total += c;
-        AM_LOG_DEBUG(instance_id, "%s sending %d audit log messages to %s", thisfunc, c, config->openam);
-        callback(config->openam, c, batch);
-        for (i = 0; i < c; i++) {
-            AM_FREE(batch[i].message, batch[i].server_id, batch[i].config_file);
+
+        if (am_timer_elapsed(&rt) > AUDIT_LATENCY_HIGH) {
+            s->batch_size = s->batch_size > 1 ? s->batch_size / 2 : 1;
+        } else if (am_timer_elapsed(&rt) < AUDIT_LATENCY_LOW && s->batch_size < max_count) {
+            s->batch_size++;
         }
+
+        end = s->header->write;
+    }
+
+    am_timer_stop(&tm);
+
+    if (s->header->read == s->header->write && s->header->write > AUDIT_SPOOL_HEADER_SIZE &&
+            am_shm_lock(audit_shm) == AM_SUCCESS) {
+        /* everything is sent and there are no pending appends - reset the spool file */
+        uint64_t write = s->header->write;
+        if (s->header->read == write && AUDIT_CAS_64(&s->header->end, write, 0)) {
+            if (spool_truncate(s->fd, AUDIT_SPOOL_HEADER_SIZE) != 0) {
+                AM_LOG_WARNING(instance_id, "%s failed to truncate audit spool file (error: %d)", thisfunc, errno);
+            }
+            s->header->read = s->header->write = AUDIT_SPOOL_HEADER_SIZE;
+            s->header->stall = 0;
+            s->header->end = AUDIT_SPOOL_HEADER_SIZE;
+            spool_header_sync(s);
+        }
+        am_shm_unlock(audit_shm);
+    }
+    return total;
+}
+
+#ifndef UNIT_TEST
+static
+#endif
+am_status_t extract_audit_entries(unsigned long instance_id,
+        am_status_t(*callback)(const char *openam, int count, struct am_audit_transfer *batch)) {
+    static const char *thisfunc = "extract_audit_entries():";
+    am_status_t status;
+    struct am_audit *audit;
+    struct am_audit_config *config;
+    struct audit_spool *spool;
+    int total, max_count, max_bytes;
+    uint32_t dropped;
+    volatile uint32_t *busy;
+    struct am_audit_transfer *batch;
+    am_timer_t tm;
+    char openam[AM_URI_SIZE], config_file[AM_PATH_SIZE];
+
+    /* take a copy of the instance configuration and move ring entries to the spool file */
+    status = am_shm_lock(audit_shm);
+    if (status != AM_SUCCESS) {
+        return status;
+    }
+    audit = get_audit_data();
+    config = get_audit_config(instance_id);
+    if (audit == NULL || config == NULL) {
+        am_shm_unlock(audit_shm);
+        return AM_EINVAL;
+    }
+    strncpy(openam, config->openam, sizeof (openam) - 1);
+    openam[sizeof (openam) - 1] = '\0';
+    strncpy(config_file, config->config_file, sizeof (config_file) - 1);
+    config_file[sizeof (config_file) - 1] = '\0';
+    max_count = config->batch_size > 0 ? config->batch_size : BATCH_SIZE;
+    max_bytes = config->batch_bytes > 0 ? config->batch_bytes : BATCH_BYTES;
+    spool = get_audit_spool(config);
+    if (spool != NULL) {
+        spool_audit_records(audit, config, spool);
+    }
+    am_shm_unlock(audit_shm);
+
+    /* only one ring consumer (and one spool sender) at a time */
+    busy = spool != NULL ? &config->sending : &config->draining;
+    if (AM_ATOMIC_CAS_32(busy, 1, 0) != 0) {
+        return AM_SUCCESS;
+    }
+
+    dropped = AM_ATOMIC_SWAP_32(&config->dropped, 0);
+    if (dropped > 0) {
+        AM_LOG_WARNING(instance_id, "%s %u audit log messages were dropped (audit buffer is full)",
+                thisfunc, dropped);
+    }
+
+    batch = calloc(max_count, sizeof (struct am_audit_transfer));
+    if (batch == NULL) {
+        AM_ATOMIC_SWAP_32(busy, 0);
+        return AM_ENOMEM;
     }
 
+    am_timer_start(&tm);
+    if (spool != NULL) {
+        total = send_spool_entries(spool, instance_id, openam, config_file, max_count, max_bytes, batch, callback);
+    } else {
+        total = send_ring_entries(audit, config, openam, config_file, max_count, max_bytes, batch, callback);
+    }
+    am_timer_stop(&tm);
+
+    AM_ATOMIC_SWAP_32(busy, 0);
+
     if (total > 0) {
         AM_LOG_DEBUG(instance_id, "%s processed %d entries (%f seconds)",
                 thisfunc, total, am_timer_elapsed(&tm));
@@ -336,72 +1151,161 @@ am_status_t extract_audit_entries(unsigned long instance_id,
 #endif
     }
 
-    am_timer_stop(&tm);
-
-    am_shm_unlock(audit_shm);
-
     AM_FREE(batch);
     return status;
 }
 
-static am_status_t write_entries_to_server(const char *openam, int count, struct am_audit_transfer *batch) {
-    static const char *thisfunc = "write_entries_to_server():";
-    int i, msg_size;
-    struct audit_worker_data *wd;
-    char *server_id = NULL, *msg = NULL, *config_file = NULL;
-    unsigned long instance_id;
+/**
+ * Assemble remote audit request payload from a batch of stored entries.
+ *
+ * Each entry is an AUDIT_REQ_MSG with a request id placeholder and a trailing placeholder for the
+ * rest of the batch. Entries are expanded in a single pass, last entry first (the same order
+ * nested formatting of the entries would produce).
+ */
+#ifndef UNIT_TEST
+static
+#endif
+char *audit_batch_message(int count, struct am_audit_transfer *batch, size_t *data_sz) {
+    int i;
+    size_t size = 0, len, pos = 0;
+    char *data;
 
-    if (count == 0 || batch == NULL || ISINVALID(openam)) {
-        return AM_EINVAL;
+    for (i = 0; i < count; i++) {
+        size += strlen(batch[i].message) + REQID_SIZE;
+    }
+    data = malloc(size + 1);
+    if (data == NULL) {
+        return NULL;
     }
 
-    wd = malloc(sizeof (struct audit_worker_data));
-    if (wd == NULL) {
-        return AM_ENOMEM;
+    for (i = count - 1; i >= 0; i--) {
+        const char *message = batch[i].message;
+        const char *reqid = strstr(message, "%d");
+
+        len = strlen(message);
+        if (len >= 2 && message[len - 2] == '%' && message[len - 1] == 's') {
+            len -= 2;
+        }
+        if (reqid == NULL || reqid >= message + len) {
+            memcpy(data + pos, message, len);
+            pos += len;
+            continue;
+        }
+        memcpy(data + pos, message, reqid - message);
+        pos += reqid - message;
+        pos += snprintf(data + pos, REQID_SIZE, "%d", i + 1);
+        len -= (reqid - message) + 2;
+        memcpy(data + pos, reqid + 2, len);
+        pos += len;
     }
+    data[pos] = '\0';
+    if (data_sz != NULL) {
+        *data_sz = pos;
+    }
+    return data;
+}
 
-    for (i = 0; i < count; i++) {
-        if (msg == NULL) {
-            server_id = batch[i].server_id;
-            instance_id = batch[i].instance_id;
-            config_file = batch[i].config_file;
-            msg_size = am_asprintf(&msg, batch[i].message, i + 1, "");
-        } else {
-            msg_size = am_asprintf(&msg, batch[i].message, i + 1, msg);
+static am_config_t *get_audit_net_config(unsigned long instance_id, const char *config_file) {
+    int i, empty = -1;
+    time_t now = time(NULL);
+    struct audit_net_config *c = NULL;
+
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (audit_net_config[i].instance_id == instance_id) {
+            c = &audit_net_config[i];
+            break;
         }
-        if (msg_size <= 0 || msg == NULL) {
-            AM_FREE(wd, msg);
-            return AM_ENOMEM;
+        if (audit_net_config[i].instance_id == 0 && empty == -1) {
+            empty = i;
+        }
+    }
+    if (c == NULL) {
+        if (empty == -1) {
+            return NULL;
         }
+        c = &audit_net_config[empty];
     }
 
-    wd->instance_id = instance_id;
-    wd->openam = strdup(openam);
-    wd->logdata = msg;
-    wd->options = malloc(sizeof (am_net_options_t));
-    if (wd->options != NULL) {
+    if (c->conf == NULL || difftime(now, c->loaded) >= NET_CONFIG_REFRESH) {
         am_config_t *conf = NULL;
-        if (am_get_agent_config(instance_id, config_file, &conf) == AM_SUCCESS) {
-            am_net_options_create(conf, wd->options, NULL);
+        if (am_get_agent_config(instance_id, config_file, &conf) == AM_SUCCESS && conf != NULL) {
+            am_config_free(&c->conf);
+            c->conf = conf;
+            c->instance_id = instance_id;
+            c->loaded = now;
+        } else {
+            /* keep using the last known configuration (if any) */
+            am_config_free(&conf);
         }
-        wd->options->server_id = strdup(server_id);
-        am_config_free(&conf);
     }
+    return c->conf;
+}
 
-    if (am_worker_dispatch(remote_audit_worker, wd) != 0) {
-        AM_LOG_WARNING(instance_id, "%s failed to dispatch remote audit_shm log worker", thisfunc);
-        am_net_options_delete(wd->options);
-        AM_FREE(wd->openam, wd->logdata, wd->options, wd);
-        return AM_ERROR;
+static void free_audit_net_config() {
+    int i;
+    AUDIT_NET_CONFIG_LOCK();
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        am_config_free(&audit_net_config[i].conf);
+        audit_net_config[i].instance_id = 0;
     }
-    return AM_SUCCESS;
+    AUDIT_NET_CONFIG_UNLOCK();
+}
+
+static am_status_t write_entries_to_server(const char *openam, int count, struct am_audit_transfer *batch) {
+    am_config_t *conf;
+    am_net_options_t options;
+    unsigned long instance_id;
+    char *logdata;
+    int status;
+
+    if (count == 0 || batch == NULL || ISINVALID(openam)) {
+        return AM_EINVAL;
+    }
+
+    instance_id = batch[0].instance_id;
+    logdata = audit_batch_message(count, batch, NULL);
+    if (logdata == NULL) {
+        return AM_ENOMEM;
+    }
+
+    memset(&options, 0, sizeof (am_net_options_t));
+    AUDIT_NET_CONFIG_LOCK();
+    conf = get_audit_net_config(instance_id, batch[0].config_file);
+    if (conf != NULL) {
+        am_net_options_create(conf, &options, NULL);
+    }
+    AUDIT_NET_CONFIG_UNLOCK();
+    options.server_id = ISVALID(batch[0].server_id) ? strdup(batch[0].server_id) : NULL;
+
+    /* the request is sent by the audit worker job: ring space is released (spool read offset
+     * is advanced) only when the server has accepted the batch */
+    status = am_agent_audit_request(instance_id, openam, logdata, &options);
+
+    am_net_options_delete(&options);
+    free(logdata);
+    return status;
+}
+
+static void audit_send_worker(void *arg) {
+    static const char *thisfunc = "audit_send_worker():";
+    unsigned long *instance_id = (unsigned long *) arg;
+    am_status_t status;
+    if (instance_id == NULL) return;
+    if (audit_shm != NULL) {
+        status = extract_audit_entries(*instance_id, write_entries_to_server);
+        if (status != AM_SUCCESS) {
+            AM_LOG_WARNING(*instance_id, "%s failed to extract audit entries (%s)", thisfunc, am_strerror(status));
+        }
+    }
+    free(instance_id);
 }
 
 static void am_audit_tick(void *arg) {
     static const char *thisfunc = "am_audit_tick():";
-    int i;
+    int i, count = 0, spooled_count = 0;
     struct am_audit *audit_data;
     int lock_status, status;
+    unsigned long instances[AM_MAX_INSTANCES], spooled[AM_MAX_INSTANCES];
 
     lock_status = am_shm_lock(audit_shm);
     if (lock_status != AM_SUCCESS) {
@@ -415,21 +1319,42 @@ static void am_audit_tick(void *arg) {
     }
 
     for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (audit_data->config[i].instance_id > 0 && audit_data->config[i].spool[0] != '\0') {
+            spooled[spooled_count++] = audit_data->config[i].instance_id;
+        }
         if (audit_data->config[i].instance_id > 0 &&
                 (audit_data->config[i].interval == 1 ||
                 audit_data->config[i].interval == ++(audit_data->config[i].last))) {
             /* reset run-count for this instance */
             audit_data->config[i].last = 0;
-
-            status = extract_audit_entries(audit_data->config[i].instance_id, write_entries_to_server);
-            if (status != AM_SUCCESS) {
-                AM_LOG_WARNING(audit_data->config[i].instance_id,
-                        "%s failed to extract audit entries (%s)", thisfunc, am_strerror(status));
-            }
+            instances[count++] = audit_data->config[i].instance_id;
         }
     }
 
     am_shm_unlock(audit_shm);
+
+    /* keep instance rings empty (in the spool files) between the runs */
+    for (i = 0; i < spooled_count; i++) {
+        spool_audit_entries(spooled[i]);
+    }
+
+    /* drain instance rings (and send the entries) in the worker pool, a job per instance */
+    for (i = 0; i < count; i++) {
+        unsigned long *instance_id = malloc(sizeof (unsigned long));
+        if (instance_id == NULL) {
+            break;
+        }
+        *instance_id = instances[i];
+        status = am_worker_dispatch_lane(AM_WORKER_LANE_LOW, instances[i], audit_send_worker, instance_id);
+        if (status != AM_SUCCESS) {
+            /* entries are kept for the next run */
+            free(instance_id);
+            if (status != AM_EINPROGRESS) {
+                AM_LOG_WARNING(instances[i], "%s failed to dispatch remote audit worker (%s)",
+                        thisfunc, am_strerror(status));
+            }
+        }
+    }
 }
 
 int am_audit_processor_init() {
@@ -450,6 +1375,78 @@ int am_audit_processor_init() {
 void am_audit_processor_shutdown() {
     am_close_timer_event(audit_timer);
     audit_timer = NULL;
+    free_audit_net_config();
+}
+
+/**
+ * Instance spool file is kept next to the instance audit log file.
+ */
+static void set_audit_spool(struct am_audit_config *config, am_config_t *conf) {
+    char *sep, spool[AM_PATH_SIZE];
+    memcpy(spool, config->spool, sizeof (spool));
+    memset(config->spool, 0, sizeof (config->spool));
+    if (ISINVALID(conf->audit_file)) {
+        config->spool_ready = 0;
+        return;
+    }
+    sep = strrchr(conf->audit_file, '/');
+#ifdef _WIN32
+    if (sep == NULL) {
+        sep = strrchr(conf->audit_file, '\\');
+    }
+#endif
+    if (sep == NULL) {
+        snprintf(config->spool, sizeof (config->spool), "remote-audit-%lu.spool", conf->instance_id);
+    } else {
+        snprintf(config->spool, sizeof (config->spool), "%.*s%cremote-audit-%lu.spool",
+                (int) (sep - conf->audit_file), conf->audit_file, *sep, conf->instance_id);
+    }
+    if (strcmp(spool, config->spool) != 0) {
+        config->spool_ready = 0;
+    }
+}
+
+/**
+ * Open instance spool file (request threads write entries which do not fit in the ring to it) and,
+ * if there are entries left unsent (by the previous agent run), have them sent on the next audit
+ * timer tick. Must be called with audit_shm lock held.
+ */
+static void replay_audit_spool(struct am_audit_config *config) {
+    struct audit_spool *s = get_audit_spool(config);
+    if (s != NULL && s->header->read < s->header->write) {
+        config->last = config->interval - 1;
+    }
+}
+
+/**
+ * Assign a free ring to an instance configuration. Must be called with audit_shm lock held.
+ */
+static void set_audit_ring(struct am_audit *audit, struct am_audit_config *config) {
+    uint32_t ring;
+    int i;
+    if (config->ring != 0) {
+        return;
+    }
+    for (ring = 1; ring <= audit->ring_count; ring++) {
+        for (i = 0; i < AM_MAX_INSTANCES; i++) {
+            if (audit->config[i].instance_id != 0 && audit->config[i].ring == ring) {
+                break;
+            }
+        }
+        if (i == AM_MAX_INSTANCES) {
+            config->ring = ring;
+            return;
+        }
+    }
+    AM_LOG_WARNING(config->instance_id, "set_audit_ring(): all %u remote audit buffers are in use, "
+            "remote audit log messages will be %s", audit->ring_count,
+            config->spool[0] != '\0' ? "written to the spool file" : "dropped");
+}
+
+static void set_audit_batch_limits(struct am_audit_config *config, am_config_t *conf) {
+    config->batch_size = conf->audit_remote_batch_size <= 0 ? BATCH_SIZE :
+            (conf->audit_remote_batch_size > BATCH_SIZE_MAX ? BATCH_SIZE_MAX : conf->audit_remote_batch_size);
+    config->batch_bytes = conf->audit_remote_batch_bytes <= 0 ? BATCH_BYTES : conf->audit_remote_batch_bytes;
 }
 
 int am_audit_register_instance(am_config_t *conf) {
@@ -480,8 +1477,12 @@ int am_audit_register_instance(am_config_t *conf) {
         if (audit_data->config[i].instance_id == conf->instance_id) {
             audit_data->config[i].interval = conf->audit_remote_interval <= 0 ?
                     DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
+            set_audit_batch_limits(&audit_data->config[i], conf);
+            set_audit_spool(&audit_data->config[i], conf);
+            set_audit_ring(audit_data, &audit_data->config[i]);
             strncpy(audit_data->config[i].config_file, conf->config, sizeof (audit_data->config[i].config_file) - 1);
             strncpy(audit_data->config[i].openam, openam, sizeof (audit_data->config[i].openam) - 1);
+            replay_audit_spool(&audit_data->config[i]);
             am_shm_unlock(audit_shm);
             return AM_SUCCESS;
         }
@@ -492,9 +1493,13 @@ int am_audit_register_instance(am_config_t *conf) {
             audit_data->config[i].instance_id = conf->instance_id;
             audit_data->config[i].interval = conf->audit_remote_interval <= 0 ?
                     DEFAULT_RUN_INTERVAL : conf->audit_remote_interval;
+            set_audit_batch_limits(&audit_data->config[i], conf);
+            set_audit_spool(&audit_data->config[i], conf);
+            set_audit_ring(audit_data, &audit_data->config[i]);
             audit_data->config[i].last = 0;
             strncpy(audit_data->config[i].config_file, conf->config, sizeof (audit_data->config[i].config_file) - 1);
             strncpy(audit_data->config[i].openam, openam, sizeof (audit_data->config[i].openam) - 1);
+            replay_audit_spool(&audit_data->config[i]);
             break;
         }
     }
@@ -420,20 +420,28 @@ int am_policy_result_serialise(struct cache_object_ctx *ctx, struct am_policy_re
 }
 
 int am_pdp_entry_serialise(struct cache_object_ctx *ctx, const char *url,
-        const char *file, const char *content_type, int method) {
+        const char *file, const char *content_type, int method, const char *data, size_t data_sz) {
     cache_object_write_str(ctx, url, ISVALID(url) ? (uint32_t) strlen(url) : 0);
     cache_object_write_str(ctx, file, ISVALID(file) ? (uint32_t) strlen(file) : 0);
     cache_object_write_str(ctx, content_type, ISVALID(content_type) ? (uint32_t) strlen(content_type) : 0);
     cache_object_write_s32(ctx, method);
+    /* post data kept in memory (not in a file) */
+    cache_object_write_str(ctx, data, data != NULL ? (uint32_t) data_sz : 0);
     return 0;
 }
 
 int am_pdp_entry_deserialise(struct cache_object_ctx *ctx, char **url,
-        char **file, char **content_type, int *method) {
+        char **file, char **content_type, int *method, char **data, size_t *data_sz) {
+    uint32_t sz = 0;
     cache_object_read_str(ctx, url, NULL);
     cache_object_read_str(ctx, file, NULL);
     cache_object_read_str(ctx, content_type, NULL);
     cache_object_read_s32(ctx, method);
+    if (cache_object_read_str(ctx, data, &sz) == 0 && sz == 0) {
+        am_free(*data);
+        *data = NULL;
+    }
+    *data_sz = sz;
     return 0;
 }
 
@@ -504,14 +512,56 @@ struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *c
     return list;
 }
 
-int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, uint64_t *time_addr) {
-    cache_object_read_u64(ctx, time_addr);
+/*
+ * policy change entry: epoch and latest change times, followed by the (time, resource) list;
+ * the list is read only when changes is set
+ */
+int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, struct am_policy_epoch *e, am_bool_t changes) {
+    uint32_t count = 0;
+
+    e->count = 0;
+    cache_object_read_u64(ctx, &e->epoch);
+    cache_object_read_u64(ctx, &e->changed);
+    if (!changes) {
+        return ctx->error;
+    }
+
+    cache_object_read_array(ctx, &count);
+    while (count-- && ctx->error == 0 && e->count < AM_POLICY_CHANGE_MAX) {
+        struct am_policy_change *c = &e->change[e->count];
+        c->resource = NULL;
+        cache_object_read_u64(ctx, &c->time);
+        if (cache_object_read_str(ctx, &c->resource, NULL) != 0) {
+            if (ctx->error == 0) {
+                ctx->error = AM_ERROR;
+            }
+            break;
+        }
+        e->count++;
+    }
     return ctx->error;
 }
 
-int am_policy_epoch_serialise(struct cache_object_ctx *ctx, uint64_t time) {
-    cache_object_write_u64(ctx, time);
+int am_policy_epoch_serialise(struct cache_object_ctx *ctx, const struct am_policy_epoch *e) {
+    uint32_t i;
+
+    cache_object_write_u64(ctx, e->epoch);
+    cache_object_write_u64(ctx, e->changed);
+    cache_object_write_array(ctx, e->count);
+    for (i = 0; i < e->count; i++) {
+        cache_object_write_u64(ctx, e->change[i].time);
+        cache_object_write_str(ctx, e->change[i].resource, (uint32_t) strlen(e->change[i].resource));
+    }
     return ctx->error;
 }
 
+void am_policy_epoch_free(struct am_policy_epoch *e) {
+    uint32_t i;
+
+    for (i = 0; i < e->count; i++) {
+        am_free(e->change[i].resource);
+    }
+    e->count = 0;
+}
+
 
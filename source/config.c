@@ -154,7 +154,21 @@ enum {
     AM_CONF_PROXY_USER,
     AM_CONF_PROXY_PASSWORD,
     AM_CONF_CDSSO_DENY_CLEANUP_DISABLE,
-    AM_CONF_POLICY_EVAL_APP
+    AM_CONF_POLICY_EVAL_APP,
+    AM_CONF_POLICY_HEDGE_ENABLE,
+    AM_CONF_NET_COMPRESS_ENABLE,
+    AM_CONF_POLICY_PREFETCH_ENABLE,
+    AM_CONF_POLICY_PREFETCH_MAP,
+    AM_CONF_LOG_SYNC,
+    AM_CONF_LOG_DEFERRED,
+    AM_CONF_LOG_ROTATE_COMPRESS,
+    AM_CONF_LOG_ROTATE_KEEP,
+    AM_CONF_LOG_ROTATE_AGE,
+    AM_CONF_AUDIT_REMOTE_BATCH_SIZE,
+    AM_CONF_AUDIT_REMOTE_BATCH_BYTES,
+    AM_CONF_METRICS_URL,
+    AM_CONF_PDP_MEMORY_LIMIT,
+    AM_CONF_METRICS_IP_MAP
 };
 
 struct am_instance {
@@ -463,6 +477,17 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (ISVALID(c->notif_url)) {
             SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_NOTIF_URL, 0), c->notif_url);
         }
+        if (ISVALID(c->metrics_url)) {
+            SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_METRICS_URL, 0), c->metrics_url);
+        }
+        if (c->metrics_ip_map_sz > 0 && c->metrics_ip_map != NULL) {
+            for (i = 0; i < c->metrics_ip_map_sz; i++) {
+                am_config_map_t *v = &(c->metrics_ip_map[i]);
+                if (ISVALID(v->name) && ISVALID(v->value)) {
+                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_METRICS_IP_MAP, c->metrics_ip_map_sz), v->name, v->value);
+                }
+            }
+        }
         if (c->url_eval_case_ignore > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_EVAL_CASE, 0), c->url_eval_case_ignore);
         }
@@ -517,6 +542,27 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (c->keepalive_disable > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_KEEPALIVE_DISABLE, 0), c->keepalive_disable);
         }
+        if (c->policy_hedge_enable > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_POLICY_HEDGE_ENABLE, 0), c->policy_hedge_enable);
+        }
+        if (c->net_compress_enable > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_NET_COMPRESS_ENABLE, 0), c->net_compress_enable);
+        }
+        if (c->log_sync != 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOG_SYNC, 0), c->log_sync);
+        }
+        if (c->log_deferred > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOG_DEFERRED, 0), c->log_deferred);
+        }
+        if (c->log_rotate_compress > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOG_ROTATE_COMPRESS, 0), c->log_rotate_compress);
+        }
+        if (c->log_rotate_keep > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOG_ROTATE_KEEP, 0), c->log_rotate_keep);
+        }
+        if (c->log_rotate_age > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_LOG_ROTATE_AGE, 0), c->log_rotate_age);
+        }
         if (c->persistent_cookie_enable > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PERSISTENT_COOKIE_ENABLE, 0), c->persistent_cookie_enable);
         }
@@ -626,6 +672,9 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
         if (c->pdp_js_repost > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_JS, 0), c->pdp_js_repost);
         }
+        if (c->pdp_memory_limit > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_PDP_MEMORY_LIMIT, 0), c->pdp_memory_limit);
+        }
         if (c->client_ip_validate > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_IP_VALIDATE, 0), c->client_ip_validate);
         }
@@ -791,12 +840,29 @@ static int am_create_instance_entry_data(uint32_t h, am_config_t *c, char all) {
                 }
             }
         }
+        if (c->policy_prefetch_enable > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_POLICY_PREFETCH_ENABLE, 0), c->policy_prefetch_enable);
+        }
+        if (c->policy_prefetch_map_sz > 0 && c->policy_prefetch_map != NULL) {
+            for (i = 0; i < c->policy_prefetch_map_sz; i++) {
+                am_config_map_t *v = &(c->policy_prefetch_map[i]);
+                if (ISVALID(v->name) && ISVALID(v->value)) {
+                    SAVE_CHAR2_VALUE(conf, h, MAKE_TYPE(AM_CONF_POLICY_PREFETCH_MAP, c->policy_prefetch_map_sz), v->name, v->value);
+                }
+            }
+        }
         if (c->audit_level > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_LEVEL, 0), c->audit_level);
         }
         if (c->audit_remote_interval > 0) {
             SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_INTERVAL, 0), c->audit_remote_interval);
         }
+        if (c->audit_remote_batch_size > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_BATCH_SIZE, 0), c->audit_remote_batch_size);
+        }
+        if (c->audit_remote_batch_bytes > 0) {
+            SAVE_NUM_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_BATCH_BYTES, 0), c->audit_remote_batch_bytes);
+        }
         if (ISVALID(c->audit_file_remote)) {
             SAVE_CHAR_VALUE(conf, h, MAKE_TYPE(AM_CONF_AUDIT_REMOTE_FILE, 0), c->audit_file_remote);
         }
@@ -882,6 +948,12 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_AUDIT_REMOTE_INTERVAL:
                 r->audit_remote_interval = i->num_value;
                 break;
+            case AM_CONF_AUDIT_REMOTE_BATCH_SIZE:
+                r->audit_remote_batch_size = i->num_value;
+                break;
+            case AM_CONF_AUDIT_REMOTE_BATCH_BYTES:
+                r->audit_remote_batch_bytes = i->num_value;
+                break;
             case AM_CONF_AUDIT_REMOTE_FILE:
                 r->audit_file_remote = strndup(i->value, i->size[0]);
                 break;
@@ -977,6 +1049,25 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_NOTIF_URL:
                 r->notif_url = strndup(i->value, i->size[0]);
                 break;
+            case AM_CONF_METRICS_URL:
+                r->metrics_url = strndup(i->value, i->size[0]);
+                break;
+            case AM_CONF_METRICS_IP_MAP:
+                if (r->metrics_ip_map_sz == 0) {
+                    r->metrics_ip_map = malloc(sz * sizeof (am_config_map_t));
+                }
+                if (r->metrics_ip_map != NULL && r->metrics_ip_map_sz < sz) {
+                    am_config_map_t *m = &(r->metrics_ip_map[r->metrics_ip_map_sz++]);
+                    m->name = malloc(i->size[0] + i->size[1] + 2);
+                    if (m->name != NULL) {
+                        memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
+                        m->value = m->name + i->size[0] + 1;
+                    } else {
+                        AM_CONF_MAP_FREE(--r->metrics_ip_map_sz, r->metrics_ip_map);
+                        r->metrics_ip_map_sz = 0;
+                    }
+                }
+                break;
             case AM_CONF_EVAL_CASE:
                 r->url_eval_case_ignore = i->num_value;
                 break;
@@ -1055,6 +1146,27 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_KEEPALIVE_DISABLE:
                 r->keepalive_disable = i->num_value;
                 break;
+            case AM_CONF_POLICY_HEDGE_ENABLE:
+                r->policy_hedge_enable = i->num_value;
+                break;
+            case AM_CONF_NET_COMPRESS_ENABLE:
+                r->net_compress_enable = i->num_value;
+                break;
+            case AM_CONF_LOG_SYNC:
+                r->log_sync = i->num_value;
+                break;
+            case AM_CONF_LOG_DEFERRED:
+                r->log_deferred = i->num_value;
+                break;
+            case AM_CONF_LOG_ROTATE_COMPRESS:
+                r->log_rotate_compress = i->num_value;
+                break;
+            case AM_CONF_LOG_ROTATE_KEEP:
+                r->log_rotate_keep = i->num_value;
+                break;
+            case AM_CONF_LOG_ROTATE_AGE:
+                r->log_rotate_age = i->num_value;
+                break;
             case AM_CONF_PERSISTENT_COOKIE_ENABLE:
                 r->persistent_cookie_enable = i->num_value;
                 break;
@@ -1195,6 +1307,9 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
             case AM_CONF_PDP_JS:
                 r->pdp_js_repost = i->num_value;
                 break;
+            case AM_CONF_PDP_MEMORY_LIMIT:
+                r->pdp_memory_limit = i->num_value;
+                break;
             case AM_CONF_PDP_SMODE:
                 r->pdp_sess_mode = strndup(i->value, i->size[0]);
                 break;
@@ -1441,6 +1556,25 @@ static am_config_t *am_get_stored_agent_config(struct am_instance_entry *c) {
                     }
                 }
                 break;
+            case AM_CONF_POLICY_PREFETCH_ENABLE:
+                r->policy_prefetch_enable = i->num_value;
+                break;
+            case AM_CONF_POLICY_PREFETCH_MAP:
+                if (r->policy_prefetch_map_sz == 0) {
+                    r->policy_prefetch_map = malloc(sz * sizeof (am_config_map_t));
+                }
+                if (r->policy_prefetch_map != NULL && r->policy_prefetch_map_sz < sz) {
+                    am_config_map_t *m = &(r->policy_prefetch_map[r->policy_prefetch_map_sz++]);
+                    m->name = malloc(i->size[0] + i->size[1] + 2);
+                    if (m->name != NULL) {
+                        memcpy(m->name, i->value, i->size[0] + i->size[1] + 2);
+                        m->value = m->name + i->size[0] + 1;
+                    } else {
+                        AM_CONF_MAP_FREE(--r->policy_prefetch_map_sz, r->policy_prefetch_map);
+                        r->policy_prefetch_map_sz = 0;
+                    }
+                }
+                break;
             case AM_CONF_ANON_USER_ENABLE:
                 r->anon_remote_user_enable = i->num_value;
                 break;
@@ -1545,6 +1679,13 @@ static int am_set_agent_config(unsigned long instance_id, const char *xml,
                 bc->audit_level = cf->audit_level;
                 bc->audit = cf->audit;
                 cf->keepalive_disable = bc->keepalive_disable;
+                cf->policy_hedge_enable = bc->policy_hedge_enable;
+                cf->net_compress_enable = bc->net_compress_enable;
+                cf->log_sync = bc->log_sync;
+                cf->log_deferred = bc->log_deferred;
+                cf->log_rotate_compress = bc->log_rotate_compress;
+                cf->log_rotate_keep = bc->log_rotate_keep;
+                cf->log_rotate_age = bc->log_rotate_age;
                 cf->secure_channel_disable = bc->secure_channel_disable;
                 cf->proxy_port = bc->proxy_port;
                 cf->proxy_password_sz = bc->proxy_password_sz;
@@ -1583,7 +1724,7 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
     int rv = AM_ERROR, in_progress = AM_FALSE;
     char *profile_xml = NULL;
     size_t profile_xml_sz = 0;
-    int max_retry = 3;
+    int max_retry = 3, failed_index = -1;
     unsigned int retry = 3, retry_wait = 2;
 
     if (instance_id == 0 || cnf == NULL || ISINVALID(config_file)) {
@@ -1602,7 +1743,9 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
         c = get_instance_entry(instance_id);
         if (c == NULL) {
             am_request_t r;
-            int login_status, should_retry = AM_FALSE, store_status;
+            int login_status, should_retry = AM_FALSE, failover = AM_FALSE, store_status, url_index;
+            const char *service_url;
+            am_timer_t tmr;
             char *agent_token = NULL;
             struct am_namevalue *agent_session = NULL;
             am_config_t *ac = NULL;
@@ -1642,9 +1785,19 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
             r.conf = ac;
             r.instance_id = instance_id;
 
-            login_status = am_agent_login(instance_id, get_valid_openam_url(&r),
+            /* do not try the same naming url again if the previous login attempt failed */
+            service_url = get_healthy_openam_url(&r, failed_index, &url_index);
+            if (service_url == NULL) {
+                service_url = get_healthy_openam_url(&r, -1, &url_index);
+            }
+
+            am_url_breaker_claim(instance_id, url_index);
+            am_timer_start(&tmr);
+            login_status = am_agent_login(instance_id, service_url,
                     ac->user, ac->pass, ac->realm, ac->policy_eval_app, &net_options,
                     &agent_token, &profile_xml, &profile_xml_sz, &agent_session);
+            am_timer_stop(&tmr);
+            am_url_breaker_report(instance_id, url_index, login_status, am_timer_elapsed(&tmr));
 
             if (login_status == AM_SUCCESS && ISVALID(agent_token) && agent_session != NULL) {
 
@@ -1671,6 +1824,9 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
                 AM_LOG_WARNING(instance_id, "%s retry %d (login failure)",
                         thisfunc, (retry - max_retry) + 1);
                 should_retry = AM_TRUE;
+                /* there is no need to wait when some other naming url is available */
+                failed_index = url_index;
+                failover = url_index != -1 && get_healthy_openam_url(&r, url_index, NULL) != NULL;
             }
 
             am_net_options_delete(&net_options);
@@ -1683,7 +1839,9 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
             if (should_retry) {
                 am_agent_init_set_value(instance_id, AM_FALSE);
                 am_agent_instance_init_unlock();
-                sleep(retry_wait);
+                if (!failover) {
+                    sleep(retry_wait);
+                }
                 continue;
             }
 
@@ -1738,6 +1896,8 @@ int am_get_agent_config(unsigned long instance_id, const char *config_file, am_c
                     /* update instance logger registration data */
                     am_log_register_instance(instance_id, (*cnf)->debug_file, (*cnf)->debug_level, (*cnf)->debug,
                             (*cnf)->audit_file, (*cnf)->audit_level, (*cnf)->audit, (*cnf)->config);
+                    am_log_set_options(instance_id, (*cnf)->log_sync, (*cnf)->log_deferred,
+                            (*cnf)->log_rotate_compress, (*cnf)->log_rotate_keep, (*cnf)->log_rotate_age);
                 }
 
                 if (AM_BITMASK_CHECK((*cnf)->audit_level, AM_LOG_LEVEL_AUDIT_REMOTE)) {
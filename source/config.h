@@ -71,6 +71,8 @@ typedef struct {
     char *audit_file;
     char *audit_file_remote;
     int audit_remote_interval; /* minutes */
+    int audit_remote_batch_size; /* max number of messages sent in one request */
+    int audit_remote_batch_bytes; /* max request payload size */
     char *audit_file_disposition;
 
     char *cert_key_file;
@@ -110,6 +112,9 @@ typedef struct {
 
     int notif_enable;
     char *notif_url;
+    char *metrics_url; /* agent metrics (Prometheus) url */
+    int metrics_ip_map_sz;
+    am_config_map_t *metrics_ip_map; /* client addresses allowed to read the metrics (loopback only, if empty) */
 
     int url_eval_case_ignore;
     int policy_cache_valid; /* seconds */
@@ -165,6 +170,7 @@ typedef struct {
     char *pdp_lb_cookie;
     int pdp_cache_valid;
     int pdp_js_repost;
+    int pdp_memory_limit; /* bytes, smaller POST bodies are preserved in the agent cache */
     char *pdp_sess_mode;
     char *pdp_sess_value;
     char *pdp_uri_prefix;
@@ -240,11 +246,22 @@ typedef struct {
     int path_info_ignore;
     int path_info_ignore_not_enforced;
     int keepalive_disable;
+    int policy_hedge_enable;
+    int net_compress_enable;
+    int log_sync;
+    int log_deferred;
+    int log_rotate_compress;
+    int log_rotate_keep;
+    int log_rotate_age;
     int persistent_cookie_enable;
 
     int skip_post_url_map_sz;
     am_config_map_t *skip_post_url_map;
 
+    int policy_prefetch_enable;
+    int policy_prefetch_map_sz;
+    am_config_map_t *policy_prefetch_map;
+
     int secure_channel_disable;
 
     int proxy_port;
@@ -295,6 +312,13 @@ typedef struct {
 #define AM_AGENTS_CONFIG_RETRY_WAIT "com.forgerock.agents.init.retry.wait"
 
 #define AM_AGENTS_CONFIG_KEEPALIVE_DISABLE "org.forgerock.agents.config.keepalive.disable"
+#define AM_AGENTS_CONFIG_POLICY_HEDGE_ENABLE "org.forgerock.agents.config.policy.hedge.enable"
+#define AM_AGENTS_CONFIG_NET_COMPRESS_ENABLE "org.forgerock.agents.config.net.compression.enable"
+#define AM_AGENTS_CONFIG_LOG_SYNC "org.forgerock.agents.config.log.sync"
+#define AM_AGENTS_CONFIG_LOG_DEFERRED "org.forgerock.agents.config.log.deferred"
+#define AM_AGENTS_CONFIG_LOG_ROTATE_COMPRESS "org.forgerock.agents.config.log.rotate.compress"
+#define AM_AGENTS_CONFIG_LOG_ROTATE_KEEP "org.forgerock.agents.config.log.rotate.keep"
+#define AM_AGENTS_CONFIG_LOG_ROTATE_AGE "org.forgerock.agents.config.log.rotate.age"
 
 /* other options */
 
@@ -304,6 +328,8 @@ typedef struct {
 #define AM_AGENTS_CONFIG_COOKIE_SECURE "com.sun.identity.agents.config.cookie.secure"        
 #define AM_AGENTS_CONFIG_NOTIF_ENABLE "com.sun.identity.agents.config.notification.enable"        
 #define AM_AGENTS_CONFIG_NOTIF_URL "com.sun.identity.client.notification.url"        
+#define AM_AGENTS_CONFIG_METRICS_URL "org.forgerock.agents.config.metrics.url"
+#define AM_AGENTS_CONFIG_METRICS_IP "org.forgerock.agents.config.metrics.ip"
 #define AM_AGENTS_CONFIG_CMP_CASE_IGNORE "com.sun.identity.agents.config.url.comparison.case.ignore"
 
 #define AM_AGENTS_CONFIG_POLICY_CACHE_VALID "com.sun.identity.agents.config.policy.cache.polling.interval"        
@@ -398,6 +424,7 @@ typedef struct {
 #define AM_AGENTS_CONFIG_IIS_PASSWORD_HEADER "com.sun.identity.agents.config.iis.password.header"
 
 #define AM_AGENTS_CONFIG_PDP_JS_REPOST "org.forgerock.agents.pdp.javascript.repost"
+#define AM_AGENTS_CONFIG_PDP_MEMORY_LIMIT "org.forgerock.agents.pdp.memory.limit"
 #define AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_URL "org.forgerock.agents.config.notenforced.ipurl"
 #define AM_AGENTS_CONFIG_EXT_NOT_ENFORCED_REGEX_ENABLE "org.forgerock.agents.config.notenforced.ext.regex.enable"
 
@@ -408,6 +435,8 @@ typedef struct {
 
 #define AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE "com.sun.identity.agents.config.remote.logfile"
 #define AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL "com.sun.identity.agents.config.remote.log.interval"
+#define AM_AGENTS_CONFIG_AUDIT_REMOTE_BATCH_SIZE "org.forgerock.agents.config.remote.log.batch.size"
+#define AM_AGENTS_CONFIG_AUDIT_REMOTE_BATCH_BYTES "org.forgerock.agents.config.remote.log.batch.bytes"
 #define AM_AGENTS_CONFIG_AUDIT_DISPOSITION "com.sun.identity.agents.config.log.disposition"
 
 #define AM_AGENTS_CONFIG_ANONYMOUS_USER_ENABLE "com.sun.identity.agents.config.anonymous.user.enable"
@@ -419,6 +448,8 @@ typedef struct {
 #define AM_AGENTS_CONFIG_PERSISTENT_COOKIE_ENABLE "org.forgerock.agents.config.cdsso.persistent.cookie.enable"
 
 #define AM_AGENTS_CONFIG_SKIP_POST_URL "org.forgerock.agents.config.skip.post.url"
+#define AM_AGENTS_CONFIG_POLICY_PREFETCH_ENABLE "org.forgerock.agents.config.policy.prefetch.enable"
+#define AM_AGENTS_CONFIG_POLICY_PREFETCH_PREFIX "org.forgerock.agents.config.policy.prefetch.prefix"
 #define AM_AGENTS_CONFIG_SCHANNEL_DISABLE "org.forgerock.agents.config.secure.channel.disable"
 
 #define AM_AGENTS_CONFIG_PROXY_HOST "com.sun.identity.agents.config.forward.proxy.host"
@@ -459,9 +459,18 @@ am_config_t *am_get_config_file(unsigned long instance_id, const char *filename)
 
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOTIF_ENABLE, CONF_NUMBER, NULL, &conf->notif_enable, NULL);
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NOTIF_URL, CONF_STRING, NULL, &conf->notif_url, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_METRICS_URL, CONF_STRING, NULL, &conf->metrics_url, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_METRICS_IP, CONF_STRING_MAP, &conf->metrics_ip_map_sz, &conf->metrics_ip_map, NULL);
 
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LB_ENABLE, CONF_NUMBER, NULL, &conf->lb_enable, NULL);
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_KEEPALIVE_DISABLE, CONF_NUMBER, NULL, &conf->keepalive_disable, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_HEDGE_ENABLE, CONF_NUMBER, NULL, &conf->policy_hedge_enable, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_NET_COMPRESS_ENABLE, CONF_NUMBER, NULL, &conf->net_compress_enable, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOG_SYNC, CONF_NUMBER, NULL, &conf->log_sync, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOG_DEFERRED, CONF_NUMBER, NULL, &conf->log_deferred, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOG_ROTATE_COMPRESS, CONF_NUMBER, NULL, &conf->log_rotate_compress, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOG_ROTATE_KEEP, CONF_NUMBER, NULL, &conf->log_rotate_keep, NULL);
+        parse_config_value(instance_id, line, AM_AGENTS_CONFIG_LOG_ROTATE_AGE, CONF_NUMBER, NULL, &conf->log_rotate_age, NULL);
         
         parse_config_value(instance_id, line, AM_AGENTS_CONFIG_SCHANNEL_DISABLE, CONF_NUMBER, NULL, &conf->secure_channel_disable, NULL);
         
@@ -572,6 +581,7 @@ am_config_t *am_get_config_file(unsigned long instance_id, const char *filename)
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_IIS_LOGON_USER, CONF_NUMBER, NULL, &conf->logon_user_enable, NULL);
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_IIS_PASSWORD_HEADER, CONF_NUMBER, NULL, &conf->password_header_enable, NULL);
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_JS_REPOST, CONF_NUMBER, NULL, &conf->pdp_js_repost, NULL);
+            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PDP_MEMORY_LIMIT, CONF_NUMBER, NULL, &conf->pdp_memory_limit, NULL);
 
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_JSON_URL, CONF_STRING_MAP, &conf->json_url_map_sz, &conf->json_url_map, NULL);
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_JSON_URL_INVERT, CONF_NUMBER, NULL, &conf->json_url_invert, NULL);
@@ -580,6 +590,8 @@ am_config_t *am_get_config_file(unsigned long instance_id, const char *filename)
 
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_LEVEL, CONF_AUDIT_LEVEL, NULL, &conf->audit_level, NULL);
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL, CONF_NUMBER, NULL, &conf->audit_remote_interval, NULL);
+            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_REMOTE_BATCH_SIZE, CONF_NUMBER, NULL, &conf->audit_remote_batch_size, NULL);
+            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_REMOTE_BATCH_BYTES, CONF_NUMBER, NULL, &conf->audit_remote_batch_bytes, NULL);
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE, CONF_STRING, NULL, &conf->audit_file_remote, NULL);
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_AUDIT_DISPOSITION, CONF_STRING, NULL, &conf->audit_file_disposition, NULL);
         
@@ -592,6 +604,9 @@ am_config_t *am_get_config_file(unsigned long instance_id, const char *filename)
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_PERSISTENT_COOKIE_ENABLE, CONF_NUMBER, NULL, &conf->persistent_cookie_enable, NULL);
             
             parse_config_value(instance_id, line, AM_AGENTS_CONFIG_SKIP_POST_URL, CONF_STRING_MAP, &conf->skip_post_url_map_sz, &conf->skip_post_url_map, NULL);
+
+            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_PREFETCH_ENABLE, CONF_NUMBER, NULL, &conf->policy_prefetch_enable, NULL);
+            parse_config_value(instance_id, line, AM_AGENTS_CONFIG_POLICY_PREFETCH_PREFIX, CONF_STRING_MAP, &conf->policy_prefetch_map_sz, &conf->policy_prefetch_map, NULL);
         }
     }
 
@@ -641,7 +656,7 @@ void am_config_free(am_config_t **cp) {
                 c->key, c->debug_file, c->audit_file, c->cert_key_file,
                 c->cert_key_pass, c->cert_file, c->cert_ca_file, c->ciphers,
                 c->tls_opts, c->valid_default_url, c->agenturi, c->cookie_name,
-                c->notif_url, c->userid_param, c->userid_param_type, c->access_denied_url,
+                c->notif_url, c->metrics_url, c->userid_param, c->userid_param_type, c->access_denied_url,
                 c->fqdn_default, c->pdp_lb_cookie, c->cookie_prefix, c->logout_redirect_url,
                 c->password_replay_key, c->url_redirect_param, c->client_ip_header,
                 c->client_hostname_header, c->url_check_regex, c->multi_attr_separator,
@@ -669,6 +684,8 @@ void am_config_free(am_config_t **cp) {
         AM_CONF_MAP_FREE(c->json_url_map_sz, c->json_url_map);
         AM_CONF_MAP_FREE(c->json_header_map_sz, c->json_header_map);
         AM_CONF_MAP_FREE(c->skip_post_url_map_sz, c->skip_post_url_map);
+        AM_CONF_MAP_FREE(c->policy_prefetch_map_sz, c->policy_prefetch_map);
+        AM_CONF_MAP_FREE(c->metrics_ip_map_sz, c->metrics_ip_map);
 
         free(c);
         c = NULL;
@@ -277,6 +277,8 @@ static void parse_other_options(am_xml_parser_ctx_t *ctx, const char *val, int l
     parse_config_value(ctx, AM_AGENTS_CONFIG_COOKIE_SECURE, CONF_NUMBER, NULL, &ctx->conf->cookie_secure, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_NOTIF_ENABLE, CONF_NUMBER, NULL, &ctx->conf->notif_enable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_NOTIF_URL, CONF_STRING, NULL, &ctx->conf->notif_url, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_METRICS_URL, CONF_STRING, NULL, &ctx->conf->metrics_url, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_METRICS_IP, CONF_STRING_MAP, &ctx->conf->metrics_ip_map_sz, &ctx->conf->metrics_ip_map, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_CMP_CASE_IGNORE, CONF_NUMBER, NULL, &ctx->conf->url_eval_case_ignore, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_POLICY_CACHE_VALID, CONF_NUMBER, NULL, &ctx->conf->policy_cache_valid, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_TOKEN_CACHE_VALID, CONF_NUMBER, NULL, &ctx->conf->token_cache_valid, val, len);
@@ -368,6 +370,7 @@ static void parse_other_options(am_xml_parser_ctx_t *ctx, const char *val, int l
     parse_config_value(ctx, AM_AGENTS_CONFIG_IIS_LOGON_USER, CONF_NUMBER, NULL, &ctx->conf->logon_user_enable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_IIS_PASSWORD_HEADER, CONF_NUMBER, NULL, &ctx->conf->password_header_enable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_PDP_JS_REPOST, CONF_NUMBER, NULL, &ctx->conf->pdp_js_repost, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_PDP_MEMORY_LIMIT, CONF_NUMBER, NULL, &ctx->conf->pdp_memory_limit, val, len);
 
     parse_config_value(ctx, AM_AGENTS_CONFIG_JSON_URL, CONF_STRING_MAP, &ctx->conf->json_url_map_sz, &ctx->conf->json_url_map, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_JSON_URL_INVERT, CONF_NUMBER, NULL, &ctx->conf->json_url_invert, val, len);
@@ -375,6 +378,8 @@ static void parse_other_options(am_xml_parser_ctx_t *ctx, const char *val, int l
     parse_config_value(ctx, AM_AGENTS_CONFIG_JSON_RESPONSE_CODE, CONF_NUMBER, NULL, &ctx->conf->json_url_response_code, val, len);
 
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_INTERVAL, CONF_NUMBER, NULL, &ctx->conf->audit_remote_interval, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_BATCH_SIZE, CONF_NUMBER, NULL, &ctx->conf->audit_remote_batch_size, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_BATCH_BYTES, CONF_NUMBER, NULL, &ctx->conf->audit_remote_batch_bytes, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_REMOTE_FILE, CONF_STRING, NULL, &ctx->conf->audit_file_remote, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_DISPOSITION, CONF_STRING, NULL, &ctx->conf->audit_file_disposition, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_AUDIT_LEVEL, CONF_AUDIT_LEVEL, NULL, &ctx->conf->audit_level, val, len);
@@ -388,6 +393,8 @@ static void parse_other_options(am_xml_parser_ctx_t *ctx, const char *val, int l
     parse_config_value(ctx, AM_AGENTS_CONFIG_PERSISTENT_COOKIE_ENABLE, CONF_NUMBER, NULL, &ctx->conf->persistent_cookie_enable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_SCHANNEL_DISABLE, CONF_NUMBER, NULL, &ctx->conf->secure_channel_disable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_SKIP_POST_URL, CONF_STRING_MAP, &ctx->conf->skip_post_url_map_sz, &ctx->conf->skip_post_url_map, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_POLICY_PREFETCH_ENABLE, CONF_NUMBER, NULL, &ctx->conf->policy_prefetch_enable, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_POLICY_PREFETCH_PREFIX, CONF_STRING_MAP, &ctx->conf->policy_prefetch_map_sz, &ctx->conf->policy_prefetch_map, val, len);
 }
 
 static void end_element(void * userData, const char * name) {
@@ -437,6 +444,13 @@ static void end_element(void * userData, const char * name) {
 
     parse_config_value(ctx, AM_AGENTS_CONFIG_LB_ENABLE, CONF_NUMBER, NULL, &ctx->conf->lb_enable, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_KEEPALIVE_DISABLE, CONF_NUMBER, NULL, &ctx->conf->keepalive_disable, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_POLICY_HEDGE_ENABLE, CONF_NUMBER, NULL, &ctx->conf->policy_hedge_enable, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_NET_COMPRESS_ENABLE, CONF_NUMBER, NULL, &ctx->conf->net_compress_enable, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_LOG_SYNC, CONF_NUMBER, NULL, &ctx->conf->log_sync, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_LOG_DEFERRED, CONF_NUMBER, NULL, &ctx->conf->log_deferred, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_LOG_ROTATE_COMPRESS, CONF_NUMBER, NULL, &ctx->conf->log_rotate_compress, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_LOG_ROTATE_KEEP, CONF_NUMBER, NULL, &ctx->conf->log_rotate_keep, val, len);
+    parse_config_value(ctx, AM_AGENTS_CONFIG_LOG_ROTATE_AGE, CONF_NUMBER, NULL, &ctx->conf->log_rotate_age, val, len);
 
     parse_config_value(ctx, AM_AGENTS_CONFIG_PROXY_HOST, CONF_STRING, NULL, &ctx->conf->proxy_host, val, len);
     parse_config_value(ctx, AM_AGENTS_CONFIG_PROXY_PORT, CONF_NUMBER, NULL, &ctx->conf->proxy_port, val, len);
@@ -795,9 +795,9 @@ static am_status_t get_request_body(am_request_t *rq) {
             /* try to analyze temp buffer data - see if we can spot our key */
             if (tmp_sz > 5) {
                 /* we've got enough data - check if that's 
-                 * LARES POST or should it be stored into a file */
+                 * LARES POST or should it be stored into a file (unless the caller asked for memory) */
                 tmp_writes = FALSE;
-                to_file = memcmp(tmp, "LARES=", 6) != 0;
+                to_file = !rq->post_data_in_memory && memcmp(tmp, "LARES=", 6) != 0;
             } else {
                 /* too little was read in */
                 rc = REQ_DATA_BUFF_SZ;
@@ -41,6 +41,9 @@ int am_init(int id) {
         if (rv != 0)
             break;
         rv = am_audit_init(id);
+        if (rv != 0)
+            break;
+        rv = am_metrics_init(id);
         if (rv != 0)
             break;
         rv = am_audit_processor_init();
@@ -71,6 +74,9 @@ int am_init_worker(int id) {
         if (rv != 0)
             break;
         rv = am_audit_init(id);
+        if (rv != 0)
+            break;
+        rv = am_metrics_init(id);
         if (rv != 0)
             break;
         rv = am_cache_init(id);
@@ -88,8 +94,10 @@ int am_shutdown(int id) {
     am_url_validator_shutdown();
     am_audit_processor_shutdown();
     am_audit_shutdown();
+    am_metrics_shutdown();
 #ifdef _WIN32
     am_worker_pool_shutdown();
+    am_notification_shutdown();
 #else
     am_worker_pool_shutdown_main();
 #endif
@@ -111,6 +119,7 @@ void am_restart_workers() {
 
 int am_shutdown_worker() {
     am_worker_pool_shutdown();
+    am_notification_shutdown();
     return 0;
 }
 
@@ -132,6 +141,12 @@ am_status_t am_remove_shm_and_locks(int id, void (*log_cb)(void *arg, char *name
         errors++;
     }
 
+    status = am_shm_delete(get_global_name(AM_METRICS_SHM_NAME, id));
+    if (status) {
+        log_cb(cb_arg, AM_METRICS_SHM_NAME, status);
+        errors++;
+    }
+
     status = am_shm_delete(get_global_name(AM_CONFIG_SHM_NAME, id));
     if (status) {
         log_cb(cb_arg, AM_CONFIG_SHM_NAME, status);
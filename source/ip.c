@@ -81,15 +81,14 @@ static am_bool_t ipv4_parse(const char * p, struct in_addr * n) {
  * @return AM_TRUE if the section of a string can be parsed as an ip v6 presentation
  */
 static am_bool_t ipv6_parse_section(const char * p, size_t length, struct in6_addr * n) {
-    am_bool_t output;
-    char * a = strndup(p, length);
-    if (a) {
-        output = ipv6_parse(a, n);
-        free(a);
-    } else {
-        output = AM_FALSE;
+    char a[INET6_ADDRSTRLEN];
+    if (length >= sizeof (a)) {
+        /* too long for an ip v6 presentation */
+        return AM_FALSE;
     }
-    return output;
+    memcpy(a, p, length);
+    a[length] = '\0';
+    return ipv6_parse(a, n);
 }
 
 /*
@@ -98,15 +97,14 @@ static am_bool_t ipv6_parse_section(const char * p, size_t length, struct in6_ad
  * @return AM_TRUE if the section of a string can be parsed as an ip v4 presentation
  */
 static am_bool_t ipv4_parse_section(const char * p, size_t length, struct in_addr * n) {
-    am_bool_t output;
-    char * a = strndup(p, length);
-    if (a) {
-        output = ipv4_parse(a, n);
-        free(a);
-    } else {
-        output = AM_FALSE;
+    char a[INET_ADDRSTRLEN];
+    if (length >= sizeof (a)) {
+        /* too long for an ip v4 presentation */
+        return AM_FALSE;
     }
-    return output;
+    memcpy(a, p, length);
+    a[length] = '\0';
+    return ipv4_parse(a, n);
 }
 
 /*
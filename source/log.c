@@ -19,8 +19,16 @@
 #include "am.h"
 #include "utility.h"
 #include "version.h"
+#include "zlib.h"
 #ifndef _WIN32
 #include <libgen.h>
+#include <sys/uio.h>
+#else
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
 #endif
 #if defined(AIX)
 #include <sys/ldr.h>
@@ -89,6 +97,9 @@ static inline uint32_t AM_ATOMIC_SWAP_32(volatile uint32_t *target, uint32_t val
 
 #define LOG_WRITE_TIMEOUT 1000
 #define LOG_READ_TIMEOUT 1000
+#define LOG_SHUTDOWN_DRAIN_TIMEOUT 1000 /* msec, without progress */
+#define LOG_BATCH_MAX 64 /* records written out by the worker at once */
+#define LOG_BATCH_WINDOW 10 /* msec, max time spent collecting a batch */
 
 enum {
     LOG_MUTEX = 0,
@@ -96,19 +107,54 @@ enum {
     LOG_INIT_MUTEX
 };
 
-struct log_block {
-    uint32_t prev;
-    uint32_t next;
+/*
+ * Log messages are stored in a ring of variable length records, following the log_buffer
+ * header in the shared memory. Cursors are free running byte offsets (ring position is
+ * cursor & (ring_size - 1)); a record never wraps around the end of the ring - space left
+ * at the end is taken by a padding record instead. Released ring space is zeroed, so that
+ * done_read/done_write flags of any record to be written there start cleared.
+ */
+struct log_record {
+    uint32_t size; /* record size, including this header, multiple of sizeof (struct log_record) */
     volatile uint32_t done_read;
     volatile uint32_t done_write;
-    unsigned long instance_id;
-    int32_t level;
-    uint64_t size;
-    char data[AM_LOG_MESSAGE_SIZE];
+    int32_t level; /* AM_LOG_LEVEL_NONE for padding records */
+    uint64_t instance_id;
+    uint32_t data_size;
+    uint32_t format; /* LOG_RECORD_TEXT or LOG_RECORD_BINARY */
+};
+
+#define LOG_RECORD_TEXT 0
+#define LOG_RECORD_BINARY 1
+
+/*
+ * Binary (deferred) log record data: message arguments are captured by the request thread and
+ * formatted by the log worker. Argument data follows this header, then format string and
+ * source file name (unless log worker runs in the same process and can use the pointers
+ * as they are).
+ */
+struct log_binary {
+    uint64_t time; /* usec */
+    uint64_t thread_id;
+    uint64_t format_id; /* format string address, 0 if format string is copied */
+    uint64_t file_id; /* source file name address, 0 if file name is copied */
+    int32_t pid;
+    int32_t line;
+    uint32_t args_size;
+    uint32_t format_size;
+    uint32_t file_size;
+    uint32_t reserved;
 };
 
+#define LOG_RECORD_ALIGN(s) \
+    (((s) + sizeof (struct log_record) - 1) & ~((uint32_t) sizeof (struct log_record) - 1))
+#define LOG_RING_OFFSET \
+    ((sizeof (struct log_buffer) + 63) & ~((size_t) 63))
+#define LOG_RING_MIN_SIZE (64 * 1024)
+#define LOG_RING_MAX_SIZE (1024 * 1024 * 1024)
+
 struct log_buffer {
-    struct log_block blocks[AM_LOG_QUEUE_SIZE];
+    volatile uint32_t ring_size; /* power of two */
     volatile uint32_t read_end; /* read and write cursors */
     volatile uint32_t read_start;
     volatile uint32_t write_end;
@@ -120,6 +166,8 @@ struct log_buffer {
     volatile int32_t lock_owner[3];
     volatile uint32_t lock[3];
 
+    volatile uint32_t level_generation; /* incremented on each files[] log level change */
+
 #ifndef _WIN32
     sem_t sem[2];
 #endif
@@ -133,6 +181,13 @@ struct log_buffer {
         int32_t max_size_audit;
         int32_t level_debug;
         int32_t level_audit;
+        int32_t sync; /* fsync policy: 0 - after each batch, -1 - never, >0 - at most every 'sync' msec */
+        int32_t deferred; /* log message formatting is done by the log worker */
+        int32_t rotate_compress; /* gzip rotated files */
+        int32_t rotate_keep; /* number of rotated files to keep, 0 - all */
+        int32_t rotate_age; /* max rotated file age (sec), 0 - no limit */
+        volatile uint32_t writes; /* batches written out */
+        volatile uint32_t syncs; /* fsync calls */
     } files[AM_MAX_INSTANCES];
 
     struct valid_url {
@@ -161,6 +216,10 @@ struct log_file {
     int32_t file_audit;
     uint64_t created_debug;
     uint64_t created_audit;
+    uint64_t synced_debug; /* msec */
+    uint64_t synced_audit;
+    int32_t unsynced_debug; /* written out since the last fsync */
+    int32_t unsynced_audit;
 };
 
 static struct am_shared_log {
@@ -180,12 +239,58 @@ static struct am_shared_log {
 static char default_log_path[AM_PATH_SIZE] = {0};
 static int32_t default_log_level = AM_LOG_LEVEL_ERROR;
 static int file_write_enabled = AM_TRUE;
-static struct log_files log_level_cache[AM_MAX_INSTANCES] = {
-    {0}
+
+/* per-process copy of the instance log levels, refreshed when level_generation changes */
+static struct log_level_table {
+    volatile uint32_t generation;
+    volatile int32_t max_level_debug; /* highest debug level of all instances */
+    volatile int32_t hint; /* last looked up entry */
+
+    struct log_level_entry {
+        volatile unsigned long instance_id;
+        volatile int32_t level_debug;
+        volatile int32_t level_audit;
+        volatile int32_t deferred;
+    } entry[AM_MAX_INSTANCES];
+} log_levels = {
+    (uint32_t) - 1, AM_LOG_LEVEL_NONE, 0, {
+        {0}
+    }
 };
 
+/**
+ * Log ring size: AM_LOG_BUFFER_SIZE (compile time default) or AM_LOG_BUFFER_SIZE environment
+ * variable value (in bytes, "k" or "m" suffix allowed), rounded up to a power of two.
+ */
+static uint32_t get_log_ring_size() {
+    uint64_t size = AM_LOG_BUFFER_SIZE;
+    uint32_t ring_size = LOG_RING_MIN_SIZE;
+    char *env = getenv("AM_LOG_BUFFER_SIZE");
+    if (ISVALID(env)) {
+        char *end = NULL;
+        uint64_t value = strtoull(env, &end, 10);
+        if (end != NULL && (*end == 'k' || *end == 'K')) {
+            value *= 1024;
+        } else if (end != NULL && (*end == 'm' || *end == 'M')) {
+            value *= 1024 * 1024;
+        }
+        if (value > 0) {
+            size = value;
+        }
+    }
+    while (ring_size < size && ring_size < LOG_RING_MAX_SIZE) {
+        ring_size <<= 1;
+    }
+    return ring_size;
+}
+
 uint64_t get_log_buffer_size() {
-    return page_size(sizeof (struct log_buffer));
+    return page_size(LOG_RING_OFFSET + get_log_ring_size());
+}
+
+static struct log_record *get_log_record(uint32_t cursor) {
+    return (struct log_record *) ((char *) log_handle->area + LOG_RING_OFFSET +
+            (cursor & (log_handle->area->ring_size - 1)));
 }
 
 static void log_mutex_lock(int type) {
@@ -220,48 +325,6 @@ static void log_mutex_lock(int type) {
     ++(mtx->count);
 }
 
-static int log_mutex_trylock(int type) {
-    struct log_mutex *mtx;
-    if (log_handle == NULL || (mtx = log_handle->mutex[type]) == NULL)
-        return AM_EINVAL;
-
-    if (
-#ifdef _WIN32
-            TryEnterCriticalSection(&mtx->lock) == 0
-#else
-            pthread_mutex_trylock(&mtx->lock) != 0
-#endif
-            ) {
-        return AM_ERROR;
-    }
-
-    for (;;) {
-        while (AM_ATOMIC_SWAP_32(&log_handle->area->lock[type], 1) != 0) {
-#ifdef _WIN32
-            Sleep(0);
-#else
-            sched_yield();
-#endif
-        }
-        if (log_handle->area->lock_owner[type] == 0 || log_handle->area->lock_owner[type] == mtx->pid) {
-            log_handle->area->lock_owner[type] = mtx->pid;
-            AM_ATOMIC_SWAP_32(&log_handle->area->lock[type], 0);
-            break;
-        }
-        AM_ATOMIC_SWAP_32(&log_handle->area->lock[type], 0);
-#ifdef _WIN32
-        Sleep(1);
-#else
-
-        nanosleep((const struct timespec[]){
-            {0, 1000000L}
-        }, NULL);
-#endif
-    }
-    ++(mtx->count);
-    return AM_SUCCESS;
-}
-
 static void log_mutex_unlock(int type) {
     struct log_mutex *mtx;
     if (log_handle == NULL || (mtx = log_handle->mutex[type]) == NULL)
@@ -283,47 +346,128 @@ static void log_mutex_unlock(int type) {
 
 #define LOGGER_RW_RETRY_LIMIT 1000
 
-static struct log_block *get_write_block() {
+static void log_record_write_done(struct log_record *record);
+
+/**
+ * Reserve a ring record of 'size' bytes (aligned).
+ */
+static struct log_record *get_write_block(uint32_t size) {
     for (int i = 0; i < LOGGER_RW_RETRY_LIMIT; i++) {
         if (log_handle == NULL || log_handle->area == NULL ||
                 AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
             return NULL;
+        uint32_t ring_size = log_handle->area->ring_size;
+        uint32_t cursor = log_handle->area->write_start;
+        uint32_t contiguous = ring_size - (cursor & (ring_size - 1));
+        /* a record which does not fit before the end of the ring is preceded by a padding record */
+        uint32_t reserve = size <= contiguous ? size : contiguous;
         /* check if there is a room to expand the cursor */
-        uint32_t index = log_handle->area->write_start;
-        struct log_block *block = log_handle->area->blocks + index;
-        if (block->next == log_handle->area->read_end) {
+        if (cursor - log_handle->area->read_end + reserve > ring_size) {
             /* nope, wait till it becomes available */
             if (wait_for_event(log_handle->log_buffer_available, LOG_WRITE_TIMEOUT) == 0)
                 continue;
             /* timeout */
+            am_metrics_incr(AM_METRIC_LOG_DROPPED);
             return NULL;
         }
         /* try to move write cursor forward */
-        if (AM_ATOMIC_CAS_32(&log_handle->area->write_start, block->next, index) == index)
-            return block;
-        /* it didn't work out - someone has taken that slot already, retry */
+        if (AM_ATOMIC_CAS_32(&log_handle->area->write_start, cursor + reserve, cursor) == cursor) {
+            struct log_record *record = get_log_record(cursor);
+            record->size = reserve;
+            record->done_read = 0;
+            if (reserve == size) {
+                return record;
+            }
+            record->level = AM_LOG_LEVEL_NONE;
+            record->instance_id = 0;
+            record->data_size = 0;
+            record->format = LOG_RECORD_TEXT;
+            log_record_write_done(record);
+            i--;
+            continue;
+        }
+        /* it didn't work out - someone has taken that space already, retry */
     }
     return NULL;
 }
 
-static struct log_block *get_read_block() {
+/**
+ * Mark record as written and move write_end cursor over all the records which are complete.
+ */
+static void log_record_write_done(struct log_record *record) {
+    /* set done flag for this record */
+    AM_ATOMIC_SWAP_32(&record->done_write, 1);
+    for (;;) {
+        if (log_handle == NULL || log_handle->area == NULL ||
+                AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
+            break;
+        /* try and get the right to move the cursor */
+        uint32_t cursor = log_handle->area->write_end;
+        record = get_log_record(cursor);
+        if (AM_ATOMIC_CAS_32(&record->done_write, 0, 1) != 1) {
+            /* some other thread has already moved cursor for us or we have
+             * reached as far as it possible for us to move the cursor
+             */
+            break;
+        }
+        /* move cursor forward */
+        AM_ATOMIC_CAS_32(&log_handle->area->write_end, cursor + record->size, cursor);
+        /* signal availability of more data */
+        if (cursor == log_handle->area->read_start)
+            set_event(log_handle->log_buffer_filled);
+    }
+}
+
+static struct log_record *get_read_block(am_bool_t wait) {
     for (int i = 0; i < LOGGER_RW_RETRY_LIMIT; i++) {
         if (log_handle == NULL || log_handle->area == NULL ||
                 AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
             return NULL;
-        uint32_t index = log_handle->area->read_start;
-        struct log_block *block = log_handle->area->blocks + index;
-        if (index == log_handle->area->write_end) {
-            if (wait_for_event(log_handle->log_buffer_filled, LOG_READ_TIMEOUT) == 0)
+        uint32_t cursor = log_handle->area->read_start;
+        struct log_record *record = get_log_record(cursor);
+        if (cursor == log_handle->area->write_end) {
+            if (wait && wait_for_event(log_handle->log_buffer_filled, LOG_READ_TIMEOUT) == 0)
                 continue;
             return NULL;
         }
-        if (AM_ATOMIC_CAS_32(&log_handle->area->read_start, block->next, index) == index)
-            return block;
+        if (AM_ATOMIC_CAS_32(&log_handle->area->read_start, cursor + record->size, cursor) == cursor)
+            return record;
     }
     return NULL;
 }
 
+/**
+ * Mark record as read and move read_end cursor over all the records which are consumed,
+ * releasing their space.
+ */
+static void log_record_read_done(struct log_record *record) {
+    /* set done flag for this record */
+    AM_ATOMIC_SWAP_32(&record->done_read, 1);
+    for (;;) {
+        if (log_handle == NULL || log_handle->area == NULL ||
+                AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
+            break;
+        /* try and get the right to move the cursor */
+        uint32_t cursor = log_handle->area->read_end;
+        uint32_t size;
+        record = get_log_record(cursor);
+        if (AM_ATOMIC_CAS_32(&record->done_read, 0, 1) != 1) {
+            /* some other thread has already moved cursor for us or we have
+             * reached as far as it possible for us to move the cursor
+             */
+            break;
+        }
+        size = record->size;
+        memset(record, 0, size);
+        /* move cursor forward */
+        AM_ATOMIC_CAS_32(&log_handle->area->read_end, cursor + size, cursor);
+        /* signal availability for more space, if the ring was (nearly) full */
+        if (log_handle->area->write_start - cursor + LOG_RECORD_ALIGN(sizeof (struct log_record) + AM_LOG_MESSAGE_SIZE)
+                > log_handle->area->ring_size)
+            set_event(log_handle->log_buffer_available);
+    }
+}
+
 static am_bool_t should_rotate_time(uint64_t ct) {
     uint64_t ts = ct;
     ts += 86400; /* once in 24 hours */
@@ -346,15 +490,323 @@ static am_bool_t should_rotate_time(uint64_t ct) {
 #define file_access(name) access(name, F_OK)
 #endif
 
-static void log_file_write(unsigned long instance_id, const char *data, unsigned int data_sz,
+/*
+ * Rotated log file tracking (log worker process only). Rotated files are named
+ * <name>.<index>[.gz], the oldest having the lowest index. Index range is found with a single
+ * directory scan when a file is rotated for the first time, after that the worker only hands out
+ * the next index. Compression and pruning of rotated files runs in a worker pool thread - a single
+ * job per log file at a time, picking up whatever was rotated meanwhile.
+ */
+#define LOG_ROTATION_MAX ((AM_MAX_INSTANCES + 1) * 2)
+
+static struct log_rotation {
+    char name[AM_PATH_SIZE];
+    uint32_t next; /* next rotated file index */
+    volatile uint32_t rotated; /* last rotated file index */
+    volatile uint32_t busy; /* rotation job is running */
+    volatile uint32_t pending; /* more work for the rotation job */
+    uint32_t first; /* oldest rotated file index (rotation job only) */
+    uint32_t compressed; /* last compressed file index (rotation job only) */
+    volatile int32_t compress;
+    volatile int32_t keep;
+    volatile int32_t age;
+} log_rotations[LOG_ROTATION_MAX];
+
+static am_bool_t rotation_table_full = AM_FALSE;
+
+static uint32_t log_rotation_index(const char *base, const char *name) {
+    size_t base_sz = strlen(base);
+    char *end = NULL;
+    unsigned long index;
+    if (strncmp(name, base, base_sz) != 0 || name[base_sz] != '.' || !isdigit(name[base_sz + 1])) {
+        return 0;
+    }
+    index = strtoul(name + base_sz + 1, &end, 10);
+    if (end == NULL || (*end != '\0' && strcmp(end, ".gz") != 0)) {
+        return 0;
+    }
+    return (uint32_t) index;
+}
+
+/**
+ * Scan the log file directory for the rotated file index range.
+ */
+static void log_rotation_scan(struct log_rotation *r) {
+    char path[AM_PATH_SIZE + 1];
+    const char *base;
+    uint32_t first = 0, last = 0;
+    char *sep;
+
+    strncpy(path, r->name, sizeof (path) - 1);
+    path[sizeof (path) - 1] = '\0';
+    sep = strrchr(path, '/');
+#ifdef _WIN32
+    {
+        char *bsep = strrchr(path, '\\');
+        if (bsep != NULL && (sep == NULL || bsep > sep)) {
+            sep = bsep;
+        }
+    }
+#endif
+    base = sep != NULL ? r->name + (sep - path) + 1 : r->name;
+
+#ifdef _WIN32
+    {
+        WIN32_FIND_DATAA fd;
+        HANDLE h;
+        char pattern[AM_PATH_SIZE + 3];
+        snprintf(pattern, sizeof (pattern), "%s.*", r->name);
+        h = FindFirstFileA(pattern, &fd);
+        if (h != INVALID_HANDLE_VALUE) {
+            do {
+                uint32_t index = log_rotation_index(base, fd.cFileName);
+                if (index > 0) {
+                    if (first == 0 || index < first) first = index;
+                    if (index > last) last = index;
+                }
+            } while (FindNextFileA(h, &fd));
+            FindClose(h);
+        }
+    }
+#else
+    {
+        DIR *dir;
+        if (sep != NULL) {
+            *(sep == path ? sep + 1 : sep) = '\0';
+        } else {
+            strcpy(path, ".");
+        }
+        dir = opendir(path);
+        if (dir != NULL) {
+            struct dirent *e;
+            while ((e = readdir(dir)) != NULL) {
+                uint32_t index = log_rotation_index(base, e->d_name);
+                if (index > 0) {
+                    if (first == 0 || index < first) first = index;
+                    if (index > last) last = index;
+                }
+            }
+            closedir(dir);
+        }
+    }
+#endif
+    r->first = first > 0 ? first : 1;
+    r->next = last + 1;
+    r->rotated = r->compressed = last;
+}
+
+static struct log_rotation *get_log_rotation(const char *name) {
+    int i, empty = -1;
+    for (i = 0; i < LOG_ROTATION_MAX; i++) {
+        if (log_rotations[i].next != 0 && strcmp(log_rotations[i].name, name) == 0) {
+            return &log_rotations[i];
+        }
+        if (log_rotations[i].next == 0 && empty == -1) {
+            empty = i;
+        }
+    }
+    if (empty == -1) {
+        return NULL;
+    }
+    strncpy(log_rotations[empty].name, name, sizeof (log_rotations[empty].name) - 1);
+    log_rotation_scan(&log_rotations[empty]);
+    return &log_rotations[empty];
+}
+
+static void log_rotated_file_delete(const char *name, uint32_t index) {
+    char path[AM_PATH_SIZE + 16];
+    snprintf(path, sizeof (path), "%s.%u", name, index);
+    unlink(path);
+    snprintf(path, sizeof (path), "%s.%u.gz", name, index);
+    unlink(path);
+}
+
+static am_bool_t log_rotated_file_old(const char *name, uint32_t index, int age, am_bool_t *missing) {
+    char path[AM_PATH_SIZE + 16];
+    file_stat_struct st;
+    snprintf(path, sizeof (path), "%s.%u.gz", name, index);
+#ifdef _WIN32
+    if (_stat64(path, &st) != 0) {
+        snprintf(path, sizeof (path), "%s.%u", name, index);
+        if (_stat64(path, &st) != 0) {
+#else
+    if (stat(path, &st) != 0) {
+        snprintf(path, sizeof (path), "%s.%u", name, index);
+        if (stat(path, &st) != 0) {
+#endif
+            *missing = AM_TRUE;
+            return AM_TRUE;
+        }
+    }
+    *missing = AM_FALSE;
+    return difftime(time(NULL), st.st_mtime) > age;
+}
+
+static void log_rotated_file_compress(const char *name, uint32_t index) {
+    char path[AM_PATH_SIZE + 16], gz_path[AM_PATH_SIZE + 16];
+    char buffer[16384];
+    size_t rd;
+    am_bool_t ok = AM_TRUE;
+    FILE *in;
+    gzFile out;
+
+    snprintf(path, sizeof (path), "%s.%u", name, index);
+    snprintf(gz_path, sizeof (gz_path), "%s.%u.gz", name, index);
+    in = fopen(path, "rb");
+    if (in == NULL) {
+        return;
+    }
+    out = gzopen(gz_path, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return;
+    }
+    while ((rd = fread(buffer, 1, sizeof (buffer), in)) > 0) {
+        if (gzwrite(out, buffer, (unsigned int) rd) != (int) rd) {
+            ok = AM_FALSE;
+            break;
+        }
+    }
+    fclose(in);
+    if (gzclose(out) != Z_OK || !ok) {
+        fprintf(stderr, "log_rotated_file_compress(): failed to compress log file %s\n", path);
+        unlink(gz_path);
+        return;
+    }
+    unlink(path);
+}
+
+/**
+ * Compress rotated files and prune them by count and age.
+ */
+static void log_rotate_worker(void *arg) {
+    struct log_rotation *r = (struct log_rotation *) arg;
+    if (r == NULL) return;
+
+    for (;;) {
+        uint32_t rotated;
+        AM_ATOMIC_SWAP_32(&r->pending, 0);
+        rotated = AM_ATOMIC_ADD_32(&r->rotated, 0);
+
+        for (; r->compressed < rotated; r->compressed++) {
+            if (r->compress) {
+                log_rotated_file_compress(r->name, r->compressed + 1);
+            }
+        }
+
+        for (; r->first < rotated; r->first++) {
+            am_bool_t missing = AM_FALSE;
+            if (r->keep > 0 && rotated - r->first >= (uint32_t) r->keep) {
+                log_rotated_file_delete(r->name, r->first);
+            } else if (r->age > 0 && log_rotated_file_old(r->name, r->first, r->age, &missing)) {
+                if (!missing) {
+                    log_rotated_file_delete(r->name, r->first);
+                }
+            } else {
+                break;
+            }
+        }
+
+        AM_ATOMIC_SWAP_32(&r->busy, 0);
+        /* pick up a rotation which has happened while this job was running */
+        if (AM_ATOMIC_ADD_32(&r->pending, 0) == 0 || AM_ATOMIC_CAS_32(&r->busy, 1, 0) != 0) {
+            break;
+        }
+    }
+}
+
+static void log_rotate_dispatch(struct log_rotation *r, uint32_t index, struct log_files *f) {
+    if (f == NULL || (!f->rotate_compress && f->rotate_keep <= 0 && f->rotate_age <= 0)) {
+        return;
+    }
+    r->compress = f->rotate_compress;
+    r->keep = f->rotate_keep;
+    r->age = f->rotate_age;
+    AM_ATOMIC_SWAP_32(&r->rotated, index);
+    AM_ATOMIC_SWAP_32(&r->pending, 1);
+    if (AM_ATOMIC_CAS_32(&r->busy, 1, 0) == 0 &&
+            am_worker_dispatch(log_rotate_worker, r) != AM_SUCCESS) {
+        /* no worker pool in this process - leave the work pending for the next rotation
+         * instead of compressing files on the log worker thread */
+        AM_ATOMIC_SWAP_32(&r->busy, 0);
+    }
+}
+
+/**
+ * Reset rotated file tracking, keeping entries a rotation job is still working on.
+ */
+static void log_rotation_reset() {
+    int i;
+    for (i = 0; i < LOG_ROTATION_MAX; i++) {
+        struct log_rotation *r = &log_rotations[i];
+        if (AM_ATOMIC_CAS_32(&r->busy, 1, 0) == 0) {
+            memset(r, 0, sizeof (struct log_rotation));
+        }
+    }
+    rotation_table_full = AM_FALSE;
+}
+
+/**
+ * Find the next free rotated file index by probing the file system. Used when the rotation
+ * table is full - such files are not compressed or pruned.
+ */
+static uint32_t log_rotation_probe(const char *name) {
+    char path[AM_PATH_SIZE + 16];
+    uint32_t index = 1;
+    do {
+        snprintf(path, sizeof (path), "%s.%u", name, index++);
+    } while (file_access(path) == 0);
+    return index - 1;
+}
+
+static uint64_t log_time_msec() {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static int64_t log_file_writev(int32_t file_handle, struct iovec *iov, int iov_cnt) {
+#ifdef _WIN32
+    int i;
+    int64_t wr = 0;
+    for (i = 0; i < iov_cnt; i++) {
+        int rv = write(file_handle, iov[i].iov_base, (unsigned int) iov[i].iov_len);
+        if (rv < 0) {
+            return wr > 0 ? wr : rv;
+        }
+        wr += rv;
+    }
+    return wr;
+#else
+    return writev(file_handle, iov, iov_cnt);
+#endif
+}
+
+static void log_file_sync(struct log_files *f, int32_t file_handle) {
+    fsync(file_handle);
+    if (f != NULL) {
+        AM_ATOMIC_ADD_32(&f->syncs, 1);
+    }
+}
+
+/**
+ * Write out a batch of log messages (iov_cnt message/newline pairs) with a single writev call
+ * and fsync the file as set by the instance 'sync' policy.
+ */
+static void log_file_write(unsigned long instance_id, struct iovec *iov, int iov_cnt,
         struct log_files *f, struct log_file *file_cache, am_bool_t is_audit) {
     file_stat_struct st;
-    uint64_t wr, file_created, fsize;
-    int32_t file_handle, max_size;
+    uint64_t file_created, fsize, now;
+    int64_t wr;
+    int32_t file_handle, max_size, sync = 0;
     const char *file_name;
     int status;
 
-    if (ISINVALID(data) || !data_sz || file_cache == NULL) {
+    if (iov == NULL || iov_cnt <= 0 || file_cache == NULL) {
         return;
     }
 
@@ -363,6 +815,7 @@ static void log_file_write(unsigned long instance_id, const char *data, unsigned
         max_size = is_audit ? f->max_size_audit : f->max_size_debug;
         file_created = is_audit ? file_cache->created_audit : file_cache->created_debug;
         file_handle = is_audit ? file_cache->file_audit : file_cache->file_debug;
+        sync = f->sync;
     } else if (instance_id == 0 && ISVALID(default_log_path)) {
         file_name = default_log_path;
         max_size = DEFAULT_LOG_SIZE;
@@ -413,27 +866,45 @@ static void log_file_write(unsigned long instance_id, const char *data, unsigned
         file_cache->created_debug = file_created;
     }
 
-    wr = write(file_handle, data, data_sz);
-    wr += write(file_handle,
-#ifdef _WIN32
-            "\r\n", 2
-#else
-            "\n", 1
-#endif
-            );
-    fsync(file_handle);
-    fsize += wr;
+    wr = log_file_writev(file_handle, iov, iov_cnt);
+    if (wr > 0) {
+        fsize += wr;
+    }
+
+    if (f != NULL && instance_id > 0) {
+        AM_ATOMIC_ADD_32(&f->writes, 1);
+    }
+
+    if (sync == 0) {
+        log_file_sync(f, file_handle);
+    } else if (sync > 0) {
+        uint64_t *synced = is_audit ? &file_cache->synced_audit : &file_cache->synced_debug;
+        int32_t *unsynced = is_audit ? &file_cache->unsynced_audit : &file_cache->unsynced_debug;
+        now = log_time_msec();
+        if (now - *synced >= (uint64_t) sync) {
+            log_file_sync(f, file_handle);
+            *synced = now;
+            *unsynced = 0;
+        } else {
+            /* picked up by log_file_cache_sync once the interval is over */
+            *unsynced = 1;
+        }
+    }
 
     /* rotate file if size exceeds max (configured) value or it is set to rotate once a day */
     if ((max_size > 0 && (fsize + 1024) > max_size) ||
             (max_size == -1 && should_rotate_time(file_created))) {
-        unsigned int idx = 1;
+        struct log_rotation *rotation = get_log_rotation(file_name);
         char *tmp = malloc(AM_PATH_SIZE + 1);
+        if (rotation == NULL && !rotation_table_full) {
+            rotation_table_full = AM_TRUE;
+            fprintf(stderr, "log_file_write(): rotated log file table is full (%d entries), "
+                    "log file %s will be rotated without compression or pruning\n",
+                    LOG_ROTATION_MAX, file_name);
+        }
         if (tmp != NULL) {
-            do {
-                snprintf(tmp, AM_PATH_SIZE, "%s.%d", file_name, idx);
-                idx++;
-            } while (file_access(tmp) == 0);
+            uint32_t idx = rotation != NULL ? rotation->next++ : log_rotation_probe(file_name);
+            snprintf(tmp, AM_PATH_SIZE, "%s.%u", file_name, idx);
 #ifdef _WIN32
             if (CopyFileExA(file_name, tmp, NULL, NULL, FALSE, COPY_FILE_NO_BUFFERING)) {
                 HANDLE fh = (HANDLE) _get_osfhandle(file_handle);
@@ -444,20 +915,33 @@ static void log_file_write(unsigned long instance_id, const char *data, unsigned
                 } else {
                     file_cache->created_debug = time(NULL);
                 }
+                if (rotation != NULL) {
+                    log_rotate_dispatch(rotation, idx, f);
+                }
             } else {
                 fprintf(stderr, "log_file_write(): could not rotate log file %s (error: %d)\n",
                         file_name, GetLastError());
             }
 #else
+            if (is_audit ? file_cache->unsynced_audit : file_cache->unsynced_debug) {
+                log_file_sync(f, file_handle);
+            }
             file_close(file_handle);
             file_handle = -1;
+            if (is_audit) {
+                file_cache->unsynced_audit = 0;
+            } else {
+                file_cache->unsynced_debug = 0;
+            }
             if (rename(file_name, tmp) != 0) {
                 fprintf(stderr, "log_file_write(): could not rotate log file %s (error: %d)\n",
                         file_name, errno);
+            } else if (rotation != NULL) {
+                log_rotate_dispatch(rotation, idx, f);
             }
 #endif
-            free(tmp);
         }
+        am_free(tmp);
     }
     /* preserve file descriptor in local cache entry */
     if (is_audit) {
@@ -488,58 +972,149 @@ static struct log_file *get_cached_file(struct log_file *fc, unsigned long insta
     return NULL;
 }
 
-static void log_buffer_read(struct log_file *fc) {
+static struct log_files *get_log_files(unsigned long instance_id) {
     int i;
-    struct log_files *file = NULL;
-    struct log_file *file_cache;
-    /* get log block to read from */
-    struct log_block *block = get_read_block();
-    if (block == NULL)
-        return;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct log_files *file = &log_handle->area->files[i];
+        if (file->used && file->instance_id == instance_id) {
+            return file;
+        }
+    }
+    return NULL;
+}
 
-    file_cache = get_cached_file(fc, block->instance_id);
-    if (file_cache == NULL)
+/**
+ * Collect a batch of log records (up to LOG_BATCH_MAX records, or as many as are available
+ * within LOG_BATCH_WINDOW msec) and write them out, one writev call per log file.
+ */
+static uint32_t log_format_binary(const struct log_record *record, char *out, uint32_t out_sz);
+
+static void log_buffer_read(struct log_file *fc, char *scratch) {
+    int i, j, count = 0;
+    uint64_t start;
+    uint32_t scratch_used = 0;
+    struct log_record *batch[LOG_BATCH_MAX];
+    char written[LOG_BATCH_MAX];
+    const char *text[LOG_BATCH_MAX];
+    uint32_t text_size[LOG_BATCH_MAX];
+    struct iovec iov[LOG_BATCH_MAX * 2];
+    /* get log record to read from - wait for one to become available */
+    struct log_record *block = get_read_block(AM_TRUE);
+    if (block == NULL)
         return;
 
-    /* lookup file data for an instance id */
-    for (i = 0; i < AM_MAX_INSTANCES; i++) {
-        file = &log_handle->area->files[i];
-        if (file->used && file->instance_id == block->instance_id) {
+    start = log_time_msec();
+    do {
+        batch[count++] = block;
+        if (count == LOG_BATCH_MAX || log_time_msec() - start >= LOG_BATCH_WINDOW)
             break;
+    } while ((block = get_read_block(AM_FALSE)) != NULL);
+    memset(written, 0, sizeof (written));
+
+    for (i = 0; i < count; i++) {
+        block = batch[i];
+        if (block->format == LOG_RECORD_BINARY && block->level != AM_LOG_LEVEL_NONE) {
+            /* deferred message - format it now */
+            text[i] = scratch + scratch_used;
+            text_size[i] = log_format_binary(block, scratch + scratch_used, AM_LOG_MESSAGE_SIZE);
+            scratch_used += text_size[i];
+        } else {
+            text[i] = (const char *) (block + 1);
+            text_size[i] = block->data_size;
         }
     }
 
-    if (file_write_enabled) {
-        /* do the actual file write op */
-        log_file_write(block->instance_id, block->data, (unsigned int) block->size, file, file_cache,
-                (block->level & AM_LOG_LEVEL_AUDIT) != 0);
+    for (i = 0; file_write_enabled && i < count; i++) {
+        unsigned long instance_id;
+        am_bool_t is_audit;
+        struct log_file *file_cache;
+        int iov_cnt = 0;
+
+        block = batch[i];
+        if (written[i] || block->level == AM_LOG_LEVEL_NONE) {
+            /* padding or already written record */
+            continue;
+        }
+
+        instance_id = (unsigned long) block->instance_id;
+        is_audit = (block->level & AM_LOG_LEVEL_AUDIT) != 0;
+        file_cache = get_cached_file(fc, instance_id);
+
+        /* collect all records in this batch going to the same file, keeping them in order */
+        for (j = i; j < count; j++) {
+            block = batch[j];
+            if (written[j] || block->level == AM_LOG_LEVEL_NONE ||
+                    (unsigned long) block->instance_id != instance_id ||
+                    ((block->level & AM_LOG_LEVEL_AUDIT) != 0) != is_audit) {
+                continue;
+            }
+            if (text_size[j] > 0) {
+                iov[iov_cnt].iov_base = (void *) text[j];
+                iov[iov_cnt++].iov_len = text_size[j];
+#ifdef _WIN32
+                iov[iov_cnt].iov_base = (void *) "\r\n";
+                iov[iov_cnt++].iov_len = 2;
+#else
+                iov[iov_cnt].iov_base = (void *) "\n";
+                iov[iov_cnt++].iov_len = 1;
+#endif
+            }
+            written[j] = 1;
+        }
+
+        if (file_cache != NULL) {
+            /* do the actual file write op */
+            log_file_write(instance_id, iov, iov_cnt, get_log_files(instance_id), file_cache, is_audit);
+        }
     }
 
-    /* set done flag for this block */
-    block->done_read = 1;
-    for (;;) {
-        if (log_handle == NULL || log_handle->area == NULL ||
-                AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
-            break;
-        /* try and get the right to move the cursor */
-        uint32_t index = log_handle->area->read_end;
-        block = log_handle->area->blocks + index;
-        if (AM_ATOMIC_CAS_32(&block->done_read, 0, 1) != 1) {
-            /* some other thread has already moved cursor for us or we have
-             * reached as far as it possible for us to move the cursor
-             */
-            break;
+    /* release ring space */
+    for (i = 0; i < count; i++) {
+        log_record_read_done(batch[i]);
+    }
+}
+
+/**
+ * Fsync log files written out since their last fsync once the instance 'sync' interval is over,
+ * so that the last batch does not stay unsynced when logging goes idle. With 'force' set
+ * (log worker shutdown), all such files are synced.
+ */
+static void log_file_cache_sync(struct log_file *fc, am_bool_t force) {
+    int i;
+    uint64_t now = 0;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct log_file *file = &fc[i];
+        struct log_files *f;
+        if (file->instance_id == 0 || (!file->unsynced_debug && !file->unsynced_audit)) {
+            continue;
+        }
+        f = log_handle != NULL && log_handle->area != NULL ? get_log_files(file->instance_id) : NULL;
+        if (!force && f != NULL && f->sync < 0) {
+            /* fsync has been turned off meanwhile */
+            file->unsynced_debug = file->unsynced_audit = 0;
+            continue;
+        }
+        if (now == 0) {
+            now = log_time_msec();
+        }
+        if (file->unsynced_debug && file->file_debug != -1 &&
+                (force || f == NULL || now - file->synced_debug >= (uint64_t) f->sync)) {
+            log_file_sync(f, file->file_debug);
+            file->synced_debug = now;
+            file->unsynced_debug = 0;
+        }
+        if (file->unsynced_audit && file->file_audit != -1 &&
+                (force || f == NULL || now - file->synced_audit >= (uint64_t) f->sync)) {
+            log_file_sync(f, file->file_audit);
+            file->synced_audit = now;
+            file->unsynced_audit = 0;
         }
-        /* move cursor forward */
-        AM_ATOMIC_CAS_32(&log_handle->area->read_end, block->next, index);
-        /* signal availability for more space */
-        if (block->prev == log_handle->area->write_start)
-            set_event(log_handle->log_buffer_available);
     }
 }
 
 static void log_file_cache_close(struct log_file *fc) {
     int i;
+    log_file_cache_sync(fc, AM_TRUE);
     for (i = 0; i < AM_MAX_INSTANCES + 1; i++) {
         struct log_file *file = &fc[i];
         if (file->file_audit != -1)
@@ -554,30 +1129,40 @@ static void *am_log_worker(void *arg) {
 
     /* local open file descriptor cache; last entry reserved for instanceid 0 */
     struct log_file *fc = malloc(sizeof (struct log_file) * (AM_MAX_INSTANCES + 1));
-    if (fc == NULL)
+    /* deferred (binary) log message formatting buffer */
+    char *scratch = malloc(LOG_BATCH_MAX * AM_LOG_MESSAGE_SIZE);
+    if (fc == NULL || scratch == NULL) {
+        AM_FREE(fc, scratch);
         return NULL;
-    
+    }
+
+    log_rotation_reset();
+
     /* reset local open file descriptor cache */
     for (i = 0; i < AM_MAX_INSTANCES + 1; i++) {
         struct log_file *file = &fc[i];
         file->instance_id = 0;
         file->created_debug = file->created_audit = 0;
+        file->synced_debug = file->synced_audit = 0;
+        file->unsynced_debug = file->unsynced_audit = 0;
         file->file_debug = file->file_audit = -1;
     }
     /* log file writer loop */
     for (;;) {
         if (log_handle == NULL || log_handle->area == NULL) {
             log_file_cache_close(fc);
-            free(fc);
+            AM_FREE(fc, scratch);
             return NULL;
         }
         if (AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
             break;
-        log_buffer_read(fc);
+        log_buffer_read(fc, scratch);
+        /* log_buffer_read returns at least once a LOG_READ_TIMEOUT when idle */
+        log_file_cache_sync(fc, AM_FALSE);
     }
     AM_ATOMIC_SWAP_32(&log_handle->area->owner, 0);
     log_file_cache_close(fc);
-    free(fc);
+    AM_FREE(fc, scratch);
     return NULL;
 }
 
@@ -650,6 +1235,8 @@ int am_log_init(int id) {
     if (log_handle != NULL) return AM_SUCCESS;
 
     memset(&default_log_path[0], 0, sizeof(default_log_path));
+    /* (re)attaching to the shared memory - invalidate local log level table */
+    log_levels.generation = (uint32_t) - 1;
 
 #ifdef _WIN32
     SECURITY_DESCRIPTOR sec_descr;
@@ -673,9 +1260,9 @@ int am_log_init(int id) {
             "/"
 #endif
             , NULL);
-    if (sizeof (struct log_buffer) > disk_size) {
-        fprintf(stderr, "am_log_init() free disk space on the system is only %"PR_L64" bytes, required %ld bytes\n",
-                disk_size, sizeof (struct log_buffer));
+    if (get_log_buffer_size() > disk_size) {
+        fprintf(stderr, "am_log_init() free disk space on the system is only %"PR_L64" bytes, required %"PR_L64" bytes\n",
+                disk_size, get_log_buffer_size());
         return AM_ENOSPC;
     }
 #endif
@@ -747,7 +1334,7 @@ int am_log_init(int id) {
     log_mutex_init(&log_handle->mutex[LOG_URL_MUTEX]->lock);
     log_mutex_init(&log_handle->mutex[LOG_INIT_MUTEX]->lock);
 
-    log_handle->area_size = page_size(sizeof (struct log_buffer));
+    log_handle->area_size = get_log_buffer_size();
 
 #ifdef _WIN32
 
@@ -770,7 +1357,7 @@ int am_log_init(int id) {
     }
 
     log_handle->area = (struct log_buffer *) MapViewOfFile(
-            log_handle->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof (struct log_buffer));
+            log_handle->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
     if (log_handle->area == NULL) {
         fprintf(stderr, "am_log_init() MapViewOfFile failed (%d)\n", GetLastError());
         CloseHandle(log_handle->mapping);
@@ -823,6 +1410,14 @@ int am_log_init(int id) {
         return AM_SHM_ERROR;
     }
 
+    if (opened) {
+        /* log ring size is set by the process which created the segment */
+        struct stat st;
+        if (fstat(log_handle->mapping, &st) == 0 && st.st_size > 0) {
+            log_handle->area_size = (uint64_t) st.st_size;
+        }
+    }
+
     log_handle->area = mmap(NULL, log_handle->area_size,
             PROT_READ | PROT_WRITE, MAP_SHARED, log_handle->mapping, 0);
     if (log_handle->area == MAP_FAILED) {
@@ -848,31 +1443,21 @@ int am_log_init(int id) {
 #endif
 
     if (!opened) {
-        memset(log_handle->area, 0, sizeof (struct log_buffer));
+        memset(log_handle->area, 0, (size_t) log_handle->area_size);
+        log_handle->area->ring_size = get_log_ring_size();
 
 #ifndef _WIN32
         log_handle->log_buffer_available = create_named_event(NULL, &log_handle->area->sem[0]);
         log_handle->log_buffer_filled = create_named_event(NULL, &log_handle->area->sem[1]);
 #endif
 
-        /* create a double circular linked list */
-        int i = 1;
-        log_handle->area->blocks[0].next = 1;
-        log_handle->area->blocks[0].prev = AM_LOG_QUEUE_SIZE - 1;
-        for (; i < AM_LOG_QUEUE_SIZE - 1; i++) {
-            /* add block into the available list */
-            log_handle->area->blocks[i].next = i + 1;
-            log_handle->area->blocks[i].prev = i - 1;
-        }
-        log_handle->area->blocks[i].next = 0;
-        log_handle->area->blocks[i].prev = AM_LOG_QUEUE_SIZE - 2;
-
         /* initialize the cursors */
         log_handle->area->read_end = 0;
         log_handle->area->read_start = 0;
-        log_handle->area->write_end = 1;
-        log_handle->area->write_start = 1;
+        log_handle->area->write_end = 0;
+        log_handle->area->write_start = 0;
 
+        int i;
         for (i = 0; i < AM_MAX_INSTANCES; i++) {
             struct log_files *f = &log_handle->area->files[i];
             f->used = AM_FALSE;
@@ -880,10 +1465,48 @@ int am_log_init(int id) {
             f->level_debug = f->level_audit = AM_LOG_LEVEL_NONE;
             f->max_size_debug = f->max_size_audit = 0;
         }
+        AM_ATOMIC_ADD_32(&log_handle->area->level_generation, 1);
+    }
+
+    log_worker_register(AM_TRUE);
+    return AM_SUCCESS;
+}
+
+/**
+ * Copy instance log levels from the shared memory into the per-process table (no locking:
+ * when levels change while they are being copied, table generation is left unchanged and
+ * the copy is repeated by the next caller).
+ */
+static void log_levels_refresh(uint32_t generation) {
+    int i;
+    int32_t max_level = AM_LOG_LEVEL_NONE;
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct log_files *f = &log_handle->area->files[i];
+        log_levels.entry[i].level_debug = f->level_debug;
+        log_levels.entry[i].level_audit = f->level_audit;
+        log_levels.entry[i].deferred = f->deferred;
+        log_levels.entry[i].instance_id = f->instance_id;
+        if (f->instance_id != 0 && f->level_debug > max_level) {
+            max_level = f->level_debug;
+        }
+    }
+    log_levels.max_level_debug = max_level;
+    if (AM_ATOMIC_ADD_32(&log_handle->area->level_generation, 0) == generation) {
+        log_levels.generation = generation;
+    }
+}
+
+static int log_levels_index(unsigned long instance_id) {
+    int i = log_levels.hint;
+    if (log_levels.entry[i].instance_id != instance_id) {
+        for (i = 0; i < AM_MAX_INSTANCES; i++) {
+            if (log_levels.entry[i].instance_id == instance_id) {
+                log_levels.hint = i;
+                break;
+            }
+        }
     }
-
-    log_worker_register(AM_TRUE);
-    return AM_SUCCESS;
+    return i;
 }
 
 /**
@@ -911,27 +1534,20 @@ int perform_logging(unsigned long instance_id, int level) {
     if (instance_id == 0) {
         log_level = default_log_level;
     } else {
-        if (log_mutex_trylock(LOG_MUTEX) == AM_SUCCESS) {
-
-            for (i = 0; i < AM_MAX_INSTANCES; i++) {
-                if (log_handle->area->files[i].instance_id == instance_id) {
-                    log_level = log_handle->area->files[i].level_debug;
-                    audit_level = log_handle->area->files[i].level_audit;
-                    break;
-                }
-            }
+        uint32_t generation = log_handle->area->level_generation;
+        if (generation != log_levels.generation) {
+            log_levels_refresh(generation);
+        }
 
-            log_mutex_unlock(LOG_MUTEX);
+        /* fast path: level is not enabled for any instance */
+        if ((level & (AM_LOG_LEVEL_AUDIT | AM_LOG_LEVEL_ALWAYS)) == 0 && level > log_levels.max_level_debug) {
+            return AM_FALSE;
+        }
 
-        } else {
-            /* No lock can be acquired - try to use earlier cached version */
-            for (i = 0; i < AM_MAX_INSTANCES; i++) {
-                if (log_level_cache[i].instance_id == instance_id) {
-                    log_level = log_level_cache[i].level_debug;
-                    audit_level = log_level_cache[i].level_audit;
-                    break;
-                }
-            }
+        i = log_levels_index(instance_id);
+        if (i < AM_MAX_INSTANCES) {
+            log_level = log_levels.entry[i].level_debug;
+            audit_level = log_levels.entry[i].level_audit;
         }
     }
 
@@ -962,29 +1578,12 @@ int perform_logging(unsigned long instance_id, int level) {
     return AM_TRUE;
 }
 
-/**
- * This routine is primarily responsible for all logging within this application.
- *   instance_id: the instance that has something to log
- *   level: the level we want to log at, see constants AM_LOG_LEVEL_* in am.h
- *   header: a header consisting of various time information and the current logging level as a string
- *   header_sz: header string length
- *   format: the printf style format string telling us about the variadic arguments
- *   args: the variadic arguments themselves.
- *
- * Normally, this routine logs into a block of shared memory, which is subsequently written to a file.
- * However if we're running a unit test, this block of memory won't have been set up, even though we
- * would still like to log something somewhere.  If test cases ensure that instance_id is set to zero,
- * then logging messages are written to the standard error.
- *
- * Note that if you're calling this function from one of the macros in log.h, then the function
- * perform_logging will already have been called.  If you're not, then consider calling that function
- * first as it will save you a lot of work figuring out you didn't really want to log a message at
- * your current logging level.
- */
-void am_log_write(unsigned long instance_id, int level, const char* header, int header_sz,
-        const char *format, ...) {
-    va_list args;
-    struct log_block *block;
+static void log_write_text(unsigned long instance_id, int level, const char* header, int header_sz,
+        const char *format, va_list args) {
+    struct log_record *block;
+    char data[AM_LOG_MESSAGE_SIZE];
+    uint32_t size;
+    int written;
 
 #ifdef UNIT_TEST
     /**
@@ -993,11 +1592,9 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
      * Note that we ALWAYS log, no matter what the level.
      */
     if (instance_id == 0) {
-        va_start(args, format);
         fprintf(stderr, "%s", header);
         vfprintf(stderr, format, args);
         fputs("\n", stderr);
-        va_end(args);
         return;
     }
 #endif
@@ -1006,52 +1603,61 @@ void am_log_write(unsigned long instance_id, int level, const char* header, int
         return;
     }
 
-    /* get the log block to write to */
-    block = get_write_block();
+    /* format the message first - ring records are sized to fit */
+    size = (uint32_t) header_sz;
+    if (size >= AM_LOG_MESSAGE_SIZE) {
+        size = AM_LOG_MESSAGE_SIZE - 1;
+    }
+    memcpy(data, header, size);
+    written = vsnprintf(data + size, AM_LOG_MESSAGE_SIZE - size, format, args);
+    if (written > 0) {
+        size += (uint32_t) written;
+    }
+    if (size >= AM_LOG_MESSAGE_SIZE) {
+        size = AM_LOG_MESSAGE_SIZE - 1;
+    }
+    data[size] = '\0';
+
+    /* get the log record to write to */
+    block = get_write_block(LOG_RECORD_ALIGN(sizeof (struct log_record) + size + 1));
     if (block == NULL)
         return;
 
-    /* copy header into the bucket */
-    if (strncpy(block->data, header, AM_LOG_MESSAGE_SIZE - 1) != NULL) {
-        va_start(args, format);
-        /* and the rest of the message */
-        block->size = vsnprintf(block->data + header_sz,
-                AM_LOG_MESSAGE_SIZE - header_sz, format, args) + header_sz;
-        if (block->size >= AM_LOG_MESSAGE_SIZE) {
-            block->size = AM_LOG_MESSAGE_SIZE - 1;
-        }
-        block->data[block->size] = '\0';
-        va_end(args);
-    }
-
+    memcpy(block + 1, data, size + 1);
+    block->data_size = size;
     block->instance_id = instance_id;
     block->level = level;
+    block->format = LOG_RECORD_TEXT;
 
-    /* push the block back into the queue ready to be consumed */
-
-    /* set done flag for this block */
-    block->done_write = 1;
-    for (;;) {
-        if (log_handle == NULL || log_handle->area == NULL ||
-                AM_ATOMIC_ADD_32(&log_handle->area->stop, 0) > 0)
-            break;
-        /* try and get the right to move the cursor */
-        uint32_t index = log_handle->area->write_end;
-        block = log_handle->area->blocks + index;
-        if (AM_ATOMIC_CAS_32(&block->done_write, 0, 1) != 1) {
-            /* some other thread has already moved cursor for us or we have
-             * reached as far as it possible for us to move the cursor
-             */
-            break;
-        }
-
-        /* move cursor forward */
-        AM_ATOMIC_CAS_32(&log_handle->area->write_end, block->next, index);
+    /* push the record back into the queue ready to be consumed */
+    log_record_write_done(block);
+}
 
-        /* signal availability of more data */
-        if (block->prev == log_handle->area->read_start)
-            set_event(log_handle->log_buffer_filled);
-    }
+/**
+ * This routine is primarily responsible for all logging within this application.
+ *   instance_id: the instance that has something to log
+ *   level: the level we want to log at, see constants AM_LOG_LEVEL_* in am.h
+ *   header: a header consisting of various time information and the current logging level as a string
+ *   header_sz: header string length
+ *   format: the printf style format string telling us about the variadic arguments
+ *   args: the variadic arguments themselves.
+ *
+ * Normally, this routine logs into a block of shared memory, which is subsequently written to a file.
+ * However if we're running a unit test, this block of memory won't have been set up, even though we
+ * would still like to log something somewhere.  If test cases ensure that instance_id is set to zero,
+ * then logging messages are written to the standard error.
+ *
+ * Note that if you're calling this function from one of the macros in log.h, then the function
+ * perform_logging will already have been called.  If you're not, then consider calling that function
+ * first as it will save you a lot of work figuring out you didn't really want to log a message at
+ * your current logging level.
+ */
+void am_log_write(unsigned long instance_id, int level, const char* header, int header_sz,
+        const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_write_text(instance_id, level, header, header_sz, format, args);
+    va_end(args);
 }
 
 void am_log_shutdown(int id) {
@@ -1060,6 +1666,25 @@ void am_log_shutdown(int id) {
     }
 
     if (AM_ATOMIC_ADD_32(&log_handle->area->owner, 0) == getpid()) {
+        int i;
+        uint32_t read_end = AM_ATOMIC_ADD_32(&log_handle->area->read_end, 0);
+        /* give the worker a chance to write out records still held in the ring (as long as it makes progress) */
+        for (i = 0; i < LOG_SHUTDOWN_DRAIN_TIMEOUT &&
+                read_end != AM_ATOMIC_ADD_32(&log_handle->area->write_end, 0); i++) {
+            uint32_t cursor = AM_ATOMIC_ADD_32(&log_handle->area->read_end, 0);
+            if (cursor != read_end) {
+                read_end = cursor;
+                i = 0;
+                continue;
+            }
+#ifdef _WIN32
+            Sleep(1);
+#else
+            nanosleep((const struct timespec[]) {
+                {0, 1000000L}
+            }, NULL);
+#endif
+        }
         AM_ATOMIC_SWAP_32(&log_handle->area->stop, 1);
         AM_THREAD_JOIN(log_handle->worker);
 #ifdef _WIN32
@@ -1133,11 +1758,13 @@ void am_log_register_instance(unsigned long instance_id, const char *debug_log,
                 f->max_size_audit = audit_size > 0 && audit_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : audit_size;
                 f->level_debug = log_level;
                 f->level_audit = audit_level;
+                f->sync = 0;
+                f->deferred = 0;
+                f->rotate_compress = f->rotate_keep = f->rotate_age = 0;
+                f->writes = f->syncs = 0;
 
-                /* Update local log level cache */
-                log_level_cache[i].instance_id = instance_id;
-                log_level_cache[i].level_debug = f->level_debug;
-                log_level_cache[i].level_audit = f->level_audit;
+                /* make all processes refresh their log level tables */
+                AM_ATOMIC_ADD_32(&log_handle->area->level_generation, 1);
 
 #define AM_LOG_HEADER "\r\n\r\n\t######################################################\r\n\t# %-51s#\r\n\t# Version: %-42s#\r\n\t# %-51s#\r\n\t# Container: %-40s#\r\n\t# Build date: %s %-27s#\r\n\t######################################################\r\n"
 
@@ -1170,16 +1797,64 @@ void am_log_register_instance(unsigned long instance_id, const char *debug_log,
         f->max_size_audit = audit_size > 0 && audit_size < DEFAULT_LOG_SIZE ? DEFAULT_LOG_SIZE : audit_size;
         f->level_debug = log_level;
         f->level_audit = audit_level;
-        
-        /* update local log level cache */
-        log_level_cache[i].instance_id = instance_id;
-        log_level_cache[i].level_debug = f->level_debug;
-        log_level_cache[i].level_audit = f->level_audit;
+
+        /* make all processes refresh their log level tables */
+        AM_ATOMIC_ADD_32(&log_handle->area->level_generation, 1);
     }
 
     log_mutex_unlock(LOG_MUTEX);
 }
 
+/**
+ * Set log file fsync policy for an instance: 0 - fsync after each batch of records
+ * written out by the log worker, -1 - never, >0 - at most once every 'sync' msec.
+ * With 'deferred' set, log messages are formatted by the log worker.
+ * Rotated log files are gzip'ed with 'rotate_compress' set and pruned to keep at most 'rotate_keep'
+ * files, none older than 'rotate_age' seconds (0 - no limit).
+ */
+void am_log_set_options(unsigned long instance_id, int sync, int deferred,
+        int rotate_compress, int rotate_keep, int rotate_age) {
+    int i;
+    if (log_handle == NULL || log_handle->area == NULL || instance_id == 0) {
+        return;
+    }
+    log_mutex_lock(LOG_MUTEX);
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        struct log_files *f = &log_handle->area->files[i];
+        if (f->used && f->instance_id == instance_id) {
+            f->sync = sync < 0 ? -1 : sync;
+            f->rotate_compress = rotate_compress ? 1 : 0;
+            f->rotate_keep = rotate_keep > 0 ? rotate_keep : 0;
+            f->rotate_age = rotate_age > 0 ? rotate_age : 0;
+            if (f->deferred != (deferred ? 1 : 0)) {
+                f->deferred = deferred ? 1 : 0;
+                /* make all processes refresh their log level tables */
+                AM_ATOMIC_ADD_32(&log_handle->area->level_generation, 1);
+            }
+            break;
+        }
+    }
+    log_mutex_unlock(LOG_MUTEX);
+}
+
+/**
+ * Get the number of log record batches written out and fsync calls made for an instance
+ * log files, since the instance has been registered.
+ */
+void am_log_get_stats(unsigned long instance_id, unsigned int *writes, unsigned int *syncs) {
+    struct log_files *f;
+    if (writes != NULL) *writes = 0;
+    if (syncs != NULL) *syncs = 0;
+    if (log_handle == NULL || log_handle->area == NULL || instance_id == 0) {
+        return;
+    }
+    f = get_log_files(instance_id);
+    if (f != NULL) {
+        if (writes != NULL) *writes = AM_ATOMIC_ADD_32(&f->writes, 0);
+        if (syncs != NULL) *syncs = AM_ATOMIC_ADD_32(&f->syncs, 0);
+    }
+}
+
 /***************************************************************************/
 
 int get_valid_url_index(unsigned long instance_id) {
@@ -1338,17 +2013,16 @@ static int gettimeofday(struct timeval *tv, void *tz) {
 
 #endif
 
-char *log_header(int log_level, int *header_sz, const char *file, int line) {
-    static AM_THREAD_LOCAL char header[160];
+static int log_header_format(char *header, size_t header_sz, int log_level, const struct timeval *tv,
+        uint64_t thread_id, int pid, const char *file, int line) {
     char tz[6];
     size_t time_string_sz;
     struct tm now;
-    struct timeval tv;
     const char *level;
     time_t rawtime;
+    int sz;
 
-    gettimeofday(&tv, NULL);
-    rawtime = (time_t) tv.tv_sec;
+    rawtime = (time_t) tv->tv_sec;
     localtime_r(&rawtime, &now);
 
     switch (log_level) {
@@ -1369,11 +2043,12 @@ char *log_header(int log_level, int *header_sz, const char *file, int line) {
             break;
     }
     /* format time */
-    time_string_sz = strftime(header, sizeof (header), "%Y-%m-%d %H:%M:%S", &now);
+    time_string_sz = strftime(header, header_sz, "%Y-%m-%d %H:%M:%S", &now);
 
     /* and time zone */
 #ifdef _WIN32
 #define LOG_HEADER_THREAD_ID "%d"
+#define LOG_HEADER_THREAD_ID_VALUE(t) ((int) (t))
     TIME_ZONE_INFORMATION tz_info;
     GetTimeZoneInformation(&tz_info);
     snprintf(tz, sizeof (tz), "%03d%02d", -(tz_info.Bias) / 60, abs(-(tz_info.Bias) % 60));
@@ -1382,31 +2057,532 @@ char *log_header(int log_level, int *header_sz, const char *file, int line) {
     }
 #else
 #define LOG_HEADER_THREAD_ID "%p"
+#define LOG_HEADER_THREAD_ID_VALUE(t) ((void *) (uintptr_t) (t))
     strftime(tz, sizeof (tz), "%z", &now);
 #endif
 
     /* set all the data for the final log header */
     if (log_level == AM_LOG_LEVEL_DEBUG) {
-        *header_sz = snprintf(header + time_string_sz, sizeof (header) - time_string_sz,
+        sz = snprintf(header + time_string_sz, header_sz - time_string_sz,
                 ".%03ld %s %7.7s ["LOG_HEADER_THREAD_ID":%d][%s:%d] ",
-                tv.tv_usec / 1000L, tz, level,
-#ifdef _WIN32
-                GetCurrentThreadId(),
-#else
-                (void *) (uintptr_t) pthread_self(),
-#endif
-                getpid(), NOTNULL(file), line);
+                (long) tv->tv_usec / 1000L, tz, level, LOG_HEADER_THREAD_ID_VALUE(thread_id),
+                pid, NOTNULL(file), line);
     } else {
-        *header_sz = snprintf(header + time_string_sz, sizeof (header) - time_string_sz,
+        sz = snprintf(header + time_string_sz, header_sz - time_string_sz,
                 ".%03ld %s %7.7s ["LOG_HEADER_THREAD_ID":%d] ",
-                tv.tv_usec / 1000L, tz, level,
+                (long) tv->tv_usec / 1000L, tz, level, LOG_HEADER_THREAD_ID_VALUE(thread_id), pid);
+    }
+    if (sz < 0) {
+        sz = 0;
+    } else if ((size_t) sz >= header_sz - time_string_sz) {
+        sz = (int) (header_sz - time_string_sz - 1);
+    }
+    return sz + (int) time_string_sz;
+}
+
+static uint64_t log_thread_id() {
 #ifdef _WIN32
-                GetCurrentThreadId(),
+    return (uint64_t) GetCurrentThreadId();
 #else
-                (void *) (uintptr_t) pthread_self(),
+    return (uint64_t) (uintptr_t) pthread_self();
 #endif
-                getpid());
-    }
-    *header_sz += (int) time_string_sz;
+}
+
+char *log_header(int log_level, int *header_sz, const char *file, int line) {
+    static AM_THREAD_LOCAL char header[160];
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    *header_sz = log_header_format(header, sizeof (header), log_level, &tv, log_thread_id(),
+            getpid(), file, line);
     return header;
 }
+
+/*
+ * Deferred (binary) logging: the request thread captures format string arguments into a ring
+ * record and the log worker does the actual formatting. Only the printf conversions used in
+ * agent messages are supported (no %n, wide characters or long double) - messages with anything
+ * else are formatted by the request thread as usual.
+ */
+
+enum {
+    LOG_ARG_LITERAL = 0, /* %% */
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_CHAR,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STRING,
+    LOG_ARG_UNSUPPORTED
+};
+
+enum {
+    LOG_LEN_NONE = 0,
+    LOG_LEN_HH,
+    LOG_LEN_H,
+    LOG_LEN_L,
+    LOG_LEN_LL,
+    LOG_LEN_Z,
+    LOG_LEN_J,
+    LOG_LEN_T,
+    LOG_LEN_I32,
+    LOG_LEN_UNSUPPORTED
+};
+
+#define LOG_SPEC_MAX 40
+
+struct log_spec {
+    const char *start; /* '%' */
+    const char *end; /* past conversion character */
+    const char *length; /* length modifier */
+    size_t length_sz;
+    int stars;
+    int precision; /* -1 if not set or set with '*' */
+    int precision_star; /* precision is set with '*' (the last star argument) */
+    int length_type;
+    int type;
+};
+
+static const char *log_parse_spec(const char *p, struct log_spec *spec) {
+    const char *q = p + 1;
+    spec->start = p;
+    spec->stars = 0;
+    spec->precision = -1;
+    spec->precision_star = AM_FALSE;
+    spec->length_type = LOG_LEN_NONE;
+    spec->type = LOG_ARG_UNSUPPORTED;
+
+    while (*q != '\0' && strchr("-+ #0", *q) != NULL) q++;
+    if (*q == '*') {
+        spec->stars++;
+        q++;
+    } else {
+        while (isdigit(*q)) q++;
+    }
+    if (*q == '.') {
+        q++;
+        if (*q == '*') {
+            spec->stars++;
+            spec->precision_star = AM_TRUE;
+            q++;
+        } else {
+            spec->precision = 0;
+            while (isdigit(*q)) {
+                spec->precision = spec->precision * 10 + (*q - '0');
+                q++;
+            }
+        }
+    }
+
+    spec->length = q;
+    switch (*q) {
+        case 'h':
+            spec->length_type = q[1] == 'h' ? LOG_LEN_HH : LOG_LEN_H;
+            q += q[1] == 'h' ? 2 : 1;
+            break;
+        case 'l':
+            spec->length_type = q[1] == 'l' ? LOG_LEN_LL : LOG_LEN_L;
+            q += q[1] == 'l' ? 2 : 1;
+            break;
+        case 'q':
+            spec->length_type = LOG_LEN_LL;
+            q++;
+            break;
+        case 'z':
+            spec->length_type = LOG_LEN_Z;
+            q++;
+            break;
+        case 'j':
+            spec->length_type = LOG_LEN_J;
+            q++;
+            break;
+        case 't':
+            spec->length_type = LOG_LEN_T;
+            q++;
+            break;
+        case 'I':
+            if (q[1] == '6' && q[2] == '4') {
+                spec->length_type = LOG_LEN_LL;
+                q += 3;
+            } else if (q[1] == '3' && q[2] == '2') {
+                spec->length_type = LOG_LEN_I32;
+                q += 3;
+            } else {
+                spec->length_type = LOG_LEN_Z;
+                q++;
+            }
+            break;
+        case 'L':
+            spec->length_type = LOG_LEN_UNSUPPORTED;
+            q++;
+            break;
+    }
+    spec->length_sz = q - spec->length;
+
+    switch (*q) {
+        case 'd':
+        case 'i':
+            spec->type = LOG_ARG_INT;
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            spec->type = LOG_ARG_UINT;
+            break;
+        case 'c':
+            spec->type = spec->length_type == LOG_LEN_NONE ? LOG_ARG_CHAR : LOG_ARG_UNSUPPORTED;
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec->type = spec->length_type == LOG_LEN_NONE || spec->length_type == LOG_LEN_L ?
+                    LOG_ARG_DOUBLE : LOG_ARG_UNSUPPORTED;
+            break;
+        case 's':
+            spec->type = spec->length_type == LOG_LEN_NONE ? LOG_ARG_STRING : LOG_ARG_UNSUPPORTED;
+            break;
+        case 'p':
+            spec->type = LOG_ARG_PTR;
+            break;
+        case '%':
+            spec->type = q == p + 1 ? LOG_ARG_LITERAL : LOG_ARG_UNSUPPORTED;
+            break;
+    }
+    if (spec->length_type == LOG_LEN_UNSUPPORTED || (q - p) >= LOG_SPEC_MAX - 3) {
+        spec->type = LOG_ARG_UNSUPPORTED;
+    }
+    spec->end = *q != '\0' ? q + 1 : q;
+    return spec->end;
+}
+
+/**
+ * Capture format string arguments into 'out'.
+ *
+ * @return size of the captured data or -1 if the format string is not supported or arguments
+ * do not fit.
+ */
+static int log_capture_args(char *out, uint32_t out_sz, const char *format, va_list args) {
+    const char *p = format;
+    char *o = out, *end = out + out_sz;
+    struct log_spec spec;
+    int i;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        int star[2] = {-1, -1};
+        int64_t value;
+        p = log_parse_spec(p, &spec);
+        if (spec.type == LOG_ARG_UNSUPPORTED) {
+            return -1;
+        }
+        if (spec.type == LOG_ARG_LITERAL) {
+            continue;
+        }
+        for (i = 0; i < spec.stars; i++) {
+            star[i] = va_arg(args, int);
+            if (o + sizeof (int64_t) > end) return -1;
+            value = star[i];
+            memcpy(o, &value, sizeof (int64_t));
+            o += sizeof (int64_t);
+        }
+
+        switch (spec.type) {
+            case LOG_ARG_INT:
+                switch (spec.length_type) {
+                    case LOG_LEN_HH: value = (signed char) va_arg(args, int);
+                        break;
+                    case LOG_LEN_H: value = (short) va_arg(args, int);
+                        break;
+                    case LOG_LEN_L: value = va_arg(args, long);
+                        break;
+                    case LOG_LEN_LL: value = va_arg(args, long long);
+                        break;
+                    case LOG_LEN_Z: value = (int64_t) (intptr_t) va_arg(args, size_t);
+                        break;
+                    case LOG_LEN_J: value = va_arg(args, intmax_t);
+                        break;
+                    case LOG_LEN_T: value = va_arg(args, ptrdiff_t);
+                        break;
+                    default: value = va_arg(args, int);
+                        break;
+                }
+                break;
+            case LOG_ARG_UINT:
+                switch (spec.length_type) {
+                    case LOG_LEN_HH: value = (unsigned char) va_arg(args, unsigned int);
+                        break;
+                    case LOG_LEN_H: value = (unsigned short) va_arg(args, unsigned int);
+                        break;
+                    case LOG_LEN_L: value = (int64_t) va_arg(args, unsigned long);
+                        break;
+                    case LOG_LEN_LL: value = (int64_t) va_arg(args, unsigned long long);
+                        break;
+                    case LOG_LEN_Z: value = (int64_t) va_arg(args, size_t);
+                        break;
+                    case LOG_LEN_J: value = (int64_t) va_arg(args, uintmax_t);
+                        break;
+                    case LOG_LEN_T: value = (int64_t) (size_t) va_arg(args, ptrdiff_t);
+                        break;
+                    default: value = va_arg(args, unsigned int);
+                        break;
+                }
+                break;
+            case LOG_ARG_CHAR:
+                value = va_arg(args, int);
+                break;
+            case LOG_ARG_DOUBLE:
+            {
+                double d = va_arg(args, double);
+                memcpy(&value, &d, sizeof (double));
+                break;
+            }
+            case LOG_ARG_PTR:
+                value = (int64_t) (uintptr_t) va_arg(args, void *);
+                break;
+            case LOG_ARG_STRING:
+            {
+                const char *str = va_arg(args, const char *);
+                uint32_t len;
+                if (str == NULL) {
+                    str = "(null)";
+                }
+                len = (uint32_t) strlen(str);
+                if (spec.precision >= 0 && (uint32_t) spec.precision < len) {
+                    len = (uint32_t) spec.precision;
+                } else if (spec.precision_star && star[spec.stars - 1] >= 0 &&
+                        (uint32_t) star[spec.stars - 1] < len) {
+                    len = (uint32_t) star[spec.stars - 1];
+                }
+                if (o + sizeof (uint32_t) + 1 > end) return -1;
+                if (len > (uint32_t) (end - o) - sizeof (uint32_t) - 1) {
+                    /* truncate, as the formatted message would be */
+                    len = (uint32_t) (end - o) - sizeof (uint32_t) - 1;
+                }
+                memcpy(o, &len, sizeof (uint32_t));
+                o += sizeof (uint32_t);
+                memcpy(o, str, len);
+                o += len;
+                *o++ = '\0';
+                continue;
+            }
+        }
+        if (o + sizeof (int64_t) > end) return -1;
+        memcpy(o, &value, sizeof (int64_t));
+        o += sizeof (int64_t);
+    }
+    return (int) (o - out);
+}
+
+#define LOG_SNPRINTF(o, n, f, s, v) \
+    ((s) == 0 ? snprintf(o, n, f, v) : \
+     (s) == 1 ? snprintf(o, n, f, star[0], v) : snprintf(o, n, f, star[0], star[1], v))
+
+/**
+ * Format deferred (binary) log record into 'out'.
+ *
+ * @return formatted message size.
+ */
+static uint32_t log_format_binary(const struct log_record *record, char *out, uint32_t out_sz) {
+    const struct log_binary *bin = (const struct log_binary *) (record + 1);
+    const char *args = (const char *) (bin + 1);
+    const char *args_end = args + bin->args_size;
+    const char *format = bin->format_id != 0 ? (const char *) (uintptr_t) bin->format_id : args_end;
+    const char *file = bin->file_id != 0 ? (const char *) (uintptr_t) bin->file_id :
+            args_end + bin->format_size;
+    const char *p = format;
+    struct log_spec spec;
+    struct timeval tv;
+    uint32_t size;
+    int i;
+
+    tv.tv_sec = (long) (bin->time / 1000000);
+    tv.tv_usec = (long) (bin->time % 1000000);
+    if ((bin->format_id != 0 || bin->file_id != 0) && bin->pid != getpid()) {
+        /* log worker has moved to another process - format string pointer is not valid here */
+        size = (uint32_t) log_header_format(out, out_sz, record->level, &tv, bin->thread_id, bin->pid,
+                NULL, bin->line);
+        size += (uint32_t) snprintf(out + size, out_sz - size, "(deferred log message is not available)");
+        return size < out_sz ? size : out_sz - 1;
+    }
+
+    size = (uint32_t) log_header_format(out, out_sz, record->level, &tv, bin->thread_id, bin->pid,
+            file, bin->line);
+
+    while (*p != '\0' && size < out_sz - 1) {
+        char spec_format[LOG_SPEC_MAX];
+        int star[2] = {0, 0}, rv = 0;
+        int64_t value = 0;
+        size_t spec_sz;
+        const char *next = strchr(p, '%');
+
+        if (next == NULL) {
+            next = p + strlen(p);
+        }
+        if (next > p) {
+            /* literal text */
+            size_t len = next - p;
+            if (len > out_sz - 1 - size) {
+                len = out_sz - 1 - size;
+            }
+            memcpy(out + size, p, len);
+            size += (uint32_t) len;
+            p = next;
+            continue;
+        }
+
+        p = log_parse_spec(p, &spec);
+        if (spec.type == LOG_ARG_LITERAL) {
+            out[size++] = '%';
+            continue;
+        }
+        if (spec.type == LOG_ARG_UNSUPPORTED) {
+            break;
+        }
+        for (i = 0; i < spec.stars; i++) {
+            if (args + sizeof (int64_t) > args_end) break;
+            memcpy(&value, args, sizeof (int64_t));
+            args += sizeof (int64_t);
+            star[i] = (int) value;
+        }
+
+        /* drop length modifier - integer values are passed as long long */
+        spec_sz = spec.length - spec.start;
+        memcpy(spec_format, spec.start, spec_sz);
+        if (spec.type == LOG_ARG_INT || spec.type == LOG_ARG_UINT) {
+            spec_format[spec_sz++] = 'l';
+            spec_format[spec_sz++] = 'l';
+        }
+        spec_format[spec_sz++] = *(spec.end - 1);
+        spec_format[spec_sz] = '\0';
+
+        if (spec.type == LOG_ARG_STRING) {
+            uint32_t len;
+            if (args + sizeof (uint32_t) > args_end) break;
+            memcpy(&len, args, sizeof (uint32_t));
+            args += sizeof (uint32_t);
+            if (args + len + 1 > args_end) break;
+            rv = LOG_SNPRINTF(out + size, out_sz - size, spec_format, spec.stars, args);
+            args += len + 1;
+        } else {
+            if (args + sizeof (int64_t) > args_end) break;
+            memcpy(&value, args, sizeof (int64_t));
+            args += sizeof (int64_t);
+            switch (spec.type) {
+                case LOG_ARG_INT:
+                    rv = LOG_SNPRINTF(out + size, out_sz - size, spec_format, spec.stars, (long long) value);
+                    break;
+                case LOG_ARG_UINT:
+                    rv = LOG_SNPRINTF(out + size, out_sz - size, spec_format, spec.stars, (unsigned long long) value);
+                    break;
+                case LOG_ARG_CHAR:
+                    rv = LOG_SNPRINTF(out + size, out_sz - size, spec_format, spec.stars, (int) value);
+                    break;
+                case LOG_ARG_DOUBLE:
+                {
+                    double d;
+                    memcpy(&d, &value, sizeof (double));
+                    rv = LOG_SNPRINTF(out + size, out_sz - size, spec_format, spec.stars, d);
+                    break;
+                }
+                case LOG_ARG_PTR:
+                    rv = LOG_SNPRINTF(out + size, out_sz - size, spec_format, spec.stars, (void *) (uintptr_t) value);
+                    break;
+            }
+        }
+        if (rv > 0) {
+            size += (uint32_t) rv;
+            if (size > out_sz - 1) {
+                size = out_sz - 1;
+            }
+        }
+    }
+    out[size] = '\0';
+    return size;
+}
+
+static am_bool_t log_deferred(unsigned long instance_id) {
+    int i;
+    uint32_t generation = log_handle->area->level_generation;
+    if (generation != log_levels.generation) {
+        log_levels_refresh(generation);
+    }
+    i = log_levels_index(instance_id);
+    return i < AM_MAX_INSTANCES && log_levels.entry[i].deferred;
+}
+
+/**
+ * Log a message, formatting it in the log worker thread if deferred logging is enabled for
+ * an instance (used by the AM_LOG_* macros).
+ */
+void am_log_write_deferred(unsigned long instance_id, int level, const char *file, int line,
+        const char *format, ...) {
+    va_list args;
+    char *header;
+    int header_sz;
+
+    if (instance_id != 0 && log_handle != NULL && log_handle->area != NULL && log_deferred(instance_id)) {
+        char data[AM_LOG_MESSAGE_SIZE];
+        struct log_binary *bin = (struct log_binary *) data;
+        char *end = data + sizeof (data);
+        uint32_t size;
+        int args_size;
+        struct timeval tv;
+        /* format string and file name pointers can only be used by the log worker in this process */
+        int pid = getpid();
+        am_bool_t local = AM_ATOMIC_ADD_32(&log_handle->area->owner, 0) == (uint32_t) pid;
+
+        memset(bin, 0, sizeof (struct log_binary));
+        va_start(args, format);
+        args_size = log_capture_args((char *) (bin + 1), (uint32_t) (end - (char *) (bin + 1)), format, args);
+        va_end(args);
+        bin->args_size = args_size > 0 ? (uint32_t) args_size : 0;
+        size = args_size >= 0 ? sizeof (struct log_binary) + bin->args_size : 0;
+
+        if (size == 0) {
+            /* not supported, format the message here */
+        } else if (local) {
+            bin->format_id = (uint64_t) (uintptr_t) format;
+            bin->file_id = (uint64_t) (uintptr_t) NOTNULL(file);
+        } else {
+            bin->format_size = (uint32_t) strlen(format) + 1;
+            bin->file_size = (uint32_t) strlen(NOTNULL(file)) + 1;
+            if (size + bin->format_size + bin->file_size <= sizeof (data)) {
+                memcpy(data + size, format, bin->format_size);
+                memcpy(data + size + bin->format_size, NOTNULL(file), bin->file_size);
+                size += bin->format_size + bin->file_size;
+            } else {
+                size = 0;
+            }
+        }
+
+        if (size > 0) {
+            struct log_record *block;
+            gettimeofday(&tv, NULL);
+            bin->time = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+            bin->thread_id = log_thread_id();
+            bin->pid = pid;
+            bin->line = line;
+
+            block = get_write_block(LOG_RECORD_ALIGN(sizeof (struct log_record) + size));
+            if (block == NULL)
+                return;
+
+            memcpy(block + 1, data, size);
+            block->data_size = size;
+            block->instance_id = instance_id;
+            block->level = level;
+            block->format = LOG_RECORD_BINARY;
+            log_record_write_done(block);
+            return;
+        }
+    }
+
+    header = log_header(level, &header_sz, file, line);
+    va_start(args, format);
+    log_write_text(instance_id, level, header, header_sz, format, args);
+    va_end(args);
+}
@@ -22,58 +22,52 @@
 int perform_logging(unsigned long instance_id, int level);
 void am_log_write(unsigned long instance_id, int level, const char* header, int header_sz, const char *format, ...);
 char *log_header(int log_level, int *header_sz, const char *file, int line);
+void am_log_write_deferred(unsigned long instance_id, int level, const char *file, int line, const char *format, ...);
+
+/*
+ * Note: with deferred logging enabled, the format string (a string literal) may be read by the
+ * log worker after the call returns.
+ */
 
 #define AM_LOG_ALWAYS(instance, format, ...)\
     do {\
         if (format != NULL) {\
-            int header_sz;\
-            char *header = log_header(AM_LOG_LEVEL_ALWAYS, &header_sz, __FILE__, __LINE__);\
-            am_log_write(instance, AM_LOG_LEVEL_ALWAYS, header, header_sz, format, ##__VA_ARGS__);\
+            am_log_write_deferred(instance, AM_LOG_LEVEL_ALWAYS, __FILE__, __LINE__, format, ##__VA_ARGS__);\
         }\
     } while (0)
 
 #define AM_LOG_INFO(instance, format, ...) \
     do {\
         if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_INFO)) {\
-            int header_sz;\
-            char *header = log_header(AM_LOG_LEVEL_INFO, &header_sz, __FILE__, __LINE__);\
-            am_log_write(instance, AM_LOG_LEVEL_INFO, header, header_sz, format, ##__VA_ARGS__);\
+            am_log_write_deferred(instance, AM_LOG_LEVEL_INFO, __FILE__, __LINE__, format, ##__VA_ARGS__);\
         }\
     } while (0)
 
 #define AM_LOG_WARNING(instance, format, ...) \
     do {\
         if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_WARNING)) {\
-            int header_sz;\
-            char *header = log_header(AM_LOG_LEVEL_WARNING, &header_sz, __FILE__, __LINE__);\
-            am_log_write(instance, AM_LOG_LEVEL_WARNING, header, header_sz, format, ##__VA_ARGS__);\
+            am_log_write_deferred(instance, AM_LOG_LEVEL_WARNING, __FILE__, __LINE__, format, ##__VA_ARGS__);\
          }\
      } while (0)
 
 #define AM_LOG_ERROR(instance, format, ...) \
     do {\
         if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_ERROR)) {\
-            int header_sz;\
-            char *header = log_header(AM_LOG_LEVEL_ERROR, &header_sz, __FILE__, __LINE__);\
-            am_log_write(instance, AM_LOG_LEVEL_ERROR, header, header_sz, format, ##__VA_ARGS__);\
+            am_log_write_deferred(instance, AM_LOG_LEVEL_ERROR, __FILE__, __LINE__, format, ##__VA_ARGS__);\
          }\
     }while (0)
 
 #define AM_LOG_DEBUG(instance, format, ...) \
     do {\
         if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_DEBUG)) {\
-            int header_sz;\
-            char *header = log_header(AM_LOG_LEVEL_DEBUG, &header_sz, __FILE__, __LINE__);\
-            am_log_write(instance, AM_LOG_LEVEL_DEBUG, header, header_sz, format, ##__VA_ARGS__);\
+            am_log_write_deferred(instance, AM_LOG_LEVEL_DEBUG, __FILE__, __LINE__, format, ##__VA_ARGS__);\
         }\
     } while (0)
 
 #define AM_LOG_AUDIT(instance, format, ...) \
     do {\
         if (format != NULL && perform_logging(instance, AM_LOG_LEVEL_AUDIT)) {\
-            int header_sz;\
-            char *header = log_header(AM_LOG_LEVEL_AUDIT, &header_sz, __FILE__, __LINE__);\
-            am_log_write(instance, AM_LOG_LEVEL_AUDIT, header, header_sz, format, ##__VA_ARGS__);\
+            am_log_write_deferred(instance, AM_LOG_LEVEL_AUDIT, __FILE__, __LINE__, format, ##__VA_ARGS__);\
         }\
     } while (0)
 
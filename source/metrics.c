@@ -0,0 +1,554 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "list.h"
+
+/*
+ * Request processing latency histograms, kept per agent instance in a dedicated shared memory
+ * segment (all processes record into the same histograms), and agent-wide event counters.
+ *
+ * Histograms are HDR-style (log-linear): values (usec) below 2 * AM_METRICS_SUB_BUCKETS are
+ * recorded exactly, larger values in AM_METRICS_SUB_BUCKETS linear sub-buckets per power of two
+ * (relative error is at most 1/AM_METRICS_SUB_BUCKETS). Recording is a couple of atomic
+ * increments, the segment is never resized and it is accessed without the lock (which is used
+ * only to assign instance slots).
+ *
+ * Counters are split into per-CPU blocks, each padded to a multiple of the cache line size, so that
+ * threads running on different CPUs do not contend for the same cache lines; readers sum all blocks.
+ * Worker pool lane depth gauges and dropped/coalesced job counters are kept the same way (lane job
+ * wait times go to agent-wide histograms).
+ */
+
+#define AM_METRICS_SUB_BUCKET_BITS 4
+#define AM_METRICS_SUB_BUCKETS (1 << AM_METRICS_SUB_BUCKET_BITS)
+#define AM_METRICS_MAX_BITS 36 /* values above 2^36 usec (~19 hours) are recorded in the last bucket */
+#define AM_METRICS_BUCKETS ((AM_METRICS_MAX_BITS - AM_METRICS_SUB_BUCKET_BITS + 2) * AM_METRICS_SUB_BUCKETS)
+#define AM_METRICS_CPU_SLOTS 64 /* power of 2 */
+#define AM_METRICS_CACHE_LINE 64
+#define AM_METRICS_CPU_BLOCK ((((AM_METRIC_MAX + AM_WORKER_LANES * AM_LANE_STAT_MAX) * sizeof (uint64_t)) / \
+    AM_METRICS_CACHE_LINE + 1) * AM_METRICS_CACHE_LINE)
+
+#if defined(_WIN32)
+#define AM_ATOMIC_ADD_32        InterlockedExchangeAdd
+#define AM_ATOMIC_ADD_64        InterlockedExchangeAdd64
+#elif defined(__sun)
+#include <sys/atomic.h>
+#define AM_ATOMIC_ADD_32        atomic_add_32_nv
+#define AM_ATOMIC_ADD_64        atomic_add_64_nv
+#else
+#define AM_ATOMIC_ADD_32        __sync_fetch_and_add
+#define AM_ATOMIC_ADD_64        __sync_fetch_and_add
+#endif
+
+struct metrics_histogram {
+    volatile uint64_t count;
+    volatile uint64_t sum; /* usec */
+    volatile uint32_t bucket[AM_METRICS_BUCKETS];
+};
+
+union metrics_cpu {
+
+    struct {
+        volatile uint64_t counter[AM_METRIC_MAX];
+        volatile uint64_t lane[AM_WORKER_LANES][AM_LANE_STAT_MAX];
+    } v;
+    uint8_t padding[AM_METRICS_CPU_BLOCK];
+};
+
+struct am_metrics {
+    union metrics_cpu cpu[AM_METRICS_CPU_SLOTS];
+    struct metrics_histogram lane_wait[AM_WORKER_LANES];
+    struct metrics_instance {
+        volatile uint64_t instance_id;
+        struct metrics_histogram span[AM_SPAN_MAX];
+    } instance[AM_MAX_INSTANCES];
+};
+
+static am_shm_t *metrics_shm = NULL;
+
+static uint64_t histogram_percentile(struct metrics_histogram *h, double percentile);
+
+static const char *span_names[AM_SPAN_MAX] = {
+    "setup_request_data",
+    "validate_url",
+    "handle_notification",
+    "validate_token",
+    "validate_fqdn_access",
+    "handle_not_enforced",
+    "validate_policy",
+    "handle_exit",
+    "request",
+    "backend_request"
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} metric_names[AM_METRIC_MAX] = {
+    { "am_cache_hits_total", "Agent cache lookups served from the cache." },
+    { "am_cache_misses_total", "Agent cache lookups not found in the cache (or expired)." },
+    { "am_cache_alloc_failures_total", "Agent cache memory allocation failures." },
+    { "am_cache_gc_runs_total", "Agent cache garbage collector runs." },
+    { "am_cache_gc_collected_total", "Agent cache objects released by the garbage collector." },
+    { "am_backend_connections_total", "Connections opened to OpenAM." },
+    { "am_backend_connection_reuse_total", "Requests sent to OpenAM over an already open connection." },
+    { "am_log_dropped_total", "Debug log messages dropped (log buffer is full)." },
+    { "am_audit_dropped_total", "Audit log messages dropped (audit buffer is full)." },
+    { "am_notifications_total", "Notifications received from OpenAM." }
+};
+
+static const char *lane_names[AM_WORKER_LANES] = {
+    "high",
+    "normal",
+    "low"
+};
+
+int am_metrics_init(int id) {
+    int shm_status = AM_ERROR;
+    if (metrics_shm != NULL) return AM_SUCCESS;
+
+    metrics_shm = am_shm_create(get_global_name(AM_METRICS_SHM_NAME, id),
+            page_size(sizeof (struct am_metrics) + 0x10000), AM_FALSE, NULL, &shm_status);
+    if (metrics_shm == NULL) {
+        return shm_status;
+    }
+    if (metrics_shm->error != AM_SUCCESS) {
+        return metrics_shm->error;
+    }
+
+    if (metrics_shm->init) {
+        struct am_metrics *metrics = (struct am_metrics *) am_shm_alloc(metrics_shm, sizeof (struct am_metrics));
+        if (metrics == NULL) {
+            return AM_ENOMEM;
+        }
+        am_shm_lock(metrics_shm);
+        memset(metrics, 0, sizeof (struct am_metrics));
+        /* store table offset (for other processes) */
+        am_shm_set_user_offset(metrics_shm, AM_GET_OFFSET(metrics_shm->pool, metrics));
+        am_shm_unlock(metrics_shm);
+    }
+    return AM_SUCCESS;
+}
+
+/**
+ * Attach to the metrics of a running agent; unlike am_metrics_init, the shared memory
+ * segment is not created when it is not there.
+ *
+ * @return AM_SUCCESS, AM_ENOTSTARTED if the agent is not running or am_metrics_init error status.
+ */
+int am_metrics_open(int id) {
+    if (metrics_shm != NULL) return AM_SUCCESS;
+    if (!am_shm_exists(get_global_name(AM_METRICS_SHM_NAME, id))) {
+        return AM_ENOTSTARTED;
+    }
+    return am_metrics_init(id);
+}
+
+int am_metrics_shutdown() {
+    am_shm_shutdown(metrics_shm);
+    metrics_shm = NULL;
+    return AM_SUCCESS;
+}
+
+static struct metrics_instance *get_metrics_instance(unsigned long instance_id, am_bool_t create) {
+    int i;
+    struct am_metrics *metrics;
+
+    if (metrics_shm == NULL || instance_id == 0 ||
+            (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (metrics->instance[i].instance_id == instance_id) {
+            return &metrics->instance[i];
+        }
+    }
+    if (!create || am_shm_lock(metrics_shm) != AM_SUCCESS) {
+        return NULL;
+    }
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (metrics->instance[i].instance_id == instance_id) {
+            break;
+        }
+        if (metrics->instance[i].instance_id == 0) {
+            metrics->instance[i].instance_id = instance_id;
+            break;
+        }
+    }
+    am_shm_unlock(metrics_shm);
+    return i < AM_MAX_INSTANCES ? &metrics->instance[i] : NULL;
+}
+
+static int value_to_bucket(uint64_t value) {
+    int msb = 0, shift;
+    uint64_t v = value;
+    if (value < 2 * AM_METRICS_SUB_BUCKETS) {
+        return (int) value;
+    }
+    while (v >>= 1) {
+        msb++;
+    }
+    if (msb > AM_METRICS_MAX_BITS) {
+        return AM_METRICS_BUCKETS - 1;
+    }
+    shift = msb - AM_METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * AM_METRICS_SUB_BUCKETS + (int) (value >> shift) - AM_METRICS_SUB_BUCKETS;
+}
+
+/* highest value recorded in a bucket */
+static uint64_t bucket_to_value(int index) {
+    int shift;
+    uint64_t sub;
+    if (index < 2 * AM_METRICS_SUB_BUCKETS) {
+        return (uint64_t) index;
+    }
+    shift = index / AM_METRICS_SUB_BUCKETS - 1;
+    sub = (uint64_t) (index % AM_METRICS_SUB_BUCKETS + AM_METRICS_SUB_BUCKETS);
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Record a request processing span duration.
+ *
+ * @param instance_id agent instance id.
+ * @param span span id (AM_SPAN_*).
+ * @param usec span duration.
+ */
+void am_metrics_record(unsigned long instance_id, int span, uint64_t usec) {
+    struct metrics_instance *m;
+    struct metrics_histogram *h;
+
+    if (span < 0 || span >= AM_SPAN_MAX || (m = get_metrics_instance(instance_id, AM_TRUE)) == NULL) {
+        return;
+    }
+    h = &m->span[span];
+    AM_ATOMIC_ADD_32(&h->bucket[value_to_bucket(usec)], 1);
+    AM_ATOMIC_ADD_64(&h->sum, usec);
+    AM_ATOMIC_ADD_64(&h->count, 1);
+}
+
+/**
+ * Record a request processing span duration, measured with a (stopped) timer.
+ */
+void am_metrics_record_span(unsigned long instance_id, int span, am_timer_t *timer) {
+    double elapsed;
+    if (timer == NULL || metrics_shm == NULL) {
+        return;
+    }
+    elapsed = am_timer_elapsed(timer);
+    am_metrics_record(instance_id, span, elapsed > 0 ? (uint64_t) (elapsed * 1000000.0) : 0);
+}
+
+static int current_cpu_slot() {
+#if defined(_WIN32)
+    return (int) (GetCurrentProcessorNumber() & (AM_METRICS_CPU_SLOTS - 1));
+#elif defined(LINUX)
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu & (AM_METRICS_CPU_SLOTS - 1);
+#else
+    /* no cheap way to find out the current cpu - spread threads over the slots */
+    return (int) (((unsigned long) pthread_self() >> 4) & (AM_METRICS_CPU_SLOTS - 1));
+#endif
+}
+
+/**
+ * Add to an agent event counter (AM_METRIC_*).
+ */
+void am_metrics_add(int metric, uint64_t value) {
+    struct am_metrics *metrics;
+    if (metric < 0 || metric >= AM_METRIC_MAX || metrics_shm == NULL ||
+            (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return;
+    }
+    AM_ATOMIC_ADD_64(&metrics->cpu[current_cpu_slot()].v.counter[metric], value);
+}
+
+/**
+ * Agent event counter value (sum of all per-cpu counters).
+ */
+uint64_t am_metrics_counter(int metric) {
+    int i;
+    uint64_t value = 0;
+    struct am_metrics *metrics;
+    if (metric < 0 || metric >= AM_METRIC_MAX || metrics_shm == NULL ||
+            (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return 0;
+    }
+    for (i = 0; i < AM_METRICS_CPU_SLOTS; i++) {
+        value += metrics->cpu[i].v.counter[metric];
+    }
+    return value;
+}
+
+static void lane_add(int lane, int stat, int64_t value) {
+    struct am_metrics *metrics;
+    if (lane < 0 || lane >= AM_WORKER_LANES || metrics_shm == NULL ||
+            (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return;
+    }
+    AM_ATOMIC_ADD_64(&metrics->cpu[current_cpu_slot()].v.lane[lane][stat], (uint64_t) value);
+}
+
+/**
+ * Update worker pool lane depth gauge (number of jobs waiting in the lane).
+ */
+void am_metrics_lane_depth(int lane, int delta) {
+    lane_add(lane, AM_LANE_STAT_DEPTH, delta);
+}
+
+/**
+ * Record the time a job spent waiting in a worker pool lane.
+ */
+void am_metrics_lane_wait(int lane, uint64_t usec) {
+    struct am_metrics *metrics;
+    struct metrics_histogram *h;
+    if (lane < 0 || lane >= AM_WORKER_LANES || metrics_shm == NULL ||
+            (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return;
+    }
+    h = &metrics->lane_wait[lane];
+    AM_ATOMIC_ADD_32(&h->bucket[value_to_bucket(usec)], 1);
+    AM_ATOMIC_ADD_64(&h->sum, usec);
+    AM_ATOMIC_ADD_64(&h->count, 1);
+}
+
+/**
+ * Count a job not queued in a worker pool lane (dropped - lane is full, or coalesced).
+ */
+void am_metrics_lane_rejected(int lane, am_bool_t coalesced) {
+    lane_add(lane, coalesced ? AM_LANE_STAT_COALESCED : AM_LANE_STAT_DROPPED, 1);
+}
+
+/**
+ * Worker pool lane statistic (AM_LANE_STAT_*), summed over all processes.
+ */
+int64_t am_metrics_lane_stat(int lane, int stat) {
+    int i;
+    uint64_t value = 0;
+    struct am_metrics *metrics;
+    if (lane < 0 || lane >= AM_WORKER_LANES || stat < 0 || stat >= AM_LANE_STAT_MAX || metrics_shm == NULL ||
+            (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return 0;
+    }
+    for (i = 0; i < AM_METRICS_CPU_SLOTS; i++) {
+        value += metrics->cpu[i].v.lane[lane][stat];
+    }
+    return (int64_t) value;
+}
+
+/**
+ * Span duration percentile (usec, highest value of the histogram bucket it falls into).
+ *
+ * @return duration or 0 if there is no data collected.
+ */
+uint64_t am_metrics_span_percentile(unsigned long instance_id, int span, double percentile) {
+    struct metrics_instance *m;
+    if (span < 0 || span >= AM_SPAN_MAX || (m = get_metrics_instance(instance_id, AM_FALSE)) == NULL) {
+        return 0;
+    }
+    return histogram_percentile(&m->span[span], percentile);
+}
+
+static uint64_t histogram_percentile(struct metrics_histogram *h, double percentile) {
+    int i;
+    uint64_t total = 0, rank;
+
+    for (i = 0; i < AM_METRICS_BUCKETS; i++) {
+        total += h->bucket[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    rank = (uint64_t) ((total * percentile + 99.999) / 100.0);
+    if (rank == 0) {
+        rank = 1;
+    }
+    total = 0;
+    for (i = 0; i < AM_METRICS_BUCKETS; i++) {
+        total += h->bucket[i];
+        if (total >= rank) {
+            return bucket_to_value(i);
+        }
+    }
+    return bucket_to_value(AM_METRICS_BUCKETS - 1);
+}
+
+/**
+ * Number of span durations recorded and their total (usec).
+ */
+uint64_t am_metrics_span_count(unsigned long instance_id, int span, uint64_t *sum) {
+    struct metrics_instance *m;
+    if (span < 0 || span >= AM_SPAN_MAX || (m = get_metrics_instance(instance_id, AM_FALSE)) == NULL) {
+        if (sum != NULL) *sum = 0;
+        return 0;
+    }
+    if (sum != NULL) {
+        *sum = m->span[span].sum;
+    }
+    return m->span[span].count;
+}
+
+const char *am_metrics_span_name(int span) {
+    return span >= 0 && span < AM_SPAN_MAX ? span_names[span] : NULL;
+}
+
+/**
+ * Discard span durations recorded for an instance (or all instances and agent event counters,
+ * if 'instance_id' is 0).
+ */
+void am_metrics_reset(unsigned long instance_id) {
+    int i;
+    struct am_metrics *metrics;
+    if (metrics_shm == NULL || am_shm_lock(metrics_shm) != AM_SUCCESS) {
+        return;
+    }
+    metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm);
+    if (metrics != NULL && instance_id == 0) {
+        memset(metrics->cpu, 0, sizeof (metrics->cpu));
+        memset(metrics->lane_wait, 0, sizeof (metrics->lane_wait));
+    }
+    for (i = 0; metrics != NULL && i < AM_MAX_INSTANCES; i++) {
+        if (instance_id == 0 || metrics->instance[i].instance_id == instance_id) {
+            memset(metrics->instance[i].span, 0, sizeof (metrics->instance[i].span));
+        }
+    }
+    am_shm_unlock(metrics_shm);
+}
+
+#define AM_METRICS_TEXT_MAX (4 * 1024 * 1024)
+
+/* metrics text is built in one growing buffer (capacity doubles as needed) */
+static void text_printf(am_post_buffer_t *text, int *status, const char *format, ...) {
+    char line[512], *tmp = NULL;
+    va_list args;
+    int size;
+
+    if (*status != AM_SUCCESS) {
+        return;
+    }
+    va_start(args, format);
+    size = vsnprintf(line, sizeof (line), format, args);
+    va_end(args);
+    if (size >= (int) sizeof (line)) {
+        va_start(args, format);
+        size = am_vasprintf(&tmp, format, args);
+        va_end(args);
+        if (tmp == NULL) {
+            *status = AM_ENOMEM;
+            return;
+        }
+    }
+    if (size < 0) {
+        *status = AM_ERROR;
+        return;
+    }
+    *status = am_post_buffer_append(text, tmp != NULL ? tmp : line, (size_t) size, AM_METRICS_TEXT_MAX);
+    am_free(tmp);
+}
+
+static void write_summary(am_post_buffer_t *text, int *status, const char *name, const char *labels,
+        struct metrics_histogram *h) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t count = h->count, sum = h->sum;
+    int i;
+
+    if (count == 0) {
+        return;
+    }
+    for (i = 0; i < (int) ARRAY_SIZE(quantiles); i++) {
+        text_printf(text, status, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels, quantiles[i],
+                (double) histogram_percentile(h, quantiles[i] * 100.0) / 1000000.0);
+    }
+    text_printf(text, status, "%s_sum{%s} %.6f\n%s_count{%s} %"PR_L64"\n",
+            name, labels, (double) sum / 1000000.0, name, labels, (int64_t) count);
+}
+
+/**
+ * Agent metrics in Prometheus text exposition format (version 0.0.4).
+ *
+ * @param instance_id agent instance id (or 0, for all instances).
+ * @return metrics text (to be released with free) or NULL if there is no metrics data available.
+ */
+char *am_metrics_text(unsigned long instance_id) {
+    am_post_buffer_t text;
+    char labels[128];
+    int i, j, status = AM_SUCCESS;
+    struct am_metrics *metrics;
+
+    if (metrics_shm == NULL || (metrics = (struct am_metrics *) am_shm_get_user_pointer(metrics_shm)) == NULL) {
+        return NULL;
+    }
+    memset(&text, 0, sizeof (am_post_buffer_t));
+
+    for (i = 0; i < AM_METRIC_MAX; i++) {
+        text_printf(&text, &status, "# HELP %s %s\n# TYPE %s counter\n%s %"PR_L64"\n",
+                metric_names[i].name, metric_names[i].help, metric_names[i].name,
+                metric_names[i].name, (int64_t) am_metrics_counter(i));
+    }
+
+    text_printf(&text, &status, "# HELP am_request_span_seconds Request processing time, per processing stage.\n"
+            "# TYPE am_request_span_seconds summary\n");
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        unsigned long id = (unsigned long) metrics->instance[i].instance_id;
+        if (id == 0 || (instance_id != 0 && id != instance_id)) continue;
+        for (j = 0; j < AM_SPAN_BACKEND_REQUEST; j++) {
+            snprintf(labels, sizeof (labels), "instance=\"%lu\",span=\"%s\"", id, span_names[j]);
+            write_summary(&text, &status, "am_request_span_seconds", labels, &metrics->instance[i].span[j]);
+        }
+    }
+
+    text_printf(&text, &status, "# HELP am_backend_request_seconds OpenAM request time.\n"
+            "# TYPE am_backend_request_seconds summary\n");
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        unsigned long id = (unsigned long) metrics->instance[i].instance_id;
+        if (id == 0 || (instance_id != 0 && id != instance_id)) continue;
+        snprintf(labels, sizeof (labels), "instance=\"%lu\"", id);
+        write_summary(&text, &status, "am_backend_request_seconds", labels, &metrics->instance[i].span[AM_SPAN_BACKEND_REQUEST]);
+    }
+
+    text_printf(&text, &status, "# HELP am_worker_lane_depth Jobs waiting in a worker pool lane.\n"
+            "# TYPE am_worker_lane_depth gauge\n");
+    for (i = 0; i < AM_WORKER_LANES; i++) {
+        text_printf(&text, &status, "am_worker_lane_depth{lane=\"%s\"} %"PR_L64"\n",
+                lane_names[i], am_metrics_lane_stat(i, AM_LANE_STAT_DEPTH));
+    }
+    text_printf(&text, &status, "# HELP am_worker_lane_dropped_total Jobs dropped (worker pool lane is full).\n"
+            "# TYPE am_worker_lane_dropped_total counter\n");
+    for (i = 0; i < AM_WORKER_LANES; i++) {
+        text_printf(&text, &status, "am_worker_lane_dropped_total{lane=\"%s\"} %"PR_L64"\n",
+                lane_names[i], am_metrics_lane_stat(i, AM_LANE_STAT_DROPPED));
+    }
+    text_printf(&text, &status, "# HELP am_worker_lane_coalesced_total Jobs coalesced with a job waiting in a worker pool lane.\n"
+            "# TYPE am_worker_lane_coalesced_total counter\n");
+    for (i = 0; i < AM_WORKER_LANES; i++) {
+        text_printf(&text, &status, "am_worker_lane_coalesced_total{lane=\"%s\"} %"PR_L64"\n",
+                lane_names[i], am_metrics_lane_stat(i, AM_LANE_STAT_COALESCED));
+    }
+    text_printf(&text, &status, "# HELP am_worker_lane_wait_seconds Time jobs spent waiting in a worker pool lane.\n"
+            "# TYPE am_worker_lane_wait_seconds summary\n");
+    for (i = 0; i < AM_WORKER_LANES; i++) {
+        snprintf(labels, sizeof (labels), "lane=\"%s\"", lane_names[i]);
+        write_summary(&text, &status, "am_worker_lane_wait_seconds", labels, &metrics->lane_wait[i]);
+    }
+    if (status != AM_SUCCESS) {
+        am_post_buffer_free(&text);
+        return NULL;
+    }
+    return text.data;
+}
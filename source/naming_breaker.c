@@ -0,0 +1,328 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include "platform.h"
+#include "am.h"
+#include "thread.h"
+#include "utility.h"
+#include "log.h"
+
+/*
+ * Per-process circuit breakers for OpenAM naming urls.
+ *
+ * The url validator pings naming urls periodically; breakers complement it with the outcome
+ * and latency of live requests so that a request thread does not keep retrying a server
+ * which is down or badly slow until the next validator tick. Breaker state is kept per
+ * process (there is no need to share it in memory segments - each process learns quickly).
+ */
+
+#define AM_BREAKER_MAX_URLS 16
+#define AM_BREAKER_FAIL_THRESHOLD 3 /* consecutive failures to open the breaker */
+#define AM_BREAKER_OPEN_INTERVAL 10 /* sec */
+#define AM_BREAKER_PROBE_INTERVAL 1 /* sec, between half-open trial requests */
+#define AM_BREAKER_BUCKETS 16 /* latency histogram: [0-1), [1-2), [2-4) ... [16384-) msec */
+#define AM_BREAKER_DECAY 1024 /* age histogram (halve all counts) after this many samples */
+
+enum {
+    AM_BREAKER_CLOSED = 0,
+    AM_BREAKER_OPEN,
+    AM_BREAKER_HALF_OPEN
+};
+
+struct url_breaker {
+    int state;
+    int failures;
+    time_t opened;
+    time_t probe;
+    uint32_t samples;
+    uint32_t latency[AM_BREAKER_BUCKETS];
+};
+
+static struct instance_breaker {
+    unsigned long instance_id;
+    struct url_breaker url[AM_BREAKER_MAX_URLS];
+} breakers[AM_MAX_INSTANCES];
+
+#ifdef _WIN32
+static INIT_ONCE breaker_initialized = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION breaker_mutex;
+
+static BOOL CALLBACK breaker_mutex_init(PINIT_ONCE io, PVOID p, PVOID *c) {
+    InitializeCriticalSection(&breaker_mutex);
+    return TRUE;
+}
+
+#define BREAKER_LOCK() \
+    do { \
+        InitOnceExecuteOnce(&breaker_initialized, breaker_mutex_init, NULL, NULL); \
+        EnterCriticalSection(&breaker_mutex); \
+    } while (0)
+#define BREAKER_UNLOCK() LeaveCriticalSection(&breaker_mutex)
+#else
+static pthread_mutex_t breaker_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define BREAKER_LOCK() pthread_mutex_lock(&breaker_mutex)
+#define BREAKER_UNLOCK() pthread_mutex_unlock(&breaker_mutex)
+#endif
+
+/* must be called with breaker_mutex held */
+static struct url_breaker *get_url_breaker(unsigned long instance_id, int index) {
+    int i, empty = -1;
+    if (instance_id == 0 || index < 0 || index >= AM_BREAKER_MAX_URLS) {
+        return NULL;
+    }
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (breakers[i].instance_id == instance_id) {
+            return &breakers[i].url[index];
+        }
+        if (breakers[i].instance_id == 0 && empty == -1) {
+            empty = i;
+        }
+    }
+    if (empty == -1) {
+        return NULL;
+    }
+    memset(&breakers[empty], 0, sizeof (struct instance_breaker));
+    breakers[empty].instance_id = instance_id;
+    return &breakers[empty].url[index];
+}
+
+/**
+ * Only network level failures (no response, timeout, broken response) count against
+ * the server - a valid "invalid session" reply is a healthy server.
+ */
+static am_bool_t is_server_failure(int status) {
+    switch (status) {
+        case AM_SUCCESS:
+        case AM_INVALID_SESSION:
+        case AM_INVALID_AGENT_SESSION:
+        case AM_ACCESS_DENIED:
+        case AM_NOT_FOUND:
+        case AM_EINVAL:
+        case AM_ENOMEM:
+            return AM_FALSE;
+        default:
+            return AM_TRUE;
+    }
+}
+
+/* side-effect free check - whether a request could be sent now */
+static am_bool_t breaker_peek(struct url_breaker *b, time_t now) {
+    switch (b->state) {
+        case AM_BREAKER_OPEN:
+            return difftime(now, b->opened) >= AM_BREAKER_OPEN_INTERVAL;
+        case AM_BREAKER_HALF_OPEN:
+            return difftime(now, b->probe) >= AM_BREAKER_PROBE_INTERVAL;
+        default:
+            return AM_TRUE;
+    }
+}
+
+/* a request is being sent - use up the half-open trial */
+static am_bool_t breaker_claim(struct url_breaker *b, time_t now) {
+    switch (b->state) {
+        case AM_BREAKER_OPEN:
+            if (difftime(now, b->opened) < AM_BREAKER_OPEN_INTERVAL) {
+                return AM_FALSE;
+            }
+            b->state = AM_BREAKER_HALF_OPEN;
+            b->probe = now;
+            return AM_TRUE;
+        case AM_BREAKER_HALF_OPEN:
+            /* let a single trial request through per probe interval */
+            if (difftime(now, b->probe) < AM_BREAKER_PROBE_INTERVAL) {
+                return AM_FALSE;
+            }
+            b->probe = now;
+            return AM_TRUE;
+        default:
+            return AM_TRUE;
+    }
+}
+
+/**
+ * Record the outcome of a request sent to naming url 'index'.
+ *
+ * @param instance_id agent instance id.
+ * @param index naming url index (as in am_config_t.naming_url).
+ * @param status request status.
+ * @param elapsed request duration, in seconds.
+ */
+void am_url_breaker_report(unsigned long instance_id, int index, int status, double elapsed) {
+    static const char *thisfunc = "am_url_breaker_report():";
+    struct url_breaker *b;
+    int state = AM_BREAKER_CLOSED, failures = 0;
+    am_bool_t changed = AM_FALSE;
+
+    am_metrics_record(instance_id, AM_SPAN_BACKEND_REQUEST, elapsed > 0 ? (uint64_t) (elapsed * 1000000.0) : 0);
+
+    BREAKER_LOCK();
+    b = get_url_breaker(instance_id, index);
+    if (b == NULL) {
+        BREAKER_UNLOCK();
+        return;
+    }
+
+    if (!is_server_failure(status)) {
+        uint64_t msec = elapsed > 0 ? (uint64_t) (elapsed * 1000.0) : 0;
+        int i, bucket = 0;
+        while (msec > 0 && bucket < AM_BREAKER_BUCKETS - 1) {
+            msec >>= 1;
+            bucket++;
+        }
+        if (++b->samples > AM_BREAKER_DECAY) {
+            b->samples = 0;
+            for (i = 0; i < AM_BREAKER_BUCKETS; i++) {
+                b->latency[i] >>= 1;
+                b->samples += b->latency[i];
+            }
+            b->samples++;
+        }
+        b->latency[bucket]++;
+        changed = b->state != AM_BREAKER_CLOSED;
+        b->state = AM_BREAKER_CLOSED;
+        b->failures = 0;
+    } else {
+        b->failures++;
+        if (b->state == AM_BREAKER_HALF_OPEN ||
+                (b->state == AM_BREAKER_CLOSED && b->failures >= AM_BREAKER_FAIL_THRESHOLD)) {
+            changed = AM_TRUE;
+            b->state = AM_BREAKER_OPEN;
+            b->opened = time(NULL);
+        }
+    }
+    state = b->state;
+    failures = b->failures;
+    BREAKER_UNLOCK();
+
+    if (changed) {
+        if (state == AM_BREAKER_OPEN) {
+            AM_LOG_WARNING(instance_id, "%s naming url %d is not available (%d failures, last: %s), suspending it for %d sec",
+                    thisfunc, index, failures, am_strerror(status), AM_BREAKER_OPEN_INTERVAL);
+        } else {
+            AM_LOG_INFO(instance_id, "%s naming url %d is available again", thisfunc, index);
+        }
+    }
+}
+
+/**
+ * Check whether a request could be sent to naming url 'index'. Breaker state is not changed.
+ */
+am_bool_t am_url_breaker_allow(unsigned long instance_id, int index) {
+    struct url_breaker *b;
+    am_bool_t allow = AM_TRUE;
+    BREAKER_LOCK();
+    b = get_url_breaker(instance_id, index);
+    if (b != NULL) {
+        allow = breaker_peek(b, time(NULL));
+    }
+    BREAKER_UNLOCK();
+    return allow;
+}
+
+/**
+ * Mark a request to naming url 'index' as being sent (an open breaker becomes half-open
+ * and its single trial request is used up). Called right before the network call.
+ *
+ * @return AM_TRUE if the breaker let this request through.
+ */
+am_bool_t am_url_breaker_claim(unsigned long instance_id, int index) {
+    struct url_breaker *b;
+    am_bool_t allow = AM_TRUE;
+    BREAKER_LOCK();
+    b = get_url_breaker(instance_id, index);
+    if (b != NULL) {
+        allow = breaker_claim(b, time(NULL));
+    }
+    BREAKER_UNLOCK();
+    return allow;
+}
+
+/**
+ * Select the first naming url, starting at 'start' (wrapping over 'url_sz' entries),
+ * which is not 'exclude' and whose circuit breaker lets a request through. Breaker state
+ * is not changed - am_url_breaker_claim does that once the request is actually sent.
+ *
+ * @return naming url index or -1 if there is none available.
+ */
+int am_url_breaker_select(unsigned long instance_id, int start, int url_sz, int exclude) {
+    int i;
+    time_t now = time(NULL);
+    if (url_sz <= 0) {
+        return -1;
+    }
+    if (start < 0 || start >= url_sz) {
+        start = 0;
+    }
+    BREAKER_LOCK();
+    for (i = 0; i < url_sz; i++) {
+        int index = (start + i) % url_sz;
+        struct url_breaker *b;
+        if (index == exclude) {
+            continue;
+        }
+        b = get_url_breaker(instance_id, index);
+        if (b == NULL || breaker_peek(b, now)) {
+            BREAKER_UNLOCK();
+            return index;
+        }
+    }
+    BREAKER_UNLOCK();
+    return -1;
+}
+
+/**
+ * Request latency percentile (in msec, bucket upper bound) for naming url 'index'.
+ *
+ * @return latency or 0 if there is no data collected yet.
+ */
+unsigned int am_url_breaker_latency(unsigned long instance_id, int index, int percentile) {
+    struct url_breaker *b;
+    unsigned int value = 0;
+    BREAKER_LOCK();
+    b = get_url_breaker(instance_id, index);
+    if (b != NULL && b->samples > 0) {
+        int i;
+        uint64_t total = 0, rank;
+        for (i = 0; i < AM_BREAKER_BUCKETS; i++) {
+            total += b->latency[i];
+        }
+        rank = (total * percentile + 99) / 100;
+        total = 0;
+        for (i = 0; i < AM_BREAKER_BUCKETS; i++) {
+            total += b->latency[i];
+            if (total >= rank && total > 0) {
+                value = 1U << i;
+                break;
+            }
+        }
+    }
+    BREAKER_UNLOCK();
+    return value;
+}
+
+/**
+ * Forget all breaker data collected for an instance (or all instances, if 'instance_id' is 0).
+ */
+void am_url_breaker_reset(unsigned long instance_id) {
+    int i;
+    BREAKER_LOCK();
+    for (i = 0; i < AM_MAX_INSTANCES; i++) {
+        if (instance_id == 0 || breakers[i].instance_id == instance_id) {
+            memset(&breakers[i], 0, sizeof (struct instance_breaker));
+        }
+    }
+    BREAKER_UNLOCK();
+}
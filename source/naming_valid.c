@@ -315,7 +315,7 @@ void url_validator_worker(void *arg) {
 
 static void am_url_validator_tick(void *arg) {
     static const char *thisfunc = "am_url_validator_tick():";
-    int i;
+    int i, rv;
     struct url_validator_worker_data *list;
 
     list = (struct url_validator_worker_data *) calloc(1,
@@ -335,8 +335,11 @@ static void am_url_validator_tick(void *arg) {
                 worker_data->url_index = list[i].url_index;
                 worker_data->last = list[i].last;
                 worker_data->config_path = strdup(list[i].config_path);
-                if (am_worker_dispatch(url_validator_worker, worker_data) != AM_SUCCESS) {
-                    AM_LOG_WARNING(list[i].instance_id, "%s failed to dispatch url validator worker", thisfunc);
+                rv = am_worker_dispatch_lane(AM_WORKER_LANE_LOW, list[i].instance_id, url_validator_worker, worker_data);
+                if (rv != AM_SUCCESS) {
+                    if (rv != AM_EINPROGRESS) {
+                        AM_LOG_WARNING(list[i].instance_id, "%s failed to dispatch url validator worker", thisfunc);
+                    }
                     AM_FREE(worker_data->config_path, worker_data);
                 }
             } else {
@@ -22,6 +22,11 @@
 #include "utility.h"
 #include "net_client.h"
 #include "list.h"
+#include "zlib.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 
 #ifndef INVALID_SOCKET
 #define INVALID_SOCKET -1
@@ -134,6 +139,42 @@ static int net_error() {
     return e;
 }
 
+/* map socket error to am_status_t */
+static int net_status(int e) {
+    switch (e) {
+#ifdef _WIN32
+        case WSAETIMEDOUT:
+            return AM_ETIMEDOUT;
+        case WSAECONNREFUSED:
+        case WSAECONNRESET:
+        case WSAECONNABORTED:
+        case WSAENOTCONN:
+            return AM_ECONNREFUSED;
+        case WSAEHOSTUNREACH:
+        case WSAENETUNREACH:
+            return AM_EHOSTUNREACH;
+        case WSAENOBUFS:
+            return AM_ENOMEM;
+#else
+        case ETIMEDOUT:
+            return AM_ETIMEDOUT;
+        case ECONNREFUSED:
+        case ECONNRESET:
+        case EPIPE:
+        case ENOTCONN:
+            return AM_ECONNREFUSED;
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+            return AM_EHOSTUNREACH;
+        case ENOBUFS:
+        case ENOMEM:
+            return AM_ENOMEM;
+#endif
+        default:
+            return AM_ERROR;
+    }
+}
+
 static int net_in_progress(int e) {
 #ifdef _WIN32
     return (e == WSAEWOULDBLOCK || e == WSAEINPROGRESS);
@@ -199,9 +240,102 @@ static int on_status_cb(http_parser *parser, const char *at, size_t length) {
     return 0;
 }
 
+static void inflate_end(am_net_t *n) {
+    z_stream *zs = (z_stream *) n->zs;
+    if (zs == NULL) return;
+    inflateEnd(zs);
+    free(zs);
+    n->zs = NULL;
+}
+
+/**
+ * Set up response body decompression when the response headers (those collected since
+ * the current response began) carry gzip or deflate Content-Encoding.
+ */
+static void inflate_begin(am_net_t *n) {
+    int i;
+    z_stream *zs;
+    const char *encoding = NULL;
+
+    inflate_end(n);
+    if (n->options == NULL || !n->options->compress) return;
+
+    for (i = n->header_start; i < n->num_headers && i < n->num_header_values; i++) {
+        if (n->header_fields[i] != NULL && strcasecmp(n->header_fields[i], "Content-Encoding") == 0) {
+            encoding = n->header_values[i];
+        }
+    }
+    if (!ISVALID(encoding) || (strcasecmp(encoding, "gzip") != 0 && strcasecmp(encoding, "deflate") != 0)) {
+        return;
+    }
+
+    zs = calloc(1, sizeof (z_stream));
+    if (zs == NULL) {
+        AM_LOG_ERROR(n->instance_id, "inflate_begin(): memory allocation error");
+        return;
+    }
+    /* 32 + MAX_WBITS: detect gzip or zlib header automatically */
+    if (inflateInit2(zs, 32 + MAX_WBITS) != Z_OK) {
+        AM_LOG_ERROR(n->instance_id, "inflate_begin(): failed to initialize %s decoder", encoding);
+        free(zs);
+        return;
+    }
+    n->zs = zs;
+    n->zs_in = n->zs_out = 0;
+}
+
+static int on_message_begin_cb(http_parser *parser) {
+    am_net_t *n = (am_net_t *) parser->data;
+    n->header_start = n->num_headers;
+    inflate_end(n);
+    return 0;
+}
+
 static int on_body_cb(http_parser *parser, const char *at, size_t length) {
     am_net_t *n = (am_net_t *) parser->data;
-    if (n->on_data) n->on_data(n->data, at, length, 0);
+    z_stream *zs = (z_stream *) n->zs;
+    char buffer[RECV_BUFFER_SZ * 4];
+    int status;
+    am_bool_t first = n->zs_in == 0;
+
+    if (zs == NULL) {
+        if (n->on_data) n->on_data(n->data, at, length, parser->status_code);
+        return 0;
+    }
+
+    /* inflate body chunk by chunk, handing out decoded data as it becomes available */
+    zs->next_in = (Bytef *) at;
+    zs->avail_in = (uInt) length;
+    n->zs_in += length;
+    do {
+        size_t out_sz;
+        zs->next_out = (Bytef *) buffer;
+        zs->avail_out = sizeof (buffer);
+        status = inflate(zs, Z_SYNC_FLUSH);
+        if (status == Z_DATA_ERROR && first && zs->total_out == 0) {
+            /* Content-Encoding: deflate sent as a raw deflate stream (no zlib header) */
+            first = AM_FALSE;
+            if (inflateReset2(zs, -MAX_WBITS) == Z_OK) {
+                zs->next_in = (Bytef *) at;
+                zs->avail_in = (uInt) length;
+                zs->avail_out = 0;
+                status = Z_OK;
+                continue;
+            }
+        }
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            AM_LOG_ERROR(n->instance_id, "on_body_cb(): failed to decode response body (%d: %s)",
+                    status, NOTNULL(zs->msg));
+            inflate_end(n);
+            n->error = AM_EPROTO;
+            return 1; /* abort response parsing */
+        }
+        out_sz = sizeof (buffer) - zs->avail_out;
+        if (out_sz > 0) {
+            n->zs_out += out_sz;
+            if (n->on_data) n->on_data(n->data, buffer, out_sz, parser->status_code);
+        }
+    } while (status == Z_OK && zs->avail_out == 0);
     return 0;
 }
 
@@ -293,15 +427,56 @@ static int on_headers_complete_cb(http_parser *parser) {
          * that it should not expect neither a body nor any further responses on this connection */
         return 1;
     }
+    inflate_begin(n);
     return 0;
 }
 
 static int on_message_complete_cb(http_parser *parser) {
     am_net_t *n = (am_net_t *) parser->data;
+    if (n->zs != NULL) {
+        z_stream *zs = (z_stream *) n->zs;
+        Bytef out;
+        zs->next_in = NULL;
+        zs->avail_in = 0;
+        zs->next_out = &out;
+        zs->avail_out = 0;
+        /* the whole compressed stream must have been received (responses w/o body are fine) */
+        if (n->zs_in > 0 && inflate(zs, Z_FINISH) != Z_STREAM_END) {
+            AM_LOG_ERROR(n->instance_id, "on_message_complete_cb(): compressed response body is truncated "
+                    "(%"PR_L64" bytes received)", n->zs_in);
+            inflate_end(n);
+            n->error = AM_EPROTO;
+            return 1; /* abort response parsing */
+        }
+        AM_LOG_DEBUG(n->instance_id, "on_message_complete_cb(): compressed response body %"PR_L64" bytes, "
+                "inflated %"PR_L64" bytes (%"PR_L64" bytes saved)", n->zs_in, n->zs_out,
+                n->zs_out > n->zs_in ? n->zs_out - n->zs_in : 0);
+        inflate_end(n);
+    }
     if (n->on_complete) n->on_complete(n->data, 0);
     return 0;
 }
 
+/**
+ * Feed received data to the response parser. When parsing (or response body decoding) fails,
+ * the response is abandoned and the connection owner is notified with on_close(error).
+ *
+ * @return AM_SUCCESS or error code.
+ */
+int net_parse_response(am_net_t *n, const char *data, size_t data_sz) {
+    http_parser_execute(n->hp, n->hs, data, data_sz);
+    if (HTTP_PARSER_ERRNO(n->hp) != HPE_OK) {
+        if (n->error == AM_SUCCESS) {
+            n->error = AM_EPROTO;
+        }
+        AM_LOG_ERROR(n->instance_id, "net_parse_response(): failed to parse response from %s (%s, %s)",
+                LOGEMPTY(n->url), http_errno_name(HTTP_PARSER_ERRNO(n->hp)), am_strerror(n->error));
+        if (n->on_close) n->on_close(n->data, n->error);
+        return n->error;
+    }
+    return AM_SUCCESS;
+}
+
 void am_net_options_create(am_config_t *conf, am_net_options_t *options, void (*log)(const char *, ...)) {
     int i;
     if (conf == NULL || options == NULL) return;
@@ -311,6 +486,7 @@ void am_net_options_create(am_config_t *conf, am_net_options_t *options, void (*
     options->net_timeout = conf->net_timeout;
     options->cert_trust = conf->cert_trust;
     options->keepalive = !conf->keepalive_disable;
+    options->compress = conf->net_compress_enable;
     options->cert_key_pass_sz = conf->cert_key_pass_sz;
     options->server_id = NULL; /* server_id is set on request */
     options->notif_url = ISVALID(conf->notif_url) ? strdup(conf->notif_url) : NULL;
@@ -622,6 +798,7 @@ int am_net_sync_connect(am_net_t *n) {
 
     n->error = AM_ENOTSTARTED;
     n->sock = INVALID_SOCKET;
+    n->requests = 0;
     n->ssl.request_data = NULL;
     n->ssl.ssl_handle = NULL;
     n->ssl.ssl_context = NULL;
@@ -650,6 +827,7 @@ int am_net_sync_connect(am_net_t *n) {
         return AM_ENOMEM;
     }
 
+    n->hs->on_message_begin = on_message_begin_cb;
     n->hs->on_status = on_status_cb;
     n->hs->on_header_field = on_header_field_cb;
     n->hs->on_header_value = on_header_value_cb;
@@ -666,6 +844,9 @@ int am_net_sync_connect(am_net_t *n) {
         sync_connect_win(n);
     }
 #endif
+    if (n->error == AM_SUCCESS) {
+        am_metrics_incr(AM_METRIC_NET_CONNECT);
+    }
     return n->error;
 }
 
@@ -699,20 +880,24 @@ static int am_net_write_internal(am_net_t *n, const char *data, size_t data_sz)
         while (sent < (int) len) {
             int rv = send(n->sock, buf + sent, (int) len - sent, flags);
             if (rv < 0) {
-                if (net_in_progress(net_error())) {
+                int e = net_error();
+                if (net_in_progress(e)) {
                     POLLFD fds[1];
                     memset(fds, 0, sizeof (fds));
                     fds[0].fd = n->sock;
                     fds[0].events = connect_ev;
                     fds[0].revents = 0;
-                    if (sockpoll(fds, 1, -1) == -1) {
-                        break;
+                    if (sockpoll(fds, 1, -1) != -1) {
+                        continue;
                     }
-                    continue;
+                    e = net_error();
                 }
+                net_log_error(n->instance_id, e);
+                status = n->error = net_status(e);
                 break;
             }
             if (rv == 0) {
+                status = n->error = AM_EOF;
                 break;
             }
             sent += rv;
@@ -736,9 +921,17 @@ static int get_req_method(const char *data, size_t data_sz) {
     return ret;
 }
 
+static void count_request(am_net_t *n) {
+    /* proxy CONNECT request does not count */
+    if (n->proxy != AM_PROXY_CONNECTING && n->requests++ > 0) {
+        am_metrics_incr(AM_METRIC_NET_REUSE);
+    }
+}
+
 int am_net_write(am_net_t *n, const char *data, size_t data_sz) {
     if (n == NULL || data == NULL || data_sz == 0) return AM_EINVAL;
     n->req_method = get_req_method(data, data_sz);
+    count_request(n);
 #ifdef _WIN32
     if (n->uv.ssl && n->options != NULL && !n->options->secure_channel_disable) {
         int status;
@@ -754,6 +947,133 @@ int am_net_write(am_net_t *n, const char *data, size_t data_sz) {
 #endif
 }
 
+/**
+ * Copy scatter/gather segments into a single buffer (used where data has to be kept
+ * for a later write, as with the SSL/TLS handshake pending).
+ */
+static char *coalesce_iov(const am_net_iov_t *iov, int iov_cnt, size_t *data_sz) {
+    int i;
+    size_t size = 0;
+    char *data;
+    for (i = 0; i < iov_cnt; i++) {
+        size += iov[i].data_sz;
+    }
+    data = malloc(size + 1);
+    if (data == NULL) return NULL;
+    size = 0;
+    for (i = 0; i < iov_cnt; i++) {
+        if (iov[i].data_sz > 0) {
+            memcpy(data + size, iov[i].data, iov[i].data_sz);
+            size += iov[i].data_sz;
+        }
+    }
+    data[size] = 0;
+    *data_sz = size;
+    return data;
+}
+
+/**
+ * write scatter/gather data segments to remote server, without building a
+ * contiguous copy of the request first (where the transport allows for it)
+ */
+int am_net_writev(am_net_t *n, const am_net_iov_t *iov, int iov_cnt) {
+    size_t data_sz = 0;
+    char *data;
+
+    if (n == NULL || iov == NULL || iov_cnt <= 0 || iov[0].data == NULL || iov[0].data_sz == 0) {
+        return AM_EINVAL;
+    }
+    if (iov_cnt > AM_NET_IOV_MAX) {
+        AM_LOG_ERROR(n->instance_id, "am_net_writev(): too many request segments (%d, max %d)",
+                iov_cnt, AM_NET_IOV_MAX);
+        return AM_E2BIG;
+    }
+    if (n->error != 0) {
+        return n->error;
+    }
+    n->req_method = get_req_method(iov[0].data, iov[0].data_sz);
+    count_request(n);
+
+#ifndef _WIN32
+    if (!n->ssl.on) {
+        struct iovec vec[AM_NET_IOV_MAX];
+        struct msghdr msg;
+        int i, cnt = 0, flags = 0;
+
+        for (i = 0; i < iov_cnt; i++) {
+            if (iov[i].data_sz == 0) continue;
+            vec[cnt].iov_base = (void *) iov[i].data;
+            vec[cnt].iov_len = iov[i].data_sz;
+            cnt++;
+        }
+#ifdef MSG_NOSIGNAL
+        flags |= MSG_NOSIGNAL;
+#endif
+        memset(&msg, 0, sizeof (struct msghdr));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = cnt;
+
+        while (msg.msg_iovlen > 0) {
+            ssize_t rv = sendmsg(n->sock, &msg, flags);
+            if (rv < 0) {
+                int e = net_error();
+                if (net_in_progress(e)) {
+                    POLLFD fds[1];
+                    memset(fds, 0, sizeof (fds));
+                    fds[0].fd = n->sock;
+                    fds[0].events = connect_ev;
+                    fds[0].revents = 0;
+                    if (sockpoll(fds, 1, -1) != -1) {
+                        continue;
+                    }
+                    e = net_error();
+                }
+                net_log_error(n->instance_id, e);
+                return n->error = net_status(e);
+            }
+            if (rv == 0) {
+                return n->error = AM_EOF;
+            }
+            /* skip over segments sent so far */
+            while (msg.msg_iovlen > 0 && (size_t) rv >= msg.msg_iov->iov_len) {
+                rv -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            if (msg.msg_iovlen > 0) {
+                msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + rv;
+                msg.msg_iov->iov_len -= rv;
+            }
+        }
+        return AM_SUCCESS;
+    }
+#endif
+
+    data = coalesce_iov(iov, iov_cnt, &data_sz);
+    if (data == NULL) {
+        return AM_ENOMEM;
+    }
+#ifdef _WIN32
+    if (n->uv.ssl && n->options != NULL && !n->options->secure_channel_disable) {
+        status = wnet_write(n, data, (int) data_sz);
+        free(data);
+        return status > 0 ? AM_SUCCESS : status;
+    }
+    if (!n->ssl.on) {
+        status = am_net_write_internal(n, data, data_sz);
+        free(data);
+        return status;
+    }
+#endif
+    /* SSL/TLS: request data is kept until the handshake is done */
+    n->ssl.request_data_sz = 0;
+    am_free(n->ssl.request_data);
+    n->ssl.request_data = data;
+    n->ssl.request_data_sz = data_sz;
+    net_write_ssl(n);
+    return AM_SUCCESS;
+}
+
 /**
  * receive and parse http message, returning when message http message is complete
  */
@@ -827,8 +1147,8 @@ static void am_net_sync_recv_internal(am_net_t *n, int timeout_secs) {
                 } else if (got == 0) {
                     if (n->on_close) n->on_close(n->data, 0);
                     break;
-                } else {
-                    http_parser_execute(n->hp, n->hs, buffer, got);
+                } else if (net_parse_response(n, buffer, got) != AM_SUCCESS) {
+                    break;
                 }
             }
             /* message is complete here */
@@ -881,6 +1201,8 @@ int am_net_close(am_net_t *n) {
     AM_FREE(n->req_headers);
     n->req_headers = NULL;
 
+    inflate_end(n);
+
     AM_FREE(n->hs, n->hp);
     n->hs = NULL;
     n->hp = NULL;
@@ -27,6 +27,7 @@ typedef struct {
     int lb_enable;
     int net_timeout;
     int keepalive;
+    int compress;
     int cert_trust;
     int hostmap_sz;
     int notif_enable;
@@ -64,6 +65,7 @@ typedef struct {
     char **header_fields;
     char **header_values;
     int req_method;
+    unsigned int requests; /* number of requests sent over this connection */
 
     struct ssl {
         char on;
@@ -85,6 +87,10 @@ typedef struct {
     int num_headers;
     int num_header_values;
     unsigned int http_status;
+    int header_start; /* index of the first header field of the current response */
+    void *zs; /* inflate stream, set when the current response body is compressed */
+    uint64_t zs_in;
+    uint64_t zs_out;
 
     enum {
         AM_PROXY_NONE = 0,
@@ -106,9 +112,18 @@ typedef struct {
 } am_net_t;
 
 
+#define AM_NET_IOV_MAX 32
+
+typedef struct {
+    const char *data;
+    size_t data_sz;
+} am_net_iov_t;
+
 int am_net_sync_connect(am_net_t *n);
 int am_net_write(am_net_t *n, const char *data, size_t data_sz);
+int am_net_writev(am_net_t *n, const am_net_iov_t *iov, int iov_cnt);
 void am_net_sync_recv(am_net_t *n, int timeout_ms);
+int net_parse_response(am_net_t *n, const char *data, size_t data_sz);
 int am_net_close(am_net_t *n);
 
 void am_net_options_create(am_config_t *ac, am_net_options_t *options, void (*log)(const char *, ...));
@@ -810,8 +810,8 @@ static int read_data_after_handshake(am_net_t *n) {
             break;
         }
 
-        http_parser_execute(n->hp, n->hs, buf, ret);
-    } while (ret > 0);
+        status = net_parse_response(n, buf, ret);
+    } while (ret > 0 && status == AM_SUCCESS);
 
     free(buf);
     return status;
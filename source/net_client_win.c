@@ -707,7 +707,9 @@ void wnet_read(am_net_t *net) {
             break;
         }
 
-        http_parser_execute(net->hp, net->hs, buf, rv);
+        if (net_parse_response(net, buf, rv) != AM_SUCCESS) {
+            break;
+        }
         if (rv == 0 || (net_ssl_pending(n) <= 0 && net_data_avail(net) <= 0)) {
             if (!net->is_complete(net->data)) continue;
             if (net->on_close) net->on_close(net->data, 0);
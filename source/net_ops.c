@@ -22,12 +22,15 @@
 #include "list.h"
 
 #define AM_LB_COOKIE "amlbcookie"
+#define ACCEPT_ENCODING(c) ((c)->options != NULL && (c)->options->compress ? \
+    "Accept-Encoding: gzip, deflate\r\n" : "")
 
 struct request_data {
     char *data;
     size_t data_size;
     int error;
     am_bool_t message_complete;
+    void *policy_stream; /* if set, successful response body is fed into the streaming policy parser */
 };
 
 void net_connect_ssl(am_net_t *n);
@@ -35,8 +38,34 @@ void net_connect_ssl(am_net_t *n);
 void sync_connect_win(am_net_t *n);
 #endif
 
+/**
+ * Add a request segment, referencing 'data' in place (it must stay valid until the
+ * request is written). Returns segment size. Segment count over AM_NET_IOV_MAX
+ * is kept as is, so that am_net_writev refuses to send a truncated request.
+ */
+static size_t iov_append(am_net_iov_t *iov, int *iov_cnt, const char *data) {
+    size_t data_sz = data != NULL ? strlen(data) : 0;
+    if (data_sz == 0) {
+        return 0;
+    }
+    if (*iov_cnt >= AM_NET_IOV_MAX) {
+        *iov_cnt = AM_NET_IOV_MAX + 1;
+        return 0;
+    }
+    iov[*iov_cnt].data = data;
+    iov[*iov_cnt].data_sz = data_sz;
+    (*iov_cnt)++;
+    return data_sz;
+}
+
 static void on_agent_request_data_cb(void *udata, const char *data, size_t data_sz, int status) {
     struct request_data *ld = (struct request_data *) udata;
+    if (ld->policy_stream != NULL && status == 200) {
+        if (am_parse_policy_xml_stream(ld->policy_stream, data, data_sz) != AM_SUCCESS) {
+            ld->error = AM_XML_ERROR;
+        }
+        return;
+    }
     if (ld->data == NULL) {
         ld->data = malloc(data_sz + 1);
         if (ld->data == NULL) {
@@ -66,6 +95,13 @@ static void on_connected_cb(void *udata, int status) {
 
 static void on_close_cb(void *udata, int status) {
     struct request_data *ld = (struct request_data *) udata;
+    if (status != AM_SUCCESS) {
+        /* response was abandoned (broken or undecodable) - do not use partial data */
+        ld->error = status;
+        am_free(ld->data);
+        ld->data = NULL;
+        ld->data_size = 0;
+    }
 }
 
 static void on_complete_cb(void *udata, int status) {
@@ -76,6 +112,7 @@ static void on_complete_cb(void *udata, int status) {
 static void reset_complete_cb(void *udata) {
     struct request_data *ld = (struct request_data *) udata;
     ld->message_complete = AM_FALSE;
+    ld->error = AM_SUCCESS;
 }
 
 static am_bool_t is_complete(void *udata) {
@@ -244,10 +281,11 @@ static int send_authcontext_request(am_net_t *conn, const char *realm, char **to
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
+            "%s"
             "Connection: %s\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive, post_data_sz, post_data);
+            "%s", conn->uv.path, conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn), keepalive, post_data_sz, post_data);
     if (post == NULL) {
         free(post_data);
         return AM_ENOMEM;
@@ -381,11 +419,12 @@ static int send_login_request(am_net_t *conn, char **token, const char *user, co
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
+            "%s"
             "Connection: %s\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "%s"
             "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
+            "%s", conn->uv.path, conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn), keepalive,
             NOTNULL(conn->req_headers), post_data_sz, post_data);
     if (post == NULL) {
         free(post_data);
@@ -474,10 +513,11 @@ static int send_attribute_request(am_net_t *conn, char **token, char **pxml, siz
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
             "%s"
+            "%s"
             "Connection: %s\r\n\r\n",
             conn->uv.path,
             NOTNULL(user_enc), NOTNULL(realm_enc), NOTNULL(token_enc),
-            conn->uv.host, conn->uv.port, NOTNULL(conn->req_headers), keepalive);
+            conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn), NOTNULL(conn->req_headers), keepalive);
     if (post == NULL) {
         AM_FREE(realm_enc, user_enc, token_enc);
         return AM_ENOMEM;
@@ -544,18 +584,20 @@ static int send_attribute_request(am_net_t *conn, char **token, char **pxml, siz
 static int send_session_request(am_net_t *conn, char **token, const char *user_token,
         struct am_namevalue **session_list) {
     static const char *thisfunc = "send_session_request():";
-    size_t post_sz, post_data_sz, token_sz;
-    char *post = NULL, *post_data = NULL, *token_in = NULL, *token_b64;
-    int status = AM_ERROR;
+    size_t post_sz, post_data_sz = 0, token_sz;
+    char *post = NULL, *token_in = NULL, *token_b64;
+    int status = AM_ERROR, iov_cnt = 1;
     struct request_data *req_data;
     char *keepalive = "Keep-Alive";
-    char *lsnr_req = NULL;
+    const char *session_id;
+    am_net_iov_t iov[AM_NET_IOV_MAX];
 
     if (conn == NULL || conn->data == NULL ||
             token == NULL || !ISVALID(*token)) return AM_EINVAL;
 
     token_sz = am_asprintf(&token_in, "token:%s", *token);
     token_b64 = base64_encode(token_in, &token_sz);
+    session_id = ISVALID(user_token) ? user_token : *token;
 
     if (conn->options != NULL && !conn->options->keepalive) {
         keepalive = "Close";
@@ -563,57 +605,64 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
 
     req_data = (struct request_data *) conn->data;
 
-    if (conn->options != NULL && conn->options->notif_enable && ISVALID(conn->options->notif_url)) {
-        /* add session listener request only if notification is enabled */
-        am_asprintf(&lsnr_req,
-                "<Request><![CDATA["
-                "<SessionRequest vers=\"1.0\" reqid=\"2\" requester=\"%s\">"
-                "<AddSessionListener>"
-                "<URL>%s</URL>"
-                "<SessionID>%s</SessionID>"
-                "</AddSessionListener>"
-                "</SessionRequest>]]>"
-                "</Request>",
-                NOTNULL(token_b64),
-                conn->options->notif_url,
-                ISVALID(user_token) ? user_token : *token);
-    }
-
-    post_data_sz = am_asprintf(&post_data,
+    /* request body segments reference static template parts and arguments in place;
+     * iov[0] is reserved for the request line and headers */
+    post_data_sz += iov_append(iov, &iov_cnt,
             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
             "<RequestSet vers=\"1.0\" svcid=\"Session\" reqid=\"0\">"
             "<Request><![CDATA["
-            "<SessionRequest vers=\"1.0\" reqid=\"1\" requester=\"%s\">"
-            "<GetSession reset=\"true\">"
-            "<SessionID>%s</SessionID>"
+            "<SessionRequest vers=\"1.0\" reqid=\"1\" requester=\"");
+    post_data_sz += iov_append(iov, &iov_cnt, token_b64);
+    post_data_sz += iov_append(iov, &iov_cnt,
+            "\"><GetSession reset=\"true\">"
+            "<SessionID>");
+    post_data_sz += iov_append(iov, &iov_cnt, session_id);
+    post_data_sz += iov_append(iov, &iov_cnt,
+            "</SessionID>"
             "</GetSession>"
             "</SessionRequest>]]>"
-            "</Request>"
-            "%s"
-            "</RequestSet>",
-            NOTNULL(token_b64),
-            ISVALID(user_token) ? user_token : *token,
-            NOTNULL(lsnr_req));
+            "</Request>");
 
-    if (post_data == NULL) {
-        AM_FREE(token_b64, token_in, lsnr_req);
-        return AM_ENOMEM;
+    if (conn->options != NULL && conn->options->notif_enable && ISVALID(conn->options->notif_url)) {
+        /* add session listener request only if notification is enabled */
+        post_data_sz += iov_append(iov, &iov_cnt,
+                "<Request><![CDATA["
+                "<SessionRequest vers=\"1.0\" reqid=\"2\" requester=\"");
+        post_data_sz += iov_append(iov, &iov_cnt, token_b64);
+        post_data_sz += iov_append(iov, &iov_cnt,
+                "\"><AddSessionListener>"
+                "<URL>");
+        post_data_sz += iov_append(iov, &iov_cnt, conn->options->notif_url);
+        post_data_sz += iov_append(iov, &iov_cnt,
+                "</URL>"
+                "<SessionID>");
+        post_data_sz += iov_append(iov, &iov_cnt, session_id);
+        post_data_sz += iov_append(iov, &iov_cnt,
+                "</SessionID>"
+                "</AddSessionListener>"
+                "</SessionRequest>]]>"
+                "</Request>");
     }
 
+    post_data_sz += iov_append(iov, &iov_cnt, "</RequestSet>");
+
     post_sz = am_asprintf(&post, "POST %s/sessionservice HTTP/1.1\r\n"
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
+            "%s"
             "Connection: %s\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "%s"
-            "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port, keepalive,
-            NOTNULL(conn->req_headers), post_data_sz, post_data);
+            "Content-Length: %d\r\n\r\n", conn->uv.path, conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn), keepalive,
+            NOTNULL(conn->req_headers), post_data_sz);
     if (post == NULL) {
-        AM_FREE(post_data, token_b64, token_in, lsnr_req);
+        AM_FREE(token_b64, token_in);
         return AM_ENOMEM;
     }
+    iov[0].data = post;
+    iov[0].data_sz = post_sz;
+    post_sz += post_data_sz;
 
 #ifdef DEBUG
     AM_LOG_DEBUG(conn->instance_id, "%s sending %d bytes to %s/sessionservice\n%s",
@@ -632,8 +681,8 @@ static int send_session_request(am_net_t *conn, char **token, const char *user_t
 #endif                
     }
 
-    status = am_net_write(conn, post, post_sz);
-    AM_FREE(post, post_data, token_b64, token_in, lsnr_req);
+    status = am_net_writev(conn, iov, iov_cnt);
+    AM_FREE(post, token_b64, token_in);
 
     if (status == AM_SUCCESS) {
         am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
@@ -722,11 +771,12 @@ static int send_policychange_request(am_net_t *conn, char **token, const char *e
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
+            "%s"
             "Connection: Close\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "%s"
             "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port,
+            "%s", conn->uv.path, conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn),
             NOTNULL(conn->req_headers), post_data_sz, post_data);
     if (post == NULL) {
         free(post_data);
@@ -776,65 +826,80 @@ static int send_policy_request(am_net_t *conn, const char *token, const char *us
         const char *req_url, const char *scope, const char *cip, const char *pattr, const char *eval_app,
         struct am_policy_result **policy_list) {
     static const char *thisfunc = "send_policy_request():";
-    size_t post_sz, post_data_sz;
-    char *post = NULL, *post_data = NULL;
-    int status = AM_ERROR;
+    size_t post_sz, post_data_sz = 0;
+    char *post = NULL;
+    int status = AM_ERROR, iov_cnt = 1;
     struct request_data *req_data;
-    size_t req_url_sz;
-    char *req_url_escaped;
+    char *req_url_escaped = NULL;
     const char *service_name = ISVALID(eval_app) ? eval_app : "iPlanetAMWebAgentService";
+    am_net_iov_t iov[AM_NET_IOV_MAX];
 
     if (conn == NULL || conn->data == NULL || !ISVALID(token) || !ISVALID(user_token) ||
             !ISVALID(req_url) || !ISVALID(scope) || !ISVALID(cip)) return AM_EINVAL;
 
     req_data = (struct request_data *) conn->data;
 
-    /* do xml-escape */
-    req_url_sz = strlen(req_url);
-    req_url_escaped = malloc(req_url_sz * 6 + 1); /* worst case */
-    if (req_url_escaped == NULL) return AM_ENOMEM;
-    memcpy(req_url_escaped, req_url, req_url_sz);
-    xml_entity_escape(req_url_escaped, req_url_sz);
+    /* do xml-escape (only when there is something to escape) */
+    if (strpbrk(req_url, "&'\"><") != NULL) {
+        size_t req_url_sz = strlen(req_url);
+        req_url_escaped = malloc(req_url_sz * 6 + 1); /* worst case */
+        if (req_url_escaped == NULL) return AM_ENOMEM;
+        memcpy(req_url_escaped, req_url, req_url_sz);
+        xml_entity_escape(req_url_escaped, req_url_sz);
+    }
+
+    /* request body segments reference static template parts and arguments in place;
+     * iov[0] is reserved for the request line and headers */
 
     /* TODO:
      * <AttributeValuePair><Attribute name=\"requestDnsName\"/><Value>%s</Value></AttributeValuePair>
      */
-    post_data_sz = am_asprintf(&post_data,
+    post_data_sz += iov_append(iov, &iov_cnt,
             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
             "<RequestSet vers=\"1.0\" svcid=\"Policy\" reqid=\"3\">"
             "<Request><![CDATA[<PolicyService version=\"1.0\">"
-            "<PolicyRequest requestId=\"4\" appSSOToken=\"%s\">"
-            "<GetResourceResults userSSOToken=\"%s\" serviceName=\"%s\" resourceName=\"%s\" resourceScope=\"%s\">"
-            "<EnvParameters><AttributeValuePair><Attribute name=\"requestIp\"/><Value>%s</Value></AttributeValuePair></EnvParameters>"
-            "<GetResponseDecisions>"
-            "%s"
+            "<PolicyRequest requestId=\"4\" appSSOToken=\"");
+    post_data_sz += iov_append(iov, &iov_cnt, token);
+    post_data_sz += iov_append(iov, &iov_cnt, "\"><GetResourceResults userSSOToken=\"");
+    post_data_sz += iov_append(iov, &iov_cnt, user_token);
+    post_data_sz += iov_append(iov, &iov_cnt, "\" serviceName=\"");
+    post_data_sz += iov_append(iov, &iov_cnt, service_name);
+    post_data_sz += iov_append(iov, &iov_cnt, "\" resourceName=\"");
+    post_data_sz += iov_append(iov, &iov_cnt, req_url_escaped != NULL ? req_url_escaped : req_url);
+    post_data_sz += iov_append(iov, &iov_cnt, "\" resourceScope=\"");
+    post_data_sz += iov_append(iov, &iov_cnt, scope);
+    post_data_sz += iov_append(iov, &iov_cnt,
+            "\"><EnvParameters><AttributeValuePair><Attribute name=\"requestIp\"/><Value>");
+    post_data_sz += iov_append(iov, &iov_cnt, cip);
+    post_data_sz += iov_append(iov, &iov_cnt,
+            "</Value></AttributeValuePair></EnvParameters>"
+            "<GetResponseDecisions>");
+    post_data_sz += iov_append(iov, &iov_cnt, pattr);
+    post_data_sz += iov_append(iov, &iov_cnt,
             "</GetResponseDecisions>"
             "</GetResourceResults>"
             "</PolicyRequest>"
             "</PolicyService>]]>"
             "</Request>"
-            "</RequestSet>",
-            token, user_token, service_name, req_url_escaped, scope, cip, NOTNULL(pattr));
-
-    if (post_data == NULL) {
-        free(req_url_escaped);
-        return AM_ENOMEM;
-    }
+            "</RequestSet>");
 
     post_sz = am_asprintf(&post, "POST %s/policyservice HTTP/1.1\r\n"
             "Host: %s:%d\r\n"
             "User-Agent: "MODINFO"\r\n"
             "Accept: text/xml\r\n"
+            "%s"
             "Connection: Close\r\n"
             "Content-Type: text/xml; charset=UTF-8\r\n"
             "%s"
-            "Content-Length: %d\r\n\r\n"
-            "%s", conn->uv.path, conn->uv.host, conn->uv.port,
-            NOTNULL(conn->req_headers), post_data_sz, post_data);
+            "Content-Length: %d\r\n\r\n", conn->uv.path, conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn),
+            NOTNULL(conn->req_headers), post_data_sz);
     if (post == NULL) {
-        AM_FREE(post_data, req_url_escaped);
+        am_free(req_url_escaped);
         return AM_ENOMEM;
     }
+    iov[0].data = post;
+    iov[0].data_sz = post_sz;
+    post_sz += post_data_sz;
 
 #ifdef DEBUG
     AM_LOG_DEBUG(conn->instance_id, "%s sending %d bytes to %s/policyservice\n%s",
@@ -853,8 +918,12 @@ static int send_policy_request(am_net_t *conn, const char *token, const char *us
 #endif                
     }
 
-    status = am_net_write(conn, post, post_sz);
-    AM_FREE(post_data, post, req_url_escaped);
+    /* policy response is parsed while it is being received */
+    req_data->policy_stream = policy_list != NULL ?
+            am_parse_policy_xml_stream_create(conn->instance_id, am_scope_to_num(scope)) : NULL;
+
+    status = am_net_writev(conn, iov, iov_cnt);
+    AM_FREE(post, req_url_escaped);
 
     if (status == AM_SUCCESS) {
         am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
@@ -867,7 +936,27 @@ static int send_policy_request(am_net_t *conn, const char *token, const char *us
                 conn->http_status, LOGEMPTY(req_data->data));
     }
 
-    if (status == AM_SUCCESS && conn->http_status == 200 && ISVALID(req_data->data)) {
+    if (req_data->policy_stream != NULL) {
+        char *exception = NULL;
+        struct am_policy_result *list = am_parse_policy_xml_stream_done(req_data->policy_stream, &exception);
+        req_data->policy_stream = NULL;
+        if (status == AM_SUCCESS && req_data->error != AM_SUCCESS) {
+            status = req_data->error;
+        } else if (status == AM_SUCCESS && conn->http_status == 200) {
+            status = exception != NULL ? parse_exception(exception, token, user_token) : AM_SUCCESS;
+            if (status == AM_SUCCESS) {
+                *policy_list = list;
+                list = NULL;
+                if (*policy_list == NULL) {
+                    status = AM_XML_ERROR;
+                }
+            }
+        } else {
+            status = AM_EINVAL;
+        }
+        delete_am_policy_result_list(&list);
+        am_free(exception);
+    } else if (status == AM_SUCCESS && conn->http_status == 200 && ISVALID(req_data->data)) {
         status = parse_exception(req_data->data, token, user_token);
         if (status == AM_SUCCESS && policy_list != NULL) {
             *policy_list = am_parse_policy_xml(conn->instance_id, req_data->data, req_data->data_size,
@@ -1225,11 +1314,12 @@ int am_agent_logout(unsigned long instance_id, const char *openam, const char *t
                 "Host: %s:%d\r\n"
                 "User-Agent: "MODINFO"\r\n"
                 "Accept: text/xml\r\n"
+                "%s"
                 "Connection: Close\r\n"
                 "Content-Type: text/xml; charset=UTF-8\r\n"
                 "%s"
                 "Content-Length: %d\r\n\r\n"
-                "%s", conn->uv.path, conn->uv.host, conn->uv.port,
+                "%s", conn->uv.path, conn->uv.host, conn->uv.port, ACCEPT_ENCODING(conn),
                 NOTNULL(conn->req_headers), post_data_sz, post_data);
         if (post != NULL) {
             AM_LOG_DEBUG(instance_id, "%s sending request:\n%s", thisfunc, post);
@@ -1526,6 +1616,10 @@ int am_agent_audit_request(unsigned long instance_id, const char *openam, const
 
     if (status == AM_SUCCESS) {
         am_net_sync_recv(conn, AM_NET_POOL_TIMEOUT);
+        if (conn->http_status != 200) {
+            /* not accepted - let the caller retry */
+            status = AM_ERROR;
+        }
     } else {
         AM_LOG_DEBUG(instance_id, "%s closing connection after failure", thisfunc);
     }
@@ -19,6 +19,7 @@
 #include "utility.h"
 
 #define URL_MATCH_FRAME_MAX 32
+#define URL_MATCH_SECTION_SIZE 256 /* url sections shorter than this are compared without a heap copy */
 
 static const char *policy_fetch_scope_str[] = {
     "self",
@@ -133,24 +134,12 @@ static am_bool_t url_pattern_match_with_backtrack(am_request_t *r, url_match_fra
  * decide whether a URL matches a pattern using a backtracking algorithm and a stack
  * allocated here.
  *
- * this uses a heap allocated stack large enough to allow 64 frames, which will suffice for
- * patterns with 32 wildcards (* or -*-).
+ * the frame stack (URL_MATCH_FRAME_MAX frames, under 1KB) lives on the C stack, so nothing is
+ * allocated for each pattern compared.
  */
 am_bool_t compare_pattern_resource(am_request_t *r, const char * pattern, const char * url) {
-    url_match_frame_t *stack = malloc(sizeof(url_match_frame_t) * URL_MATCH_FRAME_MAX);
-    am_bool_t out;
-
-    if (stack) {
-        out = url_pattern_match_with_backtrack(r, stack, URL_MATCH_FRAME_MAX, pattern, url);
-        free(stack);
-
-    } else {
-        AM_LOG_ERROR(r->instance_id, "unable to allocate URL pattern matching stack");
-        out = AM_FALSE;
-
-    }
-    return out;
-
+    url_match_frame_t stack[URL_MATCH_FRAME_MAX];
+    return url_pattern_match_with_backtrack(r, stack, URL_MATCH_FRAME_MAX, pattern, url);
 }
 
 #define end_of_protocol(offsets) (offsets [0])
@@ -244,14 +233,28 @@ char *am_normalize_pattern(const char *url) {
     return NULL;
 }
 
+/*
+ * Copy a pattern/resource section, into the buffer provided when it fits.
+ */
+static char *copy_section(char *buffer, const char *base, size_t lo, size_t hi) {
+    size_t len = hi - lo;
+    char *section = len < URL_MATCH_SECTION_SIZE ? buffer : malloc(len + 1);
+    if (section != NULL) {
+        memcpy(section, base + lo, len);
+        section[len] = '\0';
+    }
+    return section;
+}
+
 /*
  * Match sections within the pattern and resource.
  */
 static char compare_pattern_sections(am_request_t *r,
                                      const char *pattern_base, size_t pattern_lo, size_t pattern_hi,
                                      const char *resource_base, size_t resource_lo, size_t resource_hi) {
-    char * pattern_section = strndup(pattern_base + pattern_lo, pattern_hi - pattern_lo);
-    char * resource_section = strndup(resource_base + resource_lo, resource_hi - resource_lo);
+    char pattern_buffer[URL_MATCH_SECTION_SIZE], resource_buffer[URL_MATCH_SECTION_SIZE];
+    char * pattern_section = copy_section(pattern_buffer, pattern_base, pattern_lo, pattern_hi);
+    char * resource_section = copy_section(resource_buffer, resource_base, resource_lo, resource_hi);
     
     char c;
     if (pattern_section && resource_section)
@@ -259,7 +262,8 @@ static char compare_pattern_sections(am_request_t *r,
     else
         c = AM_NO_MATCH;
     
-    AM_FREE(pattern_section, resource_section);
+    if (pattern_section != pattern_buffer) am_free(pattern_section);
+    if (resource_section != resource_buffer) am_free(resource_section);
     return c;
 }
 
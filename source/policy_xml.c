@@ -360,6 +360,191 @@ void *am_parse_policy_xml(unsigned long instance_id, const char *xml, size_t xml
     return (void *) r;
 }
 
+/*
+ * Incremental (streaming) 'PolicyResponse' parser.
+ *
+ * Response body chunks are fed as they arrive from the network. The outer parser handles the
+ * PLL envelope and passes the CDATA section (PolicyService document) through to the inner
+ * parser, so that the complete response never has to be buffered. Both parsers share the
+ * same policy parser context (element names in the envelope are not the ones policy handlers
+ * are interested in, so a response without CDATA is parsed by the outer parser directly).
+ */
+
+#define AM_POLICY_EXCEPTION_SIZE 4096
+
+struct am_policy_xml_stream {
+    XML_Parser outer;
+    XML_Parser inner;
+    am_xml_parser_ctx_t ctx;
+    int in_cdata;
+    int in_exception;
+    int error;
+    size_t size;
+    char exception[AM_POLICY_EXCEPTION_SIZE];
+    size_t exception_sz;
+};
+
+static void stream_exception_data(struct am_policy_xml_stream *s, const char *val, size_t len) {
+    if (s->exception_sz + len >= sizeof (s->exception)) {
+        len = sizeof (s->exception) - s->exception_sz - 1;
+    }
+    memcpy(s->exception + s->exception_sz, val, len);
+    s->exception_sz += len;
+    s->exception[s->exception_sz] = '\0';
+}
+
+static void stream_start_element(void *userData, const char *name, const char **atts) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    if (strcmp(name, "Exception") == 0) {
+        s->in_exception++;
+        /* keep the marker so that the collected text is understood by the exception parser */
+        stream_exception_data(s, "<Exception>", 11);
+    }
+    start_element(&s->ctx, name, atts);
+}
+
+static void stream_end_element(void *userData, const char *name) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    if (strcmp(name, "Exception") == 0 && s->in_exception > 0) {
+        s->in_exception--;
+    }
+    end_element(&s->ctx, name);
+}
+
+static void stream_inner_data(void *userData, const char *val, int len) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    if (s->in_exception && len > 0) {
+        stream_exception_data(s, val, len);
+    }
+    character_data(&s->ctx, val, len);
+}
+
+static void stream_outer_data(void *userData, const char *val, int len) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    if (!s->in_cdata) {
+        stream_inner_data(userData, val, len);
+        return;
+    }
+    if (s->error == 0 && XML_Parse(s->inner, val, len, XML_FALSE) == XML_STATUS_ERROR) {
+        s->error = XML_GetErrorCode(s->inner);
+        XML_StopParser(s->outer, XML_FALSE);
+    }
+}
+
+static void stream_start_cdata(void *userData) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    s->in_cdata = AM_TRUE;
+}
+
+static void stream_end_cdata(void *userData) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    s->in_cdata = AM_FALSE;
+    if (s->error == 0 && XML_Parse(s->inner, "", 0, XML_TRUE) == XML_STATUS_ERROR) {
+        s->error = XML_GetErrorCode(s->inner);
+        XML_StopParser(s->outer, XML_FALSE);
+    }
+}
+
+static void stream_entity_declaration(void *userData, const XML_Char *entityName,
+        int is_parameter_entity, const XML_Char *value, int value_length, const XML_Char *base,
+        const XML_Char *systemId, const XML_Char *publicId, const XML_Char *notationName) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) userData;
+    s->error = XML_ERROR_ENTITY_DECLARED_IN_PE;
+    XML_StopParser(s->outer, XML_FALSE);
+}
+
+void *am_parse_policy_xml_stream_create(unsigned long instance_id, int scope) {
+    struct am_policy_xml_stream *s = calloc(1, sizeof (struct am_policy_xml_stream));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->ctx.instance_id = instance_id;
+    s->ctx.scope = scope;
+    s->ctx.status = AM_SUCCESS;
+    s->outer = XML_ParserCreate("UTF-8");
+    s->inner = XML_ParserCreate("UTF-8");
+    if (s->outer == NULL || s->inner == NULL) {
+        if (s->outer != NULL) XML_ParserFree(s->outer);
+        if (s->inner != NULL) XML_ParserFree(s->inner);
+        free(s);
+        return NULL;
+    }
+    XML_SetUserData(s->outer, s);
+    XML_SetElementHandler(s->outer, stream_start_element, stream_end_element);
+    XML_SetCharacterDataHandler(s->outer, stream_outer_data);
+    XML_SetCdataSectionHandler(s->outer, stream_start_cdata, stream_end_cdata);
+    XML_SetEntityDeclHandler(s->outer, stream_entity_declaration);
+    XML_SetUserData(s->inner, s);
+    XML_SetElementHandler(s->inner, stream_start_element, stream_end_element);
+    XML_SetCharacterDataHandler(s->inner, stream_inner_data);
+    XML_SetEntityDeclHandler(s->inner, stream_entity_declaration);
+    return s;
+}
+
+/**
+ * Feed the next response body chunk into the streaming policy parser.
+ */
+int am_parse_policy_xml_stream(void *stream, const char *data, size_t data_sz) {
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) stream;
+    if (s == NULL) {
+        return AM_EINVAL;
+    }
+    if (s->error != 0 || data == NULL || data_sz == 0) {
+        return s->error != 0 ? AM_XML_ERROR : AM_SUCCESS;
+    }
+    s->size += data_sz;
+    if (XML_Parse(s->outer, data, (int) data_sz, XML_FALSE) == XML_STATUS_ERROR && s->error == 0) {
+        s->error = XML_GetErrorCode(s->outer);
+    }
+    return s->error != 0 ? AM_XML_ERROR : AM_SUCCESS;
+}
+
+/**
+ * Complete streaming policy response parsing and release the parser.
+ *
+ * @param stream parser created with am_parse_policy_xml_stream_create.
+ * @param exception in case response contains an Exception element, its text (with the
+ *        leading <Exception> marker) is returned here (caller must free it).
+ * @return policy result list or NULL (parser error or empty response).
+ */
+void *am_parse_policy_xml_stream_done(void *stream, char **exception) {
+    static const char *thisfunc = "am_parse_policy_xml_stream_done():";
+    struct am_policy_xml_stream *s = (struct am_policy_xml_stream *) stream;
+    struct am_policy_result *r = NULL;
+
+    if (exception != NULL) *exception = NULL;
+    if (s == NULL) {
+        return NULL;
+    }
+
+    if (s->error == 0 && s->size > 0 &&
+            XML_Parse(s->outer, "", 0, XML_TRUE) == XML_STATUS_ERROR) {
+        s->error = XML_GetErrorCode(s->outer);
+    }
+
+    if (s->error != 0 || s->size == 0) {
+        if (s->error != 0) {
+            AM_LOG_ERROR(s->ctx.instance_id, "%s xml parser error (%lu bytes) %s", thisfunc,
+                    (unsigned long) s->size, XML_ErrorString(s->error));
+        }
+        delete_am_policy_result_list(&s->ctx.list);
+    } else {
+        r = s->ctx.list;
+    }
+    if (s->ctx.status != AM_SUCCESS) {
+        AM_LOG_ERROR(s->ctx.instance_id, "%s %s", thisfunc, am_strerror(s->ctx.status));
+    }
+    if (exception != NULL && s->exception_sz > 0) {
+        *exception = strdup(s->exception);
+    }
+
+    AM_FREE(s->ctx.data, s->ctx.attribute_name);
+    XML_ParserFree(s->outer);
+    XML_ParserFree(s->inner);
+    free(s);
+    return (void *) r;
+}
+
 static void delete_am_action_decision_list(struct am_action_decision **list) {
     struct am_action_decision *t = list != NULL ? *list : NULL;
     if (t != NULL) {
@@ -153,11 +153,11 @@ static am_bool_t is_json_request(am_request_t *request) {
 #ifndef UNIT_TEST
 static
 #endif
-char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
-    char *pos, *tmp, *out = NULL;
+char *remove_pathinfo_from_url(am_arena_t *arena, struct url *url, const char *pathinfo) {
+    char *pos, *tmp, *decoded;
     int sep_count;
 
-    tmp = strdup(url->path);
+    tmp = am_arena_strdup(arena, url->path);
     if (tmp == NULL) {
         return NULL;
     }
@@ -169,27 +169,25 @@ char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
         pos = am_strrstr(tmp, pathinfo);
     }
     if (pos == NULL) {
-        free(tmp);
-
         /* was not able to find it - try url-decode url path value first */
-        tmp = url_decode(url->path);
-        if (tmp == NULL) {
+        decoded = url_decode(url->path);
+        if (decoded == NULL) {
             return NULL;
         }
 
-        pos = am_strrstr(tmp, pathinfo);
+        pos = am_strrstr(decoded, pathinfo);
         if (pos == NULL) {
             /* still not able to find it - now try url-decoding pathinfo value */
             char *pathinfo_decoded = url_decode(pathinfo);
             if (pathinfo_decoded == NULL) {
-                free(tmp);
+                free(decoded);
                 return NULL;
             }
 
-            pos = am_strrstr(tmp, pathinfo_decoded);
+            pos = am_strrstr(decoded, pathinfo_decoded);
             free(pathinfo_decoded);
             if (pos == NULL) {
-                free(tmp);
+                free(decoded);
                 /* nothing - path_info value is not found in url path */
                 return NULL;
             }
@@ -199,13 +197,10 @@ char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
          * find out where the pathinfo is within the original (unencoded) url path */
         *pos = '\0';
 
-        sep_count = char_count(tmp, '/', NULL);
-        free(tmp);
+        sep_count = char_count(decoded, '/', NULL);
+        free(decoded);
 
-        pos = tmp = strdup(url->path);
-        if (tmp == NULL) {
-            return NULL;
-        }
+        pos = tmp;
         while (*pos != '\0') {
             if (*pos == '/' && --sep_count < 0) {
                 break;
@@ -216,10 +211,8 @@ char *remove_pathinfo_from_url(struct url *url, const char *pathinfo) {
     /* path_info value is found - remove it from url path */
     *pos = '\0';
 
-    am_asprintf(&out, "%s://%s:%d%s%s", url->proto, url->host,
+    return am_arena_asprintf(arena, "%s://%s:%d%s%s", url->proto, url->host,
             url->port, tmp, url->query);
-    free(tmp);
-    return out;
 }
 
 static am_return_t setup_request_data(am_request_t *r) {
@@ -246,7 +239,8 @@ static am_return_t setup_request_data(am_request_t *r) {
 
     s = strstr(r->client_ip, AM_COMMA_CHAR);
     /* if the client ip header contains more than one value, use only the first one */
-    v = s != NULL ? strndup(r->client_ip, s - r->client_ip) : strdup(r->client_ip);
+    v = s != NULL ? am_arena_strndup(&r->arena, r->client_ip, s - r->client_ip) :
+            am_arena_strdup(&r->arena, r->client_ip);
     if (v == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
         r->status = AM_ENOMEM;
@@ -260,7 +254,8 @@ static am_return_t setup_request_data(am_request_t *r) {
     if (ISVALID(r->client_host)) {
         s = strstr(r->client_host, AM_COMMA_CHAR);
         /* if the client host header contains more than one value, use only the first one */
-        v = s != NULL ? strndup(r->client_host, s - r->client_host) : strdup(r->client_host);
+        v = s != NULL ? am_arena_strndup(&r->arena, r->client_host, s - r->client_host) :
+                am_arena_strdup(&r->arena, r->client_host);
         if (v != NULL) {
             s = strstr(v, ":");
             /* if client_host contains the port number, remove it */
@@ -283,8 +278,7 @@ static am_return_t setup_request_data(am_request_t *r) {
                 errcode = getnameinfo((struct sockaddr *) res->ai_addr, slen,
                         client_host, sizeof (client_host), NULL, 0, NI_NAMEREQD);
                 if (errcode == 0) {
-                    am_free(r->client_host);
-                    r->client_host = strdup(client_host);
+                    r->client_host = am_arena_strdup(&r->arena, client_host);
                     break;
                 }
                 res = res->ai_next;
@@ -320,7 +314,7 @@ static am_return_t setup_request_data(am_request_t *r) {
         AM_LOG_DEBUG(r->instance_id, "%s no token in query parameters", thisfunc);
     }
 
-    am_asprintf(&r->normalized_url, "%s://%s:%d%s%s", r->url.proto, r->url.host,
+    r->normalized_url = am_arena_asprintf(&r->arena, "%s://%s:%d%s%s", r->url.proto, r->url.host,
             r->url.port, r->url.path, r->url.query);
     if (r->normalized_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -329,7 +323,7 @@ static am_return_t setup_request_data(am_request_t *r) {
     }
 
     if (ISVALID(r->path_info) && (r->conf->path_info_ignore_not_enforced || r->conf->path_info_ignore)) {
-        r->normalized_url_pathinfo = remove_pathinfo_from_url(&r->url, r->path_info);
+        r->normalized_url_pathinfo = remove_pathinfo_from_url(&r->arena, &r->url, r->path_info);
         if (r->normalized_url_pathinfo == NULL) {
             AM_LOG_ERROR(r->instance_id, "%s path_info %s is not part of the normalized request url %s",
                     thisfunc, r->path_info, r->normalized_url);
@@ -357,7 +351,7 @@ static am_return_t setup_request_data(am_request_t *r) {
                 thisfunc, LOGEMPTY(r->conf->agenturi));
     }
 
-    am_asprintf(&r->overridden_url, "%s://%s:%d%s%s", request_url.proto, request_url.host,
+    r->overridden_url = am_arena_asprintf(&r->arena, "%s://%s:%d%s%s", request_url.proto, request_url.host,
             request_url.port, request_url.path, request_url.query);
     if (r->overridden_url == NULL) {
         AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -366,7 +360,7 @@ static am_return_t setup_request_data(am_request_t *r) {
     }
 
     if (ISVALID(r->path_info) && r->conf->path_info_ignore) {
-        r->overridden_url_pathinfo = remove_pathinfo_from_url(&request_url, r->path_info);
+        r->overridden_url_pathinfo = remove_pathinfo_from_url(&r->arena, &request_url, r->path_info);
         if (r->overridden_url_pathinfo == NULL) {
             AM_LOG_ERROR(r->instance_id, "%s path_info %s is not part of the overridden request url %s",
                         thisfunc, r->path_info, r->overridden_url);
@@ -417,12 +411,59 @@ static am_return_t validate_url(am_request_t *r) {
     return AM_OK;
 }
 
+/**
+ * Metrics are served to the configured client addresses (single address, range or CIDR),
+ * or, with none configured, to loopback clients only.
+ */
+static am_bool_t metrics_client_allowed(am_request_t *r) {
+    static const char *thisfunc = "metrics_client_allowed():";
+    int i;
+
+    if (ISINVALID(r->client_ip)) {
+        return AM_FALSE;
+    }
+    if (r->conf->metrics_ip_map_sz == 0) {
+        return strcmp(r->client_ip, "127.0.0.1") == 0 || strcmp(r->client_ip, "::1") == 0 ? AM_TRUE : AM_FALSE;
+    }
+    for (i = 0; i < r->conf->metrics_ip_map_sz; i++) {
+        const char *l[1] = {r->conf->metrics_ip_map[i].value};
+        if (ISINVALID(l[0])) continue;
+        if (strcmp(r->client_ip, l[0]) == 0 || ip_address_match(r->client_ip, l, 1, r->instance_id) == AM_SUCCESS) {
+            return AM_TRUE;
+        }
+    }
+    AM_LOG_WARNING(r->instance_id, "%s client ip address %s is not allowed to read agent metrics",
+            thisfunc, r->client_ip);
+    return AM_FALSE;
+}
+
 static am_return_t handle_notification(am_request_t *r) {
     static const char *thisfunc = "handle_notification():";
     am_return_t status = AM_FAIL;
 
     AM_LOG_DEBUG(r->instance_id, "%s", thisfunc);
 
+    /* agent metrics request */
+    if (r->method == AM_REQUEST_GET && ISVALID(r->conf->metrics_url)) {
+        int compare_status = r->conf->url_eval_case_ignore ?
+                strcasecmp(r->normalized_url, r->conf->metrics_url) : strcmp(r->normalized_url, r->conf->metrics_url);
+        if (compare_status == 0) {
+            char *text;
+            AM_LOG_DEBUG(r->instance_id, "%s %s is an agent metrics url", thisfunc, r->normalized_url);
+            if (!metrics_client_allowed(r)) {
+                r->status = AM_FORBIDDEN;
+                return AM_FAIL;
+            }
+            text = am_metrics_text(r->instance_id);
+            if (r->am_set_custom_response_f != NULL) {
+                r->am_set_custom_response_f(r, ISVALID(text) ? text : "\n", "text/plain; version=0.0.4");
+            }
+            am_free(text);
+            r->status = AM_NOTIFICATION_DONE;
+            return AM_OK;
+        }
+    }
+
     /* check if notifications are enabled */
     if (r->method == AM_REQUEST_POST && ISVALID(r->conf->notif_url)) {
         struct notification_worker_data *wd;
@@ -442,23 +483,31 @@ static am_return_t handle_notification(am_request_t *r) {
         wd = malloc(sizeof (struct notification_worker_data));
 
         AM_LOG_DEBUG(r->instance_id, "%s %s is an agent notification url", thisfunc, url);
+        am_metrics_incr(AM_METRIC_NOTIFICATION);
 
-        /* read post data (blocking) */
+        /* read post data (blocking), notification message is small enough to be kept in memory */
+        r->post_data_in_memory = AM_TRUE;
         if (r->am_get_post_data_f != NULL) {
             r->am_get_post_data_f(r);
         }
         /* set up notification_worker argument list */
         if (wd != NULL) {
             wd->instance_id = r->instance_id;
-            /* notification worker uses data stored in a file */
-            wd->post_data = r->post_data_fn != NULL ? strdup(r->post_data_fn) : NULL;
+            if (ISVALID(r->post_data_fn)) {
+                /* web container stored the message in a file anyway */
+                wd->post_data = NULL;
+                wd->post_data_fn = strdup(r->post_data_fn);
+            } else {
+                /* hand the message buffer over to the worker */
+                wd->post_data = r->post_data;
+                wd->post_data_fn = NULL;
+                r->post_data = NULL;
+            }
             wd->post_data_sz = r->post_data_sz;
         }
         status = AM_OK;
-        /* process notification message */
-        if (am_worker_dispatch(notification_worker, wd) != 0) {
-            am_free(wd->post_data);
-            free(wd);
+        /* queue notification message for processing */
+        if (wd == NULL || am_notification_dispatch(wd) != AM_SUCCESS) {
             r->status = AM_ERROR;
             AM_LOG_WARNING(r->instance_id, "%s failed to dispatch notification worker", thisfunc);
             return status;
@@ -547,14 +596,14 @@ static am_return_t handle_not_enforced(am_request_t *r) {
     static const char *thisfunc = "handle_not_enforced():";
     int i;
     const char *url = r->overridden_url;
-    char *pdp_path = NULL;
+    char *pdp_path;
 
     AM_LOG_DEBUG(r->instance_id, "%s", thisfunc);
 
     /* post preservation url is not enforced 
      * (will use com.forgerock.agents.config.pdpuri.prefix value if set) 
      */
-    am_asprintf(&pdp_path, "%s%s%s",
+    pdp_path = am_arena_asprintf(&r->arena, "%s%s%s",
             ISVALID(r->conf->pdp_uri_prefix) && r->conf->pdp_uri_prefix[0] != '/' ? "/" : "",
             NOTNULL(r->conf->pdp_uri_prefix), POST_PRESERVE_URI);
     if (ISVALID(pdp_path) && ISVALID(r->url.query) && strcmp(r->url.path, pdp_path) == 0) {
@@ -580,10 +629,8 @@ static am_return_t handle_not_enforced(am_request_t *r) {
         AM_LOG_DEBUG(r->instance_id, "%s post preserve url is not enforced", thisfunc);
         r->is_dummypost_url = r->not_enforced = AM_TRUE;
         r->status = AM_SUCCESS;
-        free(pdp_path);
         return AM_QUIT;
     }
-    am_free(pdp_path);
 
     /* check if the request url (normalized) is an application logout url */
     if (ISVALID(r->conf->logout_url_regex) && /* check legacy com.forgerock.agents.agent.logout.url.regex option first */
@@ -660,8 +707,8 @@ static am_return_t handle_not_enforced(am_request_t *r) {
         }
         else {
             /* absolute URL - use parseurl to normalise and then do a full compare*/
-            char* normalised_access_denied_url = NULL;
-            struct url* parsed_url = malloc(sizeof(struct url));
+            char* normalised_access_denied_url;
+            struct url* parsed_url = am_arena_alloc(&r->arena, sizeof(struct url));
             AM_LOG_DEBUG(r->instance_id, "%s attempting match with absolute access denied url %s", thisfunc, r->conf->access_denied_url);
             if (NULL == parsed_url) {
                 AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -672,15 +719,12 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             if (parse_url(r->conf->access_denied_url, parsed_url)) {
                 AM_LOG_ERROR(r->instance_id, "%s failed to normalize access denied url: %s (%s)",
                         thisfunc, r->conf->access_denied_url, am_strerror(parsed_url->error));
-                AM_FREE(parsed_url);
                 return AM_FAIL;
             }
 
-            /* create the normalised url and free the parsing structure */
-            am_asprintf(&normalised_access_denied_url, "%s://%s:%d%s%s", parsed_url->proto, parsed_url->host,
-            parsed_url->port, parsed_url->path, parsed_url->query);
-            AM_FREE(parsed_url);
-            parsed_url = NULL;
+            /* create the normalised url */
+            normalised_access_denied_url = am_arena_asprintf(&r->arena, "%s://%s:%d%s%s", parsed_url->proto,
+                    parsed_url->host, parsed_url->port, parsed_url->path, parsed_url->query);
 
             if (normalised_access_denied_url == NULL) {
                 AM_LOG_ERROR(r->instance_id, "%s memory allocation failure", thisfunc);
@@ -694,7 +738,6 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             int compare_status = r->conf->url_eval_case_ignore ?
                         strncasecmp(url, normalised_access_denied_url, strlen(normalised_access_denied_url)) :
                         strncmp(url, normalised_access_denied_url, strlen(normalised_access_denied_url));
-            AM_FREE(normalised_access_denied_url);
             
             if (compare_status == 0) {
                 AM_LOG_DEBUG(r->instance_id, "%s have found a match, setting not enforced on this URL", thisfunc);
@@ -729,10 +772,9 @@ static am_return_t handle_not_enforced(am_request_t *r) {
                 AM_LOG_DEBUG(r->instance_id, "%s client ip address %s does not match %s",
                         thisfunc, r->client_ip, LOGEMPTY(m->value));
             } else {
-                char *pv = strndup(m->name, p - m->name);
+                char *pv = am_arena_strndup(&r->arena, m->name, p - m->name);
                 if (pv != NULL) {
                     int mtn = am_method_str_to_num(pv);
-                    free(pv);
                     if (r->method == mtn) {
                         const char *l[1] = {m->value};
                         if (ip_address_match(r->client_ip, l, 1, r->instance_id) == AM_SUCCESS) {
@@ -775,7 +817,7 @@ static am_return_t handle_not_enforced(am_request_t *r) {
                                     thisfunc, r->normalized_url_pathinfo);
                             compare_status += url_matches_pattern(r, m->value, r->normalized_url_pathinfo, AM_FALSE);
                         } else {
-                            char *url_query_removed = strdup(url);
+                            char *url_query_removed = am_arena_strdup(&r->arena, url);
                             if (url_query_removed != NULL) {
                                 char *qmark = strchr(url_query_removed, '?');
                                 if (qmark != NULL) {
@@ -784,7 +826,6 @@ static am_return_t handle_not_enforced(am_request_t *r) {
                                 AM_LOG_DEBUG(r->instance_id, "%s validating %s ignoring query attributes",
                                         thisfunc, url_query_removed);
                                 compare_status += url_matches_pattern(r, m->value, url_query_removed, AM_FALSE);
-                                free(url_query_removed);
                             }
                         }
                     } else {
@@ -795,10 +836,9 @@ static am_return_t handle_not_enforced(am_request_t *r) {
 
                     /* method-extended [GET,0]=not-enforced-url option */
 
-                    char *pv = strndup(m->name, p - m->name);
+                    char *pv = am_arena_strndup(&r->arena, m->name, p - m->name);
                     if (pv != NULL) {
                         int mtn = am_method_str_to_num(pv);
-                        free(pv);
                         if (r->method != mtn) continue;
                         compare_status += url_matches_pattern(r, m->value, url, r->conf->not_enforced_regex_enable);
                     }
@@ -837,10 +877,9 @@ static am_return_t handle_not_enforced(am_request_t *r) {
             if (!ISVALID(m->value)) continue;
             p = strstr(m->value, AM_PIPE_CHAR); /* 10.1.1.0/24 10.1.2.1-10.1.2.7|url1 url2 */
             if (p == NULL) continue;
-            is = strndup(m->value, p - m->value);
-            us = strdup(p + 1);
+            is = am_arena_strndup(&r->arena, m->value, p - m->value);
+            us = am_arena_strdup(&r->arena, p + 1);
             if (is == NULL || us == NULL) {
-                AM_FREE(is, us);
                 continue;
             }
             for ((v = strtok_r(is, AM_SPACE_CHAR, &t)); v; (v = strtok_r(NULL, AM_SPACE_CHAR, &t))) {
@@ -859,7 +898,6 @@ static am_return_t handle_not_enforced(am_request_t *r) {
                     }
                 }
             }
-            AM_FREE(is, us);
             if (found) {
                 AM_LOG_DEBUG(r->instance_id, "%s %s is not enforced", thisfunc, url);
                 r->not_enforced = AM_TRUE;
@@ -1113,6 +1151,463 @@ static const char *get_attr_value(am_request_t *r, const char *name, int mask, c
     return NULL;
 }
 
+#define POLICY_HEDGE_PERCENTILE 95
+#define POLICY_HEDGE_MIN_DELAY 50 /* msec */
+#define POLICY_HEDGE_DEFAULT_DELAY 500 /* msec, used until there is latency data available */
+
+#define POLICY_CALL_QUEUED 1 /* waiting for a worker */
+#define POLICY_CALL_RUNNING 2
+#define POLICY_CALL_CANCELLED 3 /* not picked up by a worker in time - worker drops it */
+
+struct policy_call {
+    unsigned long instance_id;
+    int url_index;
+    int status;
+    int state;
+    char done;
+    char *service_url;
+    char *agent_token;
+    char *user_token;
+    char *url;
+    char *scope;
+    char *client_ip;
+    char *pattrs;
+    char *app;
+    am_net_options_t net_options;
+    struct am_namevalue *session;
+    struct am_policy_result *policy;
+    struct policy_hedge *hedge;
+};
+
+struct policy_hedge {
+    am_mutex_t lock;
+    am_event_t *done;
+    int ref;
+    int pending;
+    struct policy_call call[2];
+};
+
+/**
+ * Timed session/policy request, outcome of which is fed to the naming url circuit breaker.
+ */
+static int policy_request(am_request_t *r, const char *service_url, int url_index, const char *url,
+        int scope, const char *pattrs, am_net_options_t *net_options,
+        struct am_namevalue **session, struct am_policy_result **policy) {
+    int status;
+    am_timer_t tmr;
+    am_url_breaker_claim(r->instance_id, url_index);
+    am_timer_start(&tmr);
+    status = am_agent_policy_request(r->instance_id, service_url, r->conf->token, r->token,
+            url, am_scope_to_str(scope), r->client_ip, pattrs, r->conf->policy_eval_app,
+            net_options, session, policy);
+    am_timer_stop(&tmr);
+    am_url_breaker_report(r->instance_id, url_index, status, am_timer_elapsed(&tmr));
+    return status;
+}
+
+static void policy_hedge_release(struct policy_hedge *h) {
+    int i, ref;
+    AM_MUTEX_LOCK(&h->lock);
+    ref = --h->ref;
+    AM_MUTEX_UNLOCK(&h->lock);
+    if (ref > 0) {
+        return;
+    }
+    for (i = 0; i < 2; i++) {
+        struct policy_call *c = &h->call[i];
+        AM_FREE(c->service_url, c->agent_token, c->user_token, c->url, c->scope, c->client_ip,
+                c->pattrs, c->app);
+        am_net_options_delete(&c->net_options);
+        delete_am_namevalue_list(&c->session);
+        delete_am_policy_result_list(&c->policy);
+    }
+    close_event(&h->done);
+    AM_MUTEX_DESTROY(&h->lock);
+    free(h);
+}
+
+static void policy_call_worker(void *arg) {
+    struct policy_call *c = (struct policy_call *) arg;
+    struct policy_hedge *h = c->hedge;
+    struct am_namevalue *session = NULL;
+    struct am_policy_result *policy = NULL;
+    int status;
+    am_timer_t tmr;
+
+    AM_MUTEX_LOCK(&h->lock);
+    if (c->state == POLICY_CALL_CANCELLED) {
+        AM_MUTEX_UNLOCK(&h->lock);
+        policy_hedge_release(h);
+        return;
+    }
+    c->state = POLICY_CALL_RUNNING;
+    AM_MUTEX_UNLOCK(&h->lock);
+
+    am_url_breaker_claim(c->instance_id, c->url_index);
+    am_timer_start(&tmr);
+    status = am_agent_policy_request(c->instance_id, c->service_url, c->agent_token, c->user_token,
+            c->url, c->scope, c->client_ip, c->pattrs, c->app, &c->net_options, &session, &policy);
+    am_timer_stop(&tmr);
+    am_url_breaker_report(c->instance_id, c->url_index, status, am_timer_elapsed(&tmr));
+
+    AM_MUTEX_LOCK(&h->lock);
+    c->status = status;
+    c->session = session;
+    c->policy = policy;
+    c->done = AM_TRUE;
+    h->pending--;
+    AM_MUTEX_UNLOCK(&h->lock);
+
+    set_event(h->done);
+    policy_hedge_release(h);
+}
+
+static int policy_call_dispatch(am_request_t *r, struct policy_hedge *h, int i, const char *service_url,
+        int url_index, const char *url, int scope, const char *pattrs, const char *server_id) {
+    struct policy_call *c = &h->call[i];
+    c->instance_id = r->instance_id;
+    c->url_index = url_index;
+    c->status = AM_ERROR;
+    c->hedge = h;
+    c->service_url = strdup(service_url);
+    c->agent_token = ISVALID(r->conf->token) ? strdup(r->conf->token) : NULL;
+    c->user_token = ISVALID(r->token) ? strdup(r->token) : NULL;
+    c->url = strdup(url);
+    c->scope = strdup(am_scope_to_str(scope));
+    c->client_ip = ISVALID(r->client_ip) ? strdup(r->client_ip) : NULL;
+    c->pattrs = ISVALID(pattrs) ? strdup(pattrs) : NULL;
+    c->app = ISVALID(r->conf->policy_eval_app) ? strdup(r->conf->policy_eval_app) : NULL;
+    am_net_options_create(r->conf, &c->net_options, NULL);
+    c->net_options.server_id = ISVALID(server_id) ? strdup(server_id) : NULL;
+    if (c->service_url == NULL || c->url == NULL || c->scope == NULL) {
+        return AM_ENOMEM;
+    }
+
+    AM_MUTEX_LOCK(&h->lock);
+    h->ref++;
+    h->pending++;
+    c->state = POLICY_CALL_QUEUED;
+    AM_MUTEX_UNLOCK(&h->lock);
+    if (am_worker_dispatch_lane(AM_WORKER_LANE_HIGH, 0, policy_call_worker, c) != AM_SUCCESS) {
+        AM_MUTEX_LOCK(&h->lock);
+        h->ref--;
+        h->pending--;
+        c->state = 0;
+        AM_MUTEX_UNLOCK(&h->lock);
+        return AM_ERROR;
+    }
+    return AM_SUCCESS;
+}
+
+/**
+ * Cancel a call which is still waiting for a worker. Must be called with hedge lock held.
+ */
+static am_bool_t policy_call_cancel(struct policy_hedge *h, int i) {
+    if (h->call[i].state != POLICY_CALL_QUEUED) {
+        return AM_FALSE;
+    }
+    h->call[i].state = POLICY_CALL_CANCELLED;
+    h->pending--;
+    return AM_TRUE;
+}
+
+/**
+ * Session/policy request with an optional hedge: when the call to the active naming url
+ * does not complete within its p95 latency, a second call is sent to the next available
+ * naming url and the first successful response is used. The slower call is left to complete
+ * in a worker thread and its result is discarded.
+ *
+ * Both calls are made in the worker pool (high priority lane), the request thread only waits for
+ * their outcome. Waiting in the lane is bounded separately from the network timeouts: a primary call
+ * which no worker has picked up within the hedge delay (pool is saturated) is made on the request
+ * thread instead, with no hedge; a hedge still waiting in the lane when the primary call fails is dropped.
+ */
+static int hedged_policy_request(am_request_t *r, const char *service_url, int url_index, const char *url,
+        int scope, const char *pattrs, am_net_options_t *net_options,
+        struct am_namevalue **session, struct am_policy_result **policy) {
+    static const char *thisfunc = "hedged_policy_request():";
+    struct policy_hedge *h;
+    struct policy_call *winner = NULL;
+    const char *hedge_url;
+    int i, hedge_index = -1, status = AM_ERROR, wait_limit;
+    unsigned int delay;
+    am_bool_t queued;
+
+    if (!r->conf->policy_hedge_enable || r->conf->naming_url_sz < 2 ||
+            (hedge_url = get_healthy_openam_url(r, url_index, &hedge_index)) == NULL ||
+            (h = (struct policy_hedge *) calloc(1, sizeof (struct policy_hedge))) == NULL) {
+        return policy_request(r, service_url, url_index, url, scope, pattrs, net_options, session, policy);
+    }
+
+    AM_MUTEX_INIT(&h->lock);
+    h->ref = 1;
+    h->done = create_event();
+    if (h->done == NULL ||
+            policy_call_dispatch(r, h, 0, service_url, url_index, url, scope, pattrs,
+            net_options->server_id) != AM_SUCCESS) {
+        policy_hedge_release(h);
+        return policy_request(r, service_url, url_index, url, scope, pattrs, net_options, session, policy);
+    }
+
+    delay = am_url_breaker_latency(r->instance_id, url_index, POLICY_HEDGE_PERCENTILE);
+    delay = delay == 0 ? POLICY_HEDGE_DEFAULT_DELAY :
+            (delay < POLICY_HEDGE_MIN_DELAY ? POLICY_HEDGE_MIN_DELAY : delay);
+
+    if (wait_for_event(h->done, delay) == AM_ETIMEDOUT) {
+        AM_MUTEX_LOCK(&h->lock);
+        queued = policy_call_cancel(h, 0);
+        AM_MUTEX_UNLOCK(&h->lock);
+        if (queued) {
+            AM_LOG_DEBUG(r->instance_id, "%s request to %s has not been picked up by a worker in %u msec, "
+                    "sending it from the request thread", thisfunc, service_url, delay);
+            policy_hedge_release(h);
+            return policy_request(r, service_url, url_index, url, scope, pattrs, net_options, session, policy);
+        }
+        AM_LOG_DEBUG(r->instance_id, "%s no response from %s in %u msec, sending hedged request to %s",
+                thisfunc, service_url, delay, hedge_url);
+        policy_call_dispatch(r, h, 1, hedge_url, hedge_index, url, scope, pattrs, NULL);
+    }
+
+    /* network calls are bounded by connect/read timeouts - wait a reasonable while longer */
+    wait_limit = (r->conf->net_timeout > 0 ? r->conf->net_timeout : AM_NET_CONNECT_TIMEOUT) * 4;
+    for (;;) {
+        AM_MUTEX_LOCK(&h->lock);
+        for (i = 0; i < 2 && winner == NULL; i++) {
+            if (h->call[i].done && h->call[i].status == AM_SUCCESS) {
+                winner = &h->call[i];
+            }
+        }
+        if (winner == NULL && h->call[0].done) {
+            /* primary call failed - do not wait for a hedge which no worker has picked up yet */
+            policy_call_cancel(h, 1);
+        }
+        if (winner == NULL && h->pending == 0) {
+            /* both calls failed (or only one was sent) - report the primary call status */
+            winner = &h->call[0];
+        }
+        if (winner != NULL) {
+            status = winner->status;
+            *session = winner->session;
+            *policy = winner->policy;
+            winner->session = NULL;
+            winner->policy = NULL;
+            AM_MUTEX_UNLOCK(&h->lock);
+            break;
+        }
+        AM_MUTEX_UNLOCK(&h->lock);
+        if (wait_limit-- <= 0) {
+            status = AM_ETIMEDOUT;
+            break;
+        }
+        wait_for_event(h->done, 1000);
+    }
+
+    if (winner != NULL && winner != &h->call[0]) {
+        AM_LOG_DEBUG(r->instance_id, "%s hedged request to %s completed first (%s)",
+                thisfunc, hedge_url, am_strerror(status));
+    }
+    policy_hedge_release(h);
+    return status;
+}
+
+#define POLICY_PREFETCH_SLOTS 256
+#define POLICY_PREFETCH_INTERVAL 60 /* sec, between prefetch calls for the same user and resource tree */
+
+struct policy_prefetch {
+    unsigned long instance_id;
+    int url_index;
+    int token_cache_valid;
+    char *service_url;
+    char *agent_token;
+    char *user_token;
+    char *url;
+    char *client_ip;
+    char *pattrs;
+    char *app;
+    am_net_options_t net_options;
+};
+
+#if defined(_WIN32)
+#define PREFETCH_CAS_64(p, o, n)    (InterlockedCompareExchange64((volatile LONG64 *) (p), n, o) == (LONG64) (o))
+#elif defined(__sun)
+#include <sys/atomic.h>
+#define PREFETCH_CAS_64(p, o, n)    (atomic_cas_64(p, o, n) == (o))
+#else
+#define PREFETCH_CAS_64(p, o, n)    __sync_bool_compare_and_swap(p, o, n)
+#endif
+
+#define PREFETCH_SLOT(h, t)         (((uint64_t) (h) << 32) | (uint32_t) (t))
+
+/* recently prefetched user token/resource tree hashes (per process); a slot holds
+ * the hash (high word) and the time it was claimed (low word) and is updated with CAS */
+static volatile uint64_t prefetch_slot[POLICY_PREFETCH_SLOTS];
+
+/**
+ * Claim the prefetch of user token/resource tree 'hash'. Returns AM_FALSE when the
+ * same prefetch was claimed within the last POLICY_PREFETCH_INTERVAL seconds.
+ */
+am_bool_t am_policy_prefetch_claim(uint32_t hash, time_t now) {
+    volatile uint64_t *slot = &prefetch_slot[hash % POLICY_PREFETCH_SLOTS];
+    uint64_t value = PREFETCH_SLOT(hash, now);
+
+    for (;;) {
+        uint64_t old = *slot;
+        if ((uint32_t) (old >> 32) == hash && old != 0 &&
+                (uint32_t) now - (uint32_t) old < POLICY_PREFETCH_INTERVAL) {
+            return AM_FALSE;
+        }
+        if (PREFETCH_CAS_64(slot, old, value)) {
+            return AM_TRUE;
+        }
+    }
+}
+
+/* release a claim when the prefetch could not be scheduled (unless the slot was claimed again since) */
+static void policy_prefetch_release(uint32_t hash, time_t now) {
+    volatile uint64_t *slot = &prefetch_slot[hash % POLICY_PREFETCH_SLOTS];
+    PREFETCH_CAS_64(slot, PREFETCH_SLOT(hash, now), 0);
+}
+
+static void policy_prefetch_worker(void *arg) {
+    static const char *thisfunc = "policy_prefetch_worker():";
+    struct policy_prefetch *pf = (struct policy_prefetch *) arg;
+    struct am_namevalue *session = NULL;
+    struct am_policy_result *policy = NULL;
+    int status;
+    am_timer_t tmr;
+
+    am_url_breaker_claim(pf->instance_id, pf->url_index);
+    am_timer_start(&tmr);
+    status = am_agent_policy_request(pf->instance_id, pf->service_url, pf->agent_token, pf->user_token,
+            pf->url, am_scope_to_str(AM_SCOPE_SUBTREE), pf->client_ip, pf->pattrs, pf->app,
+            &pf->net_options, &session, &policy);
+    am_timer_stop(&tmr);
+    am_url_breaker_report(pf->instance_id, pf->url_index, status, am_timer_elapsed(&tmr));
+
+    if (status == AM_SUCCESS && session != NULL && policy != NULL) {
+        /* cache entry ttl is the only configuration value used while adding an entry */
+        am_config_t conf;
+        am_request_t r;
+        memset(&conf, 0, sizeof (am_config_t));
+        memset(&r, 0, sizeof (am_request_t));
+        conf.instance_id = pf->instance_id;
+        conf.token_cache_valid = pf->token_cache_valid;
+        r.instance_id = pf->instance_id;
+        r.conf = &conf;
+        status = am_add_session_policy_cache_entry(&r, pf->user_token, policy, session);
+    }
+
+    AM_LOG_DEBUG(pf->instance_id, "%s subtree %s: %s (%.3f sec)", thisfunc, pf->url,
+            am_strerror(status), am_timer_elapsed(&tmr));
+
+    delete_am_policy_result_list(&policy);
+    delete_am_namevalue_list(&session);
+    AM_FREE(pf->service_url, pf->agent_token, pf->user_token, pf->url, pf->client_ip, pf->pattrs, pf->app);
+    am_net_options_delete(&pf->net_options);
+    free(pf);
+}
+
+/**
+ * Resource tree to prefetch policy decisions for: the longest configured prefix the
+ * request url starts with, or the parent path of the request url.
+ */
+char *am_policy_prefetch_url(am_config_t *conf, const char *url) {
+    int i;
+    size_t len = 0;
+    const char *prefix = NULL, *path, *end;
+
+    for (i = 0; i < conf->policy_prefetch_map_sz; i++) {
+        const char *value = conf->policy_prefetch_map[i].value;
+        size_t value_sz = ISVALID(value) ? strlen(value) : 0;
+        if (value_sz > len && strncasecmp(url, value, value_sz) == 0) {
+            prefix = value;
+            len = value_sz;
+        }
+    }
+    if (prefix != NULL) {
+        return strndup(prefix, len);
+    }
+
+    /* parent path, without query; there is no prefetch for top level resources */
+    path = strstr(url, "://");
+    if (path == NULL || (path = strchr(path + 3, '/')) == NULL) {
+        return NULL;
+    }
+    end = path + strcspn(path, "?#");
+    if (end - path > 1 && *(end - 1) == '/') {
+        end--;
+    }
+    while (end > path && *(end - 1) != '/') {
+        end--;
+    }
+    if (end - path <= 1) {
+        return NULL;
+    }
+    return strndup(url, end - url);
+}
+
+/**
+ * Fetch (in a worker thread) subtree policy decisions for the resource tree the user
+ * is browsing, merging them into the session/policy cache entry so that navigation to
+ * resources nearby is served from the cache.
+ */
+static void policy_prefetch(am_request_t *r, const char *service_url, int url_index, const char *url,
+        const char *pattrs) {
+    static const char *thisfunc = "policy_prefetch():";
+    struct policy_prefetch *pf;
+    char *prefetch_url;
+    uint32_t hash;
+    time_t now = time(NULL);
+
+    if (!r->conf->policy_prefetch_enable || !r->conf->policy_scope_subtree ||
+            r->conf->sso_only || !ISVALID(r->token) || !ISVALID(service_url)) {
+        return;
+    }
+
+    prefetch_url = am_policy_prefetch_url(r->conf, url);
+    if (prefetch_url == NULL) {
+        return;
+    }
+
+    hash = am_hash(r->token) ^ am_hash(prefetch_url);
+    if (!am_policy_prefetch_claim(hash, now)) {
+        free(prefetch_url);
+        return;
+    }
+
+    pf = calloc(1, sizeof (struct policy_prefetch));
+    if (pf == NULL) {
+        policy_prefetch_release(hash, now);
+        free(prefetch_url);
+        return;
+    }
+    pf->instance_id = r->instance_id;
+    pf->url_index = url_index;
+    pf->token_cache_valid = r->conf->token_cache_valid;
+    pf->url = prefetch_url;
+    pf->service_url = strdup(service_url);
+    pf->agent_token = ISVALID(r->conf->token) ? strdup(r->conf->token) : NULL;
+    pf->user_token = strdup(r->token);
+    pf->client_ip = ISVALID(r->client_ip) ? strdup(r->client_ip) : NULL;
+    pf->pattrs = ISVALID(pattrs) ? strdup(pattrs) : NULL;
+    pf->app = ISVALID(r->conf->policy_eval_app) ? strdup(r->conf->policy_eval_app) : NULL;
+    am_net_options_create(r->conf, &pf->net_options, NULL);
+    pf->net_options.server_id = r->conf->lb_enable && ISVALID(r->session_info.si) ? strdup(r->session_info.si) : NULL;
+
+    /* pf (and prefetch_url) belongs to the worker once dispatched - log before */
+    AM_LOG_DEBUG(r->instance_id, "%s scheduling prefetch of %s", thisfunc, prefetch_url);
+
+    /* best-effort: prefetch is dropped when the low priority lane is full (or the same prefetch is still waiting there) */
+    if (pf->service_url == NULL || pf->user_token == NULL ||
+            am_worker_dispatch_lane(AM_WORKER_LANE_LOW, hash, policy_prefetch_worker, pf) != AM_SUCCESS) {
+        AM_LOG_DEBUG(r->instance_id, "%s failed to schedule prefetch of %s", thisfunc, prefetch_url);
+        policy_prefetch_release(hash, now);
+        AM_FREE(pf->service_url, pf->agent_token, pf->user_token, pf->url, pf->client_ip, pf->pattrs, pf->app);
+        am_net_options_delete(&pf->net_options);
+        free(pf);
+    }
+}
+
 #define MAX_VALIDATE_POLICY_RETRY 3
 
 static am_return_t validate_policy(am_request_t *r) {
@@ -1187,7 +1682,8 @@ static am_return_t validate_policy(am_request_t *r) {
         struct am_policy_result *policy_cache_new = NULL;
         struct am_namevalue *session_cache_new = NULL;
         am_net_options_t net_options;
-        const char *service_url = get_valid_openam_url(r);
+        int url_index = -1;
+        const char *next_url, *service_url = get_healthy_openam_url(r, -1, &url_index);
         int max_retry = 3;
         unsigned int retry = 3, retry_wait = 2;
 
@@ -1203,8 +1699,7 @@ static am_return_t validate_policy(am_request_t *r) {
             policy_cache_new = NULL;
             session_cache_new = NULL;
 
-            status = am_agent_policy_request(r->instance_id, service_url, r->conf->token, r->token,
-                    url, am_scope_to_str(scope), r->client_ip, pattrs, r->conf->policy_eval_app,
+            status = hedged_policy_request(r, service_url, url_index, url, scope, pattrs,
                     &net_options, &session_cache_new, &policy_cache_new);
             if (status == AM_SUCCESS && session_cache_new != NULL && policy_cache_new != NULL) {
                 remote = AM_TRUE;
@@ -1241,7 +1736,14 @@ static am_return_t validate_policy(am_request_t *r) {
                 break;
             }
 
-            sleep(retry_wait);
+            /* fail over to the next available naming url right away, wait only if there is none */
+            next_url = get_healthy_openam_url(r, url_index, &url_index);
+            if (next_url != NULL) {
+                service_url = next_url;
+            } else {
+                service_url = get_healthy_openam_url(r, -1, &url_index);
+                sleep(retry_wait);
+            }
         } while (--max_retry > 0);
 
         am_net_options_delete(&net_options);
@@ -1253,7 +1755,6 @@ static am_return_t validate_policy(am_request_t *r) {
             status = AM_RETRY_ERROR;
         }
 
-        am_free(pattrs);
         if (status == AM_SUCCESS) {
 
             /* discard old entries */
@@ -1262,11 +1763,15 @@ static am_return_t validate_policy(am_request_t *r) {
 
             status = am_add_session_policy_cache_entry(r, r->token,
                     policy_cache_new, session_cache_new);
+            if (status == AM_SUCCESS) {
+                policy_prefetch(r, service_url, url_index, url, pattrs);
+            }
 
             policy_cache = policy_cache_new;
             session_cache = session_cache_new;
             is_valid = AM_TRUE;
         }
+        am_free(pattrs);
 
         if (status != AM_SUCCESS && cache_ts > 0) {
             /* re-use earlier cached session/policy data */
@@ -1383,7 +1888,7 @@ static am_return_t validate_policy(am_request_t *r) {
                         break;
                     }
 
-                    rv = am_check_policy_cache_epoch(e->created);
+                    rv = am_check_policy_cache_resource(e->resource, e->created);
                     AM_LOG_DEBUG(r->instance_id, "%s global policy cache status: %s", thisfunc,
                             am_strerror(rv));
                     if (rv == AM_SUCCESS) {
@@ -2041,6 +2546,42 @@ static char *find_active_login_server(am_request_t *r, char add_goto_value) {
     return login_url;
 }
 
+/*
+ * move in-memory post data into a new post data preservation file
+ */
+static am_status_t store_post_data_file(am_request_t *r) {
+    static const char *thisfunc = "store_post_data_file():";
+    char key[37];
+    char *file_name = NULL;
+
+    if (!ISVALID(r->conf->pdp_dir) || !file_exists(r->conf->pdp_dir)) {
+        AM_LOG_ERROR(r->instance_id,
+                "%s post data preservation module has no access to %s directory",
+                thisfunc, LOGEMPTY(r->conf->pdp_dir));
+        return AM_ERROR;
+    }
+
+    uuid(key, sizeof (key));
+    am_asprintf(&file_name, "%s/%s", r->conf->pdp_dir, key);
+    if (file_name == NULL) {
+        return AM_ENOMEM;
+    }
+
+    if (write_file(file_name, r->post_data, r->post_data_sz) != (ssize_t) r->post_data_sz) {
+        AM_LOG_ERROR(r->instance_id, "%s unable to write post data preservation file %s",
+                thisfunc, file_name);
+        am_delete_file(file_name);
+        free(file_name);
+        return AM_FILE_ERROR;
+    }
+
+    am_free(r->post_data);
+    r->post_data = NULL;
+    am_free(r->post_data_fn);
+    r->post_data_fn = file_name;
+    return AM_SUCCESS;
+}
+
 static am_return_t handle_exit(am_request_t *r) {
     static const char *thisfunc = "handle_exit():";
     int valid_idx, i;
@@ -2123,7 +2664,7 @@ static am_return_t handle_exit(am_request_t *r) {
                                     wd->options->server_id = r->conf->lb_enable && ISVALID(r->session_info.si) ? strdup(r->session_info.si) : NULL;
                                 }
 
-                                if (am_worker_dispatch(session_logout_worker, wd) != 0) {
+                                if (am_worker_dispatch_lane(AM_WORKER_LANE_HIGH, 0, session_logout_worker, wd) != AM_SUCCESS) {
                                     am_net_options_delete(wd->options);
                                     AM_FREE(wd->token, wd->openam, wd->options, wd);
                                     r->status = AM_ERROR;
@@ -2235,7 +2776,8 @@ static am_return_t handle_exit(am_request_t *r) {
                 /* post (pdp) data reply */
 
                 am_status_t pdp_status;
-                char *url = NULL, *file = NULL, *content_type = NULL;
+                char *url = NULL, *file = NULL, *content_type = NULL, *data = NULL;
+                size_t data_sz = 0;
                 int method = AM_REQUEST_POST;
                 const char *key = r->url.query + 1; /* skip '?' */
 
@@ -2246,20 +2788,20 @@ static am_return_t handle_exit(am_request_t *r) {
                     break;
                 }
 
-                pdp_status = am_get_pdp_cache_entry(r, key, &url, &file, &content_type, &method);
+                pdp_status = am_get_pdp_cache_entry(r, key, &url, &file, &content_type, &method, &data, &data_sz);
 
                 if (pdp_status != AM_SUCCESS) {
                     AM_LOG_WARNING(r->instance_id,
                             "%s post data preservation cache entry %s is not available (%s)",
                             thisfunc, key, am_strerror(pdp_status));
-                    AM_FREE(url, file, content_type);
+                    AM_FREE(url, file, content_type, data);
                     r->status = AM_NOT_FOUND;
                     break;
                 }
 
                 AM_LOG_DEBUG(r->instance_id, "%s found post data preservation cache "
-                        "entry: %s, url: %s, file: %s, content type: %s",
-                        thisfunc, key, LOGEMPTY(url), LOGEMPTY(file), LOGEMPTY(content_type));
+                        "entry: %s, url: %s, file: %s, content type: %s, data: %ld bytes",
+                        thisfunc, key, LOGEMPTY(url), LOGEMPTY(file), LOGEMPTY(content_type), data_sz);
 
                 /* reset pdp sticky-session load-balancer cookie */
                 if (ISVALID(r->conf->pdp_sess_mode) && ISVALID(r->conf->pdp_sess_value)
@@ -2292,8 +2834,8 @@ static am_return_t handle_exit(am_request_t *r) {
 
                     if (r->conf->pdp_js_repost) {
                         char *repost = NULL;
-                        size_t post_sz = 0;
-                        char *post = load_file(file, &post_sz);
+                        size_t post_sz = data_sz;
+                        char *post = data != NULL ? data : load_file(file, &post_sz);
                         char *post_enc = base64_encode(post, &post_sz);
 
                         /* IE10+ only */
@@ -2323,7 +2865,24 @@ static am_return_t handle_exit(am_request_t *r) {
                         r->status = AM_SUCCESS;
                         r->am_set_custom_response_f(r, repost, "text/html");
                         AM_FREE(post, post_enc, repost);
-
+                        data = NULL;
+
+                    } else if (data != NULL) {
+                        /* post data preserved in the cache entry */
+                        r->method = method;
+                        r->status = AM_PDP_DONE;
+                        r->post_data_url = url;
+                        am_free(r->post_data);
+                        r->post_data = data; /* will be released with am_request_t cleanup */
+                        r->post_data_sz = data_sz;
+                        data = NULL;
+                        am_free(r->post_data_fn);
+                        r->post_data_fn = NULL;
+
+                        if (r->am_set_post_data_f != NULL) {
+                            r->am_set_post_data_f(r);
+                        }
+                        r->am_set_custom_response_f(r, AM_SPACE_CHAR, content_type);
                     } else {
 
                         struct stat st;
@@ -2352,7 +2911,7 @@ static am_return_t handle_exit(am_request_t *r) {
                 /* delete cache entry */
                 am_remove_cache_entry(r->instance_id, key);
 
-                AM_FREE(url, file, content_type);
+                AM_FREE(url, file, content_type, data);
 
                 if (pdp_status != AM_SUCCESS) {
                     r->status = AM_NOT_FOUND;
@@ -2418,9 +2977,11 @@ static am_return_t handle_exit(am_request_t *r) {
                 /* post data preservation */
                 am_status_t pdp_status = AM_SUCCESS;
                 char key[37];
+                /* smaller post data can be kept in the cache entry (no pdp file) */
+                am_bool_t pdp_memory = r->pdp_in_memory && r->conf->pdp_memory_limit > 0;
 
                 /* check if we have access to the post data file directory */
-                if (!ISVALID(r->conf->pdp_dir) || !file_exists(r->conf->pdp_dir)) {
+                if (!pdp_memory && (!ISVALID(r->conf->pdp_dir) || !file_exists(r->conf->pdp_dir))) {
                     AM_LOG_ERROR(r->instance_id,
                             "%s post data preservation module has no access to %s directory",
                             thisfunc, LOGEMPTY(r->conf->pdp_dir));
@@ -2434,10 +2995,17 @@ static am_return_t handle_exit(am_request_t *r) {
                 /* post data should already be read in validate_token (with cdsso)
                  * if not - read it here (blocking) */
                 if (pdp_status == AM_SUCCESS && !r->conf->cdsso_enable) {
+                    r->post_data_in_memory = pdp_memory;
                     pdp_status = r->am_get_post_data_f(r);
                 }
 
-                if (pdp_status == AM_SUCCESS && ISINVALID(r->post_data_fn) && r->post_data_sz > 0) {
+                if (pdp_status == AM_SUCCESS && ISINVALID(r->post_data_fn) && r->post_data != NULL
+                        && r->post_data_sz > (size_t) r->conf->pdp_memory_limit) {
+                    /* too large to keep in the cache - spill to the post data file directory */
+                    pdp_status = store_post_data_file(r);
+                }
+
+                if (pdp_status == AM_SUCCESS && ISINVALID(r->post_data_fn) && r->post_data == NULL && r->post_data_sz > 0) {
                     AM_LOG_ERROR(r->instance_id,
                             "%s no data available for post data preservation module", thisfunc);
                     pdp_status = AM_ERROR;
@@ -2464,8 +3032,9 @@ static am_return_t handle_exit(am_request_t *r) {
 
                     /* store pdp metadata in shared cache */
                     am_add_pdp_cache_entry(r, key, repost_uri,
-                            r->post_data_sz > 0 ? r->post_data_fn : "0",
-                            r->content_type, r->method);
+                            r->post_data_sz > 0 ? NOTNULL(r->post_data_fn) : "0",
+                            r->content_type, r->method,
+                            ISINVALID(r->post_data_fn) ? r->post_data : NULL, r->post_data_sz);
 
                     if (r->am_set_post_data_filename_f != NULL) {
                         /* IIS specific: do not remove temporary file at the end of the request processor. */
@@ -2658,12 +3227,22 @@ void am_process_request(am_request_t *r) {
     am_state_t cur_state = ENTRY_STATE;
     am_return_t rc = AM_FAIL;
     am_state_func_t fn;
+    am_timer_t request_timer, span_timer;
+    unsigned long instance_id = r->instance_id;
+
+    am_timer_start(&request_timer);
     for (;;) {
         fn = am_request_state[cur_state];
+        am_timer_start(&span_timer);
         rc = fn(r);
+        am_timer_stop(&span_timer);
+        /* span ids follow am_state_t order */
+        am_metrics_record_span(instance_id, (int) cur_state, &span_timer);
         if (EXIT_STATE == cur_state) break;
         cur_state = lookup_transition(cur_state, rc);
     }
+    am_timer_stop(&request_timer);
+    am_metrics_record_span(instance_id, AM_SPAN_REQUEST, &request_timer);
 }
 
 /**
@@ -43,6 +43,33 @@
 
 static am_timer_event_t                 *cache_timer = NULL;
 
+/* process copy of the policy change list, see am_check_policy_cache_resource */
+static struct {
+    uint64_t                             generation, epoch, changed;
+    struct am_policy_epoch               e;
+} policy_memo;
+
+#ifdef _WIN32
+static INIT_ONCE                         policy_memo_initialized = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION                  policy_memo_mutex;
+
+static BOOL CALLBACK policy_memo_mutex_init(PINIT_ONCE io, PVOID p, PVOID *c) {
+    InitializeCriticalSection(&policy_memo_mutex);
+    return TRUE;
+}
+
+#define POLICY_MEMO_LOCK() \
+    do { \
+        InitOnceExecuteOnce(&policy_memo_initialized, policy_memo_mutex_init, NULL, NULL); \
+        EnterCriticalSection(&policy_memo_mutex); \
+    } while (0)
+#define POLICY_MEMO_UNLOCK()             LeaveCriticalSection(&policy_memo_mutex)
+#else
+static pthread_mutex_t                   policy_memo_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define POLICY_MEMO_LOCK()               pthread_mutex_lock(&policy_memo_mutex)
+#define POLICY_MEMO_UNLOCK()             pthread_mutex_unlock(&policy_memo_mutex)
+#endif
+
 static void cache_cleanup_event(void *arg) {
     pid_t pid;
 
@@ -137,6 +164,59 @@ int am_remove_cache_entry(unsigned long instance, const char *key) {
 
 }
 
+/*
+ * delete a batch of cache entries (each cache hash lock is taken once)
+ *
+ */
+int am_remove_cache_entries(unsigned long instance, const char **keys, int count) {
+
+    struct cache_object_ctx             *ctx;
+
+    uint32_t                            *hash;
+    void                               **data;
+
+    int                                  i, n = 0, status = AM_SUCCESS;
+
+    if (keys == NULL || count <= 0) {
+        return AM_SUCCESS;
+    }
+
+    ctx = malloc(sizeof(struct cache_object_ctx) * count);
+    hash = malloc(sizeof(uint32_t) * count);
+    data = malloc(sizeof(void *) * count);
+
+    if (ctx == NULL || hash == NULL || data == NULL) {
+        AM_FREE(ctx, hash, data);
+        for (i = 0; i < count; i++) {                                                  /* one at a time then */
+            int                          rv = am_remove_cache_entry(instance, keys[i]);
+            if (rv != AM_SUCCESS) {
+                status = rv;
+            }
+        }
+        return status;
+    }
+
+    for (i = 0; i < count; i++) {
+        cache_object_ctx_init(ctx + i);
+        cache_object_write_key(ctx + i, (char *)keys[i]);
+        if (ctx[i].error) {
+            status = ctx[i].error;
+            continue;
+        }
+        hash[n] = am_hash(keys[i]);
+        data[n++] = ctx[i].data;
+    }
+
+    cache_delete_batch(hash, data, n, key_equality);
+
+    for (i = 0; i < count; i++) {
+        cache_object_ctx_destroy(ctx + i);
+    }
+    AM_FREE(ctx, hash, data);
+    return status;
+
+}
+
 /*
  * get (readlocked) memory in shared cache
  *
@@ -162,10 +242,56 @@ static int cache_fetch_readable(uint32_t hash, char *key, void **data_addr, uint
 }
 
 /*
- * get validation time in for all policies
- *
+ * split resource into host (port excluded) and path parts, ignoring the scheme;
+ * path is cut at the first wildcard and trailing separators are removed
  */
-int am_check_policy_cache_epoch(uint64_t policy_created) {
+static void policy_resource_split(const char *resource, const char **host, size_t *host_sz,
+        const char **path, size_t *path_sz) {
+    const char *p = strstr(resource, "://");
+    const char *wildcard;
+
+    *host = p != NULL ? p + 3 : resource;
+    p = strchr(*host, '/');
+    *path = p != NULL ? p : *host + strlen(*host);
+    *host_sz = *path - *host;
+    p = memchr(*host, ':', *host_sz);
+    if (p != NULL) {
+        *host_sz = p - *host;
+    }
+
+    wildcard = strchr(*path, '*');
+    *path_sz = wildcard != NULL ? (size_t) (wildcard - *path) : strlen(*path);
+    while (*path_sz > 0 && ((*path)[*path_sz - 1] == '/' || (*path)[*path_sz - 1] == '-')) {
+        (*path_sz)--;
+    }
+}
+
+/*
+ * check whether policy change of the resource (pattern) might affect the cached resource decision;
+ * any doubt (wildcard host, related paths) counts as affected
+ */
+am_bool_t am_policy_resource_affected(const char *changed, const char *resource) {
+    const char *changed_host, *changed_path, *host, *path;
+    size_t changed_host_sz, changed_path_sz, host_sz, path_sz;
+
+    if (ISINVALID(changed) || ISINVALID(resource)) {
+        return AM_TRUE;
+    }
+
+    policy_resource_split(changed, &changed_host, &changed_host_sz, &changed_path, &changed_path_sz);
+    policy_resource_split(resource, &host, &host_sz, &path, &path_sz);
+
+    if (memchr(changed_host, '*', changed_host_sz) != NULL || memchr(host, '*', host_sz) != NULL) {
+        return AM_TRUE;
+    }
+    if (changed_host_sz != host_sz || strncasecmp(changed_host, host, host_sz) != 0) {
+        return AM_FALSE;
+    }
+    /* one path must be a prefix of the other */
+    return strncasecmp(changed_path, path, MIN(changed_path_sz, path_sz)) == 0 ? AM_TRUE : AM_FALSE;
+}
+
+static int policy_epoch_read(struct am_policy_epoch *e, am_bool_t changes) {
 
     struct cache_object_ctx              ctx;
     int                                  status;
@@ -175,18 +301,15 @@ int am_check_policy_cache_epoch(uint64_t policy_created) {
     void                                *shm_data;                                    /* pointer into hash table */
     uint32_t                             shm_data_sz;
 
-    uint64_t                             epoch_start;
+    memset(e, 0, sizeof (struct am_policy_epoch));
 
     if (( status = cache_fetch_readable(hash, (char *)AM_POLICY_CHANGE_KEY, &shm_data, &shm_data_sz) )) {
-        if (status == AM_NOT_FOUND) {
-            return AM_SUCCESS;                                                        /* no epoch set */
-        }
         return status;
     }
 
     cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
     cache_object_skip_key(&ctx);
-    am_policy_epoch_deserialise(&ctx, &epoch_start);
+    am_policy_epoch_deserialise(&ctx, e, changes);
 
     cache_release_readlocked_ptr(hash);
 
@@ -194,31 +317,33 @@ int am_check_policy_cache_epoch(uint64_t policy_created) {
     cache_object_ctx_destroy(&ctx);
 
     if (status) {
-        return status;
+        am_policy_epoch_free(e);
     }
-
-    if (policy_created < epoch_start) {
-        return AM_ETIMEDOUT;                                                          /* policy crated before the epoch */
-    }
-
     return status;
 
 }
 
-/*
- * set validation time for all policies
- *
- */
-int am_set_policy_cache_epoch(uint64_t epoch_start) {
+static int policy_epoch_write(struct am_policy_epoch *e) {
 
     struct cache_object_ctx              ctx;
     int                                  status;
 
     uint32_t                             hash = am_hash(AM_POLICY_CHANGE_KEY);
+    uint32_t                             i;
+
+    /* changes made before the epoch are covered by it */
+    for (i = 0; i < e->count; ) {
+        if (e->change[i].time <= e->epoch) {
+            am_free(e->change[i].resource);
+            e->change[i] = e->change[--e->count];
+        } else {
+            i++;
+        }
+    }
 
     cache_object_ctx_init(&ctx);
     cache_object_write_key(&ctx, (char *)AM_POLICY_CHANGE_KEY);
-    am_policy_epoch_serialise(&ctx, epoch_start);
+    am_policy_epoch_serialise(&ctx, e);
 
     if (ctx.error) {
         status = ctx.error;
@@ -228,16 +353,260 @@ int am_set_policy_cache_epoch(uint64_t epoch_start) {
         status = AM_SUCCESS;
     }
 
+    /* published even when the entry is missing: checks then treat all newer changes as relevant */
+    cache_policy_epoch_publish(e->epoch, e->changed);
+
     cache_object_ctx_destroy(&ctx);
     return status;
 
 }
 
+/*
+ * check a policy decision made at the policy_created time against the change list
+ */
+static int policy_epoch_check(struct am_policy_epoch *e, const char *resource, uint64_t policy_created) {
+
+    uint32_t                             i;
+
+    if (policy_created < e->epoch) {
+        return AM_ETIMEDOUT;                                                          /* policy created before the epoch */
+    }
+    if (policy_created >= e->changed) {
+        return AM_SUCCESS;                                                            /* no resource changes since */
+    }
+    if (resource == NULL) {
+        return AM_ETIMEDOUT;
+    }
+    for (i = 0; i < e->count; i++) {
+        if (policy_created < e->change[i].time &&
+                am_policy_resource_affected(e->change[i].resource, resource)) {
+            return AM_ETIMEDOUT;
+        }
+    }
+    return AM_SUCCESS;
+
+}
+
+/*
+ * publish the AM_POLICY_CHANGE_KEY entry again (no published copy or the entry was evicted);
+ * a missing entry is written back with all the changes up to 'changed' turned into the epoch
+ */
+static int policy_epoch_restore(struct am_policy_epoch *e, uint64_t changed) {
+
+    static const char                   *thisfunc = "policy_epoch_restore():";
+    int                                  status;
+
+    status = cache_writer_lock();
+    if (status != AM_SUCCESS) {
+        AM_LOG_ERROR(0, "%s unable to lock the cache (%s)", thisfunc, am_strerror(status));
+        memset(e, 0, sizeof (struct am_policy_epoch));
+        return status;
+    }
+
+    status = policy_epoch_read(e, AM_TRUE);
+    if (status == AM_NOT_FOUND) {
+        memset(e, 0, sizeof (struct am_policy_epoch));
+        e->epoch = e->changed = changed;
+        status = policy_epoch_write(e);
+        AM_LOG_DEBUG(0, "%s policy change list is not available, epoch set to %llu (%s)",
+                thisfunc, (unsigned long long) changed, am_strerror(status));
+    } else if (status == AM_SUCCESS) {
+        cache_policy_epoch_publish(e->epoch, e->changed);
+    }
+
+    cache_writer_unlock();
+    return status;
+
+}
+
+/*
+ * check whether a policy decision for the resource, made at the policy_created time, 
+ * is still valid (resource NULL: any policy change invalidates it)
+ *
+ */
+int am_check_policy_cache_resource(const char *resource, uint64_t policy_created) {
+
+    int                                  status;
+    uint64_t                             generation, epoch, changed;
+    am_bool_t                            restore = AM_FALSE;
+    struct am_policy_epoch               e;
+
+    /* published copy of the AM_POLICY_CHANGE_KEY header; no cache lookup in the common case */
+    status = cache_policy_epoch_load(&generation, &epoch, &changed);
+    if (status == AM_EAGAIN) {
+        /* update of the published copy did not complete (writer died) - use the cache entry */
+        status = policy_epoch_restore(&e, (uint64_t) time(NULL));
+        if (status == AM_SUCCESS) {
+            status = policy_epoch_check(&e, resource, policy_created);
+        } else {
+            status = AM_ETIMEDOUT;
+        }
+        am_policy_epoch_free(&e);
+        return status;
+    }
+    if (status != AM_SUCCESS) {
+        return AM_ERROR;
+    }
+
+    if (policy_created < epoch) {
+        return AM_ETIMEDOUT;                                                          /* policy created before the epoch */
+    }
+    if (policy_created >= changed) {
+        return AM_SUCCESS;                                                            /* no resource changes since */
+    }
+    if (resource == NULL) {
+        return AM_ETIMEDOUT;
+    }
+
+    /* there are newer resource changes - look for the one affecting this resource
+     * in the process copy of the change list, reloaded when a new list is published */
+    POLICY_MEMO_LOCK();
+    if (policy_memo.generation != generation || policy_memo.epoch != epoch || policy_memo.changed != changed) {
+        am_policy_epoch_free(&policy_memo.e);
+        policy_memo.generation = 0;
+        status = policy_epoch_read(&policy_memo.e, AM_TRUE);
+        if (status == AM_SUCCESS) {
+            policy_memo.generation = generation;
+            policy_memo.epoch = epoch;
+            policy_memo.changed = changed;
+        } else if (status == AM_NOT_FOUND) {
+            restore = AM_TRUE;
+        }
+    }
+    if (policy_memo.generation == 0) {
+        status = AM_ETIMEDOUT;                                                        /* change list is not available */
+    } else {
+        status = policy_epoch_check(&policy_memo.e, resource, policy_created);
+    }
+    POLICY_MEMO_UNLOCK();
+
+    if (restore) {
+        /* entry was evicted: turn the lost changes into the epoch, so that the checks
+         * do not keep looking it up */
+        policy_epoch_restore(&e, changed);
+        am_policy_epoch_free(&e);
+    }
+    return status;
+
+}
+
+/*
+ * get validation time in for all policies
+ *
+ */
+int am_check_policy_cache_epoch(uint64_t policy_created) {
+
+    return am_check_policy_cache_resource(NULL, policy_created);
+
+}
+
+/*
+ * set validation time for all policies
+ *
+ */
+int am_set_policy_cache_epoch(uint64_t epoch_start) {
+
+    static const char                   *thisfunc = "am_set_policy_cache_epoch():";
+    struct am_policy_epoch               e;
+    int                                  status;
+
+    /* the change list is read-modify-write and the published copy has a single writer */
+    status = cache_writer_lock();
+    if (status != AM_SUCCESS) {
+        AM_LOG_ERROR(0, "%s unable to lock the cache (%s)", thisfunc, am_strerror(status));
+        return status;
+    }
+
+    if (policy_epoch_read(&e, AM_TRUE) != AM_SUCCESS) {
+        memset(&e, 0, sizeof (struct am_policy_epoch));
+    }
+    e.epoch = epoch_start;
+    status = policy_epoch_write(&e);
+
+    cache_writer_unlock();
+    am_policy_epoch_free(&e);
+    return status;
+
+}
+
+/*
+ * record policy changes of the resources (ResourceName values) at the time; only the cached
+ * policies for the affected resources become invalid. When the change list is full,
+ * the oldest change is turned into the epoch for all policies.
+ *
+ */
+int am_add_policy_cache_changes(const char **resources, int count, uint64_t time) {
+
+    static const char                   *thisfunc = "am_add_policy_cache_changes():";
+    struct am_policy_epoch               e;
+    int                                  status;
+    int                                  i;
+    uint32_t                             j, oldest;
+
+    if (count <= 0) {
+        return AM_SUCCESS;
+    }
+    if (count > AM_POLICY_CHANGE_MAX) {
+        return am_set_policy_cache_epoch(time);
+    }
+
+    status = cache_writer_lock();
+    if (status != AM_SUCCESS) {
+        AM_LOG_ERROR(0, "%s unable to lock the cache (%s)", thisfunc, am_strerror(status));
+        return status;
+    }
+
+    status = policy_epoch_read(&e, AM_TRUE);
+    if (status != AM_SUCCESS) {
+        memset(&e, 0, sizeof (struct am_policy_epoch));
+        if (status != AM_NOT_FOUND) {
+            e.epoch = time;                                                           /* previous changes are unknown */
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (resources[i] == NULL) continue;
+
+        for (j = 0; j < e.count; j++) {
+            if (strcmp(e.change[j].resource, resources[i]) == 0) break;
+        }
+        if (j < e.count) {
+            e.change[j].time = MAX(e.change[j].time, time);
+            continue;
+        }
+
+        if (e.count == AM_POLICY_CHANGE_MAX) {
+            for (j = 1, oldest = 0; j < e.count; j++) {
+                if (e.change[j].time < e.change[oldest].time) oldest = j;
+            }
+            e.epoch = MAX(e.epoch, e.change[oldest].time);
+            am_free(e.change[oldest].resource);
+            e.change[oldest] = e.change[--e.count];
+        }
+
+        e.change[e.count].resource = strdup(resources[i]);
+        if (e.change[e.count].resource == NULL) {
+            e.epoch = MAX(e.epoch, time);
+            continue;
+        }
+        e.change[e.count++].time = time;
+    }
+    e.changed = MAX(e.changed, time);
+
+    status = policy_epoch_write(&e);
+
+    cache_writer_unlock();
+    am_policy_epoch_free(&e);
+    return status;
+
+}
+
 /*
  * deserialise cached pdp data entry
  *
  */
-int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, char **file, char **content_type, int *method) {
+int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, char **file, char **content_type, int *method,
+        char **data, size_t *data_sz) {
 
     struct cache_object_ctx              ctx;
     int                                  status;
@@ -253,7 +622,7 @@ int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, c
 
     cache_object_ctx_init_data(&ctx, shm_data, (size_t)shm_data_sz);
     cache_object_skip_key(&ctx);
-    am_pdp_entry_deserialise(&ctx, url, file, content_type, method);
+    am_pdp_entry_deserialise(&ctx, url, file, content_type, method, data, data_sz);
 
     cache_release_readlocked_ptr(hash);
 
@@ -265,10 +634,12 @@ int am_get_pdp_cache_entry(am_request_t *request, const char *key, char **url, c
 }
 
 /*
- * cache serialised pdp data
+ * cache serialised pdp data; post data (when not NULL) is stored in the entry
+ * and expires with it
  *
  */
-int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *url, const char *file, const char *content_type, int method) {
+int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *url, const char *file, const char *content_type, int method,
+        const char *data, size_t data_sz) {
 
     struct cache_object_ctx              ctx;
     int                                  status;
@@ -279,7 +650,7 @@ int am_add_pdp_cache_entry(am_request_t *request, const char *key, const char *u
 
     cache_object_ctx_init(&ctx);
     cache_object_write_key(&ctx, (char *)key);
-    am_pdp_entry_serialise(&ctx, url, file, content_type, method);
+    am_pdp_entry_serialise(&ctx, url, file, content_type, method, data, data_sz);
 
     if (ctx.error) {
         status = ctx.error;
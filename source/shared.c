@@ -578,6 +578,38 @@ int am_shm_delete(char *name) {
 
 }
 
+/**
+ * check whether a shared memory segment is there (created and still in use on Windows),
+ * without creating it
+ */
+am_bool_t am_shm_exists(const char *name) {
+    char shm_name[AM_PATH_SIZE];
+#ifdef _WIN32
+    HANDLE h;
+    snprintf(shm_name, sizeof (shm_name), AM_GLOBAL_PREFIX"%s_s", name);
+    h = OpenFileMappingA(FILE_MAP_READ, FALSE, shm_name);
+    if (h == NULL) {
+        return AM_FALSE;
+    }
+    CloseHandle(h);
+    return AM_TRUE;
+#else
+    int fd;
+#ifdef __sun
+    const char *format = "/%s_s";
+#else
+    const char *format  = "%s_s";
+#endif
+    snprintf(shm_name, sizeof (shm_name), format, name);
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1) {
+        return errno == ENOENT ? AM_FALSE : AM_TRUE;
+    }
+    close(fd);
+    return AM_TRUE;
+#endif
+}
+
 /**
  * get the max pool size for shared memory
  */
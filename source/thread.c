@@ -31,14 +31,84 @@
 #define AM_MIN_THREADS_POOL 2
 #define AM_THREADS_POOL_LINGER 30 /* sec */
 
+#define AM_LANE_BLOCK 0x01 /* back-pressure: dispatcher waits for space in the lane */
+#define AM_LANE_COALESCE 0x02
+#define AM_LANE_COALESCE_SLOTS 256
+
+#ifdef _WIN32
+#define AM_LANE_ADD(p, v)       InterlockedExchangeAdd((volatile LONG *) (p), v)
+#define AM_LANE_CAS(p, n, o)    InterlockedCompareExchange((volatile LONG *) (p), n, o)
+#define AM_LANE_SWAP(p, v)      InterlockedExchange((volatile LONG *) (p), v)
+#else
+#define AM_LANE_ADD(p, v)       __sync_fetch_and_add(p, v)
+#define AM_LANE_CAS(p, n, o)    __sync_val_compare_and_swap(p, o, n)
+#define AM_LANE_SWAP(p, v)      __sync_lock_test_and_set(p, v)
+#endif
+
+/* lane capacity (power of 2) and overflow policy, indexed by AM_WORKER_LANE_* */
+static const struct {
+    int capacity;
+    int flags;
+} lane_policy[AM_WORKER_LANES] = {
+    { 4096, AM_LANE_BLOCK},
+    { 1024, AM_LANE_BLOCK},
+    { 256, AM_LANE_COALESCE}
+};
+
 /* helper structure to wrap various callbacks, args and platforms */
 struct am_callback_args {
     volatile uint32_t *running;
     volatile uint32_t *stop;
     void *args;
     void (*callback)(void *);
+    int lane;
+    int slot; /* coalesce slot or -1 */
+    uint64_t queued; /* usec */
 };
 
+static uint64_t lane_clock() {
+#ifdef _WIN32
+    return GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+    am_clock_gettime(&ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/**
+ * Claim coalescing slot for a job (AM_SUCCESS, 'slot' is -1 if the job can not be coalesced) or
+ * return AM_EINPROGRESS if the same job is waiting in the lane already.
+ */
+static int lane_coalesce_claim(volatile uint32_t *table, int lane, unsigned long key, void (*func)(void *), int *slot) {
+    uint32_t tag, current;
+    *slot = -1;
+    if (key == 0 || !(lane_policy[lane].flags & AM_LANE_COALESCE)) {
+        return AM_SUCCESS;
+    }
+    tag = (uint32_t) ((((uintptr_t) func) >> 4) ^ (key * 2654435761u)) | 1;
+    current = AM_LANE_CAS(&table[tag % AM_LANE_COALESCE_SLOTS], tag, 0);
+    if (current == 0) {
+        *slot = (int) (tag % AM_LANE_COALESCE_SLOTS);
+        return AM_SUCCESS;
+    }
+    /* a different job in the slot - no coalescing for this one */
+    return current == tag ? AM_EINPROGRESS : AM_SUCCESS;
+}
+
+static void lane_coalesce_release(volatile uint32_t *table, int slot) {
+    if (slot >= 0) {
+        AM_LANE_SWAP(&table[slot], 0);
+    }
+}
+
+/* job left the lane (to be run now): update lane metrics */
+static void lane_job_started(int lane, uint64_t queued) {
+    uint64_t now = lane_clock();
+    am_metrics_lane_depth(lane, -1);
+    am_metrics_lane_wait(lane, now > queued ? now - queued : 0);
+}
+
 #ifdef _WIN32
 static INIT_ONCE worker_pool_initialized = INIT_ONCE_STATIC_INIT;
 static PTP_CALLBACK_ENVIRON worker_env = NULL;
@@ -57,6 +127,9 @@ enum {
 struct am_threadpool_work {
     void (*func) (void *);
     void *arg;
+    int lane;
+    int slot;
+    uint64_t queued;
     struct am_threadpool_work *next;
 };
 
@@ -65,8 +138,15 @@ struct am_threadpool {
     pthread_cond_t busy;
     pthread_cond_t work;
     pthread_cond_t wait;
-    struct am_threadpool_work *head;
-    struct am_threadpool_work *tail;
+    pthread_cond_t space; /* signalled when a job is taken out of a full lane */
+
+    struct am_threadpool_lane {
+        struct am_threadpool_work *head;
+        struct am_threadpool_work *tail;
+        int depth;
+    } lane[AM_WORKER_LANES];
+    int pending; /* number of jobs in all lanes */
+    volatile uint32_t coalesce[AM_LANE_COALESCE_SLOTS];
     pthread_attr_t attr;
     int flag;
     int linger; /* number of seconds excess idle worker threads (greater than min_threads) linger before exiting */
@@ -83,9 +163,31 @@ struct am_threadpool {
 
 static struct am_threadpool *worker_pool = NULL;
 static struct am_threadpool *worker_pool_main = NULL;
+static AM_THREAD_LOCAL struct am_threadpool *worker_pool_current = NULL;
 
 static void *do_work(void *arg);
 
+/* take the next job out of the highest priority non-empty lane (pool lock held) */
+static struct am_threadpool_work *next_work(struct am_threadpool *pool) {
+    int i;
+    for (i = 0; i < AM_WORKER_LANES; i++) {
+        struct am_threadpool_lane *l = &pool->lane[i];
+        struct am_threadpool_work *cur = l->head;
+        if (cur != NULL) {
+            l->head = cur->next;
+            if (cur == l->tail) {
+                l->tail = NULL;
+            }
+            if (l->depth-- == lane_policy[i].capacity) {
+                pthread_cond_broadcast(&pool->space);
+            }
+            pool->pending--;
+            return cur;
+        }
+    }
+    return NULL;
+}
+
 static int create_worker(struct am_threadpool *pool) {
     sigset_t oset;
     int error;
@@ -103,7 +205,7 @@ static void worker_cleanup(void *arg) {
         if (pool->num_threads == 0) {
             pthread_cond_broadcast(&pool->busy);
         }
-    } else if (pool->head != NULL && pool->num_threads < pool->max_threads &&
+    } else if (pool->pending > 0 && pool->num_threads < pool->max_threads &&
             create_worker(pool) == 0) {
         pool->num_threads++;
     }
@@ -111,7 +213,7 @@ static void worker_cleanup(void *arg) {
 }
 
 static void worker_notify(struct am_threadpool *pool) {
-    if (pool->head == NULL && pool->active == NULL) {
+    if (pool->pending == 0 && pool->active == NULL) {
         pool->flag &= ~AM_THREADPOOL_WAIT;
         pthread_cond_broadcast(&pool->wait);
     }
@@ -166,6 +268,7 @@ static void *do_work(void *arg) {
     /* maintain pool integrity in case work function calls pthread_exit() */
     pthread_cleanup_push(worker_cleanup, pool);
     active.thread = pthread_self();
+    worker_pool_current = pool;
 
     while (1) {
         /* reset (this) thread signal mask and cancellation state back to the initial values 
@@ -180,7 +283,7 @@ static void *do_work(void *arg) {
         if (pool->flag & AM_THREADPOOL_WAIT) {
             worker_notify(pool);
         }
-        while (pool->head == NULL && !(pool->flag & AM_THREADPOOL_DESTROY)) {
+        while (pool->pending == 0 && !(pool->flag & AM_THREADPOOL_DESTROY)) {
             if (pool->num_threads <= pool->min_threads) {
                 pthread_cond_wait(&pool->work, &pool->lock);
             } else {
@@ -199,16 +302,14 @@ static void *do_work(void *arg) {
             break;
         }
 
-        if ((cur = pool->head) != NULL) {
+        if ((cur = next_work(pool)) != NULL) {
             timed_out = 0;
             /* take out am_threadpool_work from the list and execute it */
             func = cur->func;
             func_arg = cur->arg;
+            lane_coalesce_release(pool->coalesce, cur->slot);
+            lane_job_started(cur->lane, cur->queued);
 
-            pool->head = cur->next;
-            if (cur == pool->tail) {
-                pool->tail = NULL;
-            }
             active.next = pool->active;
             pool->active = &active;
             pthread_mutex_unlock(&pool->lock);
@@ -231,6 +332,589 @@ static void *do_work(void *arg) {
 
 #endif
 
+#if defined(LINUX)
+#define AM_WORK_STEALING_POOL
+#endif
+
+#ifdef AM_WORK_STEALING_POOL
+
+/*
+ * Work-stealing worker pool (Linux).
+ *
+ * Each worker owns a (Chase-Lev) deque: jobs dispatched from within a worker thread are pushed to
+ * and taken from its bottom (LIFO) without any locking, idle workers steal from the top of other
+ * workers' deques. Jobs dispatched from any other thread (and high/low priority lane jobs) go to
+ * bounded lock-free (MPMC) per-lane injection queues, sized by the lane capacity. Workers look for
+ * work in the high priority queue first, then in own deque, normal queue, other workers' deques and
+ * finally in the low priority queue. Job nodes for the deques are recycled through a small per-worker cache.
+ *
+ * Idle workers keep polling for a while (the spin budget adapts to whether spinning paid off recently)
+ * before they go to sleep on the pool condition variable; dispatcher signals it only when there are
+ * sleeping workers. Like the FIFO pool, new workers are started when there is no idle one, up to
+ * AM_MAX_THREADS_POOL, and excess workers exit after AM_THREADS_POOL_LINGER seconds of inactivity.
+ *
+ * AM_WORKER_POOL=fifo environment variable selects the FIFO pool instead.
+ */
+
+#define AM_WS_DEQUE_SIZE 1024 /* jobs, per worker; power of 2 */
+#define AM_WS_JOB_CACHE 64 /* max number of job nodes cached per worker */
+#define AM_WS_SPIN_MIN 16 /* idle poll iterations before going to sleep */
+#define AM_WS_SPIN_MAX 1024
+#define AM_WS_SPIN_YIELD 8 /* poll iterations before yielding the cpu */
+#define AM_WS_QUEUE_RETRY 1000 /* times to retry (yielding the cpu) when the injection queue is full before sleeping */
+#define AM_WS_CACHE_LINE 64
+
+#if defined(__i386__) || defined(__x86_64__)
+#define ws_cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define ws_cpu_relax() __sync_synchronize()
+#endif
+
+struct ws_task {
+    void (*func) (void *);
+    void *arg;
+    int lane;
+    int slot; /* coalesce slot or -1 */
+    uint64_t queued;
+};
+
+struct ws_job {
+    struct ws_task task;
+    struct ws_job *next; /* job node cache link */
+};
+
+struct ws_deque {
+    volatile int64_t top;
+    char pad_top[AM_WS_CACHE_LINE - sizeof (int64_t)];
+    volatile int64_t bottom;
+    char pad_bottom[AM_WS_CACHE_LINE - sizeof (int64_t)];
+    struct ws_job * volatile job[AM_WS_DEQUE_SIZE];
+};
+
+struct ws_cell {
+    volatile uint64_t seq;
+    struct ws_task task;
+};
+
+struct ws_queue {
+    volatile uint64_t enqueue;
+    char pad_enqueue[AM_WS_CACHE_LINE - sizeof (uint64_t)];
+    volatile uint64_t dequeue;
+    char pad_dequeue[AM_WS_CACHE_LINE - sizeof (uint64_t)];
+    uint64_t size;
+    struct ws_cell *cell;
+};
+
+struct am_wspool;
+
+struct ws_worker {
+    struct ws_deque deque;
+    struct am_wspool *pool;
+    pthread_t thread;
+    volatile uint32_t active; /* slot is in use */
+    volatile uint32_t busy; /* worker is running a job */
+    unsigned int seed; /* victim selection */
+    int spin; /* current spin budget */
+    int cached;
+    struct ws_job *cache;
+};
+
+struct am_wspool {
+    struct ws_queue queue[AM_WORKER_LANES];
+    volatile uint32_t coalesce[AM_LANE_COALESCE_SLOTS];
+
+    volatile int32_t pending; /* number of queued jobs (injection queues and deques) */
+    volatile int32_t idle; /* number of spinning or sleeping workers */
+    volatile int32_t sleeping;
+    volatile uint32_t stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_attr_t attr;
+    int linger;
+    int min_threads;
+    int max_threads;
+    int num_threads;
+    struct ws_worker worker[AM_MAX_THREADS_POOL];
+};
+
+static struct am_wspool *ws_pool = NULL;
+static struct am_wspool *ws_pool_main = NULL;
+static AM_THREAD_LOCAL struct ws_worker *ws_current = NULL;
+
+static int ws_queue_push(struct ws_queue *q, const struct ws_task *task) {
+    struct ws_cell *cell;
+    uint64_t pos = q->enqueue;
+    for (;;) {
+        int64_t diff;
+        cell = &q->cell[pos & (q->size - 1)];
+        diff = (int64_t) cell->seq - (int64_t) pos;
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&q->enqueue, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            /* queue is full */
+            return AM_ENOSPC;
+        }
+        pos = q->enqueue;
+    }
+    cell->task = *task;
+    __sync_synchronize();
+    cell->seq = pos + 1;
+    return AM_SUCCESS;
+}
+
+static int ws_queue_pop(struct ws_queue *q, struct ws_task *task) {
+    struct ws_cell *cell;
+    uint64_t pos = q->dequeue;
+    for (;;) {
+        int64_t diff;
+        cell = &q->cell[pos & (q->size - 1)];
+        diff = (int64_t) cell->seq - (int64_t) (pos + 1);
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&q->dequeue, pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            /* queue is empty */
+            return AM_NOT_FOUND;
+        }
+        pos = q->dequeue;
+    }
+    *task = cell->task;
+    __sync_synchronize();
+    cell->seq = pos + q->size;
+    return AM_SUCCESS;
+}
+
+/* owner only */
+static int ws_deque_push(struct ws_deque *d, struct ws_job *job) {
+    int64_t b = d->bottom, t = d->top;
+    if (b - t >= AM_WS_DEQUE_SIZE) {
+        return AM_ENOSPC;
+    }
+    d->job[b & (AM_WS_DEQUE_SIZE - 1)] = job;
+    __sync_synchronize();
+    d->bottom = b + 1;
+    return AM_SUCCESS;
+}
+
+/* owner only */
+static struct ws_job *ws_deque_take(struct ws_deque *d) {
+    struct ws_job *job = NULL;
+    int64_t t, b = d->bottom - 1;
+    d->bottom = b;
+    __sync_synchronize();
+    t = d->top;
+    if (t <= b) {
+        job = d->job[b & (AM_WS_DEQUE_SIZE - 1)];
+        if (t == b) {
+            /* last job - race against stealers */
+            if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+                job = NULL;
+            }
+            d->bottom = b + 1;
+        }
+    } else {
+        d->bottom = b + 1;
+    }
+    return job;
+}
+
+static struct ws_job *ws_deque_steal(struct ws_deque *d) {
+    struct ws_job *job;
+    int64_t b, t = d->top;
+    __sync_synchronize();
+    b = d->bottom;
+    if (t >= b) {
+        return NULL;
+    }
+    job = d->job[t & (AM_WS_DEQUE_SIZE - 1)];
+    return __sync_bool_compare_and_swap(&d->top, t, t + 1) ? job : NULL;
+}
+
+static struct ws_job *ws_job_get(struct ws_worker *w) {
+    struct ws_job *job = w->cache;
+    if (job != NULL) {
+        w->cache = job->next;
+        w->cached--;
+        return job;
+    }
+    return (struct ws_job *) malloc(sizeof (struct ws_job));
+}
+
+static void ws_job_release(struct ws_worker *w, struct ws_job *job) {
+    if (w->cached >= AM_WS_JOB_CACHE) {
+        free(job);
+        return;
+    }
+    job->next = w->cache;
+    w->cache = job;
+    w->cached++;
+}
+
+static void ws_job_cache_free(struct ws_worker *w) {
+    struct ws_job *job;
+    while ((job = w->cache) != NULL) {
+        w->cache = job->next;
+        free(job);
+    }
+    w->cached = 0;
+}
+
+static am_bool_t ws_find_work(struct am_wspool *pool, struct ws_worker *w, struct ws_task *task) {
+    struct ws_job *job;
+    int i, start;
+
+    if (ws_queue_pop(&pool->queue[AM_WORKER_LANE_HIGH], task) == AM_SUCCESS) {
+        return AM_TRUE;
+    }
+    if ((job = ws_deque_take(&w->deque)) == NULL &&
+            ws_queue_pop(&pool->queue[AM_WORKER_LANE_NORMAL], task) == AM_SUCCESS) {
+        return AM_TRUE;
+    }
+    for (i = 0, start = rand_r(&w->seed) % AM_MAX_THREADS_POOL; job == NULL && i < AM_MAX_THREADS_POOL; i++) {
+        struct ws_worker *victim = &pool->worker[(start + i) % AM_MAX_THREADS_POOL];
+        if (victim != w && victim->active) {
+            job = ws_deque_steal(&victim->deque);
+        }
+    }
+    if (job == NULL) {
+        return ws_queue_pop(&pool->queue[AM_WORKER_LANE_LOW], task) == AM_SUCCESS;
+    }
+    *task = job->task;
+    ws_job_release(w, job);
+    return AM_TRUE;
+}
+
+/* called with pool lock held */
+static void ws_worker_exit(struct ws_worker *w) {
+    struct am_wspool *pool = w->pool;
+    ws_job_cache_free(w);
+    w->busy = 0;
+    w->active = 0;
+    if (--pool->num_threads == 0 && pool->stop) {
+        pthread_cond_broadcast(&pool->done);
+    }
+}
+
+static void ws_worker_cancelled(void *arg) {
+    struct ws_worker *w = (struct ws_worker *) arg;
+    pthread_mutex_lock(&w->pool->lock);
+    ws_worker_exit(w);
+    pthread_mutex_unlock(&w->pool->lock);
+}
+
+static void *ws_do_work(void *arg) {
+    struct ws_worker *w = (struct ws_worker *) arg;
+    struct am_wspool *pool = w->pool;
+    am_bool_t idle = AM_FALSE;
+    int polls = 0, timed_out;
+    struct timespec ts;
+    struct ws_task task;
+
+    ws_current = w;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (!pool->stop) {
+
+        if (ws_find_work(pool, w, &task)) {
+            __sync_fetch_and_sub(&pool->pending, 1);
+            lane_coalesce_release(pool->coalesce, task.slot);
+            lane_job_started(task.lane, task.queued);
+            if (idle) {
+                __sync_fetch_and_sub(&pool->idle, 1);
+                idle = AM_FALSE;
+                if (polls > 0 && w->spin < AM_WS_SPIN_MAX) {
+                    /* spinning paid off */
+                    w->spin <<= 1;
+                }
+            }
+            polls = 0;
+
+            /* reset (this) thread signal mask and cancellation state back to the initial values 
+             * (since the last work performed) */
+            pthread_sigmask(SIG_SETMASK, &fillset, NULL);
+            pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+            w->busy = 1;
+            /* do the actual work */
+            pthread_cleanup_push(ws_worker_cancelled, w);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            task.func(task.arg);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            pthread_cleanup_pop(0);
+            w->busy = 0;
+            continue;
+        }
+
+        if (!idle) {
+            __sync_fetch_and_add(&pool->idle, 1);
+            idle = AM_TRUE;
+        }
+        if (polls++ < w->spin) {
+            if (polls < AM_WS_SPIN_YIELD) {
+                ws_cpu_relax();
+            } else {
+                sched_yield();
+            }
+            continue;
+        }
+
+        /* nothing to do - go to sleep */
+        if (w->spin > AM_WS_SPIN_MIN) {
+            w->spin >>= 1;
+        }
+        polls = 0;
+        timed_out = 0;
+        pthread_mutex_lock(&pool->lock);
+        __sync_fetch_and_add(&pool->sleeping, 1);
+        while (pool->pending <= 0 && !pool->stop) {
+            if (pool->num_threads <= pool->min_threads) {
+                pthread_cond_wait(&pool->work, &pool->lock);
+            } else {
+                am_clock_gettime(&ts);
+                ts.tv_sec += pool->linger;
+                if (pthread_cond_timedwait(&pool->work, &pool->lock, &ts) == ETIMEDOUT) {
+                    timed_out = 1;
+                    break;
+                }
+            }
+        }
+        __sync_fetch_and_sub(&pool->sleeping, 1);
+        if (timed_out && pool->num_threads > pool->min_threads) {
+            /* worker timed out (waiting for work) and the number of workers exceeds the minimum - exit now;
+             * its deque is empty (only the owner pushes to it). Stop counting as idle before the last
+             * look at 'pending': ws_dispatch increments 'pending' before it looks at 'idle', so a job
+             * queued meanwhile is either seen here or the dispatcher does not count on this worker */
+            __sync_fetch_and_sub(&pool->idle, 1);
+            if (__sync_fetch_and_add(&pool->pending, 0) <= 0) {
+                ws_worker_exit(w);
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            __sync_fetch_and_add(&pool->idle, 1);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (idle) {
+        __sync_fetch_and_sub(&pool->idle, 1);
+    }
+    ws_worker_exit(w);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* called with pool lock held */
+static int ws_create_worker(struct am_wspool *pool) {
+    int i, error;
+    sigset_t oset;
+    struct ws_worker *w = NULL;
+
+    for (i = 0; i < AM_MAX_THREADS_POOL; i++) {
+        if (!pool->worker[i].active) {
+            w = &pool->worker[i];
+            break;
+        }
+    }
+    if (w == NULL) {
+        return AM_ENOSPC;
+    }
+    w->pool = pool;
+    w->busy = 0;
+    w->seed = (unsigned int) (i + 1) * 2654435761u;
+    w->spin = AM_WS_SPIN_MIN;
+    w->cache = NULL;
+    w->cached = 0;
+    w->active = 1;
+    pthread_sigmask(SIG_SETMASK, &fillset, &oset);
+    error = pthread_create(&w->thread, &pool->attr, ws_do_work, w);
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    if (error != 0) {
+        w->active = 0;
+        return AM_ERROR;
+    }
+    pool->num_threads++;
+    return AM_SUCCESS;
+}
+
+static int ws_dispatch(struct am_wspool *pool, int lane, unsigned long key, void (*func) (void *), void *arg) {
+    struct ws_worker *w = ws_current;
+    am_bool_t in_worker = w != NULL && w->pool == pool;
+    struct ws_task task;
+    int i, status;
+
+    if (pool->stop) {
+        return AM_ENOTSTARTED;
+    }
+
+    status = lane_coalesce_claim(pool->coalesce, lane, key, func, &task.slot);
+    if (status != AM_SUCCESS) {
+        am_metrics_lane_rejected(lane, AM_TRUE);
+        return status;
+    }
+    task.func = func;
+    task.arg = arg;
+    task.lane = lane;
+    task.queued = lane_clock();
+    am_metrics_lane_depth(lane, 1);
+
+    status = AM_ENOSPC;
+    if (in_worker && lane == AM_WORKER_LANE_NORMAL) {
+        /* dispatched from within a worker - push the job to its own deque */
+        struct ws_job *job = ws_job_get(w);
+        if (job == NULL) {
+            lane_coalesce_release(pool->coalesce, task.slot);
+            am_metrics_lane_depth(lane, -1);
+            return AM_ENOMEM;
+        }
+        job->task = task;
+        status = ws_deque_push(&w->deque, job);
+        if (status != AM_SUCCESS) {
+            ws_job_release(w, job);
+        }
+    }
+    for (i = 0; status != AM_SUCCESS; i++) {
+        status = ws_queue_push(&pool->queue[lane], &task);
+        if (status == AM_SUCCESS) {
+            break;
+        }
+        if (!(lane_policy[lane].flags & AM_LANE_BLOCK) || pool->stop) {
+            break;
+        }
+        if (in_worker) {
+            /* all queues are full - run the job right here */
+            am_metrics_lane_depth(lane, -1);
+            func(arg);
+            return AM_SUCCESS;
+        }
+        if (lane_clock() - task.queued >= AM_WORKER_LANE_WAIT * 1000ULL) {
+            break;
+        }
+        if (i < AM_WS_QUEUE_RETRY) {
+            sched_yield();
+        } else {
+            usleep(1000);
+        }
+    }
+    if (status != AM_SUCCESS) {
+        lane_coalesce_release(pool->coalesce, task.slot);
+        am_metrics_lane_depth(lane, -1);
+        am_metrics_lane_rejected(lane, AM_FALSE);
+        return status;
+    }
+
+    __sync_fetch_and_add(&pool->pending, 1);
+    if (pool->sleeping > 0) {
+        /* wake up a sleeping worker */
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    } else if (pool->idle <= 0 && pool->num_threads < pool->max_threads) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->num_threads < pool->max_threads && !pool->stop) {
+            ws_create_worker(pool);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return AM_SUCCESS;
+}
+
+static void ws_queue_free(struct ws_queue *q) {
+    struct ws_task task;
+    if (q->cell == NULL) return;
+    /* jobs left in the queue are not run */
+    while (ws_queue_pop(q, &task) == AM_SUCCESS) {
+        am_metrics_lane_depth(task.lane, -1);
+    }
+    free(q->cell);
+    q->cell = NULL;
+}
+
+static struct am_wspool *ws_pool_create() {
+    int i, l;
+    struct am_wspool *pool = (struct am_wspool *) calloc(1, sizeof (struct am_wspool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    for (l = 0; l < AM_WORKER_LANES; l++) {
+        struct ws_queue *q = &pool->queue[l];
+        q->size = (uint64_t) lane_policy[l].capacity;
+        q->cell = (struct ws_cell *) calloc(lane_policy[l].capacity, sizeof (struct ws_cell));
+        if (q->cell == NULL) {
+            while (l-- > 0) {
+                free(pool->queue[l].cell);
+            }
+            free(pool);
+            return NULL;
+        }
+        for (i = 0; i < lane_policy[l].capacity; i++) {
+            q->cell[i].seq = (uint64_t) i;
+        }
+    }
+    pool->linger = AM_THREADS_POOL_LINGER;
+    pool->min_threads = AM_MIN_THREADS_POOL;
+    pool->max_threads = AM_MAX_THREADS_POOL;
+
+    pthread_attr_init(&pool->attr);
+    pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    return pool;
+}
+
+static void ws_pool_shutdown(struct am_wspool **wspool) {
+    struct am_wspool *pool;
+    struct ws_job *job;
+    int i;
+
+    if (wspool == NULL || *wspool == NULL) return;
+    pool = *wspool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+
+    /* cancel all active workers */
+    for (i = 0; i < AM_MAX_THREADS_POOL; i++) {
+        if (pool->worker[i].active && pool->worker[i].busy) {
+            pthread_cancel(pool->worker[i].thread);
+        }
+    }
+
+    /* wait for all workers to exit */
+    while (pool->num_threads != 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* release job nodes left behind (jobs are not run) */
+    for (i = 0; i < AM_MAX_THREADS_POOL; i++) {
+        while ((job = ws_deque_steal(&pool->worker[i].deque)) != NULL) {
+            am_metrics_lane_depth(job->task.lane, -1);
+            free(job);
+        }
+    }
+    for (i = 0; i < AM_WORKER_LANES; i++) {
+        ws_queue_free(&pool->queue[i]);
+    }
+
+    pthread_attr_destroy(&pool->attr);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+    *wspool = NULL;
+}
+
+static am_bool_t ws_pool_enabled() {
+    char *env = getenv("AM_WORKER_POOL");
+    return !ISVALID(env) || strcasecmp(env, "fifo") != 0;
+}
+
+#endif /* AM_WORK_STEALING_POOL */
+
 static
 #ifdef _WIN32
 BOOL CALLBACK
@@ -277,13 +961,19 @@ create_threadpool(
 
     sigfillset(&fillset);
 
-    worker_pool = (struct am_threadpool *) malloc(sizeof (struct am_threadpool));
+#ifdef AM_WORK_STEALING_POOL
+    if (ws_pool == NULL && ws_pool_enabled()) {
+        ws_pool = ws_pool_create();
+    }
+    if (ws_pool != NULL) return;
+#endif
+
+    worker_pool = (struct am_threadpool *) calloc(1, sizeof (struct am_threadpool));
     if (worker_pool == NULL) {
         return;
     }
 
     worker_pool->active = NULL;
-    worker_pool->head = worker_pool->tail = NULL;
     worker_pool->flag = 0;
     worker_pool->linger = AM_THREADS_POOL_LINGER;
     worker_pool->min_threads = AM_MIN_THREADS_POOL;
@@ -298,6 +988,7 @@ create_threadpool(
     pthread_cond_init(&worker_pool->busy, NULL);
     pthread_cond_init(&worker_pool->work, NULL);
     pthread_cond_init(&worker_pool->wait, NULL);
+    pthread_cond_init(&worker_pool->space, NULL);
 #endif
 }
 
@@ -309,13 +1000,19 @@ static void create_threadpool_main() {
 
     sigfillset(&fillset);
 
-    worker_pool_main = (struct am_threadpool *) malloc(sizeof (struct am_threadpool));
+#ifdef AM_WORK_STEALING_POOL
+    if (ws_pool_main == NULL && ws_pool_enabled()) {
+        ws_pool_main = ws_pool_create();
+    }
+    if (ws_pool_main != NULL) return;
+#endif
+
+    worker_pool_main = (struct am_threadpool *) calloc(1, sizeof (struct am_threadpool));
     if (worker_pool_main == NULL) {
         return;
     }
 
     worker_pool_main->active = NULL;
-    worker_pool_main->head = worker_pool_main->tail = NULL;
     worker_pool_main->flag = 0;
     worker_pool_main->linger = AM_THREADS_POOL_LINGER;
     worker_pool_main->min_threads = AM_MIN_THREADS_POOL;
@@ -330,6 +1027,7 @@ static void create_threadpool_main() {
     pthread_cond_init(&worker_pool_main->busy, NULL);
     pthread_cond_init(&worker_pool_main->work, NULL);
     pthread_cond_init(&worker_pool_main->wait, NULL);
+    pthread_cond_init(&worker_pool_main->space, NULL);
 }
 
 #endif
@@ -364,10 +1062,18 @@ void am_worker_pool_init_reset() {
 
 #ifdef _WIN32
 
+static volatile LONG lane_depth[AM_WORKER_LANES];
+static volatile uint32_t lane_coalesce[AM_LANE_COALESCE_SLOTS];
+
 static void CALLBACK worker_dispatch_callback(PTP_CALLBACK_INSTANCE instance, void *arg) {
     struct am_callback_args *cba = (struct am_callback_args *) arg;
-    if (cba != NULL && cba->callback != NULL) {
-        cba->callback(cba->args);
+    if (cba != NULL) {
+        lane_coalesce_release(lane_coalesce, cba->slot);
+        AM_LANE_ADD(&lane_depth[cba->lane], -1);
+        lane_job_started(cba->lane, cba->queued);
+        if (cba->callback != NULL) {
+            cba->callback(cba->args);
+        }
     }
     am_free(cba);
 }
@@ -375,24 +1081,85 @@ static void CALLBACK worker_dispatch_callback(PTP_CALLBACK_INSTANCE instance, vo
 #endif
 
 int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
+    return am_worker_dispatch_lane(AM_WORKER_LANE_NORMAL, 0, worker_f, arg);
+}
+
+/**
+ * Schedule a job in a worker pool priority lane (see AM_WORKER_LANE_*).
+ *
+ * @param lane priority lane.
+ * @param key coalescing key (0 - do not coalesce).
+ * @param worker_f job function.
+ * @param arg job function argument.
+ * @return AM_SUCCESS if the job is scheduled, AM_EINPROGRESS if it is coalesced with a job waiting in the lane,
+ * AM_ENOSPC if the lane is full or other error status.
+ */
+int am_worker_dispatch_lane(int lane, unsigned long key, void (*worker_f)(void *), void *arg) {
 #ifdef _WIN32
     BOOL status = FALSE;
     struct am_callback_args *cb_arg;
+    int slot, rv, wait;
 
     if (worker_pool == NULL || worker_env == NULL) {
         return AM_ENOTSTARTED;
     }
+    if (lane < 0 || lane >= AM_WORKER_LANES) {
+        return AM_EINVAL;
+    }
+
+    /* system thread pool has no priorities - lanes only bound the number of queued jobs */
+    for (wait = 0; AM_LANE_ADD(&lane_depth[lane], 1) >= lane_policy[lane].capacity; wait++) {
+        AM_LANE_ADD(&lane_depth[lane], -1);
+        if (!(lane_policy[lane].flags & AM_LANE_BLOCK) || wait >= AM_WORKER_LANE_WAIT) {
+            am_metrics_lane_rejected(lane, AM_FALSE);
+            return AM_ENOSPC;
+        }
+        Sleep(1);
+    }
+    rv = lane_coalesce_claim(lane_coalesce, lane, key, worker_f, &slot);
+    if (rv != AM_SUCCESS) {
+        AM_LANE_ADD(&lane_depth[lane], -1);
+        am_metrics_lane_rejected(lane, AM_TRUE);
+        return rv;
+    }
 
     cb_arg = (struct am_callback_args *) malloc(sizeof (struct am_callback_args));
     if (cb_arg != NULL) {
         cb_arg->args = arg;
         cb_arg->callback = worker_f;
+        cb_arg->lane = lane;
+        cb_arg->slot = slot;
+        cb_arg->queued = lane_clock();
+        am_metrics_lane_depth(lane, 1);
         status = TrySubmitThreadpoolCallback(worker_dispatch_callback, cb_arg, worker_env);
+        if (status == FALSE) {
+            am_metrics_lane_depth(lane, -1);
+            free(cb_arg);
+        }
+    }
+    if (status == FALSE) {
+        lane_coalesce_release(lane_coalesce, slot);
+        AM_LANE_ADD(&lane_depth[lane], -1);
     }
     return status == FALSE ? AM_ENOMEM : AM_SUCCESS;
 #else
     struct am_threadpool_work *cur;
     struct am_threadpool *pool = NULL;
+    struct timespec ts;
+    int slot, rv;
+
+    if (lane < 0 || lane >= AM_WORKER_LANES) {
+        return AM_EINVAL;
+    }
+
+#ifdef AM_WORK_STEALING_POOL
+    if (ws_pool != NULL) {
+        return ws_dispatch(ws_pool, lane, key, worker_f, arg);
+    }
+    if (worker_pool == NULL && ws_pool_main != NULL) {
+        return ws_dispatch(ws_pool_main, lane, key, worker_f, arg);
+    }
+#endif
 
     if (worker_pool != NULL) {
         /* we've been requested to run a job from within a worker process */
@@ -411,16 +1178,63 @@ int am_worker_dispatch(void (*worker_f)(void *), void *arg) {
 
     cur->func = worker_f;
     cur->arg = arg;
+    cur->lane = lane;
     cur->next = NULL;
 
     pthread_mutex_lock(&pool->lock);
 
-    if (pool->head == NULL) {
-        pool->head = cur;
+    rv = lane_coalesce_claim(pool->coalesce, lane, key, worker_f, &slot);
+    if (rv != AM_SUCCESS) {
+        pthread_mutex_unlock(&pool->lock);
+        am_metrics_lane_rejected(lane, AM_TRUE);
+        free(cur);
+        return rv;
+    }
+
+    if (pool->lane[lane].depth >= lane_policy[lane].capacity) {
+        if ((lane_policy[lane].flags & AM_LANE_BLOCK) && worker_pool_current == pool) {
+            /* never wait in a worker thread of this pool (it could be the one to make space) - run the job right here */
+            lane_coalesce_release(pool->coalesce, slot);
+            pthread_mutex_unlock(&pool->lock);
+            free(cur);
+            worker_f(arg);
+            return AM_SUCCESS;
+        }
+        if (lane_policy[lane].flags & AM_LANE_BLOCK) {
+            /* wait for space in the lane */
+            am_clock_gettime(&ts);
+            ts.tv_sec += AM_WORKER_LANE_WAIT / 1000;
+            ts.tv_nsec += (AM_WORKER_LANE_WAIT % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            while (pool->lane[lane].depth >= lane_policy[lane].capacity && !(pool->flag & AM_THREADPOOL_DESTROY)) {
+                if (pthread_cond_timedwait(&pool->space, &pool->lock, &ts) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+        if (pool->lane[lane].depth >= lane_policy[lane].capacity || (pool->flag & AM_THREADPOOL_DESTROY)) {
+            lane_coalesce_release(pool->coalesce, slot);
+            pthread_mutex_unlock(&pool->lock);
+            am_metrics_lane_rejected(lane, AM_FALSE);
+            free(cur);
+            return AM_ENOSPC;
+        }
+    }
+
+    cur->slot = slot;
+    cur->queued = lane_clock();
+    if (pool->lane[lane].head == NULL) {
+        pool->lane[lane].head = cur;
     } else {
-        pool->tail->next = cur;
+        pool->lane[lane].tail->next = cur;
     }
-    pool->tail = cur;
+    pool->lane[lane].tail = cur;
+    pool->lane[lane].depth++;
+    pool->pending++;
+    am_metrics_lane_depth(lane, 1);
 
     if (pool->idle > 0) {
         /* if there is an idle worker in the pool - wake it up */
@@ -451,6 +1265,7 @@ static void worker_pool_shutdown(struct am_threadpool **threadpool) {
 
     pool->flag |= AM_THREADPOOL_DESTROY;
     pthread_cond_broadcast(&pool->work);
+    pthread_cond_broadcast(&pool->space);
 
     /* cancel all active workers */
     for (active = pool->active; active != NULL; active = active->next) {
@@ -468,8 +1283,9 @@ static void worker_pool_shutdown(struct am_threadpool **threadpool) {
     }
     pthread_cleanup_pop(1);
 
-    for (work = pool->head; work != NULL; work = pool->head) {
-        pool->head = work->next;
+    /* jobs left in the queue are not run */
+    while ((work = next_work(pool)) != NULL) {
+        am_metrics_lane_depth(work->lane, -1);
         free(work);
     }
 
@@ -478,6 +1294,7 @@ static void worker_pool_shutdown(struct am_threadpool **threadpool) {
     pthread_cond_destroy(&pool->busy);
     pthread_cond_destroy(&pool->work);
     pthread_cond_destroy(&pool->wait);
+    pthread_cond_destroy(&pool->space);
     free(pool);
     *threadpool = NULL;
 }
@@ -502,6 +1319,9 @@ void am_worker_pool_shutdown() {
     worker_pool = NULL;
     worker_env = NULL;
 #else
+#ifdef AM_WORK_STEALING_POOL
+    ws_pool_shutdown(&ws_pool);
+#endif
     worker_pool_shutdown(&worker_pool);
 #endif
 }
@@ -510,6 +1330,9 @@ void am_worker_pool_shutdown() {
 void am_worker_pool_shutdown_main() {
 #ifndef _WIN32
     pthread_once_t once = PTHREAD_ONCE_INIT;
+#ifdef AM_WORK_STEALING_POOL
+    ws_pool_shutdown(&ws_pool_main);
+#endif
     worker_pool_shutdown(&worker_pool_main);
     /* reset main process pool init flag */
     memcpy(&worker_pool_main_initialized, &once, sizeof (worker_pool_main_initialized));
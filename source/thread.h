@@ -100,10 +100,26 @@ void am_worker_pool_init();
 void am_worker_pool_shutdown_main();
 void am_worker_pool_init_main();
 
+/*
+ * Worker pool priority lanes: idle workers always take jobs from the highest priority lane first.
+ * Each lane is bounded; when a lane is full, dispatch either waits for space (back-pressure, up to
+ * AM_WORKER_LANE_WAIT msec) or fails straight away with AM_ENOSPC (jobs are dropped). In a lane with
+ * coalescing, a job with the same worker function and (non zero) key as a job still waiting in the lane
+ * is not queued again and dispatch returns AM_EINPROGRESS (caller owns the argument in both cases).
+ */
+enum {
+    AM_WORKER_LANE_HIGH = 0, /* notifications, logout, policy calls requests wait for; back-pressure */
+    AM_WORKER_LANE_NORMAL, /* default; back-pressure */
+    AM_WORKER_LANE_LOW, /* best-effort background jobs; dropped when full, coalesced */
+    AM_WORKER_LANES
+};
+
+#define AM_WORKER_LANE_WAIT 1000 /* msec */
+
 int am_worker_dispatch(void (*worker_f)(void *), void *arg);
+int am_worker_dispatch_lane(int lane, unsigned long key, void (*worker_f)(void *), void *arg);
 
 void notification_worker(void *arg);
 void session_logout_worker(void *arg);
-void remote_audit_worker(void *arg);
 
 #endif
@@ -1083,15 +1083,13 @@ am_status_t get_cookie_value(am_request_t *rq, const char *separator, const char
 
 am_status_t get_token_from_url(am_request_t *rq) {
     char *token, *tmp = ISVALID(rq->url.query) ?
-            strdup(rq->url.query + 1) : NULL;
-    char *query = NULL;
-    int ql = 0;
-    char *o = tmp;
-    size_t cn_sz;
+            am_arena_strdup(&rq->arena, rq->url.query + 1) : NULL;
+    /* query parameters w/o a session token are never longer than the original ones */
+    char *query = tmp != NULL ? (char *) am_arena_alloc(&rq->arena, strlen(rq->url.query) + 1) : NULL;
+    size_t ql = 0, cn_sz;
 
-    if (tmp == NULL) return AM_ENOMEM;
+    if (tmp == NULL || query == NULL) return AM_ENOMEM;
     if (!ISVALID(rq->conf->cookie_name)) {
-        free(tmp);
         return AM_EINVAL;
     }
     cn_sz = strlen(rq->conf->cookie_name);
@@ -1124,23 +1122,21 @@ am_status_t get_token_from_url(am_request_t *rq) {
             }
         } else {
             /* reconstruct query parameters w/o a session token(s) */
-            if (query == NULL) {
-                ql = am_asprintf(&query, "?%s&", token);
-            } else {
-                ql = am_asprintf(&query, "%s%s&", query, token);
-            }
+            size_t tl = strlen(token);
+            query[ql] = ql == 0 ? '?' : '&';
+            memcpy(query + ql + 1, token, tl);
+            ql += tl + 1;
         }
     }
 
-    if (ql > 0 && query[ql - 1] == '&') {
-        query[ql - 1] = 0;
+    if (ql > 0) {
+        query[ql] = 0;
         strncpy(rq->url.query, query, sizeof (rq->url.query) - 1);
-    } else if (ql == 0 && ISVALID(rq->token)) {
+    } else if (ISVALID(rq->token)) {
         /* token is the only query parameter - clear it */
         memset(rq->url.query, 0, sizeof (rq->url.query));
         /* TODO: should a question mark be left there even when token is the only parameter? */
     }
-    AM_FREE(query, o);
     return ISVALID(rq->token) ? AM_SUCCESS : AM_NOT_FOUND;
 }
 
@@ -1196,6 +1192,154 @@ int remove_cookie(am_request_t *rq, const char *cookie_name, char **cookie_hdr)
     return AM_SUCCESS;
 }
 
+/*
+ * append data to the (POST body) buffer; capacity doubles when the buffer is full,
+ * so the body is copied a constant number of times on average, however it is split.
+ * Buffer content is left intact on failure (AM_ENOSPC: limit would be exceeded).
+ */
+int am_post_buffer_append(am_post_buffer_t *b, const void *data, size_t data_sz, size_t limit) {
+    size_t required;
+
+    if (b == NULL || (data == NULL && data_sz > 0)) {
+        return AM_EINVAL;
+    }
+
+    required = b->size + data_sz;
+    if (required > limit) {
+        return AM_ENOSPC;
+    }
+
+    if (required + 1 > b->capacity) {
+        size_t capacity = b->capacity > 0 ? b->capacity : AM_POST_BUFFER_MIN;
+        char *tmp;
+
+        while (capacity < required + 1) {
+            capacity *= 2;
+        }
+        if (capacity > limit + 1) {
+            capacity = limit + 1;
+        }
+        tmp = realloc(b->data, capacity);
+        if (tmp == NULL) {
+            return AM_ENOMEM;
+        }
+        b->data = tmp;
+        b->capacity = capacity;
+    }
+
+    if (data_sz > 0) {
+        memcpy(b->data + b->size, data, data_sz);
+    }
+    b->size = required;
+    b->data[b->size] = '\0';
+    return AM_SUCCESS;
+}
+
+void am_post_buffer_free(am_post_buffer_t *b) {
+    if (b == NULL) return;
+    am_free(b->data);
+    b->data = NULL;
+    b->size = b->capacity = 0;
+}
+
+struct am_arena_block {
+    struct am_arena_block *next;
+};
+
+#define AM_ARENA_ALIGN(s) (((s) + (sizeof (void *) * 2) - 1) & ~((sizeof (void *) * 2) - 1))
+#define AM_ARENA_HEADER AM_ARENA_ALIGN(sizeof (struct am_arena_block))
+
+void am_arena_init(am_arena_t *a, void *(*alloc_f)(void *, size_t), void *alloc_ctx) {
+    if (a == NULL) return;
+    memset(a, 0, sizeof (am_arena_t));
+    a->alloc_f = alloc_f;
+    a->alloc_ctx = alloc_ctx;
+}
+
+static char *arena_block(am_arena_t *a, size_t size) {
+    struct am_arena_block *b;
+    char *p = NULL;
+
+    /* container memory is released by the container itself - no bookkeeping here */
+    if (a->alloc_f != NULL) {
+        p = (char *) a->alloc_f(a->alloc_ctx, size);
+    }
+    if (p == NULL) {
+        b = (struct am_arena_block *) malloc(AM_ARENA_HEADER + size);
+        if (b == NULL) return NULL;
+        b->next = (struct am_arena_block *) a->blocks;
+        a->blocks = b;
+        p = (char *) b + AM_ARENA_HEADER;
+    }
+    return p;
+}
+
+void *am_arena_alloc(am_arena_t *a, size_t size) {
+    char *p;
+
+    if (a == NULL) return NULL;
+    size = AM_ARENA_ALIGN(size > 0 ? size : 1);
+
+    if (size > a->avail) {
+        if (size > AM_ARENA_BLOCK_SIZE / 4) {
+            /* large allocations get a block of their own, the current one stays in use */
+            return arena_block(a, size);
+        }
+        p = arena_block(a, AM_ARENA_BLOCK_SIZE);
+        if (p == NULL) return NULL;
+        a->ptr = p;
+        a->avail = AM_ARENA_BLOCK_SIZE;
+    }
+
+    p = a->ptr;
+    a->ptr += size;
+    a->avail -= size;
+    return p;
+}
+
+char *am_arena_strndup(am_arena_t *a, const char *s, size_t size) {
+    char *p;
+    if (s == NULL) return NULL;
+    p = (char *) am_arena_alloc(a, size + 1);
+    if (p != NULL) {
+        memcpy(p, s, size);
+        p[size] = '\0';
+    }
+    return p;
+}
+
+char *am_arena_strdup(am_arena_t *a, const char *s) {
+    return s != NULL ? am_arena_strndup(a, s, strlen(s)) : NULL;
+}
+
+char *am_arena_asprintf(am_arena_t *a, const char *fmt, ...) {
+    int size;
+    char *p = NULL;
+    va_list ap;
+
+    va_start(ap, fmt);
+    size = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (size >= 0 && (p = (char *) am_arena_alloc(a, (size_t) size + 1)) != NULL) {
+        va_start(ap, fmt);
+        vsnprintf(p, (size_t) size + 1, fmt, ap);
+        va_end(ap);
+    }
+    return p;
+}
+
+void am_arena_release(am_arena_t *a) {
+    struct am_arena_block *b, *next;
+    if (a == NULL) return;
+    for (b = (struct am_arena_block *) a->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->blocks = NULL;
+    a->ptr = NULL;
+    a->avail = 0;
+}
+
 char *load_file(const char *filepath, size_t *data_sz) {
     char *text = NULL;
     int fd;
@@ -1732,15 +1876,38 @@ int am_session_decode(am_request_t *r) {
 }
 
 const char *get_valid_openam_url(am_request_t *r) {
+    return get_healthy_openam_url(r, -1, NULL);
+}
+
+/**
+ * Find active OpenAM service URL: the one selected by url validator, unless its circuit
+ * breaker is open - in which case the next available naming url is used.
+ *
+ * @param r request.
+ * @param exclude naming url index not to be returned (or -1).
+ * @param index selected naming url index (optional).
+ * @return naming url or NULL in case there is no other url than 'exclude' available.
+ */
+const char *get_healthy_openam_url(am_request_t *r, int exclude, int *index) {
     const char *val = NULL;
-    int valid_idx = get_valid_url_index(r->instance_id);
-    /* find active OpenAM service URL */
+    int idx, valid_idx = get_valid_url_index(r->instance_id);
+    if (index != NULL) *index = -1;
     if (r->conf->naming_url_sz > 0) {
-        val = valid_idx >= r->conf->naming_url_sz ?
-                r->conf->naming_url[0] : r->conf->naming_url[valid_idx];
-        AM_LOG_DEBUG(r->instance_id,
-                "get_valid_openam_url(): active OpenAM service url: %s (%d)",
-                val, valid_idx);
+        if (valid_idx >= r->conf->naming_url_sz) {
+            valid_idx = 0;
+        }
+        idx = am_url_breaker_select(r->instance_id, valid_idx, r->conf->naming_url_sz, exclude);
+        if (idx == -1 && exclude == -1) {
+            /* all breakers are open - stick to the validator choice */
+            idx = valid_idx;
+        }
+        if (idx != -1) {
+            val = r->conf->naming_url[idx];
+            AM_LOG_DEBUG(r->instance_id,
+                    "get_valid_openam_url(): active OpenAM service url: %s (%d)",
+                    val, idx);
+        }
+        if (index != NULL) *index = idx;
     }
     return val;
 }
@@ -2016,12 +2183,11 @@ void decrypt_agent_passwords(am_config_t *r) {
 
 void am_request_free(am_request_t *r) {
     if (r != NULL) {
-        AM_FREE(r->normalized_url, r->overridden_url, r->normalized_url_pathinfo,
-                r->overridden_url_pathinfo, r->token,
-                r->client_ip, r->client_host, r->post_data, r->post_data_fn,
+        AM_FREE(r->token, r->post_data, r->post_data_fn,
                 r->session_info.s1, r->session_info.si, r->session_info.sk);
         delete_am_policy_result_list(&r->pattr);
         delete_am_namevalue_list(&r->sattr);
+        am_arena_release(&r->arena);
     }
 }
 
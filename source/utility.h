@@ -21,6 +21,7 @@
 #include "net_client.h"
 
 #define AM_POLICY_CHANGE_KEY    "AM_POLICY_CHANGE_KEY"
+#define AM_POLICY_CHANGE_MAX    64  /* resource changes tracked in AM_POLICY_CHANGE_KEY, older ones expire all policies */
 #define AM_CACHE_TIMEFORMAT     "%Y-%m-%d %H:%M:%S"
 #define ARRAY_SIZE(array)       sizeof(array) / sizeof(array[0])
 #define AM_BASE_TEN             10
@@ -142,8 +143,10 @@ struct am_policy_result {
 
 struct notification_worker_data {
     unsigned long instance_id;
-    char *post_data;
+    char *post_data; /* notification message */
+    char *post_data_fn; /* or the name of a file it is stored in */
     size_t post_data_sz;
+    struct notification_worker_data *next;
 };
 
 struct logout_worker_data {
@@ -153,13 +156,6 @@ struct logout_worker_data {
     am_net_options_t *options;
 };
 
-struct audit_worker_data {
-    unsigned long instance_id;
-    char *logdata;
-    char *openam;
-    am_net_options_t *options;
-};
-
 struct url_validator_worker_data {
     unsigned long instance_id;
     uint64_t last;
@@ -187,6 +183,17 @@ double am_timer_elapsed(am_timer_t *t);
 void am_timer_report(unsigned long instance_id, am_timer_t *t, const char *op);
 
 const char *get_valid_openam_url(am_request_t *r);
+const char *get_healthy_openam_url(am_request_t *r, int exclude, int *index);
+
+void am_url_breaker_report(unsigned long instance_id, int index, int status, double elapsed);
+am_bool_t am_url_breaker_allow(unsigned long instance_id, int index);
+am_bool_t am_url_breaker_claim(unsigned long instance_id, int index);
+int am_url_breaker_select(unsigned long instance_id, int start, int url_sz, int exclude);
+unsigned int am_url_breaker_latency(unsigned long instance_id, int index, int percentile);
+void am_url_breaker_reset(unsigned long instance_id);
+
+char *am_policy_prefetch_url(am_config_t *conf, const char *url);
+am_bool_t am_policy_prefetch_claim(uint32_t hash, time_t now);
 
 am_status_t ip_address_match(const char *ip, const char **list, unsigned int listsize, unsigned long instance_id);
 
@@ -212,6 +219,7 @@ int am_shm_lock_timeout(am_shm_t *am, int timeout_msec);
 am_shm_t *am_shm_create(const char *, uint64_t, int use_new_initialiser, uint64_t *, int *);
 void am_shm_shutdown(am_shm_t *);
 int am_shm_delete(char *name);
+am_bool_t am_shm_exists(const char *name);
 void *am_shm_alloc(am_shm_t *am, uint64_t usize);
 void am_shm_free(am_shm_t *am, void *ptr);
 void *am_shm_realloc(am_shm_t *am, void *ptr, uint64_t size);
@@ -291,6 +299,9 @@ int create_am_action_decision_node(am_bool_t a, int m, uint64_t ttl,
 void *am_parse_session_xml(unsigned long instance_id, const char *xml, size_t xml_sz);
 void *am_parse_session_saml(unsigned long instance_id, const char *xml, size_t xml_sz);
 void *am_parse_policy_xml(unsigned long instance_id, const char *xml, size_t xml_sz, int scope);
+void *am_parse_policy_xml_stream_create(unsigned long instance_id, int scope);
+int am_parse_policy_xml_stream(void *stream, const char *data, size_t data_sz);
+void *am_parse_policy_xml_stream_done(void *stream, char **exception);
 
 int am_audit_init(int id);
 int am_audit_shutdown();
@@ -304,13 +315,86 @@ int am_add_remote_audit_entry(unsigned long instance_id, const char *agent_token
 int am_url_validator_init();
 void am_url_validator_shutdown();
 
+int am_notification_dispatch(struct notification_worker_data *wd);
+void am_notification_shutdown();
+
+/* request processing spans (in am_process_request state order) */
+enum {
+    AM_SPAN_SETUP_REQUEST_DATA = 0,
+    AM_SPAN_VALIDATE_URL,
+    AM_SPAN_HANDLE_NOTIFICATION,
+    AM_SPAN_VALIDATE_TOKEN,
+    AM_SPAN_VALIDATE_FQDN_ACCESS,
+    AM_SPAN_HANDLE_NOT_ENFORCED,
+    AM_SPAN_VALIDATE_POLICY,
+    AM_SPAN_HANDLE_EXIT,
+    AM_SPAN_REQUEST, /* whole request */
+    AM_SPAN_BACKEND_REQUEST, /* OpenAM request (session, policy, login) */
+    AM_SPAN_MAX
+};
+
+enum {
+    AM_METRIC_CACHE_HIT = 0,
+    AM_METRIC_CACHE_MISS,
+    AM_METRIC_ALLOC_FAILURE,
+    AM_METRIC_GC_RUN,
+    AM_METRIC_GC_COLLECTED,
+    AM_METRIC_NET_CONNECT,
+    AM_METRIC_NET_REUSE,
+    AM_METRIC_LOG_DROPPED,
+    AM_METRIC_AUDIT_DROPPED,
+    AM_METRIC_NOTIFICATION,
+    AM_METRIC_MAX
+};
+
+/* worker pool lane statistics */
+enum {
+    AM_LANE_STAT_DEPTH = 0,
+    AM_LANE_STAT_DROPPED,
+    AM_LANE_STAT_COALESCED,
+    AM_LANE_STAT_MAX
+};
+
+int am_metrics_init(int id);
+int am_metrics_open(int id);
+int am_metrics_shutdown();
+void am_metrics_record(unsigned long instance_id, int span, uint64_t usec);
+void am_metrics_record_span(unsigned long instance_id, int span, am_timer_t *timer);
+uint64_t am_metrics_span_percentile(unsigned long instance_id, int span, double percentile);
+uint64_t am_metrics_span_count(unsigned long instance_id, int span, uint64_t *sum);
+const char *am_metrics_span_name(int span);
+void am_metrics_reset(unsigned long instance_id);
+void am_metrics_add(int metric, uint64_t value);
+#define am_metrics_incr(metric) am_metrics_add(metric, 1)
+uint64_t am_metrics_counter(int metric);
+char *am_metrics_text(unsigned long instance_id);
+void am_metrics_lane_depth(int lane, int delta);
+void am_metrics_lane_wait(int lane, uint64_t usec);
+void am_metrics_lane_rejected(int lane, am_bool_t coalesced);
+int64_t am_metrics_lane_stat(int lane, int stat);
+
 int am_scope_to_num(const char *scope);
 const char *am_scope_to_str(int scope);
 
 int remove_cookie(am_request_t *rq, const char *cookie_name, char **cookie_hdr);
 
+struct am_policy_change {
+    uint64_t time;
+    char *resource;
+};
+
+struct am_policy_epoch {
+    uint64_t epoch; /* all policies created before are invalid */
+    uint64_t changed; /* time of the latest resource change */
+    uint32_t count;
+    struct am_policy_change change[AM_POLICY_CHANGE_MAX];
+};
+
 int am_set_policy_cache_epoch(uint64_t epoch_start);
 int am_check_policy_cache_epoch(uint64_t policy_created);
+int am_add_policy_cache_changes(const char **resources, int count, uint64_t time);
+int am_check_policy_cache_resource(const char *resource, uint64_t policy_created);
+am_bool_t am_policy_resource_affected(const char *changed, const char *resource);
 
 int am_get_agent_config(unsigned long instance_id, const char *config_file, am_config_t **cnf);
 
@@ -325,8 +409,10 @@ int am_get_agent_config_cache_or_local(unsigned long instance_id, const char *co
 
 am_config_t *am_parse_config_xml(unsigned long instance_id, const char *xml, size_t xml_sz, char log_enable);
 
-int am_get_pdp_cache_entry(am_request_t *r, const char *key, char **url, char **file, char **content_type, int *method);
-int am_add_pdp_cache_entry(am_request_t *r, const char *key, const char *url, const char *file, const char *content_type, int method);
+int am_get_pdp_cache_entry(am_request_t *r, const char *key, char **url, char **file, char **content_type, int *method,
+        char **data, size_t *data_sz);
+int am_add_pdp_cache_entry(am_request_t *r, const char *key, const char *url, const char *file, const char *content_type, int method,
+        const char *data, size_t data_sz);
 int am_add_session_policy_cache_entry(am_request_t *request, const char *key,
         struct am_policy_result *policy, struct am_namevalue *session);
 int am_get_session_policy_cache_entry(am_request_t *request, const char *key,
@@ -336,6 +422,7 @@ int am_get_cache_entry(unsigned long instance_id, int valid, const char *key);
 int am_add_cache_entry(unsigned long instance_id, const char *key);
 
 int am_remove_cache_entry(unsigned long instance_id, const char *key);
+int am_remove_cache_entries(unsigned long instance_id, const char **keys, int count);
 
 void* mem2cpy(void* dest, const void* source1, size_t size1, const void* source2, size_t size2);
 void* mem3cpy(void* dest, const void* source1, size_t size1, const void* source2, size_t size2, const void* source3, size_t size3);
@@ -372,12 +459,13 @@ struct am_policy_result *am_policy_result_deserialise(struct cache_object_ctx *c
 struct am_namevalue *am_name_value_deserialise(struct cache_object_ctx *ctx);
 
 int am_pdp_entry_serialise(struct cache_object_ctx *ctx, const char *url,
-        const char *file, const char *content_type, int method);
+        const char *file, const char *content_type, int method, const char *data, size_t data_sz);
 int am_pdp_entry_deserialise(struct cache_object_ctx *ctx, char **url,
-        char **file, char **content_type, int *method);
+        char **file, char **content_type, int *method, char **data, size_t *data_sz);
 
-int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, uint64_t *p_time);
-int am_policy_epoch_serialise(struct cache_object_ctx *ctx, uint64_t time);
+int am_policy_epoch_deserialise(struct cache_object_ctx *ctx, struct am_policy_epoch *e, am_bool_t changes);
+int am_policy_epoch_serialise(struct cache_object_ctx *ctx, const struct am_policy_epoch *e);
+void am_policy_epoch_free(struct am_policy_epoch *e);
 
 int am_cache_worker_init();
 void am_cache_worker_shutdown();
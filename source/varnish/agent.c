@@ -66,12 +66,9 @@ struct request {
     struct header *headers;
     char *body;
     size_t body_sz;
-    struct request *next;
 };
 
 static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
-static pthread_key_t thread_key;
 static volatile int n_init = 0;
 
 char *url_decode(const char *str);
@@ -147,15 +144,6 @@ void vmod_init_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, const char
     pthread_mutex_unlock(&init_mutex);
 }
 
-static void delete_request_list(struct request **list) {
-    struct request *t = list != NULL ? *list : NULL;
-    if (t != NULL) {
-        delete_request_list(&t->next);
-        free(t);
-        t = NULL;
-    }
-}
-
 static int am_add_header(struct request *r, const char *name, const char *value,
         int type, int unset, enum gethdr_e where) {
     struct header *h;
@@ -200,54 +188,48 @@ static int am_add_header(struct request *r, const char *name, const char *value,
     return AM_SUCCESS;
 }
 
-static struct request *create_request(const struct vrt_ctx *ctx) {
-    struct request *req_list, *req_list_entry;
-    if (ctx == NULL) return NULL;
+static void free_request(void *value) {
+    struct request *req = (struct request *) value;
+    /* request itself lives in the request workspace */
+    if (req != NULL) {
+        am_free(req->body);
+        req->body = NULL;
+    }
+}
+
+/* request data is kept in PRIV_TASK (one per client request, esi sub-requests included),
+ * allocated from the request workspace and released by varnish when the task ends */
+static struct request *create_request(const struct vrt_ctx *ctx, struct vmod_priv *task) {
+    struct request *req;
+    if (ctx == NULL || task == NULL) return NULL;
 
-    req_list = pthread_getspecific(thread_key);
-    if (req_list == NULL) {
-        /* request list is not yet available for this worker thread, 
-         * create one now and register this request */
-        req_list = (struct request *) calloc(1, sizeof (struct request));
-        if (req_list == NULL) {
-            VSLb(ctx->vsl, SLT_VCL_Log, "am_vmod memory allocation failure (%p)", THREAD_ID);
+    req = (struct request *) task->priv;
+    if (req != NULL) {
+        /* restarted request - start over */
+        free_request(req);
+    } else {
+        req = (struct request *) WS_Alloc(ctx->ws, sizeof (struct request));
+        if (req == NULL) {
+            VSLb(ctx->vsl, SLT_VCL_Log, "am_vmod workspace allocation failure (%p)", THREAD_ID);
             return NULL;
         }
-        req_list->ctx = ctx;
-        req_list->xid = ctx->req->sp->vxid;
-        req_list->inauth = 1;
-        pthread_setspecific(thread_key, req_list);
-        return req_list;
-    }
-
-    /* list is there already, register this request */
-    req_list_entry = (struct request *) calloc(1, sizeof (struct request));
-    if (req_list_entry == NULL) {
-        VSLb(ctx->vsl, SLT_VCL_Log, "am_vmod memory allocation failure (%p)", THREAD_ID);
-        return NULL;
+        task->priv = req;
+        task->free = free_request;
     }
-    req_list_entry->ctx = ctx;
-    req_list_entry->xid = ctx->req->sp->vxid;
-    req_list_entry->inauth = 1;
-    AM_LIST_INSERT(req_list, req_list_entry);
-    return req_list_entry;
+    memset(req, 0, sizeof (struct request));
+    req->ctx = ctx;
+    req->xid = ctx->req->sp->vxid;
+    req->inauth = 1;
+    return req;
 }
 
-static struct request *get_request(const struct vrt_ctx *ctx) {
-    struct request *e, *t, *request_list = pthread_getspecific(thread_key);
-    if (request_list == NULL) {
-        VSLb(ctx->vsl, SLT_VCL_Log, "am_vmod failed to get request data (%p)", THREAD_ID);
-        return NULL;
-    }
-
-    AM_LIST_FOR_EACH(request_list, e, t) {
-        if (e->xid == ctx->req->sp->vxid) {
-            return e;
-        }
+static struct request *get_request(const struct vrt_ctx *ctx, struct vmod_priv *task) {
+    struct request *req = task != NULL ? (struct request *) task->priv : NULL;
+    if (req == NULL) {
+        VSLb(ctx->vsl, SLT_VCL_Log, "am_vmod failed to get request data for xid %d (%p)",
+                ctx->req->sp->vxid, THREAD_ID);
     }
-    VSLb(ctx->vsl, SLT_VCL_Log, "am_vmod failed to locate xid %d in request list (%p)",
-            ctx->req->sp->vxid, THREAD_ID);
-    return NULL;
+    return req;
 }
 
 static char *make_header_key(const char *value) {
@@ -649,9 +631,9 @@ static am_status_t get_request_body(am_request_t *ar) {
             /* try to analyze temp buffer data - see if we can spot our key */
             if (tmp_sz > 5) {
                 /* we've got enough data - check if that's 
-                 * LARES POST or should it be stored into a file */
+                 * LARES POST or should it be stored into a file (unless the caller asked for memory) */
                 tmp_writes = AM_FALSE;
-                to_file = memcmp(tmp, "LARES=", 6) != 0;
+                to_file = !ar->post_data_in_memory && memcmp(tmp, "LARES=", 6) != 0;
             } else {
                 /* too little was read in */
                 continue;
@@ -755,14 +737,19 @@ static am_status_t set_request_body(am_request_t *ar) {
     return AM_SUCCESS;
 }
 
-unsigned int vmod_authenticate_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
+static void *request_arena_alloc(void *ws, size_t size) {
+    /* NULL on workspace overflow - arena falls back to the heap */
+    return WS_Alloc((struct ws *) ws, (unsigned int) size);
+}
+
+unsigned int vmod_authenticate_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task) {
     unsigned int result = 0;
     int status;
     am_request_t am_request;
     am_config_t *boot = NULL;
     VCL_IP client_addr = VRT_r_client_ip(ctx);
     struct agent_instance *settings = (struct agent_instance *) priv->priv;
-    struct request *req = create_request(ctx);
+    struct request *req = create_request(ctx, task);
 
     if (settings == NULL || req == NULL) {
         VSLb(ctx->vsl, SLT_VCL_Error, "am_vmod failed to allocate memory for agent instance data structures");
@@ -791,6 +778,7 @@ unsigned int vmod_authenticate_wp(const struct vrt_ctx *ctx, struct vmod_priv *p
     am_request.status = AM_ERROR;
     am_request.instance_id = settings->instance_id;
     am_request.ctx = req;
+    am_arena_init(&am_request.arena, request_arena_alloc, req->ctx->ws);
     am_request.method = am_method_str_to_num(VRT_r_req_method(ctx));
     am_request.content_type = get_request_header(ctx, HTTP_HDR_CONTENT_TYPE);
     am_request.cookies = get_request_header(ctx, HTTP_HDR_COOKIE);
@@ -846,54 +834,31 @@ static struct http *get_sess_http(const struct vrt_ctx *ctx, enum gethdr_e where
     }
 }
 
-void vmod_cleanup_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
-    static const char *thisfunc = "vmod_cleanup():";
-    struct request *request_list = pthread_getspecific(thread_key);
-    VSLb(ctx->vsl, SLT_Debug, "%s xid: %d", thisfunc, ctx->req->sp->vxid);
-    delete_request_list(&request_list);
-}
-
-void vmod_request_cleanup_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
+void vmod_request_cleanup_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task) {
     static const char *thisfunc = "vmod_request_cleanup():";
-    struct request *e, *t, *tmp;
-    struct request *request_list = pthread_getspecific(thread_key);
+    struct request *req = task != NULL ? (struct request *) task->priv : NULL;
 
-    if (request_list == NULL) return;
+    if (req == NULL) return;
 
-    VSLb(ctx->vsl, SLT_Debug, "%s xid: %d", thisfunc, ctx->req->sp->vxid);
+    VSLb(ctx->vsl, SLT_Debug, "%s removing request %d (%p)", thisfunc, req->xid, THREAD_ID);
+    free_request(req);
+    task->priv = NULL;
+    task->free = NULL;
+}
 
-    AM_LIST_FOR_EACH(request_list, e, t) {
-        if (e->xid == ctx->req->sp->vxid) {
-            VSLb(ctx->vsl, SLT_Debug, "%s removing request %d (%p)",
-                    thisfunc, e->xid, THREAD_ID);
-            am_free(e->body);
-            /* remove request from the list */
-            if (request_list == e) {
-                request_list = e->next;
-                pthread_setspecific(thread_key, request_list);
-            } else {
-                tmp = request_list;
-                while (tmp->next && tmp->next != e) {
-                    tmp = tmp->next;
-                }
-                if (tmp->next) {
-                    tmp->next = e->next;
-                }
-            }
-            free(e);
-            e = NULL;
-            break;
-        }
-    }
+void vmod_cleanup_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task) {
+    static const char *thisfunc = "vmod_cleanup():";
+    VSLb(ctx->vsl, SLT_Debug, "%s xid: %d", thisfunc, ctx->req->sp->vxid);
+    vmod_request_cleanup_wp(ctx, priv, task);
 }
 
-void vmod_done_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
+void vmod_done_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task) {
     static const char *thisfunc = "vmod_done():";
     int status;
     struct http *hp;
     struct header *h, *t;
     struct agent_instance *settings = (struct agent_instance *) priv->priv;
-    struct request *req = get_request(ctx);
+    struct request *req = get_request(ctx, task);
 
     if (settings == NULL || req == NULL) {
         http_PutResponse(ctx->http_resp, "HTTP/1.1", am_status_value(AM_ERROR), NULL); /* fatal */
@@ -932,15 +897,15 @@ void vmod_done_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
         }
     }
 
-    vmod_request_cleanup_wp(ctx, priv);
+    vmod_request_cleanup_wp(ctx, priv, task);
 }
 
-void vmod_ok_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
+void vmod_ok_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task) {
     static const char *thisfunc = "vmod_ok():";
     int status;
     struct http *hp;
     struct header *h, *t;
-    struct request *req = get_request(ctx);
+    struct request *req = get_request(ctx, task);
 
     VSLb(ctx->vsl, SLT_Debug, "%s xid: %d", thisfunc, ctx->req->sp->vxid);
 
@@ -972,16 +937,7 @@ void vmod_ok_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv) {
         }
     }
 
-    vmod_request_cleanup_wp(ctx, priv);
-}
-
-static void cleanup_key(void *value) {
-    free(value);
-    pthread_setspecific(thread_key, NULL);
-}
-
-static void make_key() {
-    pthread_key_create(&thread_key, cleanup_key);
+    vmod_request_cleanup_wp(ctx, priv, task);
 }
 
 static void init_cleanup(void *priv) {
@@ -991,7 +947,6 @@ static void init_cleanup(void *priv) {
     if (settings && --n_init == 0) {
         am_shutdown_worker();
         am_shutdown(AM_DEFAULT_AGENT_ID);
-        pthread_key_delete(thread_key);
         am_free(settings->conf_file);
         free(settings);
     }
@@ -1000,7 +955,6 @@ static void init_cleanup(void *priv) {
 
 int event_function_wp(const struct vrt_ctx *ctx, struct vmod_priv *priv, enum vcl_event_e e) {
     struct agent_instance *settings;
-    pthread_once(&thread_once, make_key);
     if (e == VCL_EVENT_LOAD) {
         settings = calloc(1, sizeof (struct agent_instance));
         AN(settings);
@@ -61,11 +61,12 @@ vmod_init:
 	jmp	vmod_init_wp@plt					# simply jump to original routine. This wrapper then is transparent and ret from original routine
 											# will return to original caller as this wrapper didn't exist.
 
-	.globl	vmod_authenticate               # unsigned int vmod_authenticate(const struct vrt_ctx *ctx, struct vmod_priv *priv);
-	.type	vmod_authenticate, @function    # ctx: request context, priv: vmod private; returns: 1 (access allowed) or 0 (needs further action)
+	.globl	vmod_authenticate               # unsigned int vmod_authenticate(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task);
+	.type	vmod_authenticate, @function    # ctx: request context, priv: vmod private, task: request private; returns: 1 (access allowed) or 0 (needs further action)
 vmod_authenticate:
 	pushq	%rdi							# save vCTX
 	pushq	%rsi							# save vmod_priv
+	pushq	%rdx							# save task private
 	call	get_extended_stack_enabled@plt  # obtains whether to use the stack switching process or not. Returns the value in eax
 											# where 0 is not enabled and 1 is enabled. int get_extended_stack_enabled();
 	test	%eax, %eax						# check return value
@@ -79,6 +80,7 @@ vmod_authenticate:
 	je	.VAUTHN_NOHEAP                      # if so jump to no heap routine, otherwise
 	movq	%rax, %rcx						# backup the new stack base pointer
 	popq 	%rdi							# rdi now contains the original size
+	popq	%rdx							# restore task private
 	addq	%rdi, %rax						# rax now holds the end of stack space address
 	popq	%rsi							# restore vmod_priv
 	popq	%rdi							# restore vCTX
@@ -101,16 +103,18 @@ vmod_authenticate:
 .VAUTHN_NOHEAP:
 	popq	%rax							# unwind the stack and restore the original values, continue into .VAUTHN_DISABLED
 .VAUTHN_DISABLED:
+	popq	%rdx							# task private
 	popq	%rsi							# vmod_priv
 	popq	%rdi							# vCTX
 	jmp	vmod_authenticate_wp@plt            # simply jump to original routine. This wrapper then is transparent and ret from original routine
 											# will return to original caller as this wrapper didn't exist.
 	
-	.globl	vmod_done                       # void vmod_done(const struct vrt_ctx *ctx, struct vmod_priv *priv);
-	.type	vmod_done, @function            # ctx: request context, priv: vmod private; returns: void
+	.globl	vmod_done                       # void vmod_done(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task);
+	.type	vmod_done, @function            # ctx: request context, priv: vmod private, task: request private; returns: void
 vmod_done:
 	pushq	%rdi							# save vCTX
 	pushq	%rsi							# save vmod_priv
+	pushq	%rdx							# save task private
 	call	get_extended_stack_enabled@plt  # obtains whether to use the stack switching process or not. Returns the value in eax
 											# where 0 is not enabled and 1 is enabled. int get_extended_stack_enabled();
 	test	%eax, %eax						# check return value
@@ -124,6 +128,7 @@ vmod_done:
 	je	.VDONE_NOHEAP                       # if so jump to no heap routine, otherwise
 	movq	%rax, %rcx						# backup the new stack base pointer
 	popq 	%rdi							# rdi now contains the original size
+	popq	%rdx							# restore task private
 	addq	%rdi, %rax						# rax now holds the end of stack space address
 	popq	%rsi							# restore vmod_priv
 	popq	%rdi							# restore vCTX
@@ -144,16 +149,18 @@ vmod_done:
 .VDONE_NOHEAP:
 	popq	%rax							# unwind the stack and restore the original values, continue into .VDONE_DISABLED
 .VDONE_DISABLED:
+	popq	%rdx							# task private
 	popq	%rsi							# vmod_priv
 	popq	%rdi							# vCTX
 	jmp	vmod_done_wp@plt                    # simply jump to original routine. This wrapper then is transparent and ret from original routine
 											# will return to original caller as this wrapper didn't exist.
 	
-	.globl	vmod_ok                         # void vmod_ok(const struct vrt_ctx *ctx, struct vmod_priv *priv);
-	.type	vmod_ok, @function              # ctx: request context, priv: vmod private; returns: void
+	.globl	vmod_ok                         # void vmod_ok(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task);
+	.type	vmod_ok, @function              # ctx: request context, priv: vmod private, task: request private; returns: void
 vmod_ok:
 	pushq	%rdi							# save vCTX
 	pushq	%rsi							# save vmod_priv
+	pushq	%rdx							# save task private
 	call	get_extended_stack_enabled@plt  # obtains whether to use the stack switching process or not. Returns the value in eax
 											# where 0 is not enabled and 1 is enabled. int get_extended_stack_enabled();
 	test	%eax, %eax						# check return value
@@ -167,6 +174,7 @@ vmod_ok:
 	je	.VOK_NOHEAP                         # if so jump to no heap routine, otherwise
 	movq	%rax, %rcx						# backup the new stack base pointer
 	popq 	%rdi							# rdi now contains the original size
+	popq	%rdx							# restore task private
 	addq	%rdi, %rax						# rax now holds the end of stack space address
 	popq	%rsi							# restore vmod_priv
 	popq	%rdi							# restore vCTX
@@ -187,16 +195,18 @@ vmod_ok:
 .VOK_NOHEAP:
 	popq	%rax							# unwind the stack and restore the original values, continue into .VOK_DISABLED
 .VOK_DISABLED:
+	popq	%rdx							# task private
 	popq	%rsi							# vmod_priv
 	popq	%rdi							# vCTX
 	jmp	vmod_ok_wp@plt                      # simply jump to original routine. This wrapper then is transparent and ret from original routine
 											# will return to original caller as this wrapper didn't exist.
 	
-	.globl	vmod_cleanup                    # void vmod_cleanup(const struct vrt_ctx *ctx, struct vmod_priv *priv);
-	.type	vmod_cleanup, @function         # ctx: request context, priv: vmod private; returns: void
+	.globl	vmod_cleanup                    # void vmod_cleanup(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task);
+	.type	vmod_cleanup, @function         # ctx: request context, priv: vmod private, task: request private; returns: void
 vmod_cleanup:
 	pushq	%rdi							# save vCTX
 	pushq	%rsi							# save vmod_priv
+	pushq	%rdx							# save task private
 	call	get_extended_stack_enabled@plt  # obtains whether to use the stack switching process or not. Returns the value in eax
 											# where 0 is not enabled and 1 is enabled. int get_extended_stack_enabled();
 	test	%eax, %eax						# check return value
@@ -210,6 +220,7 @@ vmod_cleanup:
 	je	.VCLEANUP_NOHEAP                    # if so jump to no heap routine, otherwise
 	movq	%rax, %rcx						# backup the new stack base pointer
 	popq 	%rdi							# rdi now contains the original size
+	popq	%rdx							# restore task private
 	addq	%rdi, %rax						# rax now holds the end of stack space address
 	popq	%rsi							# restore vmod_priv
 	popq	%rdi							# restore vCTX
@@ -230,16 +241,18 @@ vmod_cleanup:
 .VCLEANUP_NOHEAP:
 	popq	%rax							# unwind the stack and restore the original values, continue into .VCLEANUP_DISABLED
 .VCLEANUP_DISABLED:
+	popq	%rdx							# task private
 	popq	%rsi							# vmod_priv
 	popq	%rdi							# vCTX
 	jmp	vmod_cleanup_wp@plt                 # simply jump to original routine. This wrapper then is transparent and ret from original routine
 											# will return to original caller as this wrapper didn't exist.
 	
-	.globl	vmod_request_cleanup            # void vmod_request_cleanup(const struct vrt_ctx *ctx, struct vmod_priv *priv);
-	.type	vmod_request_cleanup, @function # ctx: request context, priv: vmod private; returns: void
+	.globl	vmod_request_cleanup            # void vmod_request_cleanup(const struct vrt_ctx *ctx, struct vmod_priv *priv, struct vmod_priv *task);
+	.type	vmod_request_cleanup, @function # ctx: request context, priv: vmod private, task: request private; returns: void
 vmod_request_cleanup:
 	pushq	%rdi							# save vCTX
 	pushq	%rsi							# save vmod_priv
+	pushq	%rdx							# save task private
 	call	get_extended_stack_enabled@plt  # obtains whether to use the stack switching process or not. Returns the value in eax
 											# where 0 is not enabled and 1 is enabled. int get_extended_stack_enabled();
 	test	%eax, %eax						# check return value
@@ -253,6 +266,7 @@ vmod_request_cleanup:
 	je	.VREQ_CLEANUP_NOHEAP                # if so jump to no heap routine, otherwise
 	movq	%rax, %rcx						# backup the new stack base pointer
 	popq 	%rdi							# rdi now contains the original size
+	popq	%rdx							# restore task private
 	addq	%rdi, %rax						# rax now holds the end of stack space address
 	popq	%rsi							# restore vmod_priv
 	popq	%rdi							# restore vCTX
@@ -273,6 +287,7 @@ vmod_request_cleanup:
 .VREQ_CLEANUP_NOHEAP:
 	popq	%rax							# unwind the stack and restore the original values, continue into .VREQ_CLEANUP_DISABLED
 .VREQ_CLEANUP_DISABLED:
+	popq	%rdx							# task private
 	popq	%rsi							# vmod_priv
 	popq	%rdi							# vCTX
 	jmp	vmod_request_cleanup_wp@plt     	# simply jump to original routine. This wrapper then is transparent and ret from original routine
@@ -21,11 +21,11 @@
 #include "vmod_abi.h"
 
 typedef VCL_VOID td_am_init(VRT_CTX, struct vmod_priv *, VCL_STRING);
-typedef VCL_BOOL td_am_authenticate(VRT_CTX, struct vmod_priv *);
-typedef VCL_VOID td_am_done(VRT_CTX, struct vmod_priv *);
-typedef VCL_VOID td_am_ok(VRT_CTX, struct vmod_priv *);
-typedef VCL_VOID td_am_cleanup(VRT_CTX, struct vmod_priv *);
-typedef VCL_VOID td_am_request_cleanup(VRT_CTX, struct vmod_priv *);
+typedef VCL_BOOL td_am_authenticate(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+typedef VCL_VOID td_am_done(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+typedef VCL_VOID td_am_ok(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+typedef VCL_VOID td_am_cleanup(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+typedef VCL_VOID td_am_request_cleanup(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
 
 struct Vmod_am_Func {
     td_am_init *init;
@@ -52,12 +52,15 @@ static const char Vmod_Proto[] =
         "typedef VCL_VOID td_am_init(VRT_CTX, struct vmod_priv *,\n"
         "    VCL_STRING);\n"
         "typedef VCL_BOOL td_am_authenticate(VRT_CTX,\n"
+        "    struct vmod_priv *, struct vmod_priv *);\n"
+        "typedef VCL_VOID td_am_done(VRT_CTX, struct vmod_priv *,\n"
         "    struct vmod_priv *);\n"
-        "typedef VCL_VOID td_am_done(VRT_CTX, struct vmod_priv *);\n"
-        "typedef VCL_VOID td_am_ok(VRT_CTX, struct vmod_priv *);\n"
-        "typedef VCL_VOID td_am_cleanup(VRT_CTX, struct vmod_priv *);\n"
-        "typedef VCL_VOID td_am_request_cleanup(VRT_CTX,\n"
+        "typedef VCL_VOID td_am_ok(VRT_CTX, struct vmod_priv *,\n"
+        "    struct vmod_priv *);\n"
+        "typedef VCL_VOID td_am_cleanup(VRT_CTX, struct vmod_priv *,\n"
         "    struct vmod_priv *);\n"
+        "typedef VCL_VOID td_am_request_cleanup(VRT_CTX,\n"
+        "    struct vmod_priv *, struct vmod_priv *);\n"
         "\n"
 
         "struct Vmod_am_Func {\n"
@@ -87,30 +90,35 @@ static const char * const Vmod_Spec[] = {
     "Vmod_am_Func.authenticate\0"
     "BOOL\0"
     "PRIV_VCL\0"
+    "PRIV_TASK\0"
     "\0",
 
     "am.done\0"
     "Vmod_am_Func.done\0"
     "VOID\0"
     "PRIV_VCL\0"
+    "PRIV_TASK\0"
     "\0",
 
     "am.ok\0"
     "Vmod_am_Func.ok\0"
     "VOID\0"
     "PRIV_VCL\0"
+    "PRIV_TASK\0"
     "\0",
 
     "am.cleanup\0"
     "Vmod_am_Func.cleanup\0"
     "VOID\0"
     "PRIV_VCL\0"
+    "PRIV_TASK\0"
     "\0",
 
     "am.request_cleanup\0"
     "Vmod_am_Func.request_cleanup\0"
     "VOID\0"
     "PRIV_VCL\0"
+    "PRIV_TASK\0"
     "\0",
 
     "$EVENT\0Vmod_am_Func._event",
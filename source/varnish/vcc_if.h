@@ -18,11 +18,11 @@ struct vmod_priv;
 extern const struct vmod_data Vmod_am_Data;
 
 VCL_VOID vmod_init(VRT_CTX, struct vmod_priv *, VCL_STRING);
-VCL_BOOL vmod_authenticate(VRT_CTX, struct vmod_priv *);
-VCL_VOID vmod_done(VRT_CTX, struct vmod_priv *);
-VCL_VOID vmod_ok(VRT_CTX, struct vmod_priv *);
-VCL_VOID vmod_cleanup(VRT_CTX, struct vmod_priv *);
-VCL_VOID vmod_request_cleanup(VRT_CTX, struct vmod_priv *);
+VCL_BOOL vmod_authenticate(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+VCL_VOID vmod_done(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+VCL_VOID vmod_ok(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+VCL_VOID vmod_cleanup(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
+VCL_VOID vmod_request_cleanup(VRT_CTX, struct vmod_priv *, struct vmod_priv *);
 
 #ifdef VCL_MET_MAX
 vmod_event_f event_function;
@@ -665,9 +665,9 @@ static am_status_t get_request_body(am_request_t *ar) {
             /* try to analyze temp buffer data - see if we can spot our key */
             if (tmp_sz > 5) {
                 /* we've got enough data - check if that's 
-                 * LARES POST or should it be stored into a file */
+                 * LARES POST or should it be stored into a file (unless the caller asked for memory) */
                 tmp_writes = AM_FALSE;
-                to_file = memcmp(tmp, "LARES=", 6) != 0;
+                to_file = !ar->post_data_in_memory && memcmp(tmp, "LARES=", 6) != 0;
             } else {
                 /* too little was read in */
                 continue;
@@ -771,6 +771,11 @@ static am_status_t set_request_body(am_request_t *ar) {
     return AM_SUCCESS;
 }
 
+static void *request_arena_alloc(void *ws, size_t size) {
+    /* NULL on workspace overflow - arena falls back to the heap */
+    return WS_Alloc((struct ws *) ws, (unsigned int) size);
+}
+
 unsigned int vmod_authenticate_wp(struct sess *ctx, struct vmod_priv *priv) {
     unsigned int result = 0;
     int status;
@@ -807,6 +812,7 @@ unsigned int vmod_authenticate_wp(struct sess *ctx, struct vmod_priv *priv) {
     am_request.status = AM_ERROR;
     am_request.instance_id = settings->instance_id;
     am_request.ctx = req;
+    am_arena_init(&am_request.arena, request_arena_alloc, req->ctx->ws);
     am_request.method = am_method_str_to_num(http_GetReq(ctx->http));
     am_request.content_type = get_request_header(ctx, HTTP_HDR_CONTENT_TYPE);
     am_request.cookies = get_request_header(ctx, HTTP_HDR_COOKIE);
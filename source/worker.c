@@ -19,70 +19,250 @@
 #include "utility.h"
 #include "list.h"
 
-void notification_worker(void *arg) {
-    static const char *thisfunc = "notification_worker():";
-    struct notification_worker_data *r = (struct notification_worker_data *) arg;
-    struct am_namevalue *e, *t, *session_list;
-    char *token = NULL, *agentid = NULL, *temp;
-    am_bool_t destroyed = AM_FALSE, policy_change_run = AM_FALSE;
-    size_t temp_sz = 0;
-
-    if (r == NULL) return;
-    if (r->post_data == NULL || r->post_data_sz == 0) {
-        AM_LOG_WARNING(r->instance_id, "%s post data is not available", thisfunc);
-        AM_FREE(r->post_data, r);
-        return;
+#define AM_NOTIFICATION_QUEUE_MAX 65536 /* max number of notification messages waiting for the worker */
+#define AM_NOTIFICATION_DELETE_BATCH 1024 /* max number of session cache entries removed at once */
+
+#ifdef _WIN32
+static INIT_ONCE notification_initialized = INIT_ONCE_STATIC_INIT;
+static CRITICAL_SECTION notification_mutex;
+
+static BOOL CALLBACK notification_mutex_init(PINIT_ONCE io, PVOID p, PVOID *c) {
+    InitializeCriticalSection(&notification_mutex);
+    return TRUE;
+}
+
+#define NOTIFICATION_LOCK() \
+    do { \
+        InitOnceExecuteOnce(&notification_initialized, notification_mutex_init, NULL, NULL); \
+        EnterCriticalSection(&notification_mutex); \
+    } while (0)
+#define NOTIFICATION_UNLOCK() LeaveCriticalSection(&notification_mutex)
+#else
+static pthread_mutex_t notification_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define NOTIFICATION_LOCK() pthread_mutex_lock(&notification_mutex)
+#define NOTIFICATION_UNLOCK() pthread_mutex_unlock(&notification_mutex)
+#endif
+
+/* notification messages waiting for the worker (per process) */
+static struct notification_worker_data *notification_queue = NULL;
+static struct notification_worker_data *notification_queue_tail = NULL;
+static int notification_queue_size = 0;
+static am_bool_t notification_worker_scheduled = AM_FALSE;
+
+static void notification_list_free(struct notification_worker_data *list) {
+    struct notification_worker_data *next;
+    for (; list != NULL; list = next) {
+        next = list->next;
+        AM_FREE(list->post_data, list->post_data_fn, list);
+    }
+}
+
+/**
+ * Queue a notification message for the notification worker. Messages received while the worker
+ * is busy are processed together, in one batch, with no more than one worker job scheduled at a time.
+ * When the worker can not be scheduled, the messages stay queued and scheduling is retried with
+ * the next message.
+ *
+ * @param wd notification message; owned by the queue once this function is called (also on error).
+ * @return AM_SUCCESS if the message is queued, AM_ENOSPC if the queue is full.
+ */
+int am_notification_dispatch(struct notification_worker_data *wd) {
+    static const char *thisfunc = "am_notification_dispatch():";
+    unsigned long instance_id;
+    am_bool_t schedule;
+    int status, size;
+
+    if (wd == NULL) return AM_EINVAL;
+    wd->next = NULL;
+    instance_id = wd->instance_id;
+
+    NOTIFICATION_LOCK();
+    if (notification_queue_size >= AM_NOTIFICATION_QUEUE_MAX) {
+        NOTIFICATION_UNLOCK();
+        notification_list_free(wd);
+        return AM_ENOSPC;
+    }
+    if (notification_queue_tail == NULL) {
+        notification_queue = wd;
+    } else {
+        notification_queue_tail->next = wd;
+    }
+    notification_queue_tail = wd;
+    notification_queue_size++;
+    schedule = !notification_worker_scheduled;
+    notification_worker_scheduled = AM_TRUE;
+    NOTIFICATION_UNLOCK();
+
+    if (!schedule) {
+        /* worker is already on its way */
+        return AM_SUCCESS;
     }
 
-    temp = load_file(r->post_data, &temp_sz);
-    if (temp == NULL) {
-        AM_LOG_WARNING(r->instance_id, "%s failed to load post data from %s", thisfunc, r->post_data);
-        AM_FREE(r->post_data, r);
-        return;
+    /* wd might be processed (and freed) by the worker from here on */
+    status = am_worker_dispatch_lane(AM_WORKER_LANE_HIGH, 0, notification_worker, NULL);
+    if (status != AM_SUCCESS) {
+        NOTIFICATION_LOCK();
+        notification_worker_scheduled = AM_FALSE;
+        size = notification_queue_size;
+        NOTIFICATION_UNLOCK();
+        AM_LOG_WARNING(instance_id, "%s failed to dispatch notification worker (%s), %d message(s) stay queued",
+                thisfunc, am_strerror(status), size);
+    }
+    return AM_SUCCESS;
+}
+
+/**
+ * Drop the messages still queued once the worker pool is shut down (a scheduled worker
+ * job is cancelled with it), so that the next message schedules a new worker.
+ */
+void am_notification_shutdown() {
+    struct notification_worker_data *dropped;
+
+    NOTIFICATION_LOCK();
+    dropped = notification_queue;
+    notification_queue = notification_queue_tail = NULL;
+    notification_queue_size = 0;
+    notification_worker_scheduled = AM_FALSE;
+    NOTIFICATION_UNLOCK();
+    notification_list_free(dropped);
+}
+
+/* remove collected session cache entries (in one cache batch) */
+static void notification_remove_sessions(unsigned long instance_id, char **tokens, int *count) {
+    int i;
+    if (*count == 0) return;
+    am_remove_cache_entries(instance_id, (const char **) tokens, *count);
+    for (i = 0; i < *count; i++) {
+        free(tokens[i]);
     }
-    session_list = am_parse_session_xml(r->instance_id, temp, temp_sz);
+    *count = 0;
+}
+
+static void notification_batch(struct notification_worker_data *batch) {
+    static const char *thisfunc = "notification_worker():";
+    struct notification_worker_data *r, *next;
+    struct am_namevalue *e, *t, *session_list;
+    unsigned long instance_id = 0;
+    am_bool_t policy_change = AM_FALSE;
+    int count = 0, tokens_count = 0, resources_count = 0;
+    char **tokens = (char **) malloc(sizeof (char *) * AM_NOTIFICATION_DELETE_BATCH);
+    char *resources[AM_POLICY_CHANGE_MAX];
+
+    for (r = batch; r != NULL; r = next) {
+        char *token = NULL, *agentid = NULL, *temp = NULL, *data = r->post_data;
+        size_t data_sz = r->post_data_sz;
+        am_bool_t destroyed = AM_FALSE;
 
-    AM_LIST_FOR_EACH(session_list, e, t) {
-        /* SessionNotification */
-        if (strcmp(e->n, "sid") == 0) {
-            token = e->v;
+        next = r->next;
+        instance_id = r->instance_id;
+        count++;
+
+        if (data == NULL && ISVALID(r->post_data_fn) && r->post_data_sz > 0) {
+            /* web container stored the message in a file */
+            data = temp = load_file(r->post_data_fn, &data_sz);
+            if (temp == NULL) {
+                AM_LOG_WARNING(r->instance_id, "%s failed to load post data from %s", thisfunc, r->post_data_fn);
+            }
+            am_delete_file(r->post_data_fn);
         }
-        if (strcmp(e->n, "state") == 0 &&
-                (strcmp(e->v, "destroyed") == 0 || strcmp(e->v, "valid") == 0)) {
-            /* state = destroyed:
-             *  agent will remove token from its cache;
-             * state = valid:
-             *  agent will also remove token from its cache, but just to let 
-             *  it to be refreshed with the next call to SessionService
-             */
-            destroyed = AM_TRUE;
+        if (data == NULL || data_sz == 0) {
+            AM_LOG_WARNING(r->instance_id, "%s post data is not available", thisfunc);
+            AM_FREE(r->post_data, r->post_data_fn, temp, r);
+            continue;
         }
-        if (strcmp(e->n, "agentName") == 0) {
-            agentid = e->v;
+
+        session_list = am_parse_session_xml(r->instance_id, data, data_sz);
+
+        AM_LIST_FOR_EACH(session_list, e, t) {
+            /* SessionNotification */
+            if (strcmp(e->n, "sid") == 0) {
+                token = e->v;
+            }
+            if (strcmp(e->n, "state") == 0 &&
+                    (strcmp(e->v, "destroyed") == 0 || strcmp(e->v, "valid") == 0)) {
+                /* state = destroyed:
+                 *  agent will remove token from its cache;
+                 * state = valid:
+                 *  agent will also remove token from its cache, but just to let 
+                 *  it to be refreshed with the next call to SessionService
+                 */
+                destroyed = AM_TRUE;
+            }
+            if (strcmp(e->n, "agentName") == 0) {
+                agentid = e->v;
+            }
+            /* PolicyChangeNotification - ResourceName */
+            if (strcmp(e->n, "ResourceName") == 0) {
+                /* one AM_POLICY_CHANGE_KEY update per batch is enough; when there are more
+                 * changed resources than it can track, all cached policies are invalidated */
+                char *resource = resources_count < AM_POLICY_CHANGE_MAX ? strdup(NOTNULL(e->v)) : NULL;
+                if (resource == NULL) {
+                    policy_change = AM_TRUE;
+                } else {
+                    resources[resources_count++] = resource;
+                }
+            }
         }
-        /* PolicyChangeNotification - ResourceName */
-        if (!policy_change_run && strcmp(e->n, "ResourceName") == 0) {
-            int rv;
-            rv = am_set_policy_cache_epoch(time(0));
-            AM_LOG_DEBUG(r->instance_id, "%s policy change cache update status: %s",
-                    thisfunc, am_strerror(rv));
-            policy_change_run = AM_TRUE; /* one AM_POLICY_CHANGE_KEY update per PolicyChangeNotification is enough */
+
+        if (ISVALID(token) && destroyed) {
+            char *sid = tokens != NULL ? strdup(token) : NULL;
+            if (sid == NULL) {
+                am_remove_cache_entry(r->instance_id, token);
+            } else {
+                tokens[tokens_count++] = sid;
+                if (tokens_count == AM_NOTIFICATION_DELETE_BATCH) {
+                    notification_remove_sessions(r->instance_id, tokens, &tokens_count);
+                }
+            }
+        }
+
+        if (ISVALID(agentid)) {
+            AM_LOG_DEBUG(r->instance_id, "%s agent configuration entry removed (%s)",
+                    thisfunc, agentid);
+            remove_agent_instance_byname(agentid);
         }
-    }
 
-    if (ISVALID(token) && destroyed) {
-        am_remove_cache_entry(r->instance_id, token);
+        delete_am_namevalue_list(&session_list);
+        AM_FREE(r->post_data, r->post_data_fn, temp, r);
     }
 
-    if (ISVALID(agentid)) {
-        AM_LOG_DEBUG(r->instance_id, "%s agent configuration entry removed (%s)",
-                thisfunc, agentid);
-        remove_agent_instance_byname(agentid);
+    notification_remove_sessions(instance_id, tokens, &tokens_count);
+    am_free(tokens);
+
+    if (policy_change) {
+        int rv = am_set_policy_cache_epoch(time(0));
+        AM_LOG_DEBUG(instance_id, "%s policy change cache update status: %s",
+                thisfunc, am_strerror(rv));
+    } else if (resources_count > 0) {
+        int rv = am_add_policy_cache_changes((const char **) resources, resources_count, time(0));
+        AM_LOG_DEBUG(instance_id, "%s policy change cache update (%d resources) status: %s",
+                thisfunc, resources_count, am_strerror(rv));
     }
+    while (resources_count > 0) {
+        free(resources[--resources_count]);
+    }
+    AM_LOG_DEBUG(instance_id, "%s processed %d notification message(s)", thisfunc, count);
+}
 
-    delete_am_namevalue_list(&session_list);
-    am_delete_file(r->post_data);
-    AM_FREE(r->post_data, temp, r);
+/**
+ * Process all queued notification messages (see am_notification_dispatch).
+ */
+void notification_worker(void *arg) {
+    struct notification_worker_data *batch;
+    for (;;) {
+        NOTIFICATION_LOCK();
+        batch = notification_queue;
+        notification_queue = notification_queue_tail = NULL;
+        notification_queue_size = 0;
+        if (batch == NULL) {
+            notification_worker_scheduled = AM_FALSE;
+        }
+        NOTIFICATION_UNLOCK();
+        if (batch == NULL) {
+            break;
+        }
+        notification_batch(batch);
+    }
 }
 
 void session_logout_worker(void *arg) {
@@ -94,10 +274,3 @@ void session_logout_worker(void *arg) {
     am_net_options_delete(r->options);
     AM_FREE(r->openam, r->token, r->options, r);
 }
-
-void remote_audit_worker(void *arg) {
-    struct audit_worker_data *r = (struct audit_worker_data *) arg;
-    am_agent_audit_request(r->instance_id, r->openam, r->logdata, r->options);
-    am_net_options_delete(r->options);
-    AM_FREE(r->openam, r->logdata, r->options, r);
-}
@@ -34,18 +34,25 @@ struct am_audit_transfer {
 };
 
 #define INSTANCE_ID 1
-#define NUM_ENTRIES 4500 /* this value will require one shared memory resize op */
+#define NUM_ENTRIES 4500 /* fits in a 2MB instance audit ring */
+#define RING_TEST_ID 7
+#define RING_TEST_ENTRIES 1000
 #define MESSAGE_TEMPLATE "user %d - got access ticket"
 
 static int proc = 0;
+static int max_batch = 0;
+static int ring_proc = 0;
 
 am_status_t extract_audit_entries(unsigned long instance_id,
         am_status_t(*callback)(const char *openam, int count, struct am_audit_transfer *batch));
+char *audit_batch_message(int count, struct am_audit_transfer *batch, size_t *data_sz);
+void am_worker_pool_init_reset();
 
 static am_status_t write_entries_to_server(const char *openam, int count, struct am_audit_transfer *batch) {
     int msg_size, i;
+    size_t data_sz = 0;
     unsigned long instance_id;
-    char *server_id = NULL, *msg = NULL, *config_file = NULL;
+    char *server_id = NULL, *msg = NULL, *config_file = NULL, *data;
 
     for (i = 0; i < count; i++) {
         if (msg == NULL) {
@@ -57,9 +64,18 @@ static am_status_t write_entries_to_server(const char *openam, int count, struct
             msg_size = am_asprintf(&msg, batch[i].message, i + 1, msg);
         }
     }
-    AM_FREE(msg);
+
+    /* single pass payload assembly must match nested entry formatting */
+    data = audit_batch_message(count, batch, &data_sz);
+    assert_non_null(data);
+    assert_int_equal(data_sz, msg_size);
+    assert_string_equal(data, msg);
+    AM_FREE(msg, data);
 
     proc += count;
+    if (count > max_batch) {
+        max_batch = count;
+    }
 
 #define WRITE_TEST_SLEEP 1000 /* msec */
 #ifdef _WIN32
@@ -79,7 +95,14 @@ void test_audit_shm(void **state) {
     conf.config = "agent.conf";
     conf.naming_url_sz = 1;
     conf.naming_url = am;
+    conf.audit_remote_batch_size = 25;
+    conf.audit_remote_batch_bytes = 0x10000;
 
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_SIZE=2m");
+#else
+    setenv("AM_AUDIT_BUFFER_SIZE", "2m", 1);
+#endif
     assert_int_equal(am_audit_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
     assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
 
@@ -94,6 +117,344 @@ void test_audit_shm(void **state) {
     printf("extracted %d entries\n", proc);
 
     assert_int_equal(proc, NUM_ENTRIES);
+    assert_int_equal(max_batch, 25);
+
+    am_audit_shutdown();
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_SIZE=");
+#else
+    unsetenv("AM_AUDIT_BUFFER_SIZE");
+#endif
+}
+
+static am_status_t count_entries(const char *openam, int count, struct am_audit_transfer *batch) {
+    char *data = audit_batch_message(count, batch, NULL);
+    assert_non_null(data);
+    assert_non_null(strstr(data, "reqid=\"1\""));
+    free(data);
+    ring_proc += count;
+    return AM_SUCCESS;
+}
+
+/**
+ * Entries are dropped (not blocking the caller) while the instance audit ring is full,
+ * and accepted again once the ring is drained.
+ */
+void test_audit_ring_full(void **state) {
+    int i, added = 0, dropped = 0, status;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+    conf.audit_remote_batch_size = 100;
+
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_SIZE=64k");
+#else
+    setenv("AM_AUDIT_BUFFER_SIZE", "64k", 1);
+#endif
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < RING_TEST_ENTRIES; i++) {
+        status = am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i);
+        if (status == AM_SUCCESS) {
+            added++;
+        } else {
+            assert_int_equal(status, AM_ENOSPC);
+            dropped++;
+        }
+    }
+    assert_true(added > 0);
+    assert_true(dropped > 0);
+    assert_int_equal(added + dropped, RING_TEST_ENTRIES);
+
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, added);
+
+    /* ring is empty again */
+    assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+            "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, added + 1);
+
+    am_audit_shutdown();
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_SIZE=");
+#else
+    unsetenv("AM_AUDIT_BUFFER_SIZE");
+#endif
+}
+
+/**
+ * Rings are assigned to instances as they register; an instance registered after all the rings
+ * are taken (and with no spool file) can not queue audit entries.
+ */
+void test_audit_ring_assign(void **state) {
+    int i;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.config = "agent.conf";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_COUNT=2");
+#else
+    setenv("AM_AUDIT_BUFFER_COUNT", "2", 1);
+#endif
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    for (i = 1; i <= 3; i++) {
+        conf.instance_id = i;
+        assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+    }
+    /* re-registration keeps the ring */
+    conf.instance_id = 2;
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 1; i <= 3; i++) {
+        assert_int_equal(am_add_remote_audit_entry(i, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), i <= 2 ? AM_SUCCESS : AM_ENOSPC);
+    }
+    for (i = 1; i <= 2; i++) {
+        ring_proc = 0;
+        assert_int_equal(extract_audit_entries(i, count_entries), AM_SUCCESS);
+        assert_int_equal(ring_proc, 1);
+    }
+
+    am_audit_shutdown();
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_COUNT=");
+#else
+    unsetenv("AM_AUDIT_BUFFER_COUNT");
+#endif
+}
+
+static am_status_t fail_entries(const char *openam, int count, struct am_audit_transfer *batch) {
+    return AM_ERROR;
+}
+
+/**
+ * Without a spool file, ring entries of a batch the server did not accept are kept in the ring
+ * and sent on the next run.
+ */
+void test_audit_ring_send_failed(void **state) {
+    int i;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+    conf.audit_remote_batch_size = 10;
+
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < 95; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    }
+
+    /* server does not accept anything */
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, fail_entries), AM_SUCCESS);
+
+    ring_proc = 0;
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, 95);
+
+    /* everything is released */
+    ring_proc = 0;
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, 0);
+
+    am_audit_shutdown();
+}
+
+static am_config_t *consumer_conf = NULL;
+static int nested_proc = 0;
+
+/* while the ring is sent directly, a spool file shows up (other process, reconfigured instance) */
+static am_status_t nested_entries(const char *openam, int count, struct am_audit_transfer *batch) {
+    if (consumer_conf->audit_file == NULL) {
+        int outer = ring_proc;
+        consumer_conf->audit_file = "."FILE_PATH_SEP"audit-spool-test.log";
+        assert_int_equal(am_audit_register_instance(consumer_conf), AM_SUCCESS);
+        assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+        nested_proc = ring_proc - outer;
+    }
+    ring_proc += count;
+    return AM_SUCCESS;
+}
+
+/**
+ * The ring has a single consumer: entries which are being sent directly from the ring are not
+ * moved to the spool file (and sent again) meanwhile.
+ */
+void test_audit_single_consumer(void **state) {
+    int i;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+    consumer_conf = &conf;
+
+    unlink("."FILE_PATH_SEP"remote-audit-1.spool");
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < 10; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+    }
+
+    ring_proc = 0;
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, nested_entries), AM_SUCCESS);
+    assert_int_equal(nested_proc, 0);
+    assert_int_equal(ring_proc, 10);
+
+    /* nothing left, neither in the ring nor in the spool file */
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, 10);
 
     am_audit_shutdown();
+    unlink("."FILE_PATH_SEP"remote-audit-1.spool");
+}
+
+/**
+ * With a spool file, ring entries are spooled by the audit timer, entries which do not fit in the
+ * ring are written to the spool file directly, entries which the server did not accept are kept,
+ * and the backlog is sent after a restart.
+ */
+void test_audit_spool_replay(void **state) {
+    int i;
+    struct stat st;
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+    conf.audit_remote_batch_size = 100;
+    conf.audit_file = "."FILE_PATH_SEP"audit-spool-test.log";
+
+    unlink("."FILE_PATH_SEP"remote-audit-1.spool");
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_SIZE=64k");
+#else
+    setenv("AM_AUDIT_BUFFER_SIZE", "64k", 1);
+#endif
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < RING_TEST_ENTRIES; i++) {
+        assert_int_equal(am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i), AM_SUCCESS);
+        if (i == RING_TEST_ENTRIES / 2) {
+            /* timer run moves the ring to the spool file (server does not accept anything) */
+            assert_int_equal(extract_audit_entries(INSTANCE_ID, fail_entries), AM_SUCCESS);
+        }
+    }
+
+    /* server does not accept anything */
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, fail_entries), AM_SUCCESS);
+    assert_int_equal(stat("."FILE_PATH_SEP"remote-audit-1.spool", &st), 0);
+    assert_true(st.st_size > RING_TEST_ENTRIES * 100);
+
+    /* restart */
+    am_audit_shutdown();
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    ring_proc = 0;
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, RING_TEST_ENTRIES);
+
+    /* spool file is reset once everything is sent */
+    assert_int_equal(stat("."FILE_PATH_SEP"remote-audit-1.spool", &st), 0);
+    assert_int_equal(st.st_size, 4096);
+
+    am_audit_shutdown();
+    unlink("."FILE_PATH_SEP"remote-audit-1.spool");
+#ifdef _WIN32
+    _putenv("AM_AUDIT_BUFFER_SIZE=");
+#else
+    unsetenv("AM_AUDIT_BUFFER_SIZE");
+#endif
+}
+
+#define SPILL_THREADS 4
+
+static void *spill_producer(void *arg) {
+    int i, *added = (int *) arg;
+    for (i = 0; i < RING_TEST_ENTRIES / 2; i++) {
+        if (am_add_remote_audit_entry(INSTANCE_ID, "AGENT_TOKEN", "01", "remote-file.log",
+                "USER_TOKEN", MESSAGE_TEMPLATE, i) == AM_SUCCESS) {
+            (*added)++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * A full ring does not block request threads, and with a spool file nothing is lost: entries which
+ * do not fit in the ring are written to the spool file, and a worker job moves the ring to the spool
+ * file, making room for new entries.
+ */
+void test_audit_spool_spill(void **state) {
+#ifndef _WIN32
+    int i, total = 0;
+    int added[SPILL_THREADS];
+    pthread_t producers[SPILL_THREADS];
+    am_config_t conf;
+    char *am[] = {"http://localhost/am"};
+    memset(&conf, 0, sizeof (am_config_t));
+    conf.instance_id = INSTANCE_ID;
+    conf.config = "agent.conf";
+    conf.naming_url_sz = 1;
+    conf.naming_url = am;
+    conf.audit_remote_batch_size = 100;
+    conf.audit_file = "."FILE_PATH_SEP"audit-spool-test.log";
+
+    unlink("."FILE_PATH_SEP"remote-audit-1.spool");
+    setenv("AM_AUDIT_BUFFER_SIZE", "64k", 1);
+    am_worker_pool_init_reset();
+    am_worker_pool_init();
+    assert_int_equal(am_audit_init(RING_TEST_ID), AM_SUCCESS);
+    assert_int_equal(am_audit_register_instance(&conf), AM_SUCCESS);
+
+    for (i = 0; i < SPILL_THREADS; i++) {
+        added[i] = 0;
+        assert_int_equal(pthread_create(&producers[i], NULL, spill_producer, &added[i]), 0);
+    }
+    for (i = 0; i < SPILL_THREADS; i++) {
+        pthread_join(producers[i], NULL);
+        assert_int_equal(added[i], RING_TEST_ENTRIES / 2);
+        total += added[i];
+    }
+
+    /* timer runs (each one is throttled) send everything */
+    ring_proc = 0;
+    for (i = 0; i < 10 && ring_proc < total; i++) {
+        assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    }
+    assert_int_equal(ring_proc, total);
+    assert_int_equal(extract_audit_entries(INSTANCE_ID, count_entries), AM_SUCCESS);
+    assert_int_equal(ring_proc, total);
+
+    am_worker_pool_shutdown();
+    am_audit_shutdown();
+    unlink("."FILE_PATH_SEP"remote-audit-1.spool");
+    unsetenv("AM_AUDIT_BUFFER_SIZE");
+#endif
 }
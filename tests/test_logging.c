@@ -23,6 +23,7 @@
 #include "utility.h"
 #include "net_client.h"
 #include "thread.h"
+#include "zlib.h"
 #include "cmocka.h"
 
 struct log_range {
@@ -177,3 +178,364 @@ void test_logging(void **state) {
     am_delete_file("temp-debug.log");
     am_delete_file("temp-audit.log");
 }
+
+/*
+ * log level changes made with am_log_register_instance must be picked up by perform_logging
+ */
+void test_logging_level_refresh(void **state) {
+    int instance = 2;
+    int clearup_count = 0;
+
+    assert_int_equal(am_remove_shm_and_locks(instance, test_log_callback, &clearup_count), AM_SUCCESS);
+#ifdef _WIN32
+    am_init_worker(instance);
+#else
+    am_init(instance);
+#endif
+
+    am_log_register_instance(instance, "temp-debug.log", AM_LOG_LEVEL_ERROR, 0,
+            "temp-audit.log", AM_LOG_LEVEL_NONE, 0x100000, "temp-agent.conf");
+
+    assert_true(perform_logging(instance, AM_LOG_LEVEL_ERROR));
+    assert_false(perform_logging(instance, AM_LOG_LEVEL_WARNING));
+    assert_false(perform_logging(instance, AM_LOG_LEVEL_DEBUG));
+    assert_false(perform_logging(instance, AM_LOG_LEVEL_AUDIT));
+    assert_false(perform_logging(instance + 1, AM_LOG_LEVEL_ERROR));
+
+    am_log_register_instance(instance, "temp-debug.log", AM_LOG_LEVEL_DEBUG, 0,
+            "temp-audit.log", AM_LOG_LEVEL_AUDIT, 0x100000, "temp-agent.conf");
+
+    assert_true(perform_logging(instance, AM_LOG_LEVEL_DEBUG));
+    assert_true(perform_logging(instance, AM_LOG_LEVEL_AUDIT));
+    assert_false(perform_logging(instance + 1, AM_LOG_LEVEL_DEBUG));
+
+    am_shutdown_worker();
+    am_shutdown(instance);
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+}
+
+static void *log_variable_procedure(void * params) {
+    struct log_range * range = params;
+    char padding[4096];
+    int i;
+
+    memset(padding, 'x', sizeof (padding));
+    for (i = range->start; i < range->end; i++) {
+        AM_LOG_DEBUG(range->inst, "message %d %.*s", i, (i * 131) % (int) sizeof (padding), padding);
+    }
+    return NULL;
+}
+
+/*
+ * log messages of varying length through a small log ring, so that records wrap around
+ * the end of the ring many times, and ensure that each message is present
+ */
+void test_logging_variable_records(void **state) {
+    int instance = 3;
+    int clearup_count = 0;
+    int i, nthreads = 8, nlogs = 500;
+    am_thread_t threads[8];
+    struct log_range ranges[8];
+
+    assert_int_equal(am_remove_shm_and_locks(instance, test_log_callback, &clearup_count), AM_SUCCESS);
+#ifdef _WIN32
+    _putenv("AM_LOG_BUFFER_SIZE=64k");
+    am_init_worker(instance);
+#else
+    setenv("AM_LOG_BUFFER_SIZE", "64k", 1);
+    am_init(instance);
+#endif
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+
+    am_log_register_instance(instance, "temp-debug.log", AM_LOG_LEVEL_DEBUG, 0,
+            "temp-audit.log", 0, 0x10000000, "temp-agent.conf");
+
+    for (i = 0; i < nthreads; i++) {
+        ranges[i].inst = instance;
+        ranges[i].start = i * nlogs;
+        ranges[i].end = ranges[i].start + nlogs;
+        AM_THREAD_CREATE(threads[i], log_variable_procedure, ranges + i);
+    }
+    for (i = 0; i < nthreads; i++) {
+        AM_THREAD_JOIN(threads[i]);
+    }
+
+    am_shutdown_worker();
+    am_shutdown(instance);
+
+#ifdef _WIN32
+    _putenv("AM_LOG_BUFFER_SIZE=");
+#else
+    unsetenv("AM_LOG_BUFFER_SIZE");
+#endif
+
+    verify_file("temp-debug.log", nthreads * nlogs);
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+}
+
+/*
+ * with deferred logging, messages formatted by the log worker must read the same as those
+ * formatted by the caller
+ */
+void test_logging_deferred(void **state) {
+    int instance = 4;
+    int clearup_count = 0;
+    size_t size = 0;
+    char *data, expected[256];
+    const char *str = "value";
+    long double ld = 1.5;
+
+    assert_int_equal(am_remove_shm_and_locks(instance, test_log_callback, &clearup_count), AM_SUCCESS);
+#ifdef _WIN32
+    am_init_worker(instance);
+#else
+    am_init(instance);
+#endif
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+
+    am_log_register_instance(instance, "temp-debug.log", AM_LOG_LEVEL_DEBUG, 0,
+            "temp-audit.log", AM_LOG_LEVEL_AUDIT, 0x100000, "temp-agent.conf");
+    am_log_set_options(instance, -1, AM_TRUE, 0, 0, 0);
+
+    AM_LOG_DEBUG(instance, "deferred %d %5u|%-4x|%c %s|%.3s|%*d|%.*s %"PR_L64" %zu %.2f%%",
+            -42, 7u, 0xab, 'z', str, str, 6, 12, 2, str, (int64_t) 1234567890123LL, (size_t) 99, 3.14159);
+    AM_LOG_ERROR(instance, "deferred error %s %ld", NULL, -5L);
+    AM_LOG_DEBUG(instance, "deferred long double %.1Lf", ld);
+    AM_LOG_WARNING(instance, "deferred literal only");
+
+    am_shutdown_worker();
+    am_shutdown(instance);
+
+    data = load_file("temp-debug.log", &size);
+    assert_non_null(data);
+
+    snprintf(expected, sizeof (expected), "deferred %d %5u|%-4x|%c %s|%.3s|%*d|%.*s %"PR_L64" %zu %.2f%%",
+            -42, 7u, 0xab, 'z', str, str, 6, 12, 2, str, (int64_t) 1234567890123LL, (size_t) 99, 3.14159);
+    assert_non_null(strstr(data, expected));
+    assert_non_null(strstr(data, "deferred error (null) -5"));
+    assert_non_null(strstr(data, "deferred long double 1.5"));
+    assert_non_null(strstr(data, "WARNING"));
+    assert_non_null(strstr(data, "deferred literal only"));
+    assert_non_null(strstr(data, "test_logging.c:"));
+    free(data);
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+}
+
+static am_bool_t rotated_file_exists(const char *name, int index, const char *suffix) {
+    char path[256];
+    snprintf(path, sizeof (path), "%s.%d%s", name, index, suffix);
+    return file_exists(path);
+}
+
+/*
+ * rotated log files are numbered after the ones already present, compressed and pruned
+ * (to keep the newest two) by the rotation job
+ */
+void test_logging_rotation(void **state) {
+    int instance = 5;
+    int clearup_count = 0;
+    int i;
+    char padding[1000], path[256];
+    const char *name = "temp-rotate.log";
+    FILE *f;
+    gzFile gz;
+
+    for (i = 1; i < 16; i++) {
+        snprintf(path, sizeof (path), "%s.%d", name, i);
+        am_delete_file(path);
+        snprintf(path, sizeof (path), "%s.%d.gz", name, i);
+        am_delete_file(path);
+    }
+    am_delete_file(name);
+    /* stale rotated files */
+    for (i = 1; i < 4; i += 2) {
+        snprintf(path, sizeof (path), "%s.%d", name, i);
+        f = fopen(path, "w");
+        assert_non_null(f);
+        fputs("old\n", f);
+        fclose(f);
+    }
+
+    assert_int_equal(am_remove_shm_and_locks(instance, test_log_callback, &clearup_count), AM_SUCCESS);
+#ifdef _WIN32
+    am_init_worker(instance);
+#else
+    am_init(instance);
+#endif
+
+    am_log_register_instance(instance, name, AM_LOG_LEVEL_DEBUG, 1,
+            "temp-audit.log", AM_LOG_LEVEL_NONE, 0, "temp-agent.conf");
+    am_log_set_options(instance, -1, AM_FALSE, AM_TRUE, 2, 0);
+
+    /* at least 4 rotations at the minimum log file size (5MB) */
+    memset(padding, 'r', sizeof (padding));
+    for (i = 0; i < 22000; i++) {
+        AM_LOG_DEBUG(instance, "rotate %d %.*s", i, (int) sizeof (padding), padding);
+    }
+
+    am_shutdown_worker();
+    am_shutdown(instance);
+
+    /* rotation jobs run in the background */
+    for (i = 0; i < 100 && (rotated_file_exists(name, 5, ".gz") || !rotated_file_exists(name, 7, ".gz")); i++) {
+        sleep(1);
+    }
+
+    for (i = 1; i < 6; i++) {
+        assert_false(rotated_file_exists(name, i, ""));
+        assert_false(rotated_file_exists(name, i, ".gz"));
+    }
+    assert_false(rotated_file_exists(name, 6, ""));
+    assert_true(rotated_file_exists(name, 6, ".gz"));
+    assert_true(rotated_file_exists(name, 7, ".gz"));
+
+    snprintf(path, sizeof (path), "%s.7.gz", name);
+    gz = gzopen(path, "rb");
+    assert_non_null(gz);
+    memset(padding, 0, sizeof (padding));
+    assert_true(gzread(gz, padding, sizeof (padding) - 1) > 0);
+    assert_non_null(strstr(padding, "rotate "));
+    gzclose(gz);
+
+    for (i = 1; i < 16; i++) {
+        snprintf(path, sizeof (path), "%s.%d", name, i);
+        am_delete_file(path);
+        snprintf(path, sizeof (path), "%s.%d.gz", name, i);
+        am_delete_file(path);
+    }
+    am_delete_file(name);
+    am_delete_file("temp-audit.log");
+}
+
+static am_bool_t wait_for_log_stats(int instance, unsigned int writes, unsigned int syncs) {
+    unsigned int w, s;
+    int i;
+    for (i = 0; i < 100; i++) {
+        am_log_get_stats(instance, &w, &s);
+        if (w >= writes && s >= syncs) {
+            return AM_TRUE;
+        }
+        usleep(50000);
+    }
+    return AM_FALSE;
+}
+
+/*
+ * records logged in a burst are written out in batches, each batch fsync'ed with the default
+ * sync policy
+ */
+void test_logging_batch_sync(void **state) {
+    int instance = 6;
+    int clearup_count = 0;
+    int i, count = 5000;
+    unsigned int writes, syncs;
+
+    assert_int_equal(am_remove_shm_and_locks(instance, test_log_callback, &clearup_count), AM_SUCCESS);
+#ifdef _WIN32
+    am_init_worker(instance);
+#else
+    am_init(instance);
+#endif
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+
+    am_log_register_instance(instance, "temp-debug.log", AM_LOG_LEVEL_DEBUG, 0,
+            "temp-audit.log", AM_LOG_LEVEL_NONE, 0, "temp-agent.conf");
+    /* instance registration header */
+    assert_true(wait_for_log_stats(instance, 1, 1));
+    am_log_get_stats(instance, &writes, &syncs);
+
+    for (i = 0; i < count; i++) {
+        AM_LOG_DEBUG(instance, "message %d", i);
+    }
+    assert_true(wait_for_log_stats(instance, writes + 1, syncs + 1));
+    for (i = 0; i < 100; i++) {
+        unsigned int w, s;
+        usleep(50000);
+        am_log_get_stats(instance, &w, &s);
+        if (w == writes && s == syncs && w == s) {
+            /* all written out and synced */
+            break;
+        }
+        writes = w;
+        syncs = s;
+    }
+    assert_true(writes > 1);
+    assert_true(writes < (unsigned int) count);
+    assert_int_equal(writes, syncs);
+
+    am_shutdown_worker();
+    am_shutdown(instance);
+
+    verify_file("temp-debug.log", count);
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+}
+
+/*
+ * with an fsync interval, the last batch is fsync'ed once the interval is over, even though
+ * nothing more is logged; with fsync turned off, batches are only written out
+ */
+void test_logging_sync_interval(void **state) {
+    int instance = 7;
+    int clearup_count = 0;
+    unsigned int writes, syncs, w, s;
+
+    assert_int_equal(am_remove_shm_and_locks(instance, test_log_callback, &clearup_count), AM_SUCCESS);
+#ifdef _WIN32
+    am_init_worker(instance);
+#else
+    am_init(instance);
+#endif
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+
+    am_log_register_instance(instance, "temp-debug.log", AM_LOG_LEVEL_DEBUG, 0,
+            "temp-audit.log", AM_LOG_LEVEL_NONE, 0, "temp-agent.conf");
+    assert_true(wait_for_log_stats(instance, 1, 1));
+    am_log_set_options(instance, 1500, AM_FALSE, 0, 0, 0);
+
+    /* first batch after the interval is synced right away */
+    sleep(2);
+    am_log_get_stats(instance, &writes, &syncs);
+    AM_LOG_DEBUG(instance, "message 0");
+    assert_true(wait_for_log_stats(instance, writes + 1, syncs + 1));
+    am_log_get_stats(instance, &writes, &syncs);
+
+    /* next one is left for the interval to be over */
+    AM_LOG_DEBUG(instance, "message 1");
+    assert_true(wait_for_log_stats(instance, writes + 1, 0));
+    am_log_get_stats(instance, &w, &s);
+    assert_int_equal(s, syncs);
+    assert_true(wait_for_log_stats(instance, writes + 1, syncs + 1));
+
+    /* fsync turned off */
+    am_log_set_options(instance, -1, AM_FALSE, 0, 0, 0);
+    am_log_get_stats(instance, &writes, &syncs);
+    AM_LOG_DEBUG(instance, "message 2");
+    assert_true(wait_for_log_stats(instance, writes + 1, 0));
+    sleep(2);
+    am_log_get_stats(instance, &w, &s);
+    assert_int_equal(s, syncs);
+
+    am_shutdown_worker();
+    am_shutdown(instance);
+
+    verify_file("temp-debug.log", 3);
+
+    am_delete_file("temp-debug.log");
+    am_delete_file("temp-audit.log");
+}
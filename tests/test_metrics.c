@@ -0,0 +1,209 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "cmocka.h"
+
+typedef am_return_t (* am_state_func_t)(am_request_t *);
+void am_test_get_state_funcs(am_state_func_t const **func_array_p, int *func_array_len_p);
+
+#define METRICS_TEST_ID 11
+#define METRICS_TEST_INSTANCE 4343
+
+/**
+ * Span percentiles are reported within the histogram precision (1/16 of the value).
+ */
+void test_metrics_span_percentiles(void **state) {
+    int i;
+    uint64_t sum = 0, v;
+
+    assert_int_equal(am_metrics_init(METRICS_TEST_ID), AM_SUCCESS);
+    am_metrics_reset(METRICS_TEST_INSTANCE);
+    assert_int_equal(am_metrics_span_percentile(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, 99), 0);
+
+    for (i = 0; i < 990; i++) {
+        am_metrics_record(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, 250);
+    }
+    for (i = 0; i < 10; i++) {
+        am_metrics_record(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, 40000);
+    }
+    am_metrics_record(METRICS_TEST_INSTANCE, AM_SPAN_SETUP_REQUEST_DATA, 7);
+
+    assert_int_equal(am_metrics_span_count(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, &sum), 1000);
+    assert_int_equal(sum, 990 * 250 + 10 * 40000);
+
+    v = am_metrics_span_percentile(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, 50);
+    assert_true(v >= 250 && v <= 250 + 250 / 16);
+    v = am_metrics_span_percentile(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, 99);
+    assert_true(v >= 250 && v <= 250 + 250 / 16);
+    v = am_metrics_span_percentile(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, 99.9);
+    assert_true(v >= 40000 && v <= 40000 + 40000 / 16);
+
+    /* small values are exact */
+    assert_int_equal(am_metrics_span_percentile(METRICS_TEST_INSTANCE, AM_SPAN_SETUP_REQUEST_DATA, 50), 7);
+    assert_string_equal(am_metrics_span_name(AM_SPAN_REQUEST), "request");
+
+    am_metrics_reset(METRICS_TEST_INSTANCE);
+    assert_int_equal(am_metrics_span_count(METRICS_TEST_INSTANCE, AM_SPAN_VALIDATE_POLICY, NULL), 0);
+    am_metrics_shutdown();
+}
+
+/**
+ * Per-cpu counters are summed up and reported (with span summaries) in Prometheus text format.
+ */
+void test_metrics_text(void **state) {
+    int i;
+    char *text;
+
+    assert_int_equal(am_metrics_init(METRICS_TEST_ID), AM_SUCCESS);
+    am_metrics_reset(0);
+
+    for (i = 0; i < 100; i++) {
+        am_metrics_incr(AM_METRIC_CACHE_HIT);
+    }
+    am_metrics_add(AM_METRIC_CACHE_MISS, 7);
+    assert_int_equal(am_metrics_counter(AM_METRIC_CACHE_HIT), 100);
+    assert_int_equal(am_metrics_counter(AM_METRIC_CACHE_MISS), 7);
+    assert_int_equal(am_metrics_counter(AM_METRIC_MAX), 0);
+
+    am_metrics_record(METRICS_TEST_INSTANCE, AM_SPAN_BACKEND_REQUEST, 1500000);
+    am_metrics_record(METRICS_TEST_INSTANCE + 1, AM_SPAN_BACKEND_REQUEST, 1000);
+
+    text = am_metrics_text(0);
+    assert_non_null(text);
+    assert_non_null(strstr(text, "# TYPE am_cache_hits_total counter\nam_cache_hits_total 100\n"));
+    assert_non_null(strstr(text, "\nam_cache_misses_total 7\n"));
+    assert_non_null(strstr(text, "\nam_backend_request_seconds_count{instance=\"4343\"} 1\n"));
+    assert_non_null(strstr(text, "\nam_backend_request_seconds_sum{instance=\"4343\"} 1.500000\n"));
+    assert_non_null(strstr(text, "\nam_backend_request_seconds_count{instance=\"4344\"} 1\n"));
+    assert_null(strstr(text, "am_request_span_seconds_count"));
+    /* text is complete, up to the last section */
+    assert_non_null(strstr(text, "# TYPE am_worker_lane_wait_seconds summary\n"));
+    free(text);
+
+    /* one instance only */
+    text = am_metrics_text(METRICS_TEST_INSTANCE);
+    assert_non_null(text);
+    assert_non_null(strstr(text, "\nam_backend_request_seconds_count{instance=\"4343\"} 1\n"));
+    assert_null(strstr(text, "instance=\"4344\""));
+    free(text);
+
+    am_metrics_reset(0);
+    assert_int_equal(am_metrics_counter(AM_METRIC_CACHE_HIT), 0);
+    am_metrics_shutdown();
+}
+
+/**
+ * Metrics of an agent that is not running are not created by a reader.
+ */
+void test_metrics_open(void **state) {
+    char name[AM_PATH_SIZE], *text;
+
+    snprintf(name, sizeof (name), "%s", get_global_name(AM_METRICS_SHM_NAME, METRICS_TEST_ID + 1));
+    am_shm_delete(name);
+
+    assert_int_equal(am_metrics_open(METRICS_TEST_ID + 1), AM_ENOTSTARTED);
+    assert_false(am_shm_exists(name));
+    assert_null(am_metrics_text(0));
+
+    /* agent is running */
+    assert_int_equal(am_metrics_init(METRICS_TEST_ID), AM_SUCCESS);
+    assert_true(am_shm_exists(get_global_name(AM_METRICS_SHM_NAME, METRICS_TEST_ID)));
+    assert_int_equal(am_metrics_open(METRICS_TEST_ID), AM_SUCCESS);
+    text = am_metrics_text(0);
+    assert_non_null(text);
+    free(text);
+    am_metrics_shutdown();
+}
+
+static char *metrics_response = NULL;
+
+static am_status_t set_metrics_response(am_request_t *r, const char *data, const char *content_type) {
+    am_free(metrics_response);
+    metrics_response = strdup(data);
+    return AM_SUCCESS;
+}
+
+static am_return_t metrics_request(am_request_t *r, const char *client_ip) {
+    am_state_func_t const *func_array = NULL;
+    int array_len = 0;
+
+    am_test_get_state_funcs(&func_array, &array_len);
+    am_free(metrics_response);
+    metrics_response = NULL;
+    r->client_ip = (char *) client_ip;
+    r->status = AM_SUCCESS;
+    return func_array[2](r); /* handle_notification */
+}
+
+/**
+ * Metrics url serves the request's agent instance metrics to the allowed client addresses only
+ * (loopback, if none are configured).
+ */
+void test_metrics_url_access(void **state) {
+    am_config_map_t allowed[] = {
+        { "0", "10.1.0.0/16" },
+        { "1", "192.168.1.7" }
+    };
+    am_config_t config;
+    am_request_t request;
+
+    memset(&config, 0, sizeof (am_config_t));
+    config.metrics_url = "http://a.example.com:80/metrics";
+    memset(&request, 0, sizeof (am_request_t));
+    request.instance_id = METRICS_TEST_INSTANCE;
+    request.conf = &config;
+    request.method = AM_REQUEST_GET;
+    request.normalized_url = "http://a.example.com:80/metrics";
+    request.am_set_custom_response_f = set_metrics_response;
+
+    assert_int_equal(am_metrics_init(METRICS_TEST_ID), AM_SUCCESS);
+    am_metrics_reset(0);
+    am_metrics_record(METRICS_TEST_INSTANCE, AM_SPAN_BACKEND_REQUEST, 1000);
+    am_metrics_record(METRICS_TEST_INSTANCE + 1, AM_SPAN_BACKEND_REQUEST, 1000);
+
+    assert_int_equal(metrics_request(&request, "10.1.1.1"), AM_FAIL);
+    assert_int_equal(request.status, AM_FORBIDDEN);
+    assert_null(metrics_response);
+
+    assert_int_equal(metrics_request(&request, "127.0.0.1"), AM_OK);
+    assert_int_equal(request.status, AM_NOTIFICATION_DONE);
+    assert_non_null(metrics_response);
+    assert_non_null(strstr(metrics_response, "am_backend_request_seconds_count{instance=\"4343\"} 1\n"));
+    assert_null(strstr(metrics_response, "instance=\"4344\""));
+
+    config.metrics_ip_map = allowed;
+    config.metrics_ip_map_sz = 2;
+    assert_int_equal(metrics_request(&request, "127.0.0.1"), AM_FAIL);
+    assert_int_equal(request.status, AM_FORBIDDEN);
+    assert_int_equal(metrics_request(&request, "10.2.1.1"), AM_FAIL);
+    assert_int_equal(metrics_request(&request, "10.1.1.1"), AM_OK);
+    assert_int_equal(request.status, AM_NOTIFICATION_DONE);
+    assert_int_equal(metrics_request(&request, "192.168.1.7"), AM_OK);
+
+    am_free(metrics_response);
+    metrics_response = NULL;
+    am_metrics_reset(0);
+    am_metrics_shutdown();
+}
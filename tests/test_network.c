@@ -24,6 +24,7 @@
 #include "net_client.h"
 #include "thread.h"
 #include "list.h"
+#include "zlib.h"
 #include "cmocka.h"
 
 void am_net_init_ssl_reset();
@@ -118,3 +119,342 @@ void test_multiple_requests(void **state) {
     AM_FREE(agent_token, profile_xml);
     delete_am_namevalue_list(&agent_session);
 }
+
+#ifndef _WIN32
+
+#define BENCH_POLICY_CALLS 200
+
+static const char *bench_session_response =
+    "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+    "<ResponseSet vers='1.0' svcid='session' reqid='0'><Response><![CDATA["
+    "<SessionResponse vers='1.0' reqid='1'><GetSession></GetSession></SessionResponse>]]>"
+    "</Response></ResponseSet>";
+
+static const char *bench_policy_response =
+    "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+    "<ResponseSet vers='1.0' svcid='policy' reqid='3'>"
+    "<Response><![CDATA[<PolicyService version='1.0'><PolicyResponse requestId='4' issueInstant='1424783306343'>"
+    "<ResourceResult name='http://a.example.com:80/index.html'><PolicyDecision>"
+    "<ActionDecision timeToLive='9223372036854775807'><AttributeValuePair><Attribute name='GET'/>"
+    "<Value>allow</Value></AttributeValuePair><Advices></Advices></ActionDecision>"
+    "</PolicyDecision></ResourceResult>"
+    "</PolicyResponse></PolicyService>]]></Response></ResponseSet>";
+
+static volatile int bench_server_stop = 0;
+
+/* minimal http server, replying to session and policy service requests (no heap use) */
+static void *bench_server(void *arg) {
+    int sock = *(int *) arg;
+    char buffer[8192], response[2048];
+
+    while (!bench_server_stop) {
+        int client, got = 0, rv, content_length = -1;
+        char *body = NULL;
+        const char *reply;
+
+        client = accept(sock, NULL, NULL);
+        if (client < 0) break;
+
+        while (got < (int) sizeof (buffer) - 1) {
+            rv = (int) recv(client, buffer + got, sizeof (buffer) - 1 - got, 0);
+            if (rv <= 0) break;
+            got += rv;
+            buffer[got] = 0;
+            if (body == NULL && (body = strstr(buffer, "\r\n\r\n")) != NULL) {
+                char *cl = strstr(buffer, "Content-Length: ");
+                body += 4;
+                content_length = cl != NULL ? atoi(cl + 16) : 0;
+            }
+            if (body != NULL && (int) (buffer + got - body) >= content_length) break;
+        }
+
+        reply = strstr(buffer, "/sessionservice") != NULL ? bench_session_response : bench_policy_response;
+        rv = snprintf(response, sizeof (response), "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/xml\r\n"
+                "Content-Length: %d\r\n"
+                "Connection: close\r\n\r\n%s", (int) strlen(reply), reply);
+        send(client, response, rv, 0);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * Policy call benchmark: time per am_agent_policy_request
+ * (session + policy request against a local server).
+ */
+void test_policy_request_benchmark(void **state) {
+    int i, rv, sock, port, reuse = 1;
+    struct sockaddr_in addr;
+    socklen_t addr_sz = sizeof (addr);
+    pthread_t server;
+    am_net_options_t net_options;
+    char openam_url[64];
+    am_timer_t tmr = {0, 0, 0, 0};
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(sock >= 0);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &reuse, sizeof (reuse));
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert_int_equal(bind(sock, (struct sockaddr *) &addr, sizeof (addr)), 0);
+    assert_int_equal(listen(sock, 16), 0);
+    assert_int_equal(getsockname(sock, (struct sockaddr *) &addr, &addr_sz), 0);
+    port = ntohs(addr.sin_port);
+    snprintf(openam_url, sizeof (openam_url), "http://127.0.0.1:%d/am", port);
+
+    bench_server_stop = 0;
+    assert_int_equal(pthread_create(&server, NULL, bench_server, &sock), 0);
+
+    memset(&net_options, 0, sizeof (am_net_options_t));
+    net_options.local = AM_TRUE;
+    am_net_init();
+
+    am_timer_start(&tmr);
+    for (i = 0; i < BENCH_POLICY_CALLS; i++) {
+        struct am_policy_result *policy = NULL;
+        rv = am_agent_policy_request(0, openam_url, "AQIC5wM2LY4SfcxAgent", "AQIC5wM2LY4SfcxUser",
+                "http://a.example.com:80/index.html", "self", "127.0.0.1", NULL, NULL,
+                &net_options, NULL, &policy);
+        assert_int_equal(rv, AM_SUCCESS);
+        assert_non_null(policy);
+        delete_am_policy_result_list(&policy);
+    }
+    am_timer_stop(&tmr);
+
+    bench_server_stop = 1;
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+    pthread_join(server, NULL);
+
+    am_net_options_delete(&net_options);
+    am_net_shutdown();
+
+    fprintf(stderr, "POLICY CALL: %.3f msec/call\n", am_timer_elapsed(&tmr) * 1000.0 / BENCH_POLICY_CALLS);
+}
+
+
+/* canned response, served once per connection by encoded_server */
+static char encoded_response[16384];
+static size_t encoded_response_sz = 0;
+
+static void *encoded_server(void *arg) {
+    int sock = *(int *) arg, client;
+    char buffer[4096];
+    client = accept(sock, NULL, NULL);
+    if (client >= 0) {
+        recv(client, buffer, sizeof (buffer), 0);
+        send(client, encoded_response, encoded_response_sz, 0);
+        close(client);
+    }
+    return NULL;
+}
+
+struct encoded_data {
+    char data[8192];
+    size_t data_sz;
+    am_bool_t complete;
+    int close_status;
+};
+
+static void encoded_on_data(void *udata, const char *data, size_t data_sz, int status) {
+    struct encoded_data *d = (struct encoded_data *) udata;
+    if (d->data_sz + data_sz < sizeof (d->data)) {
+        memcpy(d->data + d->data_sz, data, data_sz);
+        d->data_sz += data_sz;
+    }
+}
+
+static void encoded_on_complete(void *udata, int status) {
+    ((struct encoded_data *) udata)->complete = AM_TRUE;
+}
+
+static void encoded_on_close(void *udata, int status) {
+    struct encoded_data *d = (struct encoded_data *) udata;
+    if (status != 0) d->close_status = status;
+}
+
+static void encoded_reset(void *udata) {
+    ((struct encoded_data *) udata)->complete = AM_FALSE;
+}
+
+static am_bool_t encoded_is_complete(void *udata) {
+    return ((struct encoded_data *) udata)->complete;
+}
+
+/* compress 'data' with the zlib 'window_bits' format (gzip: 16 + MAX_WBITS, zlib: MAX_WBITS, raw: -MAX_WBITS) */
+static size_t encode_body(const char *data, int window_bits, char *out, size_t out_sz) {
+    z_stream zs;
+    memset(&zs, 0, sizeof (zs));
+    assert_int_equal(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY), Z_OK);
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = (uInt) strlen(data);
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = (uInt) out_sz;
+    assert_int_equal(deflate(&zs, Z_FINISH), Z_STREAM_END);
+    deflateEnd(&zs);
+    return zs.total_out;
+}
+
+static void set_encoded_response(const char *encoding, const char *body, size_t body_sz) {
+    int len = snprintf(encoded_response, sizeof (encoded_response), "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/xml\r\n"
+            "Content-Encoding: %s\r\n"
+            "Content-Length: %d\r\n"
+            "Connection: close\r\n\r\n", encoding, (int) body_sz);
+    memcpy(encoded_response + len, body, body_sz);
+    encoded_response_sz = len + body_sz;
+}
+
+/* fetch the canned response through am_net_t (compression enabled) */
+static int fetch_encoded_response(struct encoded_data *d) {
+    int sock, port, reuse = 1, status;
+    struct sockaddr_in addr;
+    socklen_t addr_sz = sizeof (addr);
+    pthread_t server;
+    am_net_options_t net_options;
+    char url[64];
+    const char *request = "GET /am/test HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    am_net_t n;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(sock >= 0);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *) &reuse, sizeof (reuse));
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert_int_equal(bind(sock, (struct sockaddr *) &addr, sizeof (addr)), 0);
+    assert_int_equal(listen(sock, 1), 0);
+    assert_int_equal(getsockname(sock, (struct sockaddr *) &addr, &addr_sz), 0);
+    port = ntohs(addr.sin_port);
+    snprintf(url, sizeof (url), "http://127.0.0.1:%d/am", port);
+    assert_int_equal(pthread_create(&server, NULL, encoded_server, &sock), 0);
+
+    memset(&net_options, 0, sizeof (am_net_options_t));
+    net_options.local = net_options.compress = AM_TRUE;
+    memset(d, 0, sizeof (struct encoded_data));
+    memset(&n, 0, sizeof (am_net_t));
+    n.url = url;
+    n.options = &net_options;
+    n.data = d;
+    n.on_data = encoded_on_data;
+    n.on_complete = encoded_on_complete;
+    n.on_close = encoded_on_close;
+    n.reset_complete = encoded_reset;
+    n.is_complete = encoded_is_complete;
+
+    am_net_init();
+    status = am_net_sync_connect(&n);
+    if (status == AM_SUCCESS) {
+        status = am_net_write(&n, request, strlen(request));
+    }
+    if (status == AM_SUCCESS) {
+        am_net_sync_recv(&n, 5);
+        status = n.error;
+    }
+    am_net_close(&n);
+    am_net_shutdown();
+
+    pthread_join(server, NULL);
+    close(sock);
+    return status;
+}
+
+static const char *encoded_body =
+    "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+    "<ResponseSet vers='1.0' svcid='session' reqid='0'><Response><![CDATA["
+    "<SessionResponse vers='1.0' reqid='1'><GetSession></GetSession></SessionResponse>]]>"
+    "</Response></ResponseSet>";
+
+/**
+ * gzip, zlib and raw deflate response bodies are decoded transparently.
+ */
+void test_net_compressed_response(void **state) {
+    static const struct {
+        const char *encoding;
+        int window_bits;
+    } formats[] = {
+        {"gzip", 16 + MAX_WBITS},
+        {"deflate", MAX_WBITS},
+        {"deflate", -MAX_WBITS}
+    };
+    struct encoded_data d;
+    char body[4096];
+    size_t i, body_sz;
+
+    for (i = 0; i < sizeof (formats) / sizeof (formats[0]); i++) {
+        body_sz = encode_body(encoded_body, formats[i].window_bits, body, sizeof (body));
+        set_encoded_response(formats[i].encoding, body, body_sz);
+        assert_int_equal(fetch_encoded_response(&d), AM_SUCCESS);
+        assert_true(d.complete);
+        assert_int_equal(d.close_status, 0);
+        assert_int_equal(d.data_sz, strlen(encoded_body));
+        assert_memory_equal(d.data, encoded_body, d.data_sz);
+    }
+}
+
+/**
+ * Truncated or corrupt compressed body aborts the response - no raw or partial data is passed on as complete.
+ */
+void test_net_compressed_response_broken(void **state) {
+    struct encoded_data d;
+    char body[4096];
+    size_t body_sz;
+
+    /* truncated: Content-Length matches what is sent, but the stream has no end */
+    body_sz = encode_body(encoded_body, 16 + MAX_WBITS, body, sizeof (body));
+    set_encoded_response("gzip", body, body_sz / 2);
+    assert_int_equal(fetch_encoded_response(&d), AM_EPROTO);
+    assert_false(d.complete);
+    assert_int_equal(d.close_status, AM_EPROTO);
+
+    /* corrupt: garbage in the middle of the stream */
+    body_sz = encode_body(encoded_body, 16 + MAX_WBITS, body, sizeof (body));
+    memset(body + 12, 0xff, 16);
+    set_encoded_response("gzip", body, body_sz);
+    assert_int_equal(fetch_encoded_response(&d), AM_EPROTO);
+    assert_false(d.complete);
+    assert_int_equal(d.close_status, AM_EPROTO);
+    assert_null(memchr(d.data, 0x1f, d.data_sz)); /* gzip magic would mean raw data was passed on */
+
+    /* not compressed at all */
+    set_encoded_response("gzip", encoded_body, strlen(encoded_body));
+    assert_int_equal(fetch_encoded_response(&d), AM_EPROTO);
+    assert_false(d.complete);
+    assert_int_equal(d.data_sz, 0);
+}
+
+/**
+ * Request write errors are reported; a request with too many segments is not sent (truncated).
+ */
+void test_net_writev_errors(void **state) {
+    am_net_t n;
+    am_net_iov_t iov[AM_NET_IOV_MAX + 1];
+    int i, sv[2];
+    char buffer[64];
+
+    for (i = 0; i < AM_NET_IOV_MAX + 1; i++) {
+        iov[i].data = i == 0 ? "POST / HTTP/1.1\r\n\r\n" : "x";
+        iov[i].data_sz = strlen(iov[i].data);
+    }
+
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    memset(&n, 0, sizeof (am_net_t));
+    n.sock = sv[0];
+
+    assert_int_equal(am_net_writev(&n, iov, AM_NET_IOV_MAX + 1), AM_E2BIG);
+
+    assert_int_equal(am_net_writev(&n, iov, 3), AM_SUCCESS);
+    assert_int_equal(recv(sv[1], buffer, sizeof (buffer), 0), (int) (iov[0].data_sz + 2));
+
+    /* peer is gone */
+    close(sv[1]);
+    assert_int_equal(am_net_writev(&n, iov, 3), AM_ECONNREFUSED);
+    assert_int_equal(n.error, AM_ECONNREFUSED);
+    /* connection stays failed */
+    assert_int_equal(am_net_writev(&n, iov, 3), AM_ECONNREFUSED);
+    close(sv[0]);
+}
+
+#endif
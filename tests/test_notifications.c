@@ -22,6 +22,7 @@
 #include "am.h"
 #include "utility.h"
 #include "thread.h"
+#include "list.h"
 #include "cmocka.h"
 
 typedef am_return_t (* am_state_func_t)(am_request_t *);
@@ -40,6 +41,14 @@ static am_status_t get_post_data(struct am_request * request)
     return AM_SUCCESS;
 }
 
+/* web container which honours post_data_in_memory */
+static am_status_t get_post_data_in_memory(struct am_request * request)
+{
+    assert_true(request->post_data_in_memory);
+    request->post_data = strndup(request->post_data, request->post_data_sz);
+    return AM_SUCCESS;
+}
+
 static am_status_t set_custom_response(struct am_request * request, const char * data, const char * content_type)
 {
     return AM_SUCCESS;
@@ -488,7 +497,305 @@ void test_resource_notification_on_policy_cache(void **state) {
     assert_int_equal(am_get_session_policy_cache_entry(&request, session_id, &r, &session, &ets), AM_SUCCESS);
     assert_int_equal(strcmp(r->resource, "a.b.c:3232/d/e/f"), 0);
     assert_int_equal(am_check_policy_cache_epoch(r->created), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource(r->resource, r->created), AM_ETIMEDOUT);
+    /* policies cached for other resources are still valid */
+    assert_int_equal(am_check_policy_cache_resource("a.b.c:3232/d/x", r->created), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("x.b.c:3232/d/e/f", r->created), AM_SUCCESS);
+    delete_am_policy_result_list(&r);
+
+    am_shutdown_worker();
+    am_shutdown(AM_DEFAULT_AGENT_ID);
+    am_worker_pool_init_reset();
+    am_net_init_ssl_reset();
+}
+
+
+/**
+ * Policy change of a resource (pattern) must invalidate only related cached resources.
+ */
+void test_policy_change_resource_match(void **state) {
+    assert_true(am_policy_resource_affected("a.b.c:3232/d/e/f", "a.b.c:3232/d/e/f"));
+    assert_true(am_policy_resource_affected("http://A.b.c:80/d/e", "a.b.c:80/d/e/f?g=h"));
+    assert_true(am_policy_resource_affected("a.b.c:3232/d/*", "a.b.c:3232/d/e/f"));
+    assert_true(am_policy_resource_affected("a.b.c:3232/d/-*-/f", "a.b.c:3232/d/e/f"));
+    assert_true(am_policy_resource_affected("*://*:*/d/e", "a.b.c:3232/x"));
+    assert_true(am_policy_resource_affected("a.b.c:3232/d/e/f", "a.b.c:3232/d"));
+    assert_true(am_policy_resource_affected("", "a.b.c:3232/d"));
+    assert_false(am_policy_resource_affected("a.b.c:3232/d/e/f", "a.b.c:3232/d/x"));
+    assert_false(am_policy_resource_affected("a.b.c:3232/d/e/f", "x.b.c:3232/d/e/f"));
+    assert_false(am_policy_resource_affected("https://a.b.c/d/*", "a.b.c/e/f"));
+}
+
+/**
+ * Policy change list is bounded: the oldest changes turn into an epoch for all policies.
+ */
+void test_policy_change_resource_overflow(void **state) {
+    char resource[64];
+    const char *resources[1];
+    int i;
+
+    am_cache_destroy();
+    assert_int_equal(am_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_set_policy_cache_epoch(100), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/d", 150), AM_SUCCESS);
+
+    resources[0] = "a.b.c/d";
+    assert_int_equal(am_add_policy_cache_changes(resources, 1, 200), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/d/e", 150), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/d/e", 200), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/x", 150), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_epoch(150), AM_ETIMEDOUT);
+
+    /* push the first change out of the list */
+    for (i = 0; i < AM_POLICY_CHANGE_MAX; i++) {
+        snprintf(resource, sizeof (resource), "a.b.c/r%d", i);
+        resources[0] = resource;
+        assert_int_equal(am_add_policy_cache_changes(resources, 1, 300 + i), AM_SUCCESS);
+    }
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/x", 150), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/x", 250), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/r1", 250), AM_ETIMEDOUT);
+
+    /* global epoch covers all changes */
+    assert_int_equal(am_set_policy_cache_epoch(1000), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/r1", 999), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/r1", 1000), AM_SUCCESS);
+
+    am_shutdown(AM_DEFAULT_AGENT_ID);
+}
+
+/**
+ * Process copy of the policy change list must follow every published change.
+ */
+void test_policy_change_published(void **state) {
+    const char *resources[1];
+    int i;
+
+    am_cache_destroy();
+    assert_int_equal(am_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    resources[0] = "a.b.c/x";
+    assert_int_equal(am_add_policy_cache_changes(resources, 1, 300), AM_SUCCESS);
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 250), AM_SUCCESS);
+        assert_int_equal(am_check_policy_cache_resource("a.b.c/x", 250), AM_ETIMEDOUT);
+    }
+
+    resources[0] = "a.b.c/y";
+    assert_int_equal(am_add_policy_cache_changes(resources, 1, 300), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 250), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/z", 250), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 300), AM_SUCCESS);
+
+    am_shutdown(AM_DEFAULT_AGENT_ID);
+
+    /* no update without the cache writer lock */
+    assert_int_equal(am_add_policy_cache_changes(resources, 1, 400), AM_EINVAL);
+    assert_int_equal(am_set_policy_cache_epoch(400), AM_EINVAL);
+}
+
+/**
+ * Evicted policy change list is written back, with the changes it had turned into the epoch.
+ */
+void test_policy_change_evicted(void **state) {
+    const char *resources[1];
+
+    am_cache_destroy();
+    assert_int_equal(am_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    resources[0] = "a.b.c/x";
+    assert_int_equal(am_add_policy_cache_changes(resources, 1, 500), AM_SUCCESS);
+    assert_int_equal(am_remove_cache_entry(AM_DEFAULT_AGENT_ID, AM_POLICY_CHANGE_KEY), AM_SUCCESS);
+
+    /* changes are not known any more */
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 450), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 450), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_epoch(499), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_epoch(500), AM_SUCCESS);
+
+    /* the epoch is kept in the restored entry */
+    resources[0] = "a.b.c/q";
+    assert_int_equal(am_add_policy_cache_changes(resources, 1, 600), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 450), AM_ETIMEDOUT);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/y", 550), AM_SUCCESS);
+    assert_int_equal(am_check_policy_cache_resource("a.b.c/q", 550), AM_ETIMEDOUT);
+
+    am_shutdown(AM_DEFAULT_AGENT_ID);
+}
+
+#define NOTIFICATION_BATCH_SESSIONS 50
+
+/**
+ * A burst of session notifications is handled in memory (no post preservation files) and in batches;
+ * every notified session is removed from the cache.
+ */
+void test_session_notification_batch_in_memory(void **state) {
+
+    am_state_func_t const * func_array = NULL;
+    int array_len = 0;
+    am_state_func_t notification_handler;
+    char session_id[32];
+    char message[256];
+    int i;
+
+    struct ctx {
+        void *dummy;
+    } ctx;
+
+    am_config_t config = {
+        .instance_id                = 0,
+        .token_cache_valid          = 0,
+
+        .notif_enable               = AM_TRUE,
+        .notif_url                  = "https://www.notify.com:1234/am",
+        .override_notif_url         = AM_FALSE,
+
+        .url_eval_case_ignore       = AM_FALSE,
+    };
+
+    am_request_t request = {
+        .instance_id                = 0,
+        .conf                       = &config,
+        .ctx                        = &ctx,
+
+        .method                     = AM_REQUEST_POST,
+        .token                      = NULL,
+
+        .overridden_url             = "https://www.override.com:90/am",
+        .normalized_url             = "https://www.notify.com:1234/am",
+
+        .am_get_post_data_f         = get_post_data_in_memory,
+
+        .am_set_custom_response_f   = set_custom_response,
+    };
+
+    char * xml =
+        "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+        "<ResponseSet vers='1.0' svcid='poicy' reqid='48'>"
+        "  <Response><![CDATA["
+        "<PolicyService version='1.0' revisionNumber='60'>"
+        "  <PolicyResponse requestId='4' issueInstant='1424783306343' >"
+        "    <ResourceResult name='http://vb2.local.com:80/testwebsite'>"
+        "      <PolicyDecision>"
+        "        <ActionDecision timeToLive='1234'>"
+        "          <AttributeValuePair>"
+        "            <Attribute name='GET'/> <Value>allow</Value>"
+        "          </AttributeValuePair>"
+        "        </ActionDecision>"
+        "      </PolicyDecision>"
+        "    </ResourceResult>"
+        "  </PolicyResponse>"
+        "</PolicyService>"
+        "]]></Response>"
+        "</ResponseSet>";
+
+    uint64_t ets;
+    struct am_policy_result * r = NULL;
+    struct am_namevalue * session = NULL;
+    struct am_policy_result * result = am_parse_policy_xml(0l, xml, strlen(xml), 0);
+
+    assert_non_null(result);
+
+    am_test_get_state_funcs(&func_array, &array_len);
+    notification_handler = func_array [2];
+
+    am_cache_destroy();
+
+    assert_int_equal(am_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+    am_init_worker(AM_DEFAULT_AGENT_ID);
+
+    sleep(2); /* must wait till worker pool is all set */
+
+    for (i = 0; i < NOTIFICATION_BATCH_SESSIONS; i++) {
+        snprintf(session_id, sizeof (session_id), "BATCH-%d", i);
+        assert_int_equal(am_add_session_policy_cache_entry(&request, session_id, result, NULL), AM_SUCCESS);
+    }
+    delete_am_policy_result_list(&result);
+
+    for (i = 0; i < NOTIFICATION_BATCH_SESSIONS; i++) {
+        snprintf(message, sizeof (message), "<NotificationSet version='1.0'><Notification>"
+                "<SessionNotification><Session sid='BATCH-%d' state='destroyed' /></SessionNotification>"
+                "</Notification></NotificationSet>", i);
+        request.post_data = message;
+        request.post_data_sz = strlen(message);
+        assert_int_equal(notification_handler(&request), AM_OK);
+        assert_int_equal(request.status, AM_NOTIFICATION_DONE);
+        /* message buffer is owned by the notification worker now */
+        assert_null(request.post_data);
+        assert_null(request.post_data_fn);
+    }
+
+    /* wait for the worker to have finished */
+    sleep(2);
+
+    for (i = 0; i < NOTIFICATION_BATCH_SESSIONS; i++) {
+        snprintf(session_id, sizeof (session_id), "BATCH-%d", i);
+        assert_int_equal(am_get_session_policy_cache_entry(&request, session_id, &r, &session, &ets), AM_NOT_FOUND);
+    }
+
+    am_shutdown_worker();
+    am_shutdown(AM_DEFAULT_AGENT_ID);
+    am_worker_pool_init_reset();
+    am_net_init_ssl_reset();
+}
+
+static struct notification_worker_data *session_notification(const char *sid) {
+    struct notification_worker_data *wd = calloc(1, sizeof (struct notification_worker_data));
+    assert_non_null(wd);
+    wd->instance_id = AM_DEFAULT_AGENT_ID;
+    am_asprintf(&wd->post_data, "<NotificationSet version='1.0'><Notification>"
+            "<SessionNotification><Session sid='%s' state='destroyed' /></SessionNotification>"
+            "</Notification></NotificationSet>", sid);
+    assert_non_null(wd->post_data);
+    wd->post_data_sz = strlen(wd->post_data);
+    return wd;
+}
+
+/**
+ * Notification messages stay queued when the worker can not be scheduled; the next
+ * message schedules the worker again and all of them are processed.
+ */
+void test_notification_dispatch_retry(void **state) {
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config };
+    struct am_policy_result *r = NULL;
+    struct am_namevalue *session = NULL;
+    uint64_t ets;
+    char *xml = "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+        "<ResponseSet vers='1.0' svcid='poicy' reqid='48'><Response><![CDATA["
+        "<PolicyService version='1.0' revisionNumber='60'>"
+        "<PolicyResponse requestId='4' issueInstant='1424783306343'>"
+        "<ResourceResult name='http://vb2.local.com:80/testwebsite'><PolicyDecision>"
+        "<ActionDecision timeToLive='1234'><AttributeValuePair><Attribute name='GET'/> <Value>allow</Value>"
+        "</AttributeValuePair></ActionDecision></PolicyDecision></ResourceResult>"
+        "</PolicyResponse></PolicyService>]]></Response></ResponseSet>";
+    struct am_policy_result *result = am_parse_policy_xml(0l, xml, strlen(xml), 0);
+
+    assert_non_null(result);
+
+    am_cache_destroy();
+    assert_int_equal(am_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "RETRY-1", result, NULL), AM_SUCCESS);
+    assert_int_equal(am_add_session_policy_cache_entry(&request, "RETRY-2", result, NULL), AM_SUCCESS);
+    delete_am_policy_result_list(&result);
+
+    /* no worker pool: message is kept */
+    am_worker_pool_shutdown_main();
+    assert_int_equal(am_notification_dispatch(session_notification("RETRY-1")), AM_SUCCESS);
+    sleep(1);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "RETRY-1", &r, &session, &ets), AM_SUCCESS);
     delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+
+    am_init_worker(AM_DEFAULT_AGENT_ID);
+    sleep(2); /* must wait till worker pool is all set */
+
+    assert_int_equal(am_notification_dispatch(session_notification("RETRY-2")), AM_SUCCESS);
+    sleep(2);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "RETRY-1", &r, &session, &ets), AM_NOT_FOUND);
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "RETRY-2", &r, &session, &ets), AM_NOT_FOUND);
 
     am_shutdown_worker();
     am_shutdown(AM_DEFAULT_AGENT_ID);
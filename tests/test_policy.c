@@ -23,6 +23,7 @@
 #include "am.h"
 #include "platform.h"
 #include "utility.h"
+#include "list.h"
 #include "log.h"
 #include "cmocka.h"
 
@@ -469,3 +470,89 @@ void test_am_policy_results(void **state) {
 
 }
 
+
+static const char *policy_stream_pll =
+    "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+    "<ResponseSet vers='1.0' svcid='policy' reqid='48'>"
+    "<Response><![CDATA[<PolicyService version='1.0'><PolicyResponse requestId='4' issueInstant='1424783306343'>"
+    "<ResourceResult name='http://a.example.com:80/*'><PolicyDecision>"
+    "<ResponseAttributes><AttributeValuePair><Attribute name='ra'/><Value>one</Value><Value>two</Value>"
+    "</AttributeValuePair></ResponseAttributes>"
+    "<ActionDecision timeToLive='9223372036854775807'><AttributeValuePair><Attribute name='GET'/>"
+    "<Value>allow</Value></AttributeValuePair><Advices></Advices></ActionDecision>"
+    "<ResponseDecisions><AttributeValuePair><Attribute name='rd'/><Value>three</Value>"
+    "</AttributeValuePair></ResponseDecisions>"
+    "</PolicyDecision></ResourceResult>"
+    "<ResourceResult name='http://b.example.com:80/*'><PolicyDecision>"
+    "<ActionDecision timeToLive='100'><AttributeValuePair><Attribute name='POST'/>"
+    "<Value>deny</Value></AttributeValuePair></ActionDecision>"
+    "</PolicyDecision></ResourceResult>"
+    "</PolicyResponse></PolicyService>]]></Response></ResponseSet>";
+
+static int count_namevalue(struct am_namevalue *list) {
+    int n = 0;
+    for (; list != NULL; list = list->next) n++;
+    return n;
+}
+
+/**
+ * Streaming policy parser must produce the same result as the buffered one, no matter
+ * how the response body is split into chunks.
+ */
+void test_policy_xml_stream(void **state) {
+    size_t chunk, i, sz = strlen(policy_stream_pll);
+
+    for (chunk = 1; chunk <= sz; chunk = chunk * 3 + 1) {
+        struct am_policy_result *expected, *result, *e, *r;
+        char *exception = NULL;
+        void *stream = am_parse_policy_xml_stream_create(0l, 0);
+        assert_non_null(stream);
+
+        for (i = 0; i < sz; i += chunk) {
+            assert_int_equal(am_parse_policy_xml_stream(stream, policy_stream_pll + i,
+                    i + chunk > sz ? sz - i : chunk), AM_SUCCESS);
+        }
+        result = am_parse_policy_xml_stream_done(stream, &exception);
+        expected = am_parse_policy_xml(0l, policy_stream_pll, sz, 0);
+        assert_non_null(result);
+        assert_non_null(expected);
+        assert_null(exception);
+
+        for (e = expected, r = result; e != NULL; e = e->next, r = r->next) {
+            assert_non_null(r);
+            assert_string_equal(e->resource, r->resource);
+            assert_int_equal(e->index, r->index);
+            assert_int_equal(count_namevalue(e->response_attributes), count_namevalue(r->response_attributes));
+            assert_int_equal(count_namevalue(e->response_decisions), count_namevalue(r->response_decisions));
+            assert_non_null(r->action_decisions);
+            assert_int_equal(e->action_decisions->action, r->action_decisions->action);
+            assert_int_equal(e->action_decisions->method, r->action_decisions->method);
+            assert_true(e->action_decisions->ttl == r->action_decisions->ttl);
+        }
+        assert_null(r);
+
+        delete_am_policy_result_list(&expected);
+        delete_am_policy_result_list(&result);
+    }
+}
+
+void test_policy_xml_stream_exception(void **state) {
+    const char *pll = "<?xml version='1.0' encoding='UTF-8' standalone='yes'?>"
+        "<ResponseSet vers='1.0' svcid='policy' reqid='48'>"
+        "<Response><![CDATA[<PolicyService version='1.0'><PolicyResponse requestId='4'>"
+        "<Exception>Application token passed in: AQIC5wM2LY4Sfcw is invalid</Exception>"
+        "</PolicyResponse></PolicyService>]]></Response></ResponseSet>";
+    char *exception = NULL;
+    void *stream = am_parse_policy_xml_stream_create(0l, 0);
+
+    assert_int_equal(am_parse_policy_xml_stream(stream, pll, strlen(pll)), AM_SUCCESS);
+    assert_null(am_parse_policy_xml_stream_done(stream, &exception));
+    assert_non_null(exception);
+    assert_string_equal(exception, "<Exception>Application token passed in: AQIC5wM2LY4Sfcw is invalid");
+    free(exception);
+
+    /* broken response */
+    stream = am_parse_policy_xml_stream_create(0l, 0);
+    am_parse_policy_xml_stream(stream, "<ResponseSet><Response><![CDATA[<Policy", 39);
+    assert_null(am_parse_policy_xml_stream_done(stream, NULL));
+}
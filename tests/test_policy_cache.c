@@ -337,6 +337,123 @@ void test_policy_cache_simple(void **state) {
 }
 
 
+/**
+ * Preserved post data can be kept in the pdp cache entry itself (binary safe), or referred to by file name.
+ */
+void test_pdp_cache_entry_in_memory(void **state) {
+
+    am_config_t config = { .pdp_cache_valid = 100 };
+    am_request_t request = { .conf = &config };
+    const char body[] = "a=1&b=\0&c=3";
+    char *url = NULL, *file = NULL, *content_type = NULL, *data = NULL;
+    size_t data_sz = 0;
+    int method = 0;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    assert_int_equal(am_add_pdp_cache_entry(&request, "pdp-memory", "/a/b?c", "",
+            "application/x-www-form-urlencoded", AM_REQUEST_POST, body, sizeof (body) - 1), AM_SUCCESS);
+    assert_int_equal(am_add_pdp_cache_entry(&request, "pdp-file", "/a/b", "/tmp/pdp-file",
+            "text/plain", AM_REQUEST_PUT, NULL, 42), AM_SUCCESS);
+
+    assert_int_equal(am_get_pdp_cache_entry(&request, "pdp-memory", &url, &file, &content_type, &method,
+            &data, &data_sz), AM_SUCCESS);
+    assert_string_equal(url, "/a/b?c");
+    assert_string_equal(file, "");
+    assert_string_equal(content_type, "application/x-www-form-urlencoded");
+    assert_int_equal(method, AM_REQUEST_POST);
+    assert_int_equal(data_sz, sizeof (body) - 1);
+    assert_memory_equal(data, body, data_sz);
+    AM_FREE(url, file, content_type, data);
+
+    assert_int_equal(am_get_pdp_cache_entry(&request, "pdp-file", &url, &file, &content_type, &method,
+            &data, &data_sz), AM_SUCCESS);
+    assert_string_equal(file, "/tmp/pdp-file");
+    assert_int_equal(method, AM_REQUEST_PUT);
+    assert_null(data);
+    assert_int_equal(data_sz, 0);
+    AM_FREE(url, file, content_type, data);
+
+    am_cache_shutdown();
+}
+
+static int never_identical(void *a, void *b) {
+    return 0;
+}
+
+/**
+ * Batched removal takes each cache hash lock once and removes exactly the listed entries.
+ */
+void test_policy_cache_remove_entries_batch(void **state) {
+
+    enum { test_size = 2000, locks = 4096 };
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config } ;
+    char* buffer = NULL;
+    struct am_policy_result * result;
+    uint64_t ets;
+    char key[32];
+    char *keys[test_size / 2];
+    uint32_t hash[2 * locks];
+    void *data[2 * locks];
+    int i;
+
+    request.conf = &config;
+
+    am_asprintf(&buffer, pll, policy_xml);
+    result = am_parse_policy_xml(0l, buffer, strlen(buffer), 0);
+
+    free(buffer);
+
+    // destroy the cache, if it exists
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    /* deletions are grouped by the hash lock */
+    for (i = 0; i < 2 * locks; i++) {
+        hash[i] = 42;
+        data[i] = NULL;
+    }
+    assert_int_equal(cache_delete_batch(hash, data, 100, never_identical), 1);
+    for (i = 0; i < 2 * locks; i++) {
+        hash[i] = (uint32_t) i;
+    }
+    assert_true(cache_delete_batch(hash, data, 2 * locks, never_identical) <= locks);
+
+    for (i = 0; i < test_size; i++) {
+        snprintf(key, sizeof (key), "batch-key-%d", i);
+        assert_int_equal(am_add_session_policy_cache_entry(&request, key, result, NULL), AM_SUCCESS);
+    }
+    delete_am_policy_result_list(&result);
+
+    /* remove every other entry */
+    for (i = 0; i < test_size / 2; i++) {
+        am_asprintf(&keys[i], "batch-key-%d", i * 2);
+    }
+    assert_int_equal(am_remove_cache_entries(0, (const char **) keys, test_size / 2), AM_SUCCESS);
+    for (i = 0; i < test_size / 2; i++) {
+        free(keys[i]);
+    }
+
+    for (i = 0; i < test_size; i++) {
+        struct am_policy_result * r = NULL;
+        struct am_namevalue * session = NULL;
+
+        snprintf(key, sizeof (key), "batch-key-%d", i);
+        if (i % 2 == 0) {
+            assert_int_equal(am_get_session_policy_cache_entry(&request, key, &r, &session, &ets), AM_NOT_FOUND);
+        } else {
+            assert_int_equal(am_get_session_policy_cache_entry(&request, key, &r, &session, &ets), AM_SUCCESS);
+            delete_am_policy_result_list(&r);
+            delete_am_namevalue_list(&session);
+        }
+    }
+
+    am_cache_destroy();
+}
+
+
 const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789*";
 
 
@@ -806,3 +923,102 @@ void test_key_creation(void **state) {
         free(keys[i]);
     }
 }
+
+/**
+ * Prefetch resource tree: the longest configured prefix, or the parent path of the request url.
+ */
+void test_policy_prefetch_url(void **state) {
+    am_config_map_t map[] = {
+        { "0", "http://a.example.com:80/app/" },
+        { "1", "http://a.example.com:80/app/docs/" }
+    };
+    am_config_t config;
+    char *url;
+
+    memset(&config, 0, sizeof (am_config_t));
+
+    url = am_policy_prefetch_url(&config, "http://a.example.com:80/app/docs/index.html?a=b/c");
+    assert_string_equal(url, "http://a.example.com:80/app/docs/");
+    free(url);
+    url = am_policy_prefetch_url(&config, "http://a.example.com:80/app/docs/");
+    assert_string_equal(url, "http://a.example.com:80/app/");
+    free(url);
+    /* no prefetch for top level resources */
+    assert_null(am_policy_prefetch_url(&config, "http://a.example.com:80/index.html"));
+    assert_null(am_policy_prefetch_url(&config, "http://a.example.com:80/"));
+    assert_null(am_policy_prefetch_url(&config, "http://a.example.com:80"));
+
+    config.policy_prefetch_map = map;
+    config.policy_prefetch_map_sz = 2;
+    url = am_policy_prefetch_url(&config, "http://a.example.com:80/app/docs/a/b/index.html");
+    assert_string_equal(url, "http://a.example.com:80/app/docs/");
+    free(url);
+    url = am_policy_prefetch_url(&config, "http://a.example.com:80/app/img/a.png");
+    assert_string_equal(url, "http://a.example.com:80/app/");
+    free(url);
+    url = am_policy_prefetch_url(&config, "http://b.example.com:80/other/a.png");
+    assert_string_equal(url, "http://b.example.com:80/other/");
+    free(url);
+}
+
+/**
+ * The same user/resource tree is prefetched once per interval; other trees are not affected.
+ */
+void test_policy_prefetch_dedupe(void **state) {
+    time_t now = time(NULL);
+    uint32_t hash = am_hash("prefetch-token") ^ am_hash("http://a.example.com:80/app/");
+    uint32_t other = am_hash("prefetch-token") ^ am_hash("http://a.example.com:80/other/");
+
+    assert_true(am_policy_prefetch_claim(hash, now));
+    assert_false(am_policy_prefetch_claim(hash, now));
+    assert_false(am_policy_prefetch_claim(hash, now + 59));
+    assert_true(am_policy_prefetch_claim(other, now));
+
+    /* interval elapsed */
+    assert_true(am_policy_prefetch_claim(hash, now + 60));
+    assert_false(am_policy_prefetch_claim(hash, now + 61));
+}
+
+/**
+ * Prefetched subtree decisions are merged into the user's cache entry: decisions for other
+ * resources are kept, decisions for the same resource are replaced.
+ */
+void test_policy_prefetch_merge(void **state) {
+    am_config_t config = { .token_cache_valid = 100 };
+    am_request_t request = { .conf = &config };
+    const char *resources[] = {
+        "http://a.example.com:80/app/index.html",
+        "http://a.example.com:80/app/*",
+        "http://a.example.com:80/app/index.html"
+    };
+    struct am_policy_result *r = NULL, *e;
+    struct am_namevalue *session = NULL;
+    uint64_t ets;
+    int i, count = 0;
+
+    cleardown();
+    assert_int_equal(am_cache_init(AM_DEFAULT_AGENT_ID), AM_SUCCESS);
+
+    for (i = 0; i < sizeof (resources) / sizeof (resources[0]); i++) {
+        char *xml = get_policy_for_url(resources[i]);
+        struct am_policy_result *result;
+        assert_non_null(xml);
+        result = am_parse_policy_xml(0l, xml, strlen(xml), 0);
+        free(xml);
+        assert_non_null(result);
+        assert_int_equal(am_add_session_policy_cache_entry(&request, "prefetch-token", result, NULL), AM_SUCCESS);
+        delete_am_policy_result_list(&result);
+    }
+
+    assert_int_equal(am_get_session_policy_cache_entry(&request, "prefetch-token", &r, &session, &ets), AM_SUCCESS);
+    for (e = r; e != NULL; e = e->next) {
+        assert_true(strcmp(e->resource, resources[0]) == 0 || strcmp(e->resource, resources[1]) == 0);
+        count++;
+    }
+    assert_int_equal(count, 2);
+
+    delete_am_policy_result_list(&r);
+    delete_am_namevalue_list(&session);
+    am_cache_shutdown();
+    am_cache_destroy();
+}
@@ -0,0 +1,111 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2015 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "am.h"
+#include "platform.h"
+#include "utility.h"
+#include "cmocka.h"
+
+#define BREAKER_TEST_INSTANCE 4242
+
+/**
+ * Consecutive network failures must open the breaker, and selection must skip the failed url.
+ */
+void test_url_breaker_failover(void **state) {
+    int i;
+
+    am_url_breaker_reset(BREAKER_TEST_INSTANCE);
+
+    assert_true(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 0));
+    assert_int_equal(am_url_breaker_select(BREAKER_TEST_INSTANCE, 0, 3, -1), 0);
+
+    /* a healthy (even if negative) reply does not count as a failure */
+    for (i = 0; i < 10; i++) {
+        am_url_breaker_report(BREAKER_TEST_INSTANCE, 0, AM_INVALID_SESSION, 0.01);
+    }
+    assert_true(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 0));
+
+    for (i = 0; i < 3; i++) {
+        am_url_breaker_report(BREAKER_TEST_INSTANCE, 0, AM_ETIMEDOUT, 4.0);
+    }
+    assert_false(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 0));
+    assert_int_equal(am_url_breaker_select(BREAKER_TEST_INSTANCE, 0, 3, -1), 1);
+    assert_int_equal(am_url_breaker_select(BREAKER_TEST_INSTANCE, 0, 3, 1), 2);
+    assert_int_equal(am_url_breaker_select(BREAKER_TEST_INSTANCE, 0, 1, -1), -1);
+
+    /* successful reply closes the breaker again */
+    am_url_breaker_report(BREAKER_TEST_INSTANCE, 0, AM_SUCCESS, 0.01);
+    assert_true(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 0));
+
+    am_url_breaker_reset(BREAKER_TEST_INSTANCE);
+}
+
+/**
+ * Latency percentiles are reported as power-of-two msec bucket upper bounds.
+ */
+void test_url_breaker_latency(void **state) {
+    int i;
+
+    am_url_breaker_reset(BREAKER_TEST_INSTANCE);
+    assert_int_equal(am_url_breaker_latency(BREAKER_TEST_INSTANCE, 1, 95), 0);
+
+    for (i = 0; i < 95; i++) {
+        am_url_breaker_report(BREAKER_TEST_INSTANCE, 1, AM_SUCCESS, 0.003);
+    }
+    for (i = 0; i < 5; i++) {
+        am_url_breaker_report(BREAKER_TEST_INSTANCE, 1, AM_SUCCESS, 0.9);
+    }
+    assert_int_equal(am_url_breaker_latency(BREAKER_TEST_INSTANCE, 1, 50), 4);
+    assert_int_equal(am_url_breaker_latency(BREAKER_TEST_INSTANCE, 1, 95), 4);
+    assert_int_equal(am_url_breaker_latency(BREAKER_TEST_INSTANCE, 1, 99), 1024);
+
+    am_url_breaker_reset(BREAKER_TEST_INSTANCE);
+}
+
+/**
+ * Checks (allow/select) must not use up the breaker state, only claim (request sent) does.
+ */
+void test_url_breaker_claim(void **state) {
+    int i;
+
+    am_url_breaker_reset(BREAKER_TEST_INSTANCE);
+
+    assert_true(am_url_breaker_claim(BREAKER_TEST_INSTANCE, 0));
+    for (i = 0; i < 3; i++) {
+        am_url_breaker_report(BREAKER_TEST_INSTANCE, 0, AM_ECONNREFUSED, 0.01);
+    }
+
+    for (i = 0; i < 10; i++) {
+        assert_false(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 0));
+        assert_int_equal(am_url_breaker_select(BREAKER_TEST_INSTANCE, 0, 2, -1), 1);
+    }
+    /* open breaker does not let a request through before the open interval is over */
+    assert_false(am_url_breaker_claim(BREAKER_TEST_INSTANCE, 0));
+    assert_false(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 0));
+
+    /* claim on a closed breaker is a no-op */
+    assert_true(am_url_breaker_claim(BREAKER_TEST_INSTANCE, 1));
+    assert_true(am_url_breaker_claim(BREAKER_TEST_INSTANCE, 1));
+    assert_true(am_url_breaker_allow(BREAKER_TEST_INSTANCE, 1));
+
+    am_url_breaker_reset(BREAKER_TEST_INSTANCE);
+}
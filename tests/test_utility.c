@@ -898,10 +898,11 @@ void test_header_value_encoding(void **state) {
     free(val);
 }
 
-char *remove_pathinfo_from_url(struct url *url, const char *pathinfo);
+char *remove_pathinfo_from_url(am_arena_t *arena, struct url *url, const char *pathinfo);
 
 void test_pathinfo_removal(void **state) {
     struct url u;
+    am_arena_t a;
     char *res;
     int i;
 
@@ -925,18 +926,311 @@ void test_pathinfo_removal(void **state) {
         {.url = iso88591_url, .pathinfo = "/caf%E9.gif", .result = "http://host:80/caf%C3%A9/index.cgi"}
     };
 
+    am_arena_init(&a, NULL, NULL);
     for (i = 0; i < ARRAY_SIZE(ut); i++) {
         struct url_test *e = &ut[i];
         memset(&u, 0, sizeof (struct url));
         assert_int_equal(parse_url(e->url, &u), AM_SUCCESS);
-        res = remove_pathinfo_from_url(&u, e->pathinfo);
+        res = remove_pathinfo_from_url(&a, &u, e->pathinfo);
         if (e->result == NULL) {
             assert_true(res == NULL);
         } else {
             assert_true(res != NULL);
             assert_string_equal(res, e->result);
         }
-        am_free(res);
     }
+    am_arena_release(&a);
     AM_FREE(iso88591, iso88591_url);
 }
+
+/**
+ * POST body buffer keeps the data intact while growing and refuses to grow over the limit.
+ */
+void test_post_buffer_append(void **state) {
+    am_post_buffer_t b = {NULL, 0, 0};
+    char chunk[1000], *big;
+    size_t i, reallocs = 0, capacity = 0;
+
+    for (i = 0; i < sizeof (chunk); i++) {
+        chunk[i] = (char) ('a' + i % 26);
+    }
+
+    for (i = 0; i < 1000; i++) {
+        assert_int_equal(am_post_buffer_append(&b, chunk, sizeof (chunk), AM_POST_MEMORY_MAX), AM_SUCCESS);
+        if (b.capacity != capacity) {
+            capacity = b.capacity;
+            reallocs++;
+        }
+    }
+    assert_int_equal(b.size, 1000 * sizeof (chunk));
+    assert_int_equal(b.data[b.size], '\0');
+    assert_memory_equal(b.data + 999 * sizeof (chunk), chunk, sizeof (chunk));
+    assert_true(reallocs <= 10);
+
+    /* limit is not exceeded, content stays */
+    big = calloc(1, AM_POST_MEMORY_MAX);
+    assert_non_null(big);
+    assert_int_equal(am_post_buffer_append(&b, big, AM_POST_MEMORY_MAX - b.size + 1, AM_POST_MEMORY_MAX), AM_ENOSPC);
+    assert_int_equal(b.size, 1000 * sizeof (chunk));
+    assert_memory_equal(b.data + 999 * sizeof (chunk), chunk, sizeof (chunk));
+    assert_int_equal(am_post_buffer_append(&b, big, AM_POST_MEMORY_MAX - b.size, AM_POST_MEMORY_MAX), AM_SUCCESS);
+    assert_int_equal(b.size, AM_POST_MEMORY_MAX);
+    assert_true(b.capacity <= AM_POST_MEMORY_MAX + 1);
+    free(big);
+
+    am_post_buffer_free(&b);
+    assert_null(b.data);
+    assert_int_equal(am_post_buffer_append(&b, NULL, 0, 10), AM_SUCCESS);
+    assert_string_equal(b.data, "");
+    am_post_buffer_free(&b);
+}
+
+#define BENCH_POST_CHUNK 8192 /* apache HUGE_STRING_LEN */
+
+/**
+ * POST body read benchmark: geometric buffer growth vs. a realloc per chunk, 1KB - 10MB bodies.
+ */
+void test_post_buffer_benchmark(void **state) {
+    static const size_t sizes[] = {1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024};
+    char *chunk = malloc(BENCH_POST_CHUNK);
+    size_t i, n;
+
+    assert_non_null(chunk);
+    memset(chunk, 'x', BENCH_POST_CHUNK);
+
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+        am_timer_t tmr_buffer = {0, 0, 0, 0}, tmr_realloc = {0, 0, 0, 0};
+        am_post_buffer_t b = {NULL, 0, 0};
+        char *out = NULL;
+        size_t read_bytes = 0;
+
+        am_timer_start(&tmr_buffer);
+        for (n = 0; n < sizes[i]; n += BENCH_POST_CHUNK) {
+            size_t sz = MIN(BENCH_POST_CHUNK, sizes[i] - n);
+            assert_int_equal(am_post_buffer_append(&b, chunk, sz, AM_POST_LARES_MAX * 4), AM_SUCCESS);
+        }
+        am_timer_stop(&tmr_buffer);
+        assert_int_equal(b.size, sizes[i]);
+
+        am_timer_start(&tmr_realloc);
+        for (n = 0; n < sizes[i]; n += BENCH_POST_CHUNK) {
+            size_t sz = MIN(BENCH_POST_CHUNK, sizes[i] - n);
+            char *tmp = realloc(out, read_bytes + sz + 1);
+            assert_non_null(tmp);
+            out = tmp;
+            memcpy(out + read_bytes, chunk, sz);
+            read_bytes += sz;
+            out[read_bytes] = 0;
+        }
+        am_timer_stop(&tmr_realloc);
+
+        fprintf(stderr, "POST BODY %8lu bytes: buffer %.3f msec, realloc per chunk %.3f msec\n",
+                (unsigned long) sizes[i], am_timer_elapsed(&tmr_buffer) * 1000.0,
+                am_timer_elapsed(&tmr_realloc) * 1000.0);
+
+        am_post_buffer_free(&b);
+        free(out);
+    }
+    free(chunk);
+}
+
+static char test_arena_container[AM_ARENA_BLOCK_SIZE];
+
+static void *test_arena_container_alloc(void *ctx, size_t size) {
+    size_t *used = (size_t *) ctx;
+    char *p;
+    if (*used + size > sizeof (test_arena_container)) {
+        return NULL; /* container memory exhausted, arena falls back to the heap */
+    }
+    p = test_arena_container + *used;
+    *used += size;
+    return p;
+}
+
+void test_request_arena(void **state) {
+    am_arena_t a;
+    char *s, *p, *big;
+    size_t i, used;
+
+    /* heap backed */
+    am_arena_init(&a, NULL, NULL);
+    s = am_arena_strdup(&a, "abc");
+    assert_string_equal(s, "abc");
+    assert_string_equal(am_arena_strndup(&a, "127.0.0.1, 10.0.0.1", 9), "127.0.0.1");
+    assert_string_equal(am_arena_asprintf(&a, "%s://%s:%d%s", "http", "a.b.c", 80, "/x"), "http://a.b.c:80/x");
+    assert_null(am_arena_strdup(&a, NULL));
+
+    for (i = 0; i < 1000; i++) {
+        p = am_arena_alloc(&a, 24);
+        assert_non_null(p);
+        assert_int_equal(((size_t) p) % sizeof (void *), 0);
+        memset(p, 'x', 24);
+    }
+    big = am_arena_alloc(&a, AM_ARENA_BLOCK_SIZE * 4);
+    assert_non_null(big);
+    memset(big, 'y', AM_ARENA_BLOCK_SIZE * 4);
+    /* earlier allocations are untouched */
+    assert_string_equal(s, "abc");
+    assert_non_null(a.blocks);
+    am_arena_release(&a);
+    assert_null(a.blocks);
+    assert_int_equal(a.avail, 0);
+
+    /* container backed: no heap blocks until the container runs out */
+    used = 0;
+    am_arena_init(&a, test_arena_container_alloc, &used);
+    assert_string_equal(am_arena_strdup(&a, "def"), "def");
+    assert_null(a.blocks);
+    assert_int_equal(used, AM_ARENA_BLOCK_SIZE);
+    assert_non_null(am_arena_alloc(&a, AM_ARENA_BLOCK_SIZE));
+    assert_non_null(a.blocks);
+    am_arena_release(&a);
+    assert_null(a.blocks);
+}
+
+#if defined(__GLIBC__)
+
+/* glibc lets an application replace the allocator: these forward to it, counting the heap
+ * allocations made by the current thread while alloc_counting is set */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int alloc_counting = 0;
+static __thread int alloc_count = 0;
+
+void *malloc(size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+#endif
+
+typedef am_return_t (*am_state_func_t)(am_request_t *);
+void am_test_get_state_funcs(am_state_func_t const **func_array_p, int *func_array_len_p);
+
+#define ARENA_TEST_URL "http://a.b.c:80/app/index.cgi/extra?g=h&C-name=AQIC5wM2LY4Sfcyro187TdQ7LJIs373&i=j"
+#define ARENA_TEST_AGENT_URL "https://www.override.com:90/am"
+
+static char test_request_container[AM_ARENA_BLOCK_SIZE * 4];
+
+static void *test_request_container_alloc(void *ctx, size_t size) {
+    size_t *used = (size_t *) ctx;
+    char *p;
+    if (*used + size > sizeof (test_request_container)) {
+        return NULL;
+    }
+    p = test_request_container + *used;
+    *used += size;
+    return p;
+}
+
+static am_status_t get_arena_test_url(am_request_t *r) {
+    r->orig_url = ARENA_TEST_URL;
+    return AM_SUCCESS;
+}
+
+static void init_arena_test_request(am_request_t *r, am_config_t *conf, void *ctx, size_t *used) {
+    memset(r, 0, sizeof (am_request_t));
+    r->conf = conf;
+    r->ctx = ctx;
+    r->am_get_request_url_f = get_arena_test_url;
+    r->client_ip = "10.1.1.1, 10.2.2.2";
+    r->client_host = "d.e.f:8080";
+    r->path_info = "/extra";
+    r->method = AM_REQUEST_GET;
+    *used = 0;
+    am_arena_init(&r->arena, test_request_container_alloc, used);
+}
+
+/**
+ * Request setup and not enforced list evaluation take their per-request strings from the request
+ * arena, and url pattern and ip range matching do not allocate: apart from url parsing and the
+ * session token (owned by the request), nothing is allocated from the heap.
+ */
+void test_request_arena_allocations(void **state) {
+#if defined(__GLIBC__)
+    int parse_count;
+    size_t used;
+    struct url u;
+    am_state_func_t const *func_array = NULL;
+    int array_len = 0;
+    struct ctx {
+        void *dummy;
+    } ctx;
+    struct am_config_map not_enforced_ips[] = {
+        {"POST,0", "10.1.1.0/24"},
+    };
+    struct am_config_map not_enforced_map[] = {
+        {"0", "http://a.b.c:80/public/*"},
+        {"GET,1", "https://www.override.com:80/static/*"},
+    };
+    struct am_config_map not_enforced_ext_map[] = {
+        {"0", "10.1.1.0/24 10.1.2.0/24|http://a.b.c:80/other/* https://www.override.com:80/other/*"},
+    };
+    am_config_t config;
+    am_request_t request;
+
+    memset(&config, 0, sizeof (am_config_t));
+    config.agenturi = ARENA_TEST_AGENT_URL;
+    config.override_protocol = config.override_host = AM_TRUE;
+    config.cookie_name = "C-name";
+    config.path_info_ignore = AM_TRUE;
+    config.access_denied_url = "/deny.html";
+    config.not_enforced_ip_map_sz = ARRAY_SIZE(not_enforced_ips);
+    config.not_enforced_ip_map = not_enforced_ips;
+    config.not_enforced_map_sz = ARRAY_SIZE(not_enforced_map);
+    config.not_enforced_map = not_enforced_map;
+    config.not_enforced_ext_map_sz = ARRAY_SIZE(not_enforced_ext_map);
+    config.not_enforced_ext_map = not_enforced_ext_map;
+
+    am_test_get_state_funcs(&func_array, &array_len);
+
+    /* warm up (one-off allocations, e.g. time zone data for the log) */
+    init_arena_test_request(&request, &config, &ctx, &used);
+    assert_int_equal(func_array[0](&request), AM_OK); /* setup_request_data */
+    assert_int_equal(func_array[5](&request), AM_OK); /* handle_not_enforced */
+    am_request_free(&request);
+
+    /* url parsing (the request and the agent url) is not arena based */
+    alloc_count = 0;
+    alloc_counting = 1;
+    parse_url(ARENA_TEST_URL, &u);
+    parse_url(ARENA_TEST_AGENT_URL, &u);
+    alloc_counting = 0;
+    parse_count = alloc_count;
+
+    init_arena_test_request(&request, &config, &ctx, &used);
+    alloc_count = 0;
+    alloc_counting = 1;
+    assert_int_equal(func_array[0](&request), AM_OK);
+    assert_int_equal(func_array[5](&request), AM_OK);
+    alloc_counting = 0;
+
+    assert_string_equal(request.client_ip, "10.1.1.1");
+    assert_string_equal(request.token, "AQIC5wM2LY4Sfcyro187TdQ7LJIs373");
+    assert_string_equal(request.url.query, "?g=h&i=j");
+    assert_string_equal(request.overridden_url_pathinfo, "https://www.override.com:80/app/index.cgi?g=h&i=j");
+    assert_int_equal(request.not_enforced, AM_FALSE);
+    assert_int_equal(alloc_count, parse_count + 1);
+    assert_null(request.arena.blocks);
+    assert_true(used > 0);
+
+    am_request_free(&request);
+#endif
+}
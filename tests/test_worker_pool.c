@@ -0,0 +1,232 @@
+/**
+ * The contents of this file are subject to the terms of the Common Development and
+ * Distribution License (the License). You may not use this file except in compliance with the
+ * License.
+ *
+ * You can obtain a copy of the License at legal/CDDLv1.0.txt. See the License for the
+ * specific language governing permission and limitations under the License.
+ *
+ * When distributing Covered Software, include this CDDL Header Notice in each file and include
+ * the License file at legal/CDDLv1.0.txt. If applicable, add the following below the CDDL
+ * Header, with the fields enclosed by brackets [] replaced by your own identifying
+ * information: "Portions copyright [year] [name of copyright owner]".
+ *
+ * Copyright 2016 ForgeRock AS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "platform.h"
+#include "am.h"
+#include "utility.h"
+#include "thread.h"
+#include "cmocka.h"
+
+#ifndef _WIN32
+
+void am_worker_pool_init_reset();
+
+#define POOL_FANOUT_DEPTH 12 /* 2^13 - 1 jobs */
+#define POOL_BENCH_PRODUCERS 4
+#define POOL_BENCH_JOBS 50000 /* per producer */
+#define POOL_BENCH_FANOUT_DEPTH 15
+#define POOL_LANE_TEST_ID 12
+#define POOL_LANE_LOW_CAPACITY 256
+
+static volatile uint32_t jobs_done = 0;
+
+static void count_job(void *arg) {
+    __sync_fetch_and_add(&jobs_done, 1);
+}
+
+/* a job which dispatches two more jobs, until the depth (passed in as an argument) reaches 0 */
+static void fanout_job(void *arg) {
+    intptr_t depth = (intptr_t) arg;
+    if (depth > 0) {
+        assert_int_equal(am_worker_dispatch(fanout_job, (void *) (depth - 1)), AM_SUCCESS);
+        assert_int_equal(am_worker_dispatch(fanout_job, (void *) (depth - 1)), AM_SUCCESS);
+    }
+    __sync_fetch_and_add(&jobs_done, 1);
+}
+
+static volatile uint32_t pool_blocked = 0;
+static volatile uint32_t low_done_before_high = 0;
+
+/* holds a worker until the test releases the pool */
+static void blocking_job(void *arg) {
+    while (__sync_fetch_and_add(&pool_blocked, 0)) {
+        usleep(1000);
+    }
+    __sync_fetch_and_add(&jobs_done, 1);
+}
+
+static void low_job(void *arg) {
+    __sync_fetch_and_add((volatile uint32_t *) arg, 1);
+    __sync_fetch_and_add(&jobs_done, 1);
+}
+
+static void high_job(void *arg) {
+    low_done_before_high = __sync_fetch_and_add((volatile uint32_t *) arg, 0);
+    __sync_fetch_and_add(&jobs_done, 1);
+}
+
+static am_bool_t wait_for_jobs(uint32_t count, int timeout) {
+    int i;
+    for (i = 0; i < timeout * 1000; i++) {
+        if (__sync_fetch_and_add(&jobs_done, 0) >= count) {
+            return AM_TRUE;
+        }
+        usleep(1000);
+    }
+    return AM_FALSE;
+}
+
+static void *producer(void *arg) {
+    int i;
+    for (i = 0; i < POOL_BENCH_JOBS; i++) {
+        while (am_worker_dispatch(count_job, NULL) != AM_SUCCESS) {
+            /* bounded work-stealing pool queue is full */
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void pool_start(const char *type) {
+    if (type != NULL) {
+        setenv("AM_WORKER_POOL", type, 1);
+    } else {
+        unsetenv("AM_WORKER_POOL");
+    }
+    am_worker_pool_init_reset();
+    am_worker_pool_init();
+    jobs_done = 0;
+}
+
+static void pool_stop() {
+    am_worker_pool_shutdown();
+    am_worker_pool_init_reset();
+    unsetenv("AM_WORKER_POOL");
+}
+
+/**
+ * Jobs dispatched from within worker threads (pushed to worker deques and stolen by other workers)
+ * must all run, with either pool.
+ */
+void test_worker_pool_fanout(void **state) {
+    const char *types[] = {NULL, "fifo"};
+    int i;
+
+    for (i = 0; i < (int) ARRAY_SIZE(types); i++) {
+        pool_start(types[i]);
+        assert_int_equal(am_worker_dispatch(fanout_job, (void *) POOL_FANOUT_DEPTH), AM_SUCCESS);
+        assert_true(wait_for_jobs((1 << (POOL_FANOUT_DEPTH + 1)) - 1, 30));
+        assert_int_equal(jobs_done, (1 << (POOL_FANOUT_DEPTH + 1)) - 1);
+        pool_stop();
+    }
+}
+
+/**
+ * Worker pool throughput: short jobs dispatched by several threads at once and jobs dispatched
+ * from within worker threads, FIFO pool vs work-stealing pool.
+ */
+void test_worker_pool_benchmark(void **state) {
+    const char *types[] = {"fifo", NULL};
+    pthread_t producers[POOL_BENCH_PRODUCERS];
+    am_timer_t tmr = {0, 0, 0, 0};
+    uint32_t total = POOL_BENCH_PRODUCERS * POOL_BENCH_JOBS;
+    int i, j;
+
+    for (i = 0; i < (int) ARRAY_SIZE(types); i++) {
+        const char *name = types[i] != NULL ? types[i] : "work-stealing";
+
+        pool_start(types[i]);
+        am_timer_start(&tmr);
+        for (j = 0; j < POOL_BENCH_PRODUCERS; j++) {
+            assert_int_equal(pthread_create(&producers[j], NULL, producer, NULL), 0);
+        }
+        for (j = 0; j < POOL_BENCH_PRODUCERS; j++) {
+            pthread_join(producers[j], NULL);
+        }
+        assert_true(wait_for_jobs(total, 120));
+        am_timer_stop(&tmr);
+        fprintf(stderr, "WORKER POOL (%s): %.0f jobs/sec dispatched by %d threads\n",
+                name, total / am_timer_elapsed(&tmr), POOL_BENCH_PRODUCERS);
+
+        jobs_done = 0;
+        am_timer_start(&tmr);
+        assert_int_equal(am_worker_dispatch(fanout_job, (void *) POOL_BENCH_FANOUT_DEPTH), AM_SUCCESS);
+        assert_true(wait_for_jobs((1 << (POOL_BENCH_FANOUT_DEPTH + 1)) - 1, 120));
+        am_timer_stop(&tmr);
+        fprintf(stderr, "WORKER POOL (%s): %.0f jobs/sec dispatched by workers\n",
+                name, ((1 << (POOL_BENCH_FANOUT_DEPTH + 1)) - 1) / am_timer_elapsed(&tmr));
+        pool_stop();
+    }
+}
+
+/**
+ * With all workers busy, low priority lane jobs are coalesced by key and dropped once the lane is full;
+ * a high priority job queued after them runs ahead of them. Lane depth and drops are reported in metrics.
+ */
+void test_worker_pool_lanes(void **state) {
+    const char *types[] = {NULL, "fifo"};
+    volatile uint32_t low_done;
+    uint32_t expected;
+    char *text;
+    int i, j, rv;
+
+    assert_int_equal(am_metrics_init(POOL_LANE_TEST_ID), AM_SUCCESS);
+
+    for (i = 0; i < (int) ARRAY_SIZE(types); i++) {
+        am_metrics_reset(0);
+        pool_start(types[i]);
+        pool_blocked = 1;
+        low_done = 0;
+        low_done_before_high = 0;
+
+        /* occupy every worker the pool could start */
+        for (j = 0; j < AM_MAX_THREADS_POOL; j++) {
+            assert_int_equal(am_worker_dispatch(blocking_job, NULL), AM_SUCCESS);
+        }
+        usleep(200000);
+
+        assert_int_equal(am_worker_dispatch_lane(AM_WORKER_LANE_LOW, 42, low_job, (void *) &low_done), AM_SUCCESS);
+        assert_int_equal(am_worker_dispatch_lane(AM_WORKER_LANE_LOW, 42, low_job, (void *) &low_done), AM_EINPROGRESS);
+        assert_int_equal(am_metrics_lane_stat(AM_WORKER_LANE_LOW, AM_LANE_STAT_COALESCED), 1);
+
+        for (j = 1; j < POOL_LANE_LOW_CAPACITY; j++) {
+            assert_int_equal(am_worker_dispatch_lane(AM_WORKER_LANE_LOW, 0, low_job, (void *) &low_done), AM_SUCCESS);
+        }
+        rv = am_worker_dispatch_lane(AM_WORKER_LANE_LOW, 0, low_job, (void *) &low_done);
+        assert_int_equal(rv, AM_ENOSPC);
+        assert_int_equal(am_metrics_lane_stat(AM_WORKER_LANE_LOW, AM_LANE_STAT_DROPPED), 1);
+        assert_int_equal(am_metrics_lane_stat(AM_WORKER_LANE_LOW, AM_LANE_STAT_DEPTH), POOL_LANE_LOW_CAPACITY);
+
+        assert_int_equal(am_worker_dispatch_lane(AM_WORKER_LANE_HIGH, 0, high_job, (void *) &low_done), AM_SUCCESS);
+
+        __sync_fetch_and_sub(&pool_blocked, 1);
+        expected = AM_MAX_THREADS_POOL + POOL_LANE_LOW_CAPACITY + 1;
+        assert_true(wait_for_jobs(expected, 30));
+        assert_int_equal(low_done, POOL_LANE_LOW_CAPACITY);
+        /* high priority job is taken before any of the low priority ones (which could only be running in other workers) */
+        assert_true(low_done_before_high < AM_MAX_THREADS_POOL);
+
+        assert_int_equal(am_metrics_lane_stat(AM_WORKER_LANE_LOW, AM_LANE_STAT_DEPTH), 0);
+        assert_int_equal(am_metrics_lane_stat(AM_WORKER_LANE_HIGH, AM_LANE_STAT_DEPTH), 0);
+        text = am_metrics_text(0);
+        assert_non_null(text);
+        assert_non_null(strstr(text, "am_worker_lane_dropped_total{lane=\"low\"} 1\n"));
+        assert_non_null(strstr(text, "am_worker_lane_wait_seconds_count{lane=\"low\"} 256\n"));
+        free(text);
+        pool_stop();
+    }
+
+    am_metrics_reset(0);
+    am_metrics_shutdown();
+}
+
+#endif